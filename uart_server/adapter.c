@@ -21,56 +21,240 @@
 #include <glib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdatomic.h>
  
 #include "log.h"
+#include "adapter.h"
+#include "stats.h"
+#include "hci.h"
 
 
-static void adapter_properties_set(GDBusConnection *conn, char *interface, char *name, GVariant *value)
+/*
+ * adapter属性的缓存, 按hci编号索引
+ * 启动时GetAll一次, 之后由PropertiesChanged信号更新, 在main loop线程中写,
+ * 其他线程无锁读取, 不需要D-Bus往返
+ */
+#define ADAPTER_CACHE_MAX 16
+
+struct adapter_cache_t {
+	atomic_int valid;
+	atomic_int powered;
+	atomic_int discoverable;
+	/*
+	 * 以下只在main loop线程中访问
+	 */
+	GDBusConnection *conn;
+	guint signal_id;
+	GCancellable *cancellable;
+	char *adapter;
+};
+
+static struct adapter_cache_t adapter_cache[ADAPTER_CACHE_MAX];
+
+static adapter_changed_t adapter_changed_cb;
+static void *adapter_changed_data;
+
+
+/*
+ * 一次异步调用, 失败时重试使用同一个parameters
+ */
+struct bluez_call_t {
+	GDBusConnection *conn;
+	char *path;
+	char *interface;
+	char *method;
+	GVariant *parameters;
+	GCancellable *cancellable;
+	int retries;
+	bluez_call_cb_t cb;
+	void *user_data;
+};
+
+
+static void bluez_call_free(struct bluez_call_t *call)
+{
+	g_object_unref(call->conn);
+	if(call->cancellable) {
+		g_object_unref(call->cancellable);
+	}
+	if(call->parameters) {
+		g_variant_unref(call->parameters);
+	}
+	g_free(call->path);
+	g_free(call->interface);
+	g_free(call->method);
+	g_free(call);
+}
+
+
+static void bluez_call_send(struct bluez_call_t *call);
+
+
+static gboolean bluez_call_retry(gpointer user_data)
+{
+	struct bluez_call_t *call = user_data;
+
+	if(call->cancellable && g_cancellable_is_cancelled(call->cancellable)) {
+		bluez_call_free(call);
+	} else {
+		bluez_call_send(call);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * 重试的调用可能在超时前已经在bluez中成功了, 这时再调用会返回AlreadyExists
+ */
+static int bluez_call_already_done(struct bluez_call_t *call, const GError *error)
+{
+	gchar *name;
+	int ret;
+
+	if(!call->retries || !g_dbus_error_is_remote_error(error)) {
+		return 0;
+	}
+
+	name = g_dbus_error_get_remote_error(error);
+	ret = !g_strcmp0(name, "org.bluez.Error.AlreadyExists");
+	g_free(name);
+
+	return ret;
+}
+
+
+static void bluez_call_ready(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	struct bluez_call_t *call = user_data;
+	GError *error = NULL;
+	GVariant *reply;
+
+	reply = g_dbus_connection_call_finish((GDBusConnection *)source_object, res, &error);
+
+	if(error) {
+		if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_error_free(error);
+			bluez_call_free(call);
+			return;
+		}
+
+		if(bluez_call_already_done(call, error)) {
+			g_clear_error(&error);
+		} else if(call->retries < BLUEZ_CALL_RETRIES) {
+			u_tm_log("Error: %s %s %s, retry %d\n", call->path, call->method, error->message, call->retries + 1);
+			g_error_free(error);
+			stats_inc(STATS_BLUEZ_RETRIES);
+			call->retries++;
+			g_timeout_add(BLUEZ_RETRY_DELAY_MS, bluez_call_retry, call);
+			return;
+		} else {
+			u_tm_log("Error: %s %s %s\n", call->path, call->method, error->message);
+		}
+	}
+
+	if(call->cb) {
+		call->cb(reply, error, call->user_data);
+	}
+
+	if(reply) {
+		g_variant_unref(reply);
+	}
+	if(error) {
+		g_error_free(error);
+	}
+	bluez_call_free(call);
+}
+
+
+static void bluez_call_send(struct bluez_call_t *call)
+{
+	g_dbus_connection_call(call->conn,
+							"org.bluez",
+							call->path,
+							call->interface,
+							call->method,
+							call->parameters,
+							NULL,
+							G_DBUS_CALL_FLAGS_NONE,
+							BLUEZ_CALL_TIMEOUT_MS,
+							call->cancellable,
+							bluez_call_ready,
+							call);
+}
+
+
+/*
+ * 异步调用bluez的方法, 超时BLUEZ_CALL_TIMEOUT_MS, 失败时间隔BLUEZ_RETRY_DELAY_MS重试,
+ * 最多BLUEZ_CALL_RETRIES次, 最后的结果交给cb(成功时error为NULL)
+ * cancellable被取消后不再调用cb, 所以user_data可以在取消之后释放
+ */
+void bluez_call_async(GDBusConnection *conn, const char *path, const char *interface, const char *method,
+					GVariant *parameters, GCancellable *cancellable, bluez_call_cb_t cb, void *user_data)
+{
+	struct bluez_call_t *call = g_new0(struct bluez_call_t, 1);
+
+	call->conn = g_object_ref(conn);
+	call->path = g_strdup(path);
+	call->interface = g_strdup(interface);
+	call->method = g_strdup(method);
+	call->parameters = parameters ? g_variant_ref_sink(parameters) : NULL;
+	call->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+	call->cb = cb;
+	call->user_data = user_data;
+
+	bluez_call_send(call);
+}
+
+
+static void adapter_properties_set(GDBusConnection *conn, const char *adapter, char *interface, char *name, GVariant *value)
 {
 	GError *error = NULL;
 
-	u_tm_log("adapter_properties_set %s:%s\n", interface, name);
+	u_tm_log("adapter_properties_set %s %s:%s\n", adapter, interface, name);
 
 	GVariant *parameters = g_variant_new("(ssv)", interface, name, value);
 
-	g_dbus_connection_call_sync(conn,
+	GVariant *reply = g_dbus_connection_call_sync(conn,
                              	"org.bluez",
-								"/org/bluez/hci1",
+								adapter,
                              	"org.freedesktop.DBus.Properties",
                              	"Set",
                              	parameters,
                              	NULL,
                              	G_DBUS_CALL_FLAGS_NONE,
-                             	-1,
+                             	BLUEZ_CALL_TIMEOUT_MS,
                              	NULL,
                              	&error);
 
 	if(error) {
 		u_tm_log("Error: adapter_properties_set %s\n", error->message);
 		g_error_free (error);
+		return;
 	}
-	
+
+	g_variant_unref(reply);
 }
 
 
-static GVariant *adapter_properties_get(GDBusConnection *conn, char *interface, char *name)
+static GVariant *adapter_properties_get(GDBusConnection *conn, const char *adapter, char *interface, char *name)
 {
 	GError *error = NULL;
 	GVariant *ret = NULL;
 	
-	u_tm_log("adapter_properties_get %s:%s\n", interface, name);
+	u_tm_log("adapter_properties_get %s %s:%s\n", adapter, interface, name);
 
 	GVariant *parameters = g_variant_new("(ss)", interface, name);
 
 	GVariant *v = g_dbus_connection_call_sync(conn,
 				                             	"org.bluez",
-												"/org/bluez/hci1",
+												adapter,
 				                             	"org.freedesktop.DBus.Properties",
 				                             	"Get",
 				                             	parameters,
 				                             	NULL,
 				                             	G_DBUS_CALL_FLAGS_NONE,
-				                             	-1,
+				                             	BLUEZ_CALL_TIMEOUT_MS,
 				                             	NULL,
 				                             	&error);
 
@@ -82,6 +266,7 @@ static GVariant *adapter_properties_get(GDBusConnection *conn, char *interface,
 
 	
 	g_variant_get(v, "(v)", &ret);
+	g_variant_unref(v);
 
 	return ret;
 	
@@ -89,45 +274,261 @@ static GVariant *adapter_properties_get(GDBusConnection *conn, char *interface,
 
 
 
-void adapter_discoverable_enable(GDBusConnection *conn)
+void adapter_discoverable_enable(GDBusConnection *conn, const char *adapter)
 {
-	adapter_properties_set(conn, "org.bluez.Adapter1", "Discoverable", g_variant_new("b", 1));
+	adapter_properties_set(conn, adapter, "org.bluez.Adapter1", "Discoverable", g_variant_new("b", 1));
 }
 
-void adapter_discoverable_disable(GDBusConnection *conn)
+void adapter_discoverable_disable(GDBusConnection *conn, const char *adapter)
 {
-	adapter_properties_set(conn, "org.bluez.Adapter1", "Discoverable", g_variant_new("b", 0));
+	adapter_properties_set(conn, adapter, "org.bluez.Adapter1", "Discoverable", g_variant_new("b", 0));
 }
 
-void adapter_power_on(GDBusConnection *conn)
+void adapter_power_on(GDBusConnection *conn, const char *adapter)
 {
-	adapter_properties_set(conn, "org.bluez.Adapter1", "Powered", g_variant_new("b", 1));	
+	adapter_properties_set(conn, adapter, "org.bluez.Adapter1", "Powered", g_variant_new("b", 1));	
 }
 
-void adapter_power_off(GDBusConnection *conn)
+void adapter_power_off(GDBusConnection *conn, const char *adapter)
 {
-	adapter_properties_set(conn, "org.bluez.Adapter1", "Powered", g_variant_new("b", 0));
+	adapter_properties_set(conn, adapter, "org.bluez.Adapter1", "Powered", g_variant_new("b", 0));
 }
 
 
-int adapter_power_state(GDBusConnection *conn)
+static struct adapter_cache_t *adapter_cache_find(const char *adapter)
 {
-	GVariant * v = adapter_properties_get(conn, "org.bluez.Adapter1", "Powered");
-		
-	int ret;
-	g_variant_get(v, "b", &ret);
+	int id = hci_dev_id(adapter);
 
-	return ret;
+	if(id < 0 || id >= ADAPTER_CACHE_MAX) {
+		return NULL;
+	}
+
+	return &adapter_cache[id];
 }
 
-int adapter_discoverable_state(GDBusConnection *conn)
+
+/*
+ * 返回布尔属性的值, 读取失败时返回-1
+ * 有缓存时直接返回缓存的值, conn可以为NULL
+ */
+static int adapter_bool_get(GDBusConnection *conn, const char *adapter, char *name)
 {
-	GVariant * v = adapter_properties_get(conn, "org.bluez.Adapter1", "Discoverable");
-		
-	int ret;
-	g_variant_get(v, "b", &ret);
+	struct adapter_cache_t *cache = adapter_cache_find(adapter);
+	GVariant *v;
+	gboolean ret;
+
+	if(cache && atomic_load_explicit(&cache->valid, memory_order_acquire)) {
+		if(!strcmp(name, "Powered")) {
+			return atomic_load_explicit(&cache->powered, memory_order_relaxed);
+		}
+		if(!strcmp(name, "Discoverable")) {
+			return atomic_load_explicit(&cache->discoverable, memory_order_relaxed);
+		}
+	}
+
+	if(!conn) {
+		return -1;
+	}
+
+	v = adapter_properties_get(conn, adapter, "org.bluez.Adapter1", name);
+	if(!v) {
+		return -1;
+	}
+
+	if(!g_variant_is_of_type(v, G_VARIANT_TYPE_BOOLEAN)) {
+		g_variant_unref(v);
+		return -1;
+	}
+
+	ret = g_variant_get_boolean(v);
+	g_variant_unref(v);
 
 	return ret;
 }
 
 
+int adapter_power_state(GDBusConnection *conn, const char *adapter)
+{
+	return adapter_bool_get(conn, adapter, "Powered");
+}
+
+int adapter_discoverable_state(GDBusConnection *conn, const char *adapter)
+{
+	return adapter_bool_get(conn, adapter, "Discoverable");
+}
+
+
+/*
+ * 异步设置Adapter1的属性, 结果交给cb
+ */
+void adapter_properties_set_async(GDBusConnection *conn, const char *adapter, const char *name, GVariant *value,
+					GCancellable *cancellable, bluez_call_cb_t cb, void *user_data)
+{
+	u_tm_log("adapter_properties_set_async %s %s\n", adapter, name);
+
+	bluez_call_async(conn, adapter, "org.freedesktop.DBus.Properties", "Set",
+					g_variant_new("(ssv)", "org.bluez.Adapter1", name, value),
+					cancellable, cb, user_data);
+}
+
+
+void adapter_power_on_async(GDBusConnection *conn, const char *adapter,
+					GCancellable *cancellable, bluez_call_cb_t cb, void *user_data)
+{
+	adapter_properties_set_async(conn, adapter, "Powered", g_variant_new("b", 1), cancellable, cb, user_data);
+}
+
+
+void adapter_discoverable_enable_async(GDBusConnection *conn, const char *adapter,
+					GCancellable *cancellable, bluez_call_cb_t cb, void *user_data)
+{
+	adapter_properties_set_async(conn, adapter, "Discoverable", g_variant_new("b", 1), cancellable, cb, user_data);
+}
+
+
+/*
+ * 更新缓存中的属性, 值变化时调用adapter_changed_cb
+ */
+static void adapter_cache_update(struct adapter_cache_t *cache, GVariant *props)
+{
+	GVariantIter iter;
+	const char *name;
+	GVariant *value;
+	atomic_int *slot;
+	int v;
+
+	g_variant_iter_init(&iter, props);
+	while(g_variant_iter_next(&iter, "{&sv}", &name, &value)) {
+		slot = NULL;
+		if(!strcmp(name, "Powered")) {
+			slot = &cache->powered;
+		} else if(!strcmp(name, "Discoverable")) {
+			slot = &cache->discoverable;
+		}
+
+		if(slot && g_variant_is_of_type(value, G_VARIANT_TYPE_BOOLEAN)) {
+			v = g_variant_get_boolean(value);
+			if(atomic_exchange_explicit(slot, v, memory_order_relaxed) != v
+				&& atomic_load_explicit(&cache->valid, memory_order_relaxed) && adapter_changed_cb) {
+				adapter_changed_cb(cache->adapter, name, v, adapter_changed_data);
+			}
+		}
+
+		g_variant_unref(value);
+	}
+}
+
+
+static void adapter_cache_changed(GDBusConnection *conn,
+							const gchar *sender,
+							const gchar *object_path,
+							const gchar *interface_name,
+							const gchar *signal_name,
+							GVariant *params,
+							gpointer user_data)
+{
+	struct adapter_cache_t *cache = user_data;
+	GVariant *changed;
+	const char *iface;
+
+	g_variant_get(params, "(&s@a{sv}@as)", &iface, &changed, NULL);
+
+	if(!strcmp(iface, "org.bluez.Adapter1")) {
+		adapter_cache_update(cache, changed);
+	}
+
+	g_variant_unref(changed);
+}
+
+
+static void adapter_cache_get_all_ready(GVariant *reply, const GError *error, void *user_data)
+{
+	struct adapter_cache_t *cache = user_data;
+	GVariant *props;
+
+	if(error || !g_variant_is_of_type(reply, G_VARIANT_TYPE("(a{sv})"))) {
+		return;
+	}
+
+	props = g_variant_get_child_value(reply, 0);
+	adapter_cache_update(cache, props);
+	g_variant_unref(props);
+
+	atomic_store_explicit(&cache->valid, 1, memory_order_release);
+
+	u_tm_log("%s cache powered = %d discoverable = %d\n", cache->adapter,
+				atomic_load_explicit(&cache->powered, memory_order_relaxed),
+				atomic_load_explicit(&cache->discoverable, memory_order_relaxed));
+}
+
+
+/*
+ * 在main loop线程中调用, 开始缓存adapter的属性
+ * 先订阅PropertiesChanged再GetAll, 同一个发送者的信号和回复是有序的, 不会漏掉变化
+ */
+int adapter_cache_start(GDBusConnection *conn, const char *adapter)
+{
+	struct adapter_cache_t *cache = adapter_cache_find(adapter);
+
+	if(!cache) {
+		return -1;
+	}
+
+	adapter_cache_stop(adapter);
+
+	cache->conn = g_object_ref(conn);
+	cache->adapter = g_strdup(adapter);
+	cache->cancellable = g_cancellable_new();
+	cache->signal_id = g_dbus_connection_signal_subscribe(conn,
+										"org.bluez",
+										"org.freedesktop.DBus.Properties",
+										"PropertiesChanged",
+										adapter,
+										"org.bluez.Adapter1",
+										G_DBUS_SIGNAL_FLAGS_NONE,
+										adapter_cache_changed,
+										cache,
+										NULL);
+
+	bluez_call_async(conn, adapter, "org.freedesktop.DBus.Properties", "GetAll",
+					g_variant_new("(s)", "org.bluez.Adapter1"),
+					cache->cancellable, adapter_cache_get_all_ready, cache);
+
+	return 0;
+}
+
+
+/*
+ * 在main loop线程中调用, adapter移除时停止缓存, 之后的查询返回-1
+ */
+void adapter_cache_stop(const char *adapter)
+{
+	struct adapter_cache_t *cache = adapter_cache_find(adapter);
+
+	if(!cache || !cache->conn) {
+		return;
+	}
+
+	atomic_store_explicit(&cache->valid, 0, memory_order_relaxed);
+
+	g_cancellable_cancel(cache->cancellable);
+	g_object_unref(cache->cancellable);
+	g_dbus_connection_signal_unsubscribe(cache->conn, cache->signal_id);
+	g_object_unref(cache->conn);
+	g_free(cache->adapter);
+
+	cache->conn = NULL;
+	cache->cancellable = NULL;
+	cache->signal_id = 0;
+	cache->adapter = NULL;
+}
+
+
+/*
+ * 缓存的属性变化时在main loop线程中调用cb, GetAll完成之前的变化不通知
+ */
+void adapter_cache_set_cb(adapter_changed_t cb, void *user_data)
+{
+	adapter_changed_data = user_data;
+	adapter_changed_cb = cb;
+}
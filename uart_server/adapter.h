@@ -7,13 +7,48 @@
 
 #include <gio/gio.h>
 
-void adapter_discoverable_enable(GDBusConnection *conn);
-void adapter_discoverable_disable(GDBusConnection *conn);
-void adapter_power_on(GDBusConnection *conn);
-void adapter_power_off(GDBusConnection *conn);
-
-int adapter_power_state(GDBusConnection *conn);
-int adapter_discoverable_state(GDBusConnection *conn);
+/*
+ * 调用bluez的超时和重试
+ */
+#define BLUEZ_CALL_TIMEOUT_MS	3000
+#define BLUEZ_CALL_RETRIES		3
+#define BLUEZ_RETRY_DELAY_MS	200
+
+/*
+ * 异步调用的结果, 成功时error为NULL, reply和error在回调返回后释放
+ */
+typedef void (*bluez_call_cb_t)(GVariant *reply, const GError *error, void *user_data);
+
+void bluez_call_async(GDBusConnection *conn, const char *path, const char *interface, const char *method,
+					GVariant *parameters, GCancellable *cancellable, bluez_call_cb_t cb, void *user_data);
+
+void adapter_discoverable_enable(GDBusConnection *conn, const char *adapter);
+void adapter_discoverable_disable(GDBusConnection *conn, const char *adapter);
+void adapter_power_on(GDBusConnection *conn, const char *adapter);
+void adapter_power_off(GDBusConnection *conn, const char *adapter);
+
+/*
+ * 调用过adapter_cache_start的adapter直接返回缓存的值(可以在任意线程调用, conn可以为NULL),
+ * 否则同步读取, 失败时返回-1
+ */
+int adapter_power_state(GDBusConnection *conn, const char *adapter);
+int adapter_discoverable_state(GDBusConnection *conn, const char *adapter);
+
+/*
+ * 缓存的属性变化, name为"Powered"或者"Discoverable"
+ */
+typedef void (*adapter_changed_t)(const char *adapter, const char *name, int value, void *user_data);
+
+int adapter_cache_start(GDBusConnection *conn, const char *adapter);
+void adapter_cache_stop(const char *adapter);
+void adapter_cache_set_cb(adapter_changed_t cb, void *user_data);
+
+void adapter_properties_set_async(GDBusConnection *conn, const char *adapter, const char *name, GVariant *value,
+					GCancellable *cancellable, bluez_call_cb_t cb, void *user_data);
+void adapter_power_on_async(GDBusConnection *conn, const char *adapter,
+					GCancellable *cancellable, bluez_call_cb_t cb, void *user_data);
+void adapter_discoverable_enable_async(GDBusConnection *conn, const char *adapter,
+					GCancellable *cancellable, bluez_call_cb_t cb, void *user_data);
 
 
 #endif
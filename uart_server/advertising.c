@@ -20,13 +20,31 @@
 #include <glib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "log.h"
+#include "hci.h"
+#include "adapter.h"
 
+/*
+ * 每个adapter一个广播, 路径为ADVERT_OBJ_PATH/<adapter名字>
+ */
 struct advertising_t {
-	GDBusNodeInfo *node_info;
-	GDBusInterfaceInfo *if_info;
+	GDBusConnection *conn;
+	char *adapter;
+	char *path;
 	guint reg_id;
+	/*
+	 * 1: 快速广播阶段, fast_timer到期后切换到慢速广播
+	 */
+	int fast;
+	guint fast_timer;
+	/*
+	 * 停止广播时取消还没有回复的调用
+	 */
+	GCancellable *cancellable;
+	advertising_registered_t registered_cb;
+	void *user_data;
 };
 
 struct advertisement_data_t {
@@ -40,6 +58,16 @@ struct advertisement_data_t {
 	 */
 	uint8_t Discoverable;
 	uint16_t DiscoverableTimeout;
+	/*
+	 * 以下属性可以在运行中修改, 修改后通过PropertiesChanged通知bluez, 不需要重新注册广播
+	 * 没有设置的属性不出现在广播中
+	 */
+	int has_tx_power;
+	int16_t TxPower;
+	uint16_t ManufacturerId;
+	GBytes *ManufacturerData;
+	char *ServiceUUID;
+	GBytes *ServiceData;
 };
 
 static struct advertisement_data_t advertisement_data = {
@@ -49,11 +77,63 @@ static struct advertisement_data_t advertisement_data = {
 	.DiscoverableTimeout = 0,
 };
 
+/*
+ * 保护advertisement_data中可以修改的属性和pending_changed
+ * advertising_set_*可以在任意线程调用, PropertiesChanged在main loop线程中发送
+ */
+G_LOCK_DEFINE_STATIC(advertisement_data);
+
+#define ADV_CHANGED_TX_POWER		(1 << 0)
+#define ADV_CHANGED_MANUFACTURER	(1 << 1)
+#define ADV_CHANGED_SERVICE			(1 << 2)
+
+static guint pending_changed;
+
+/*
+ * 连接断开后要尽快被重新发现, 所以先快速广播fast_timeout秒, 之后慢速广播节省功耗
+ * 间隔单位ms, bluez 5.55之后的MinInterval/MaxInterval, 需要bluetoothd打开experimental(-E),
+ * 旧版本忽略这两个属性, 使用默认的间隔
+ */
+static struct advertising_policy_t advertising_policy = {
+	.fast_min_interval = 20,
+	.fast_max_interval = 30,
+	.fast_timeout = 30,
+	.slow_min_interval = 211,
+	.slow_max_interval = 319,
+};
+
+/*
+ * 所有正在广播的struct advertising_t, 只在main loop线程中访问
+ */
+static GPtrArray *advertisings;
+
+/*
+ * ATT模式下直接用HCI命令广播的adapter
+ */
+static struct hci_engine_t *adv_hci;
+static guint adv_hci_timer;
 
-static struct advertising_t advertising_ctx;
+
+/*
+ * 所有广播共用的node info
+ */
+static GDBusNodeInfo *advertising_node_info;
 
 #define ADVERT_OBJ_PATH "/org/uart/advertising"
 
+/*
+ * 6e400001-b5a3-f393-e0a9-e50e24dcca9e, 广播中是小端
+ */
+static const uint8_t uart_service_uuid128[16] = {
+	0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0,
+	0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e,
+};
+
+/*
+ * ms -> HCI的广播间隔单位0.625ms, ms超出advertising.h中的范围时会溢出
+ */
+#define ADVERT_HCI_INTERVAL(ms) ((uint16_t)((ms) * 8 / 5))
+
 
 static const gchar advertising_xml[] =
 "<node>"
@@ -64,6 +144,11 @@ static const gchar advertising_xml[] =
 "	 <property name='ServiceUUIDs' type='as' access='read'/>"
 "    <property name='Discoverable' type='b' access='read'/>"
 "    <property name='DiscoverableTimeout' type='q' access='read'/>"
+"    <property name='MinInterval' type='u' access='read'/>"
+"    <property name='MaxInterval' type='u' access='read'/>"
+"    <property name='TxPower' type='n' access='read'/>"
+"    <property name='ManufacturerData' type='a{qv}' access='read'/>"
+"    <property name='ServiceData' type='a{sv}' access='read'/>"
 "  </interface>"
 "</node>";
 
@@ -77,6 +162,10 @@ static int advertising_get_interface_info(const gchar *xml_data)
 {
 	GError *error = NULL;
 
+	if(advertising_node_info) {
+		return 0;
+	}
+
 	GDBusNodeInfo *node_info = g_dbus_node_info_new_for_xml(xml_data, &error);
 
 	if(error) {
@@ -90,7 +179,7 @@ static int advertising_get_interface_info(const gchar *xml_data)
 		return -1;
 	}
 
-	advertising_ctx.node_info = node_info;
+	advertising_node_info = node_info;
 
 	return 0;
 }
@@ -113,31 +202,19 @@ on_method_call(GDBusConnection *con,
 }
 
 /*
- * 如果interface info中有可读的属性存在,那么必须提供一个非空的get_property,
- * 或者在org.freedesktop.DBus.Properties接口上的method_call方法中实现Get和GetAll两个函数.
- * 
+ * 返回NULL表示没有设置这个属性, GetAll时会跳过
  */
-static GVariant *
-get_property(GDBusConnection *connection,
-					const gchar *sender,
-					const gchar *object_path,
-					const gchar *interface_name,
-					const gchar *property_name,
-					GError **error,
-					gpointer user_data)
+static GVariant *advertising_property(struct advertising_t *adv, const gchar *property_name)
 {
-	u_tm_log("[%s:%d] sender :%s\n", __FUNCTION__, __LINE__, sender);
-	u_tm_log("[%s:%d] object_path :%s\n", __FUNCTION__, __LINE__, object_path);
-	u_tm_log("[%s:%d] interface_name :%s\n", __FUNCTION__, __LINE__, interface_name);
-	u_tm_log("[%s:%d] property_name :%s\n", __FUNCTION__, __LINE__, property_name);
-
+	GVariantBuilder *builder;
 	GVariant *v = NULL;
+
 	if(!strcmp(property_name, "LocalName")) {
 		v = g_variant_new("s", advertisement_data.LocalName);
 	} else if(!strcmp(property_name, "Type")) {
 		v = g_variant_new("s", "peripheral"); /* "broadcast" or "peripheral" */
 	} else if(!strcmp(property_name, "ServiceUUIDs")) {
-		  GVariantBuilder *builder = g_variant_builder_new(G_VARIANT_TYPE("as"));
+		  builder = g_variant_builder_new(G_VARIANT_TYPE("as"));
 
 		  g_variant_builder_add(builder, "s", "6e400001-b5a3-f393-e0a9-e50e24dcca9e");
 		  v= g_variant_builder_end(builder);
@@ -146,13 +223,68 @@ get_property(GDBusConnection *connection,
 		v = g_variant_new("b", advertisement_data.Discoverable);
 	} else if(!strcmp(property_name, "DiscoverableTimeout")) {
 		v = g_variant_new("q", advertisement_data.DiscoverableTimeout);
+	} else if(!strcmp(property_name, "MinInterval")) {
+		v = g_variant_new("u", adv->fast ? advertising_policy.fast_min_interval : advertising_policy.slow_min_interval);
+	} else if(!strcmp(property_name, "MaxInterval")) {
+		v = g_variant_new("u", adv->fast ? advertising_policy.fast_max_interval : advertising_policy.slow_max_interval);
 	}
-	
+
+	if(v) {
+		return v;
+	}
+
+	G_LOCK(advertisement_data);
+	if(!strcmp(property_name, "TxPower")) {
+		if(advertisement_data.has_tx_power) {
+			v = g_variant_new("n", advertisement_data.TxPower);
+		}
+	} else if(!strcmp(property_name, "ManufacturerData")) {
+		if(advertisement_data.ManufacturerData) {
+			builder = g_variant_builder_new(G_VARIANT_TYPE("a{qv}"));
+			g_variant_builder_add(builder, "{qv}", advertisement_data.ManufacturerId,
+						g_variant_new_from_bytes(G_VARIANT_TYPE_BYTESTRING, advertisement_data.ManufacturerData, TRUE));
+			v = g_variant_builder_end(builder);
+			g_variant_builder_unref(builder);
+		}
+	} else if(!strcmp(property_name, "ServiceData")) {
+		if(advertisement_data.ServiceData) {
+			builder = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
+			g_variant_builder_add(builder, "{sv}", advertisement_data.ServiceUUID,
+						g_variant_new_from_bytes(G_VARIANT_TYPE_BYTESTRING, advertisement_data.ServiceData, TRUE));
+			v = g_variant_builder_end(builder);
+			g_variant_builder_unref(builder);
+		}
+	}
+	G_UNLOCK(advertisement_data);
+
 	return v;
 }
+
+
+/*
+ * 如果interface info中有可读的属性存在,那么必须提供一个非空的get_property,
+ * 或者在org.freedesktop.DBus.Properties接口上的method_call方法中实现Get和GetAll两个函数.
+ * 
+ */
+static GVariant *
+get_property(GDBusConnection *connection,
+					const gchar *sender,
+					const gchar *object_path,
+					const gchar *interface_name,
+					const gchar *property_name,
+					GError **error,
+					gpointer user_data)
+{
+	u_tm_log("[%s:%d] sender :%s\n", __FUNCTION__, __LINE__, sender);
+	u_tm_log("[%s:%d] object_path :%s\n", __FUNCTION__, __LINE__, object_path);
+	u_tm_log("[%s:%d] interface_name :%s\n", __FUNCTION__, __LINE__, interface_name);
+	u_tm_log("[%s:%d] property_name :%s\n", __FUNCTION__, __LINE__, property_name);
+
+	return advertising_property(user_data, property_name);
+}
 															 
 
-static int advertising_object_register(GDBusConnection *conn)
+static int advertising_object_register(struct advertising_t *adv)
 {
 	GError *error = NULL;
 	GDBusInterfaceVTable interface_vtable;
@@ -165,11 +297,11 @@ static int advertising_object_register(GDBusConnection *conn)
 	interface_vtable.set_property = NULL;
 
 	guint reg_id = 
-		g_dbus_connection_register_object(conn,
-                                   		ADVERT_OBJ_PATH,
-                                   		advertising_ctx.node_info->interfaces[0],/*org.bluez.LEAdvertisement1*/
+		g_dbus_connection_register_object(adv->conn,
+                                   		adv->path,
+                                   		advertising_node_info->interfaces[0],/*org.bluez.LEAdvertisement1*/
                                    		&interface_vtable,
-                                   		NULL,
+                                   		adv,
                                    		NULL,
                                    		&error);
 	if(error) {
@@ -179,7 +311,7 @@ static int advertising_object_register(GDBusConnection *conn)
 		return -1;
 	}
 
-	advertising_ctx.reg_id = reg_id;
+	adv->reg_id = reg_id;
 
 	return 0;
 }
@@ -190,26 +322,47 @@ static void async_ready_callback(GObject *source_object,
                         gpointer user_data)
 {
 	u_tm_log("async_ready_callback\n");
-	GDBusConnection *conn = (GDBusConnection *)user_data;
+	GDBusConnection *conn = (GDBusConnection *)source_object;
 	GError *error = NULL;
+	GVariant *ret;
 	
-	g_dbus_connection_call_finish (conn,
+	ret = g_dbus_connection_call_finish (conn,
                                res,
                                &error);
+	if(ret) {
+		g_variant_unref(ret);
+	}
 
    if(error) {
-	   u_tm_log("RegisterAdvertisement Error\n");
+	   u_tm_log("%s Error\n", (const char *)user_data);
 	   u_tm_log("%s\n", error->message);
 	   g_error_free (error);
    }
 }
 
 
-static int advertising_register_to_bluez_async(GDBusConnection *conn)
+/*
+ * 重试已经用完时error不为NULL, 广播停止(取消)后不会调用
+ */
+static void advertising_register_ready(GVariant *reply, const GError *error, void *user_data)
+{
+	struct advertising_t *adv = user_data;
+
+	if(!error) {
+		u_tm_log("%s RegisterAdvertisement ok\n", adv->path);
+	}
+
+	if(adv->registered_cb) {
+		adv->registered_cb(adv, !error, adv->user_data);
+	}
+}
+
+
+static int advertising_register_to_bluez_async(struct advertising_t *adv)
 {
 	GVariant *parameters;
 	
-	GVariant *vobject_path = g_variant_new("o", ADVERT_OBJ_PATH);
+	GVariant *vobject_path = g_variant_new("o", adv->path);
 
 	GVariantBuilder *dict_builder = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
 	g_variant_builder_add(dict_builder, "{sv}", "param", g_variant_new_string("value"));
@@ -220,30 +373,456 @@ static int advertising_register_to_bluez_async(GDBusConnection *conn)
 	GVariant *children[] = {vobject_path, dict_v};
 	parameters = g_variant_new_tuple(children, 2);
 
-	g_dbus_connection_call (conn,
+	bluez_call_async(adv->conn, adv->adapter, "org.bluez.LEAdvertisingManager1", "RegisterAdvertisement",
+					parameters, adv->cancellable, advertising_register_ready, adv);
+	
+	return 0;						
+}
+
+
+/*
+ * 不重试: 重试的Unregister可能在之后的Register后面到达bluez
+ */
+static void advertising_unregister_from_bluez_async(struct advertising_t *adv)
+{
+	g_dbus_connection_call (adv->conn,
 							"org.bluez",
-							"/org/bluez/hci1",
+							adv->adapter,
 							"org.bluez.LEAdvertisingManager1",
-							"RegisterAdvertisement",
-							parameters,
+							"UnregisterAdvertisement",
+							g_variant_new("(o)", adv->path),
 							NULL,
 							G_DBUS_CALL_FLAGS_NONE,
-							-1,
-							NULL,
+							BLUEZ_CALL_TIMEOUT_MS,
+							adv->cancellable,
 							async_ready_callback,
-							conn);
-	
-	return 0;						
+							"UnregisterAdvertisement");
+}
+
+
+/*
+ * 发送PropertiesChanged, names以NULL结束, 没有设置的属性放在invalidated_properties中
+ */
+static void advertising_properties_changed(struct advertising_t *adv, const char * const *names)
+{
+	GVariantBuilder *changed = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
+	GVariantBuilder *invalidated = g_variant_builder_new(G_VARIANT_TYPE("as"));
+	GError *error = NULL;
+	GVariant *v;
+	int i;
+
+	for(i = 0; names[i]; i++) {
+		v = advertising_property(adv, names[i]);
+		if(v) {
+			g_variant_builder_add(changed, "{sv}", names[i], v);
+		} else {
+			g_variant_builder_add(invalidated, "s", names[i]);
+		}
+	}
+
+	g_dbus_connection_emit_signal(adv->conn,
+							NULL,
+							adv->path,
+							"org.freedesktop.DBus.Properties",
+							"PropertiesChanged",
+							g_variant_new("(sa{sv}as)", "org.bluez.LEAdvertisement1", changed, invalidated),
+							&error);
+	g_variant_builder_unref(changed);
+	g_variant_builder_unref(invalidated);
+
+	if(error) {
+		u_tm_log("[%s:%d] %s\n", __FUNCTION__, __LINE__, error->message);
+		g_error_free(error);
+	}
+}
+
+
+static void advertising_hci_update_data(struct hci_engine_t *eng);
+
+
+/*
+ * main loop线程中把advertising_set_*的修改通知给bluez和HCI广播
+ */
+static gboolean advertising_emit_changed(gpointer user_data)
+{
+	const char *names[4];
+	guint changed;
+	int i, n = 0;
+
+	G_LOCK(advertisement_data);
+	changed = pending_changed;
+	pending_changed = 0;
+	G_UNLOCK(advertisement_data);
+
+	if(changed & ADV_CHANGED_TX_POWER) {
+		names[n++] = "TxPower";
+	}
+	if(changed & ADV_CHANGED_MANUFACTURER) {
+		names[n++] = "ManufacturerData";
+	}
+	if(changed & ADV_CHANGED_SERVICE) {
+		names[n++] = "ServiceData";
+	}
+	names[n] = NULL;
+
+	for(i = 0; advertisings && i < (int)advertisings->len; i++) {
+		advertising_properties_changed(g_ptr_array_index(advertisings, i), names);
+	}
+
+	if(adv_hci) {
+		advertising_hci_update_data(adv_hci);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * 在任意线程调用
+ */
+static void advertising_changed_locked(guint mask)
+{
+	if(!pending_changed) {
+		g_idle_add(advertising_emit_changed, NULL);
+	}
+	pending_changed |= mask;
+}
+
+
+/*
+ * 快速广播结束, 切换到慢速广播
+ * bluez只在注册时读取广播间隔, 所以重新注册一次
+ */
+static gboolean advertising_slow_timeout(gpointer user_data)
+{
+	struct advertising_t *adv = user_data;
+
+	u_tm_log("%s advertising slow\n", adv->path);
+
+	adv->fast_timer = 0;
+	adv->fast = 0;
+	advertising_unregister_from_bluez_async(adv);
+	advertising_register_to_bluez_async(adv);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * 重新开始快速广播, 例如连接断开后, 在main loop线程中调用
+ */
+void advertising_fast(struct advertising_t *adv)
+{
+	int was_fast;
+
+	if(!adv) {
+		return;
+	}
+
+	if(adv->fast_timer) {
+		g_source_remove(adv->fast_timer);
+		adv->fast_timer = 0;
+	}
+
+	was_fast = adv->fast;
+	adv->fast = 1;
+	if(advertising_policy.fast_timeout) {
+		adv->fast_timer = g_timeout_add_seconds(advertising_policy.fast_timeout, advertising_slow_timeout, adv);
+	}
+
+	if(!was_fast) {
+		u_tm_log("%s advertising fast\n", adv->path);
+		advertising_unregister_from_bluez_async(adv);
+		advertising_register_to_bluez_async(adv);
+	}
 }
 
 
-int advertising_start(GDBusConnection *conn)
+/*
+ * 在adapter上开始广播, adapter为object path, 例如/org/bluez/hci0
+ * 每次向bluez注册(包括快速/慢速切换时的重新注册)后调用cb
+ */
+struct advertising_t *advertising_start(GDBusConnection *conn, const char *adapter,
+					advertising_registered_t cb, void *user_data)
 {
-	advertising_get_interface_info(advertising_xml);
-	advertising_object_register(conn);
-	advertising_register_to_bluez_async(conn);
+	struct advertising_t *adv;
+	const char *name;
+
+	if(advertising_get_interface_info(advertising_xml) < 0) {
+		return NULL;
+	}
+
+	name = strrchr(adapter, '/');
+	name = name ? name + 1 : adapter;
+
+	adv = g_new0(struct advertising_t, 1);
+	adv->conn = conn;
+	adv->adapter = g_strdup(adapter);
+	adv->path = g_strdup_printf(ADVERT_OBJ_PATH"/%s", name);
+	adv->cancellable = g_cancellable_new();
+	adv->registered_cb = cb;
+	adv->user_data = user_data;
+	adv->fast = 1;
+	if(advertising_policy.fast_timeout) {
+		adv->fast_timer = g_timeout_add_seconds(advertising_policy.fast_timeout, advertising_slow_timeout, adv);
+	}
+
+	advertising_object_register(adv);
+	advertising_register_to_bluez_async(adv);
+
+	if(!advertisings) {
+		advertisings = g_ptr_array_new();
+	}
+	g_ptr_array_add(advertisings, adv);
 	
+	return adv;
+}
+
+
+/*
+ * adapter被移除时调用, bluez那边的广播已经随adapter一起消失, 这里只注销本地对象
+ */
+void advertising_stop(struct advertising_t *adv)
+{
+	if(!adv) {
+		return;
+	}
+
+	if(adv->fast_timer) {
+		g_source_remove(adv->fast_timer);
+	}
+
+	g_cancellable_cancel(adv->cancellable);
+	g_object_unref(adv->cancellable);
+
+	if(adv->reg_id) {
+		g_dbus_connection_unregister_object(adv->conn, adv->reg_id);
+	}
+
+	g_ptr_array_remove_fast(advertisings, adv);
+
+	g_free(adv->adapter);
+	g_free(adv->path);
+	g_free(adv);
+}
+
+
+/*
+ * 设置广播间隔策略, 之后开始(或者重新开始快速)的广播使用新的策略
+ * 在main loop线程中调用或者在启动uart server之前调用
+ */
+void advertising_set_policy(const struct advertising_policy_t *policy)
+{
+	if(policy->fast_min_interval > policy->fast_max_interval
+		|| policy->slow_min_interval > policy->slow_max_interval
+		|| policy->fast_min_interval < ADVERTISING_MIN_INTERVAL
+		|| policy->slow_min_interval < ADVERTISING_MIN_INTERVAL
+		|| policy->fast_max_interval > ADVERTISING_MAX_INTERVAL
+		|| policy->slow_max_interval > ADVERTISING_MAX_INTERVAL) {
+		u_tm_log("Error: invalid advertising interval\n");
+		return;
+	}
+
+	advertising_policy = *policy;
+}
+
+
+/*
+ * 请求的发射功率(dBm), 可以在任意线程调用
+ */
+void advertising_set_tx_power(int16_t tx_power)
+{
+	G_LOCK(advertisement_data);
+	advertisement_data.has_tx_power = 1;
+	advertisement_data.TxPower = tx_power;
+	advertising_changed_locked(ADV_CHANGED_TX_POWER);
+	G_UNLOCK(advertisement_data);
+}
+
+
+/*
+ * len为0时删除, 可以在任意线程调用
+ */
+void advertising_set_manufacturer_data(uint16_t company_id, const uint8_t *data, int len)
+{
+	GBytes *bytes = len > 0 ? g_bytes_new(data, len) : NULL;
+
+	G_LOCK(advertisement_data);
+	if(advertisement_data.ManufacturerData) {
+		g_bytes_unref(advertisement_data.ManufacturerData);
+	}
+	advertisement_data.ManufacturerId = company_id;
+	advertisement_data.ManufacturerData = bytes;
+	advertising_changed_locked(ADV_CHANGED_MANUFACTURER);
+	G_UNLOCK(advertisement_data);
+}
+
+
+/*
+ * uuid可以是16位("180d")或者128位的字符串, len为0时删除, 可以在任意线程调用
+ */
+void advertising_set_service_data(const char *uuid, const uint8_t *data, int len)
+{
+	GBytes *bytes = (uuid && len > 0) ? g_bytes_new(data, len) : NULL;
+
+	G_LOCK(advertisement_data);
+	if(advertisement_data.ServiceData) {
+		g_bytes_unref(advertisement_data.ServiceData);
+	}
+	g_free(advertisement_data.ServiceUUID);
+	advertisement_data.ServiceUUID = bytes ? g_strdup(uuid) : NULL;
+	advertisement_data.ServiceData = bytes;
+	advertising_changed_locked(ADV_CHANGED_SERVICE);
+	G_UNLOCK(advertisement_data);
+}
+
+
+/*
+ * "180d"或者"0000180d-0000-1000-8000-00805f9b34fb" -> 0x180d
+ * 其他128位UUID返回-1, HCI广播中只放16位UUID的Service Data
+ */
+static int advertising_uuid16(const char *uuid)
+{
+	unsigned int v;
+	char tail[40];
+
+	if(strlen(uuid) == 4 && sscanf(uuid, "%4x", &v) == 1) {
+		return v;
+	}
+
+	if(sscanf(uuid, "0000%4x-%39s", &v, tail) == 2 && !g_ascii_strcasecmp(tail, "0000-1000-8000-00805f9b34fb")) {
+		return v;
+	}
+
+	return -1;
+}
+
+
+/*
+ * 放入一个AD structure, 放不下时返回-1
+ */
+static int advertising_ad_put(uint8_t *buf, int *len, uint8_t type, const uint8_t *prefix, int prefix_len,
+					const uint8_t *data, int data_len)
+{
+	if(*len + 2 + prefix_len + data_len > 31) {
+		return -1;
+	}
+
+	buf[(*len)++] = 1 + prefix_len + data_len;
+	buf[(*len)++] = type;
+	if(prefix_len) {
+		memcpy(buf + *len, prefix, prefix_len);
+		*len += prefix_len;
+	}
+	memcpy(buf + *len, data, data_len);
+	*len += data_len;
+
 	return 0;
 }
 
 
+/*
+ * 广播数据: Flags + 服务UUID + TX Power Level
+ * 扫描回复: LocalName + Manufacturer Specific Data + Service Data
+ * 更新数据不需要关闭广播
+ */
+static void advertising_hci_update_data(struct hci_engine_t *eng)
+{
+	uint8_t data[31], prefix[2], flags = 0x06;	/* LE General Discoverable, BR/EDR Not Supported */
+	const uint8_t *p;
+	gsize size;
+	int len = 0, name_len, uuid16;
+
+	advertising_ad_put(data, &len, 0x01, NULL, 0, &flags, 1);
+	advertising_ad_put(data, &len, 0x07, NULL, 0, uart_service_uuid128, sizeof(uart_service_uuid128));
+
+	G_LOCK(advertisement_data);
+
+	if(advertisement_data.has_tx_power) {
+		int8_t level = advertisement_data.TxPower;
+		advertising_ad_put(data, &len, 0x0A, NULL, 0, (uint8_t *)&level, 1);
+	}
+	hci_le_set_adv_data(eng, data, len, NULL, NULL);
+
+	name_len = strlen(advertisement_data.LocalName);
+	if(name_len > 29) {
+		name_len = 29;
+	}
+	len = 0;
+	advertising_ad_put(data, &len, 0x09, NULL, 0, (const uint8_t *)advertisement_data.LocalName, name_len);
+
+	if(advertisement_data.ManufacturerData) {
+		p = g_bytes_get_data(advertisement_data.ManufacturerData, &size);
+		prefix[0] = advertisement_data.ManufacturerId & 0xff;
+		prefix[1] = advertisement_data.ManufacturerId >> 8;
+		if(advertising_ad_put(data, &len, 0xFF, prefix, 2, p, size) < 0) {
+			u_tm_log("Error: manufacturer data too long for scan response\n");
+		}
+	}
+
+	if(advertisement_data.ServiceData) {
+		uuid16 = advertising_uuid16(advertisement_data.ServiceUUID);
+		p = g_bytes_get_data(advertisement_data.ServiceData, &size);
+		prefix[0] = uuid16 & 0xff;
+		prefix[1] = uuid16 >> 8;
+		if(uuid16 < 0 || advertising_ad_put(data, &len, 0x16, prefix, 2, p, size) < 0) {
+			u_tm_log("Error: service data does not fit in scan response\n");
+		}
+	}
+
+	G_UNLOCK(advertisement_data);
+
+	hci_le_set_scan_rsp_data(eng, data, len, NULL, NULL);
+}
+
+
+static void advertising_hci_set_interval(struct hci_engine_t *eng, uint32_t min_ms, uint32_t max_ms)
+{
+	hci_le_set_adv_enable(eng, 0, NULL, NULL);
+	hci_le_set_adv_params(eng, ADVERT_HCI_INTERVAL(min_ms), ADVERT_HCI_INTERVAL(max_ms), 0x07, NULL, NULL);
+	hci_le_set_adv_enable(eng, 1, NULL, NULL);
+}
+
+
+static gboolean advertising_hci_slow_timeout(gpointer user_data)
+{
+	u_tm_log("hci advertising slow\n");
+
+	adv_hci_timer = 0;
+	advertising_hci_set_interval(user_data, advertising_policy.slow_min_interval, advertising_policy.slow_max_interval);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * 不经过bluetoothd, 用HCI命令广播(ATT模式)
+ * 命令一起放入engine的队列, 按顺序发送, 连接断开后需要再调用advertising_hci_enable
+ */
+int advertising_start_hci(struct hci_engine_t *eng)
+{
+	adv_hci = eng;
+	advertising_hci_update_data(eng);
+
+	return advertising_hci_enable(eng);
+}
+
+
+/*
+ * 连接建立后控制器自动停止广播, 断开后调用这个函数重新开始快速广播
+ */
+int advertising_hci_enable(struct hci_engine_t *eng)
+{
+	if(adv_hci_timer) {
+		g_source_remove(adv_hci_timer);
+		adv_hci_timer = 0;
+	}
+
+	advertising_hci_set_interval(eng, advertising_policy.fast_min_interval, advertising_policy.fast_max_interval);
+
+	if(advertising_policy.fast_timeout) {
+		adv_hci_timer = g_timeout_add_seconds(advertising_policy.fast_timeout, advertising_hci_slow_timeout, eng);
+	}
+
+	return 0;
+}
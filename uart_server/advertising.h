@@ -2,8 +2,45 @@
 #define __ADVERTISING_H__
 
 #include <gio/gio.h>
+#include <stdint.h>
 
-int advertising_start(GDBusConnection *conn);
+struct advertising_t;
+struct hci_engine_t;
+
+/*
+ * 广播间隔的范围(ms), HCI的0x0020 - 0x4000(单位0.625ms)
+ */
+#define ADVERTISING_MIN_INTERVAL 20
+#define ADVERTISING_MAX_INTERVAL 10240
+
+/*
+ * 广播间隔策略, 间隔单位ms, 在ADVERTISING_MIN_INTERVAL和ADVERTISING_MAX_INTERVAL之间
+ * 开始广播和advertising_fast之后使用fast间隔, fast_timeout秒后切换到slow间隔
+ * fast_timeout为0时一直快速广播
+ */
+struct advertising_policy_t {
+	uint32_t fast_min_interval;
+	uint32_t fast_max_interval;
+	uint32_t fast_timeout;
+	uint32_t slow_min_interval;
+	uint32_t slow_max_interval;
+};
+
+/*
+ * ok: RegisterAdvertisement成功
+ */
+typedef void (*advertising_registered_t)(struct advertising_t *adv, int ok, void *user_data);
+
+struct advertising_t *advertising_start(GDBusConnection *conn, const char *adapter,
+					advertising_registered_t cb, void *user_data);
+void advertising_stop(struct advertising_t *adv);
+void advertising_fast(struct advertising_t *adv);
+void advertising_set_policy(const struct advertising_policy_t *policy);
+void advertising_set_tx_power(int16_t tx_power);
+void advertising_set_manufacturer_data(uint16_t company_id, const uint8_t *data, int len);
+void advertising_set_service_data(const char *uuid, const uint8_t *data, int len);
+int advertising_start_hci(struct hci_engine_t *eng);
+int advertising_hci_enable(struct hci_engine_t *eng);
 
 
 #endif
@@ -0,0 +1,675 @@
+/*
+ * ATT协议处理
+ *
+ * 1.属性表是固定的: GAP服务(Device Name)和Nordic UART服务(RX, TX, TX的CCCD),
+ *   UUID和gatt.c中的一样, 客户端不需要区分两种模式.
+ * 2.支持MTU交换, Find Information, Find By Type Value, Read By Type,
+ *   Read By Group Type, Read, Read Blob, Write Request, Write Command和通知,
+ *   其他请求回复Request Not Supported.
+ * 3.一个连接一个struct att_conn_t, 所有函数都在同一个线程中调用.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "att.h"
+#include "stats.h"
+
+#define UUID_PRIMARY_SERVICE	0x2800
+#define UUID_CHARACTERISTIC		0x2803
+#define UUID_CCCD				0x2902
+#define UUID_GAP_SERVICE		0x1800
+#define UUID_DEVICE_NAME		0x2A00
+
+#define CHAR_PROP_READ			0x02
+#define CHAR_PROP_WRITE_CMD		0x04
+#define CHAR_PROP_WRITE			0x08
+#define CHAR_PROP_NOTIFY		0x10
+
+#define ATT_PERM_READ			0x01
+#define ATT_PERM_WRITE			0x02
+#define ATT_PERM_WRITE_CMD		0x04
+
+#define CCCD_NOTIFY				0x0001
+
+/*
+ * 需要在连接中处理的属性
+ */
+enum att_attr_id_t {
+	ATT_ID_NONE,
+	ATT_ID_RX,
+	ATT_ID_TX,
+	ATT_ID_CCCD,
+};
+
+struct att_attr_t {
+	uint16_t handle;
+	uint16_t type;				/* 16位UUID */
+	const uint8_t *type128;		/* 不为NULL时是128位UUID, 小端 */
+	uint8_t perm;
+	uint8_t id;
+	const uint8_t *value;
+	uint16_t len;
+};
+
+struct att_conn_t {
+	struct att_transport_t tp;
+	uint16_t mtu;
+	uint16_t cccd;
+	uint8_t cccd_value[2];
+	att_receive_t receive_cb;
+	att_notify_t notify_cb;
+	void *user_data;
+	uint8_t rsp[ATT_MAX_MTU];
+};
+
+/*
+ * 6e400001-b5a3-f393-e0a9-e50e24dcca9e, 小端
+ */
+#define NUS_UUID(n) 0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, n, 0x00, 0x40, 0x6e
+
+static const uint8_t nus_service_uuid[16] = {NUS_UUID(0x01)};
+static const uint8_t nus_rx_uuid[16] = {NUS_UUID(0x02)};
+static const uint8_t nus_tx_uuid[16] = {NUS_UUID(0x03)};
+
+static const uint8_t gap_service_value[] = {UUID_GAP_SERVICE & 0xff, UUID_GAP_SERVICE >> 8};
+static const uint8_t device_name_decl[] = {CHAR_PROP_READ, 0x03, 0x00, UUID_DEVICE_NAME & 0xff, UUID_DEVICE_NAME >> 8};
+static const uint8_t device_name[] = "bluez_uart";
+static const uint8_t rx_decl[] = {CHAR_PROP_WRITE_CMD | CHAR_PROP_WRITE, 0x06, 0x00, NUS_UUID(0x02)};
+static const uint8_t tx_decl[] = {CHAR_PROP_NOTIFY, 0x08, 0x00, NUS_UUID(0x03)};
+
+#define ATT_TX_HANDLE 0x0008
+
+/*
+ * 按handle排序, handle从1开始连续
+ */
+static const struct att_attr_t att_attrs[] = {
+	{0x0001, UUID_PRIMARY_SERVICE, NULL, ATT_PERM_READ, ATT_ID_NONE, gap_service_value, sizeof(gap_service_value)},
+	{0x0002, UUID_CHARACTERISTIC, NULL, ATT_PERM_READ, ATT_ID_NONE, device_name_decl, sizeof(device_name_decl)},
+	{0x0003, UUID_DEVICE_NAME, NULL, ATT_PERM_READ, ATT_ID_NONE, device_name, sizeof(device_name) - 1},
+	{0x0004, UUID_PRIMARY_SERVICE, NULL, ATT_PERM_READ, ATT_ID_NONE, nus_service_uuid, sizeof(nus_service_uuid)},
+	{0x0005, UUID_CHARACTERISTIC, NULL, ATT_PERM_READ, ATT_ID_NONE, rx_decl, sizeof(rx_decl)},
+	{0x0006, 0, nus_rx_uuid, ATT_PERM_WRITE | ATT_PERM_WRITE_CMD, ATT_ID_RX, NULL, 0},
+	{0x0007, UUID_CHARACTERISTIC, NULL, ATT_PERM_READ, ATT_ID_NONE, tx_decl, sizeof(tx_decl)},
+	{ATT_TX_HANDLE, 0, nus_tx_uuid, 0, ATT_ID_TX, NULL, 0},
+	{0x0009, UUID_CCCD, NULL, ATT_PERM_READ | ATT_PERM_WRITE, ATT_ID_CCCD, NULL, 0},
+};
+
+#define ATT_ATTR_COUNT ((int)(sizeof(att_attrs) / sizeof(att_attrs[0])))
+
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+
+static inline void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+
+static const struct att_attr_t *att_attr_find(uint16_t handle)
+{
+	if(handle == 0 || handle > ATT_ATTR_COUNT) {
+		return NULL;
+	}
+
+	return &att_attrs[handle - 1];
+}
+
+
+/*
+ * 属性的类型是否等于uuid(2或者16个字节, 小端)
+ */
+static int att_attr_type_equal(const struct att_attr_t *attr, const uint8_t *uuid, int uuid_len)
+{
+	if(uuid_len == 2) {
+		return !attr->type128 && attr->type == get_le16(uuid);
+	}
+
+	return attr->type128 && !memcmp(attr->type128, uuid, 16);
+}
+
+
+static const uint8_t *att_attr_value(struct att_conn_t *conn, const struct att_attr_t *attr, int *len)
+{
+	if(attr->id == ATT_ID_CCCD) {
+		put_le16(conn->cccd_value, conn->cccd);
+		*len = sizeof(conn->cccd_value);
+		return conn->cccd_value;
+	}
+
+	*len = attr->len;
+
+	return attr->value;
+}
+
+
+/*
+ * 服务的最后一个handle
+ */
+static uint16_t att_group_end(const struct att_attr_t *attr)
+{
+	int i;
+
+	for(i = attr->handle; i < ATT_ATTR_COUNT; i++) {
+		if(!att_attrs[i].type128 && att_attrs[i].type == UUID_PRIMARY_SERVICE) {
+			return att_attrs[i].handle - 1;
+		}
+	}
+
+	return 0xffff;
+}
+
+
+static int att_send(struct att_conn_t *conn, const uint8_t *pdu, int len)
+{
+	return conn->tp.send(conn->tp.ctx, pdu, len);
+}
+
+
+static int att_error(struct att_conn_t *conn, uint8_t opcode, uint16_t handle, uint8_t ecode)
+{
+	uint8_t pdu[5];
+
+	pdu[0] = ATT_OP_ERROR_RSP;
+	pdu[1] = opcode;
+	put_le16(pdu + 2, handle);
+	pdu[4] = ecode;
+
+	return att_send(conn, pdu, sizeof(pdu));
+}
+
+
+/*
+ * 检查请求中的handle范围, 错误时已经回复
+ */
+static int att_check_range(struct att_conn_t *conn, uint8_t opcode, uint16_t start, uint16_t end)
+{
+	if(!start || start > end) {
+		att_error(conn, opcode, start, ATT_ECODE_INVALID_HANDLE);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int att_mtu_req(struct att_conn_t *conn, const uint8_t *pdu, int len)
+{
+	uint16_t mtu;
+	uint8_t rsp[3];
+
+	if(len != 3) {
+		return att_error(conn, pdu[0], 0, ATT_ECODE_INVALID_PDU);
+	}
+
+	mtu = get_le16(pdu + 1);
+	if(mtu < ATT_DEFAULT_MTU) {
+		mtu = ATT_DEFAULT_MTU;
+	}
+
+	rsp[0] = ATT_OP_MTU_RSP;
+	put_le16(rsp + 1, ATT_MAX_MTU);
+
+	if(att_send(conn, rsp, sizeof(rsp)) < 0) {
+		return -1;
+	}
+
+	/*
+	 * 回复之后才使用新的MTU
+	 */
+	conn->mtu = mtu < ATT_MAX_MTU ? mtu : ATT_MAX_MTU;
+
+	return 0;
+}
+
+
+/*
+ * 回复handle和UUID, format 1是16位UUID, 2是128位UUID, 一个回复中只有一种
+ */
+static int att_find_info_req(struct att_conn_t *conn, const uint8_t *pdu, int len)
+{
+	uint8_t *rsp = conn->rsp;
+	uint16_t start, end;
+	int i, n = 2, format = 0;
+
+	if(len != 5) {
+		return att_error(conn, pdu[0], 0, ATT_ECODE_INVALID_PDU);
+	}
+
+	start = get_le16(pdu + 1);
+	end = get_le16(pdu + 3);
+	if(att_check_range(conn, pdu[0], start, end) < 0) {
+		return 0;
+	}
+
+	for(i = start - 1; i < ATT_ATTR_COUNT && att_attrs[i].handle <= end; i++) {
+		const struct att_attr_t *attr = &att_attrs[i];
+		int f = attr->type128 ? 2 : 1;
+		int size = f == 1 ? 4 : 18;
+
+		if(format && f != format) {
+			break;
+		}
+		if(n + size > conn->mtu) {
+			break;
+		}
+
+		format = f;
+		put_le16(rsp + n, attr->handle);
+		if(f == 1) {
+			put_le16(rsp + n + 2, attr->type);
+		} else {
+			memcpy(rsp + n + 2, attr->type128, 16);
+		}
+		n += size;
+	}
+
+	if(!format) {
+		return att_error(conn, pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+	}
+
+	rsp[0] = ATT_OP_FIND_INFO_RSP;
+	rsp[1] = format;
+
+	return att_send(conn, rsp, n);
+}
+
+
+/*
+ * 只支持按照UUID查找主服务
+ */
+static int att_find_by_type_req(struct att_conn_t *conn, const uint8_t *pdu, int len)
+{
+	uint8_t *rsp = conn->rsp;
+	uint16_t start, end, type;
+	const uint8_t *value;
+	int i, n = 1, vlen;
+
+	if(len < 7) {
+		return att_error(conn, pdu[0], 0, ATT_ECODE_INVALID_PDU);
+	}
+
+	start = get_le16(pdu + 1);
+	end = get_le16(pdu + 3);
+	type = get_le16(pdu + 5);
+	value = pdu + 7;
+	vlen = len - 7;
+	if(att_check_range(conn, pdu[0], start, end) < 0) {
+		return 0;
+	}
+
+	for(i = start - 1; i < ATT_ATTR_COUNT && att_attrs[i].handle <= end; i++) {
+		const struct att_attr_t *attr = &att_attrs[i];
+
+		if(attr->type128 || attr->type != type || type != UUID_PRIMARY_SERVICE) {
+			continue;
+		}
+		if(attr->len != vlen || memcmp(attr->value, value, vlen)) {
+			continue;
+		}
+		if(n + 4 > conn->mtu) {
+			break;
+		}
+
+		put_le16(rsp + n, attr->handle);
+		put_le16(rsp + n + 2, att_group_end(attr));
+		n += 4;
+	}
+
+	if(n == 1) {
+		return att_error(conn, pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+	}
+
+	rsp[0] = ATT_OP_FIND_BY_TYPE_RSP;
+
+	return att_send(conn, rsp, n);
+}
+
+
+/*
+ * Read By Type和Read By Group Type: 一个回复中每一项的长度必须相同
+ * group为1时每一项多一个服务的最后一个handle
+ */
+static int att_read_by_type(struct att_conn_t *conn, const uint8_t *pdu, int len, int group)
+{
+	uint8_t *rsp = conn->rsp;
+	uint16_t start, end;
+	const uint8_t *uuid;
+	const uint8_t *value;
+	int i, n = 2, uuid_len, vlen, item_len = 0;
+	int hdr = group ? 4 : 2;
+
+	if(len != 7 && len != 21) {
+		return att_error(conn, pdu[0], 0, ATT_ECODE_INVALID_PDU);
+	}
+
+	start = get_le16(pdu + 1);
+	end = get_le16(pdu + 3);
+	uuid = pdu + 5;
+	uuid_len = len - 5;
+	if(att_check_range(conn, pdu[0], start, end) < 0) {
+		return 0;
+	}
+
+	if(group && (uuid_len != 2 || get_le16(uuid) != UUID_PRIMARY_SERVICE)) {
+		return att_error(conn, pdu[0], start, ATT_ECODE_UNSUPP_GRP_TYPE);
+	}
+
+	for(i = start - 1; i < ATT_ATTR_COUNT && att_attrs[i].handle <= end; i++) {
+		const struct att_attr_t *attr = &att_attrs[i];
+
+		if(!att_attr_type_equal(attr, uuid, uuid_len)) {
+			continue;
+		}
+
+		if(!(attr->perm & ATT_PERM_READ)) {
+			if(!item_len) {
+				return att_error(conn, pdu[0], attr->handle, ATT_ECODE_READ_NOT_PERM);
+			}
+			break;
+		}
+
+		value = att_attr_value(conn, attr, &vlen);
+
+		/*
+		 * 长度字段只有一个字节, 值按MTU截断
+		 */
+		if(vlen > conn->mtu - 2 - hdr) {
+			vlen = conn->mtu - 2 - hdr;
+		}
+		if(vlen > 255 - hdr) {
+			vlen = 255 - hdr;
+		}
+
+		if(item_len && item_len != hdr + vlen) {
+			break;
+		}
+		if(n + hdr + vlen > conn->mtu) {
+			break;
+		}
+
+		item_len = hdr + vlen;
+		put_le16(rsp + n, attr->handle);
+		if(group) {
+			put_le16(rsp + n + 2, att_group_end(attr));
+		}
+		memcpy(rsp + n + hdr, value, vlen);
+		n += item_len;
+	}
+
+	if(!item_len) {
+		return att_error(conn, pdu[0], start, ATT_ECODE_ATTR_NOT_FOUND);
+	}
+
+	rsp[0] = group ? ATT_OP_READ_BY_GROUP_RSP : ATT_OP_READ_BY_TYPE_RSP;
+	rsp[1] = item_len;
+
+	return att_send(conn, rsp, n);
+}
+
+
+static int att_read_req(struct att_conn_t *conn, const uint8_t *pdu, int len, int blob)
+{
+	const struct att_attr_t *attr;
+	const uint8_t *value;
+	uint16_t handle, offset = 0;
+	int vlen;
+
+	if(len != (blob ? 5 : 3)) {
+		return att_error(conn, pdu[0], 0, ATT_ECODE_INVALID_PDU);
+	}
+
+	handle = get_le16(pdu + 1);
+	if(blob) {
+		offset = get_le16(pdu + 3);
+	}
+
+	attr = att_attr_find(handle);
+	if(!attr) {
+		return att_error(conn, pdu[0], handle, ATT_ECODE_INVALID_HANDLE);
+	}
+
+	if(!(attr->perm & ATT_PERM_READ)) {
+		return att_error(conn, pdu[0], handle, ATT_ECODE_READ_NOT_PERM);
+	}
+
+	value = att_attr_value(conn, attr, &vlen);
+	if(offset > vlen) {
+		return att_error(conn, pdu[0], handle, ATT_ECODE_INVALID_OFFSET);
+	}
+
+	vlen -= offset;
+	if(vlen > conn->mtu - 1) {
+		vlen = conn->mtu - 1;
+	}
+
+	conn->rsp[0] = blob ? ATT_OP_READ_BLOB_RSP : ATT_OP_READ_RSP;
+	memcpy(conn->rsp + 1, value + offset, vlen);
+
+	return att_send(conn, conn->rsp, vlen + 1);
+}
+
+
+static void att_rx_deliver(struct att_conn_t *conn, const uint8_t *buf, int len)
+{
+	uint64_t start;
+
+	if(!len) {
+		return;
+	}
+
+	stats_inc(STATS_RX_PACKETS);
+	stats_add(STATS_RX_BYTES, len);
+
+	if(conn->receive_cb) {
+		start = stats_now();
+		conn->receive_cb(conn, (uint8_t *)buf, len, conn->user_data);
+		stats_hist_add(STATS_HIST_RX_LATENCY, stats_now() - start);
+	}
+}
+
+
+static void att_set_cccd(struct att_conn_t *conn, uint16_t value)
+{
+	int old = conn->cccd & CCCD_NOTIFY;
+
+	conn->cccd = value;
+
+	if(old == (value & CCCD_NOTIFY)) {
+		return;
+	}
+
+	stats_inc(old ? STATS_STOP_NOTIFY : STATS_START_NOTIFY);
+
+	if(conn->notify_cb) {
+		conn->notify_cb(conn, !old, conn->user_data);
+	}
+}
+
+
+/*
+ * Write Request需要回复, Write Command出错时也不回复
+ */
+static int att_write(struct att_conn_t *conn, const uint8_t *pdu, int len)
+{
+	const struct att_attr_t *attr;
+	int cmd = pdu[0] == ATT_OP_WRITE_CMD;
+	uint8_t rsp = ATT_OP_WRITE_RSP;
+	uint16_t handle;
+	uint8_t ecode = 0;
+
+	if(len < 3) {
+		return cmd ? 0 : att_error(conn, pdu[0], 0, ATT_ECODE_INVALID_PDU);
+	}
+
+	handle = get_le16(pdu + 1);
+	attr = att_attr_find(handle);
+
+	if(!attr) {
+		ecode = ATT_ECODE_INVALID_HANDLE;
+	} else if(!(attr->perm & (cmd ? ATT_PERM_WRITE_CMD : ATT_PERM_WRITE))) {
+		ecode = ATT_ECODE_WRITE_NOT_PERM;
+	} else if(attr->id == ATT_ID_CCCD && len != 5) {
+		ecode = ATT_ECODE_INVAL_ATTR_VALUE_LEN;
+	} else if(len - 3 > ATT_MAX_VALUE_LEN) {
+		ecode = ATT_ECODE_INVAL_ATTR_VALUE_LEN;
+	}
+
+	if(ecode) {
+		return cmd ? 0 : att_error(conn, pdu[0], handle, ecode);
+	}
+
+	/*
+	 * 先回复再交给回调, 回调中发送的通知在回复之后
+	 */
+	if(!cmd && att_send(conn, &rsp, 1) < 0) {
+		return -1;
+	}
+
+	if(attr->id == ATT_ID_CCCD) {
+		att_set_cccd(conn, get_le16(pdu + 3));
+	} else if(attr->id == ATT_ID_RX) {
+		att_rx_deliver(conn, pdu + 3, len - 3);
+	}
+
+	return 0;
+}
+
+
+/*
+ * 处理收到的一个PDU, 返回-1表示发送失败
+ */
+int att_conn_input(struct att_conn_t *conn, const uint8_t *pdu, int len)
+{
+	if(len < 1) {
+		return 0;
+	}
+
+	switch(pdu[0]) {
+	case ATT_OP_MTU_REQ:
+		return att_mtu_req(conn, pdu, len);
+	case ATT_OP_FIND_INFO_REQ:
+		return att_find_info_req(conn, pdu, len);
+	case ATT_OP_FIND_BY_TYPE_REQ:
+		return att_find_by_type_req(conn, pdu, len);
+	case ATT_OP_READ_BY_TYPE_REQ:
+		return att_read_by_type(conn, pdu, len, 0);
+	case ATT_OP_READ_BY_GROUP_REQ:
+		return att_read_by_type(conn, pdu, len, 1);
+	case ATT_OP_READ_REQ:
+		return att_read_req(conn, pdu, len, 0);
+	case ATT_OP_READ_BLOB_REQ:
+		return att_read_req(conn, pdu, len, 1);
+	case ATT_OP_WRITE_REQ:
+	case ATT_OP_WRITE_CMD:
+		return att_write(conn, pdu, len);
+	case ATT_OP_HANDLE_CNF:
+		return 0;
+	}
+
+	/*
+	 * 不支持的Command直接忽略, 不支持的请求回复错误
+	 */
+	if(pdu[0] & ATT_OP_CMD_FLAG) {
+		return 0;
+	}
+
+	return att_error(conn, pdu[0], 0, ATT_ECODE_REQ_NOT_SUPP);
+}
+
+
+/*
+ * 通过TX特征发送一个通知, 最长MTU - 3
+ * 返回0表示已经发送, -1表示数据被丢弃
+ */
+int att_conn_notify(struct att_conn_t *conn, const uint8_t *buf, int len)
+{
+	uint8_t *pdu = conn->rsp;
+	uint64_t start;
+
+	if(!(conn->cccd & CCCD_NOTIFY)) {
+		stats_inc(STATS_TX_DROP_NOT_NOTIFYING);
+		return -1;
+	}
+
+	if(len > conn->mtu - 3) {
+		stats_inc(STATS_TX_DROP_TOO_LONG);
+		return -1;
+	}
+
+	start = stats_now();
+
+	pdu[0] = ATT_OP_HANDLE_NOTIFY;
+	put_le16(pdu + 1, ATT_TX_HANDLE);
+	memcpy(pdu + 3, buf, len);
+
+	if(att_send(conn, pdu, len + 3) < 0) {
+		stats_inc(STATS_SOCKET_ERRORS);
+		return -1;
+	}
+
+	stats_inc(STATS_TX_PACKETS);
+	stats_add(STATS_TX_BYTES, len);
+	stats_hist_add(STATS_HIST_TX_LATENCY, stats_now() - start);
+
+	return 0;
+}
+
+
+int att_conn_is_notifying(struct att_conn_t *conn)
+{
+	return conn->cccd & CCCD_NOTIFY;
+}
+
+
+int att_conn_payload_size(struct att_conn_t *conn)
+{
+	return conn->mtu - 3;
+}
+
+
+void *att_conn_get_user_data(struct att_conn_t *conn)
+{
+	return conn->user_data;
+}
+
+
+struct att_conn_t *att_conn_new(const struct att_transport_t *tp,
+								att_receive_t receive_cb,
+								att_notify_t notify_cb,
+								void *user_data)
+{
+	struct att_conn_t *conn = calloc(1, sizeof(*conn));
+
+	if(!conn) {
+		return NULL;
+	}
+
+	conn->tp = *tp;
+	conn->mtu = ATT_DEFAULT_MTU;
+	conn->receive_cb = receive_cb;
+	conn->notify_cb = notify_cb;
+	conn->user_data = user_data;
+
+	return conn;
+}
+
+
+/*
+ * 打开着通知时先通知关闭
+ */
+void att_conn_free(struct att_conn_t *conn)
+{
+	if(!conn) {
+		return;
+	}
+
+	att_set_cccd(conn, 0);
+	free(conn);
+}
@@ -0,0 +1,107 @@
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#ifndef __ATT_H__
+#define __ATT_H__
+
+#include <stdint.h>
+
+/*
+ * 不经过bluetoothd的ATT协议处理, 提供和gatt.c一样的Nordic UART属性表
+ *
+ * 只处理PDU, 不关心PDU从哪里来: 收到的PDU交给att_conn_input,
+ * 回复和通知通过struct att_transport_t发出去.
+ * L2CAP socket和socketpair的实现见att_l2cap.c.
+ */
+
+#define ATT_CID 4
+
+#define ATT_DEFAULT_MTU 23
+#define ATT_MAX_MTU 517
+
+/*
+ * 属性值的最大长度
+ */
+#define ATT_MAX_VALUE_LEN 512
+
+/*
+ * Opcodes
+ */
+#define ATT_OP_ERROR_RSP				0x01
+#define ATT_OP_MTU_REQ					0x02
+#define ATT_OP_MTU_RSP					0x03
+#define ATT_OP_FIND_INFO_REQ			0x04
+#define ATT_OP_FIND_INFO_RSP			0x05
+#define ATT_OP_FIND_BY_TYPE_REQ			0x06
+#define ATT_OP_FIND_BY_TYPE_RSP			0x07
+#define ATT_OP_READ_BY_TYPE_REQ			0x08
+#define ATT_OP_READ_BY_TYPE_RSP			0x09
+#define ATT_OP_READ_REQ					0x0A
+#define ATT_OP_READ_RSP					0x0B
+#define ATT_OP_READ_BLOB_REQ			0x0C
+#define ATT_OP_READ_BLOB_RSP			0x0D
+#define ATT_OP_READ_BY_GROUP_REQ		0x10
+#define ATT_OP_READ_BY_GROUP_RSP		0x11
+#define ATT_OP_WRITE_REQ				0x12
+#define ATT_OP_WRITE_RSP				0x13
+#define ATT_OP_HANDLE_NOTIFY			0x1B
+#define ATT_OP_HANDLE_IND				0x1D
+#define ATT_OP_HANDLE_CNF				0x1E
+#define ATT_OP_WRITE_CMD				0x52
+
+/*
+ * opcode中的Command Flag, 没有回复
+ */
+#define ATT_OP_CMD_FLAG					0x40
+
+/*
+ * Error codes
+ */
+#define ATT_ECODE_INVALID_HANDLE		0x01
+#define ATT_ECODE_READ_NOT_PERM			0x02
+#define ATT_ECODE_WRITE_NOT_PERM		0x03
+#define ATT_ECODE_INVALID_PDU			0x04
+#define ATT_ECODE_REQ_NOT_SUPP			0x06
+#define ATT_ECODE_INVALID_OFFSET		0x07
+#define ATT_ECODE_ATTR_NOT_FOUND		0x0A
+#define ATT_ECODE_INVAL_ATTR_VALUE_LEN	0x0D
+#define ATT_ECODE_UNSUPP_GRP_TYPE		0x10
+
+/*
+ * 发送一个PDU, 返回0表示成功
+ */
+struct att_transport_t {
+	int (*send)(void *ctx, const uint8_t *pdu, int len);
+	void *ctx;
+};
+
+struct att_conn_t;
+
+/*
+ * 收到RX特征的写入(Write Request或者Write Command)
+ */
+typedef void (*att_receive_t)(struct att_conn_t *conn, uint8_t *buf, int len, void *user_data);
+
+/*
+ * 客户端写TX特征的CCCD打开或者关闭通知, 连接断开时也会调用(notifying为0)
+ */
+typedef void (*att_notify_t)(struct att_conn_t *conn, int notifying, void *user_data);
+
+struct att_conn_t *att_conn_new(const struct att_transport_t *tp,
+								att_receive_t receive_cb,
+								att_notify_t notify_cb,
+								void *user_data);
+void att_conn_free(struct att_conn_t *conn);
+int att_conn_input(struct att_conn_t *conn, const uint8_t *pdu, int len);
+int att_conn_notify(struct att_conn_t *conn, const uint8_t *buf, int len);
+int att_conn_is_notifying(struct att_conn_t *conn);
+int att_conn_payload_size(struct att_conn_t *conn);
+void *att_conn_get_user_data(struct att_conn_t *conn);
+
+
+#endif
+#ifdef __cplusplus
+}
+#endif
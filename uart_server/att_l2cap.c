@@ -0,0 +1,493 @@
+/*
+ * ATT连接的传输层
+ *
+ * 1.在LE ATT固定通道(CID 4)上监听, 每个accept的socket是一个连接,
+ *   需要bluetoothd没有运行(或者运行时没有占用ATT通道), 广播需要另外打开.
+ * 2.L2CAP socket和AF_UNIX的SEQPACKET socket一样, 一次recv/send是一个PDU,
+ *   所以socketpair的一端也可以作为连接加入, 用来测试和评估协议处理.
+ */
+
+#define _GNU_SOURCE		/* accept4 */
+
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
+
+#include "att_l2cap.h"
+#include "log.h"
+#include "stats.h"
+
+/*
+ * socket满时等待发送的PDU的最大个数, 回复总是放入队列(客户端同时只有一个请求),
+ * 通知超过这个个数时丢弃(正常时uart_server_tx_gate已经停止发送)
+ */
+#define ATT_FD_QUEUE_MAX 64
+
+struct att_fd_conn_t {
+	struct att_server_t *srv;
+	struct att_conn_t *att;
+	int fd;
+	guint watch_id;
+	/*
+	 * socket满时按顺序放入out, out_id等待G_IO_OUT后发送
+	 */
+	GQueue *out;			/* GBytes */
+	guint out_id;
+};
+
+struct att_server_t {
+	int listen_fd;
+	guint listen_id;
+	GPtrArray *conns;		/* struct att_fd_conn_t */
+	att_receive_t receive_cb;
+	att_notify_t notify_cb;
+	att_writable_t writable_cb;
+	void *user_data;
+	/*
+	 * 所有打开通知的连接中最小的MTU - 3, 没有时为0, 其他线程读取
+	 */
+	gint payload_size;
+	uint8_t buf[ATT_MAX_MTU];
+};
+
+
+static gboolean att_fd_writable(gint fd, GIOCondition condition, gpointer user_data);
+
+
+/*
+ * 按顺序发送out中的PDU, 返回0表示全部发送, 1表示socket又满了, -1表示socket出错
+ */
+static int att_fd_flush(struct att_fd_conn_t *c)
+{
+	const uint8_t *pdu;
+	GBytes *b;
+	gsize len;
+
+	while((b = g_queue_peek_head(c->out))) {
+		pdu = g_bytes_get_data(b, &len);
+		if(send(c->fd, pdu, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 1;
+			}
+			u_tm_log("[%s:%d] fd %d send error: %s\n", __FUNCTION__, __LINE__, c->fd, strerror(errno));
+			return -1;
+		}
+		g_bytes_unref(g_queue_pop_head(c->out));
+	}
+
+	return 0;
+}
+
+
+/*
+ * socket是非阻塞的, 发送缓冲满(控制器来不及发送)时放入out, 不阻塞main loop
+ * 满的时候回复不能丢, 丢了客户端的请求会一直等到超时
+ */
+static int att_fd_send(void *ctx, const uint8_t *pdu, int len)
+{
+	struct att_fd_conn_t *c = ctx;
+
+	if(g_queue_is_empty(c->out)) {
+		if(send(c->fd, pdu, len, MSG_NOSIGNAL | MSG_DONTWAIT) == len) {
+			return 0;
+		}
+		if(errno != EAGAIN && errno != EWOULDBLOCK) {
+			u_tm_log("[%s:%d] fd %d send error: %s\n", __FUNCTION__, __LINE__, c->fd, strerror(errno));
+			return -1;
+		}
+		stats_inc(STATS_TX_SOCKET_FULL);
+	}
+
+	if(pdu[0] == ATT_OP_HANDLE_NOTIFY && g_queue_get_length(c->out) >= ATT_FD_QUEUE_MAX) {
+		return -1;
+	}
+
+	g_queue_push_tail(c->out, g_bytes_new(pdu, len));
+	if(!c->out_id) {
+		c->out_id = g_unix_fd_add(c->fd, G_IO_OUT, att_fd_writable, c);
+	}
+
+	return 0;
+}
+
+
+/*
+ * socket可以写了, 发送完out之后通知上层继续发送
+ * 出错时丢弃out, 连接由att_fd_callback在G_IO_HUP/G_IO_ERR时关闭
+ */
+static gboolean att_fd_writable(gint fd, GIOCondition condition, gpointer user_data)
+{
+	struct att_fd_conn_t *c = user_data;
+	struct att_server_t *srv = c->srv;
+	int ret = att_fd_flush(c);
+
+	if(ret > 0) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	c->out_id = 0;
+
+	if(ret < 0) {
+		g_queue_clear_full(c->out, (GDestroyNotify)g_bytes_unref);
+	} else if(srv->writable_cb) {
+		srv->writable_cb(srv->user_data);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void att_server_update_payload_size(struct att_server_t *srv)
+{
+	struct att_fd_conn_t *c;
+	int i, n, size = 0;
+
+	for(i = 0; i < (int)srv->conns->len; i++) {
+		c = g_ptr_array_index(srv->conns, i);
+		if(!att_conn_is_notifying(c->att)) {
+			continue;
+		}
+		n = att_conn_payload_size(c->att);
+		if(!size || n < size) {
+			size = n;
+		}
+	}
+
+	g_atomic_int_set(&srv->payload_size, size);
+}
+
+
+static void att_server_receive(struct att_conn_t *conn, uint8_t *buf, int len, void *user_data)
+{
+	struct att_fd_conn_t *c = user_data;
+	struct att_server_t *srv = c->srv;
+
+	if(srv->receive_cb) {
+		srv->receive_cb(conn, buf, len, srv->user_data);
+	}
+}
+
+
+static void att_server_notify(struct att_conn_t *conn, int notifying, void *user_data)
+{
+	struct att_fd_conn_t *c = user_data;
+	struct att_server_t *srv = c->srv;
+
+	u_tm_log("att fd %d notifying = %d\n", c->fd, notifying);
+
+	if(srv->notify_cb) {
+		srv->notify_cb(conn, notifying, srv->user_data);
+	}
+}
+
+
+static void att_fd_conn_free(struct att_fd_conn_t *c)
+{
+	u_tm_log("att fd %d closed\n", c->fd);
+
+	if(c->watch_id) {
+		g_source_remove(c->watch_id);
+	}
+	if(c->out_id) {
+		g_source_remove(c->out_id);
+	}
+	g_queue_free_full(c->out, (GDestroyNotify)g_bytes_unref);
+
+	/*
+	 * 先从列表中删除, 关闭通知的回调中不会再发给这个连接
+	 */
+	g_ptr_array_remove_fast(c->srv->conns, c);
+	att_conn_free(c->att);
+	att_server_update_payload_size(c->srv);
+	close(c->fd);
+	g_free(c);
+}
+
+
+/*
+ * 一次读完socket中所有的PDU
+ */
+static gboolean att_fd_callback(gint fd, GIOCondition condition, gpointer user_data)
+{
+	struct att_fd_conn_t *c = user_data;
+	struct att_server_t *srv = c->srv;
+	ssize_t n;
+
+	if(condition & G_IO_IN) {
+		while(1) {
+			n = recv(fd, srv->buf, sizeof(srv->buf), MSG_DONTWAIT);
+			if(n < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+					break;
+				}
+				goto close;
+			}
+			if(n == 0) {
+				goto close;
+			}
+			if(att_conn_input(c->att, srv->buf, n) < 0) {
+				goto close;
+			}
+		}
+
+		att_server_update_payload_size(srv);
+	}
+
+	if(condition & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		goto close;
+	}
+
+	return G_SOURCE_CONTINUE;
+
+close:
+	c->watch_id = 0;
+	att_fd_conn_free(c);
+	return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * 加入一个已经连接的SEQPACKET socket, 之后由att_server管理和关闭
+ */
+struct att_conn_t *att_server_add_fd(struct att_server_t *srv, int fd)
+{
+	struct att_fd_conn_t *c = g_new0(struct att_fd_conn_t, 1);
+	struct att_transport_t tp = {
+		.send = att_fd_send,
+		.ctx = c,
+	};
+
+	c->srv = srv;
+	c->fd = fd;
+	c->out = g_queue_new();
+	c->att = att_conn_new(&tp, att_server_receive, att_server_notify, c);
+	if(!c->att) {
+		g_queue_free(c->out);
+		g_free(c);
+		close(fd);
+		return NULL;
+	}
+
+	c->watch_id = g_unix_fd_add(fd, G_IO_IN | G_IO_HUP | G_IO_ERR, att_fd_callback, c);
+	g_ptr_array_add(srv->conns, c);
+
+	return c->att;
+}
+
+
+/*
+ * 接受所有等待的连接, 直到EAGAIN
+ * 连接的socket是非阻塞的, 发送缓冲满时att_fd_send丢弃而不是阻塞
+ */
+static gboolean att_listen_callback(gint fd, GIOCondition condition, gpointer user_data)
+{
+	struct att_server_t *srv = user_data;
+	struct sockaddr_l2 addr;
+	socklen_t len;
+	int cfd;
+
+	while(1) {
+		len = sizeof(addr);
+		memset(&addr, 0, sizeof(addr));
+		cfd = accept4(fd, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(cfd < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				u_tm_log("[%s:%d] accept error: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+			}
+			break;
+		}
+
+		u_tm_log("att connected %02X:%02X:%02X:%02X:%02X:%02X fd %d\n",
+					addr.l2_bdaddr.b[5], addr.l2_bdaddr.b[4], addr.l2_bdaddr.b[3],
+					addr.l2_bdaddr.b[2], addr.l2_bdaddr.b[1], addr.l2_bdaddr.b[0], cfd);
+
+		att_server_add_fd(srv, cfd);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+/*
+ * "XX:XX:XX:XX:XX:XX" -> bdaddr_t, 字节顺序是反的
+ */
+static int att_parse_address(const char *str, bdaddr_t *ba)
+{
+	unsigned int b[6];
+	int i;
+
+	if(sscanf(str, "%x:%x:%x:%x:%x:%x", &b[5], &b[4], &b[3], &b[2], &b[1], &b[0]) != 6) {
+		return -1;
+	}
+
+	for(i = 0; i < 6; i++) {
+		ba->b[i] = b[i];
+	}
+
+	return 0;
+}
+
+
+/*
+ * 在adapter的地址上监听ATT通道, address为NULL时监听所有adapter
+ */
+int att_server_listen(struct att_server_t *srv, const char *address)
+{
+	struct sockaddr_l2 addr;
+	struct bt_security sec;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.l2_family = AF_BLUETOOTH;
+	addr.l2_cid = htobs(ATT_CID);
+	addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+
+	if(address && att_parse_address(address, &addr.l2_bdaddr) < 0) {
+		u_tm_log("Error: invalid address %s\n", address);
+		return -1;
+	}
+
+	fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_L2CAP);
+	if(fd < 0) {
+		u_tm_log("Error: [%s:%d] socket: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		return -1;
+	}
+
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		u_tm_log("Error: [%s:%d] bind: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		goto err;
+	}
+
+	memset(&sec, 0, sizeof(sec));
+	sec.level = BT_SECURITY_LOW;
+	if(setsockopt(fd, SOL_BLUETOOTH, BT_SECURITY, &sec, sizeof(sec)) < 0) {
+		u_tm_log("Error: [%s:%d] BT_SECURITY: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		goto err;
+	}
+
+	if(listen(fd, 4) < 0) {
+		u_tm_log("Error: [%s:%d] listen: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		goto err;
+	}
+
+	srv->listen_fd = fd;
+	srv->listen_id = g_unix_fd_add(fd, G_IO_IN, att_listen_callback, srv);
+
+	u_tm_log("att listening on %s\n", address ? address : "00:00:00:00:00:00");
+
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+}
+
+
+/*
+ * 发送给所有打开通知的连接, 返回0表示至少发给了一个连接
+ */
+int att_server_send(struct att_server_t *srv, const uint8_t *buf, int len)
+{
+	struct att_fd_conn_t *c;
+	int i, notifying = 0, ret = -1;
+
+	for(i = 0; i < (int)srv->conns->len; i++) {
+		c = g_ptr_array_index(srv->conns, i);
+		if(!att_conn_is_notifying(c->att)) {
+			continue;
+		}
+		notifying = 1;
+		if(!att_conn_notify(c->att, buf, len)) {
+			ret = 0;
+		}
+	}
+
+	if(!notifying) {
+		stats_inc(STATS_TX_DROP_NOT_NOTIFYING);
+	}
+
+	return ret;
+}
+
+
+/*
+ * 有打开通知的连接socket满了, 等待发送的通知还没有发出去
+ * 这时停止发送, socket可以写之后由writable_cb通知继续
+ */
+int att_server_tx_blocked(struct att_server_t *srv)
+{
+	struct att_fd_conn_t *c;
+	int i;
+
+	for(i = 0; i < (int)srv->conns->len; i++) {
+		c = g_ptr_array_index(srv->conns, i);
+		if(att_conn_is_notifying(c->att) && !g_queue_is_empty(c->out)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+void att_server_set_writable_cb(struct att_server_t *srv, att_writable_t cb)
+{
+	srv->writable_cb = cb;
+}
+
+
+/*
+ * 可以在任意线程调用
+ */
+int att_server_payload_size(struct att_server_t *srv)
+{
+	return g_atomic_int_get(&srv->payload_size);
+}
+
+
+struct att_server_t *att_server_new(att_receive_t receive_cb, att_notify_t notify_cb, void *user_data)
+{
+	struct att_server_t *srv = g_new0(struct att_server_t, 1);
+
+	srv->listen_fd = -1;
+	srv->conns = g_ptr_array_new();
+	srv->receive_cb = receive_cb;
+	srv->notify_cb = notify_cb;
+	srv->user_data = user_data;
+
+	return srv;
+}
+
+
+void att_server_free(struct att_server_t *srv)
+{
+	if(!srv) {
+		return;
+	}
+
+	while(srv->conns->len) {
+		att_fd_conn_free(g_ptr_array_index(srv->conns, 0));
+	}
+	g_ptr_array_free(srv->conns, TRUE);
+
+	if(srv->listen_id) {
+		g_source_remove(srv->listen_id);
+	}
+	if(srv->listen_fd >= 0) {
+		close(srv->listen_fd);
+	}
+
+	g_free(srv);
+}
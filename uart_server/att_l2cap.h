@@ -0,0 +1,36 @@
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#ifndef __ATT_L2CAP_H__
+#define __ATT_L2CAP_H__
+
+#include "att.h"
+
+/*
+ * 管理多个ATT连接, 只在main loop线程中使用(att_server_payload_size除外)
+ * 连接可以是L2CAP LE ATT通道(CID 4)上accept的socket,
+ * 也可以是att_server_add_fd加入的SEQPACKET socket, 例如socketpair的一端
+ */
+struct att_server_t;
+
+/*
+ * att_server_tx_blocked之后socket可以写了
+ */
+typedef void (*att_writable_t)(void *user_data);
+
+struct att_server_t *att_server_new(att_receive_t receive_cb, att_notify_t notify_cb, void *user_data);
+void att_server_free(struct att_server_t *srv);
+int att_server_listen(struct att_server_t *srv, const char *address);
+struct att_conn_t *att_server_add_fd(struct att_server_t *srv, int fd);
+int att_server_send(struct att_server_t *srv, const uint8_t *buf, int len);
+int att_server_payload_size(struct att_server_t *srv);
+int att_server_tx_blocked(struct att_server_t *srv);
+void att_server_set_writable_cb(struct att_server_t *srv, att_writable_t cb);
+
+
+#endif
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,363 @@
+/*
+ * ATT协议处理的测试, 不需要蓝牙设备
+ *
+ * 1.socketpair的一端通过att_server_add_fd作为一个连接加入att_server, 另一端作为客户端,
+ *   和L2CAP ATT通道一样一次send/recv是一个PDU.
+ * 2.客户端依次做MTU交换, 服务发现(服务, 特征, CCCD), 打开通知, 写入RX特征,
+ *   接收回调把数据原样通知回来, 检查TX特征上的notification.
+ * 3.客户端不接收, 通知把socket填满之后发送Write Request, 回复要排队等待发送, 连接不能断开.
+ *
+ * make test 运行, 全部通过时返回0.
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "att.h"
+#include "att_l2cap.h"
+
+/*
+ * 等待一个PDU的最长时间, 不应该收到PDU时也等这么长时间
+ */
+#define ATT_TEST_TIMEOUT_MS 200
+
+#define ATT_TEST_MTU 247
+
+#define ATT_UUID_PRIMARY_SERVICE	0x2800
+#define ATT_UUID_CHARACTERISTIC		0x2803
+#define ATT_UUID_CCCD				0x2902
+
+/*
+ * UART服务和特征的128位UUID(小端), 第12个字节区分服务(0x01), RX(0x02)和TX(0x03)
+ */
+static const uint8_t att_test_uart_uuid[16] = {
+	0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0,
+	0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e,
+};
+
+struct att_test_t {
+	struct att_server_t *srv;
+	int fd;			/* 客户端 */
+	int notifying;
+	int writable;
+	int failures;
+
+	uint16_t svc_start, svc_end;
+	uint16_t rx_handle, tx_handle, tx_cccd;
+};
+
+static struct att_test_t t;
+
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+
+static inline void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+
+static void att_test_check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if(!ok) {
+		t.failures++;
+	}
+}
+
+
+/*
+ * 回显, 和uart_server的ATT模式一样通过att_server_send发给所有打开通知的连接
+ */
+static void att_test_receive(struct att_conn_t *conn, uint8_t *buf, int len, void *user_data)
+{
+	att_server_send(t.srv, buf, len);
+}
+
+
+static void att_test_notify(struct att_conn_t *conn, int notifying, void *user_data)
+{
+	t.notifying = notifying;
+}
+
+
+static void att_test_writable(void *user_data)
+{
+	t.writable++;
+}
+
+
+/*
+ * 客户端发送req(为NULL时只接收), 运行main loop直到客户端收到一个PDU
+ * 返回PDU的长度, 超时返回-1
+ */
+static int att_test_xfer(const uint8_t *req, int len, uint8_t *rsp)
+{
+	gint64 deadline = g_get_monotonic_time() + ATT_TEST_TIMEOUT_MS * 1000;
+	ssize_t n;
+
+	if(req && send(t.fd, req, len, 0) != len) {
+		return -1;
+	}
+
+	while(g_get_monotonic_time() < deadline) {
+		n = recv(t.fd, rsp, ATT_MAX_MTU, MSG_DONTWAIT);
+		if(n > 0) {
+			return n;
+		}
+		if(!g_main_context_iteration(NULL, FALSE)) {
+			g_usleep(1000);
+		}
+	}
+
+	return -1;
+}
+
+
+static void att_test_mtu(void)
+{
+	uint8_t req[3] = {ATT_OP_MTU_REQ}, rsp[ATT_MAX_MTU];
+	int n;
+
+	put_le16(req + 1, ATT_TEST_MTU);
+	n = att_test_xfer(req, sizeof(req), rsp);
+
+	att_test_check(n == 3 && rsp[0] == ATT_OP_MTU_RSP && get_le16(rsp + 1) >= ATT_TEST_MTU,
+					"exchange mtu");
+}
+
+
+/*
+ * Read By Group Type找到UART服务的handle范围
+ */
+static void att_test_discover_service(void)
+{
+	uint8_t req[7] = {ATT_OP_READ_BY_GROUP_REQ}, rsp[ATT_MAX_MTU];
+	uint16_t start = 0x0001;
+	int n, i;
+
+	while(!t.svc_start) {
+		put_le16(req + 1, start);
+		put_le16(req + 3, 0xffff);
+		put_le16(req + 5, ATT_UUID_PRIMARY_SERVICE);
+		n = att_test_xfer(req, sizeof(req), rsp);
+		if(n < 2 || rsp[0] != ATT_OP_READ_BY_GROUP_RSP) {
+			break;
+		}
+
+		/*
+		 * 每一项: 开始handle, 结束handle, 服务UUID
+		 */
+		for(i = 2; i + rsp[1] <= n; i += rsp[1]) {
+			if(rsp[1] == 4 + 16 && !memcmp(rsp + i + 4, att_test_uart_uuid, 16)) {
+				t.svc_start = get_le16(rsp + i);
+				t.svc_end = get_le16(rsp + i + 2);
+			}
+			start = get_le16(rsp + i + 2) + 1;
+		}
+
+		if(start <= 1) {
+			break;
+		}
+	}
+
+	att_test_check(t.svc_start && t.svc_end >= t.svc_start, "discover uart service");
+}
+
+
+/*
+ * Read By Type找到RX和TX特征的value handle
+ */
+static void att_test_discover_chars(void)
+{
+	uint8_t req[7] = {ATT_OP_READ_BY_TYPE_REQ}, rsp[ATT_MAX_MTU];
+	uint16_t start = t.svc_start;
+	int n, i;
+
+	while(start && start <= t.svc_end) {
+		put_le16(req + 1, start);
+		put_le16(req + 3, t.svc_end);
+		put_le16(req + 5, ATT_UUID_CHARACTERISTIC);
+		n = att_test_xfer(req, sizeof(req), rsp);
+		if(n < 2 || rsp[0] != ATT_OP_READ_BY_TYPE_RSP) {
+			break;
+		}
+
+		/*
+		 * 每一项: 声明handle, 属性, value handle, 特征UUID
+		 */
+		for(i = 2; i + rsp[1] <= n; i += rsp[1]) {
+			if(rsp[1] == 5 + 16 && !memcmp(rsp + i + 5, att_test_uart_uuid, 12)) {
+				if(rsp[i + 5 + 12] == 0x02) {
+					t.rx_handle = get_le16(rsp + i + 3);
+				} else if(rsp[i + 5 + 12] == 0x03) {
+					t.tx_handle = get_le16(rsp + i + 3);
+				}
+			}
+			start = get_le16(rsp + i + 3) + 1;
+		}
+	}
+
+	att_test_check(t.rx_handle && t.tx_handle, "discover rx/tx characteristics");
+}
+
+
+/*
+ * Find Information找到TX特征的CCCD
+ */
+static void att_test_discover_cccd(void)
+{
+	uint8_t req[5] = {ATT_OP_FIND_INFO_REQ}, rsp[ATT_MAX_MTU];
+	int n, i;
+
+	put_le16(req + 1, t.tx_handle + 1);
+	put_le16(req + 3, t.svc_end);
+	n = att_test_xfer(req, sizeof(req), rsp);
+
+	/*
+	 * format 1: 16位UUID, 每一项: handle, UUID
+	 */
+	if(n >= 2 && rsp[0] == ATT_OP_FIND_INFO_RSP && rsp[1] == 1) {
+		for(i = 2; i + 4 <= n; i += 4) {
+			if(get_le16(rsp + i + 2) == ATT_UUID_CCCD) {
+				t.tx_cccd = get_le16(rsp + i);
+				break;
+			}
+		}
+	}
+
+	att_test_check(t.tx_cccd, "discover tx cccd");
+}
+
+
+static void att_test_cccd(int on)
+{
+	uint8_t req[5] = {ATT_OP_WRITE_REQ}, rsp[ATT_MAX_MTU];
+	int n;
+
+	put_le16(req + 1, t.tx_cccd);
+	put_le16(req + 3, on ? 0x0001 : 0x0000);
+	n = att_test_xfer(req, sizeof(req), rsp);
+
+	att_test_check(n == 1 && rsp[0] == ATT_OP_WRITE_RSP && t.notifying == on,
+					on ? "enable notifications" : "disable notifications");
+}
+
+
+/*
+ * 写入RX特征, Write Request时先收到Write Response, 然后检查回显的notification
+ */
+static void att_test_write(uint8_t op, const char *data)
+{
+	uint8_t req[ATT_MAX_MTU] = {op}, rsp[ATT_MAX_MTU];
+	int len = strlen(data), n;
+
+	put_le16(req + 1, t.rx_handle);
+	memcpy(req + 3, data, len);
+
+	n = att_test_xfer(req, 3 + len, rsp);
+	if(op == ATT_OP_WRITE_REQ) {
+		att_test_check(n == 1 && rsp[0] == ATT_OP_WRITE_RSP, "write request");
+		n = att_test_xfer(NULL, 0, rsp);
+	}
+
+	att_test_check(n == 3 + len && rsp[0] == ATT_OP_HANDLE_NOTIFY &&
+					get_le16(rsp + 1) == t.tx_handle && !memcmp(rsp + 3, data, len),
+					op == ATT_OP_WRITE_REQ ? "notify after write request" : "notify after write command");
+}
+
+
+/*
+ * 客户端不接收, 通知填满socket之后发送Write Request
+ * 回复放入等待队列, 客户端开始接收之后按顺序收到之前的通知和Write Response
+ */
+static void att_test_socket_full(void)
+{
+	uint8_t data[ATT_TEST_MTU - 3], req[3 + 4] = {ATT_OP_WRITE_REQ}, rsp[ATT_MAX_MTU];
+	int i, n, sent, notifies = 0, write_rsp = 0;
+
+	memset(data, 0x5a, sizeof(data));
+	for(sent = 0; sent < 100000 && !att_server_tx_blocked(t.srv); sent++) {
+		att_server_send(t.srv, data, sizeof(data));
+	}
+	att_test_check(att_server_tx_blocked(t.srv), "notifications fill the socket");
+
+	put_le16(req + 1, t.rx_handle);
+	memcpy(req + 3, "full", 4);
+	att_test_check(send(t.fd, req, sizeof(req), 0) == sizeof(req), "write request while socket full");
+
+	/*
+	 * 先让服务端处理Write Request, 这时回复只能排队
+	 */
+	for(i = 0; i < 10; i++) {
+		g_main_context_iteration(NULL, FALSE);
+	}
+
+	t.writable = 0;
+	while((n = att_test_xfer(NULL, 0, rsp)) > 0) {
+		if(rsp[0] == ATT_OP_HANDLE_NOTIFY) {
+			notifies++;
+		} else if(n == 1 && rsp[0] == ATT_OP_WRITE_RSP) {
+			write_rsp++;
+		}
+	}
+
+	att_test_check(notifies >= sent && write_rsp == 1, "write response after queued notifications");
+	att_test_check(!att_server_tx_blocked(t.srv) && t.writable > 0, "writable after drain");
+
+	att_test_write(ATT_OP_WRITE_CMD, "still connected");
+}
+
+
+int main(int argc, char *argv[])
+{
+	uint8_t req[8] = {ATT_OP_WRITE_CMD}, rsp[ATT_MAX_MTU];
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	t.srv = att_server_new(att_test_receive, att_test_notify, NULL);
+	t.fd = sv[1];
+	att_server_set_writable_cb(t.srv, att_test_writable);
+	att_server_add_fd(t.srv, sv[0]);
+
+	att_test_mtu();
+	att_test_discover_service();
+	att_test_discover_chars();
+	att_test_discover_cccd();
+
+	att_test_cccd(1);
+	att_test_check(att_server_payload_size(t.srv) == ATT_TEST_MTU - 3, "payload size follows mtu");
+
+	att_test_write(ATT_OP_WRITE_CMD, "hello");
+	att_test_write(ATT_OP_WRITE_REQ, "world");
+	att_test_socket_full();
+
+	/*
+	 * 关闭通知之后写入不会有notification
+	 */
+	att_test_cccd(0);
+	put_le16(req + 1, t.rx_handle);
+	att_test_check(att_test_xfer(req, sizeof(req), rsp) < 0, "no notify when disabled");
+
+	att_server_free(t.srv);
+	close(t.fd);
+
+	printf("%s\n", t.failures ? "FAILED" : "PASSED");
+
+	return t.failures ? 1 : 0;
+}
@@ -0,0 +1,839 @@
+/*
+ * 端到端性能测试, 不需要真实的蓝牙设备
+ *
+ * 1.在私有的dbus-daemon上占用org.bluez, 模拟bluez的Adapter1, GattManager1,
+ *   LEAdvertisingManager1和根路径上的ObjectManager.
+ * 2.uart_server调用RegisterApplication后, 通过GetManagedObjects找到rx/tx特征,
+ *   调用tx的StartNotify, 订阅tx的PropertiesChanged.
+ * 3.对每种长度, 保持window个WriteValue在途, uart_server的main.c把数据原样回显,
+ *   按照收到的字节数判断每条消息回显完成(回显可能被分片), 统计吞吐和延时.
+ * 4.-f指定片段长度时, 每条消息和bluez执行Execute Write一样分成几个"reliable"的WriteValue,
+ *   片段比Prepare Write能带的数据短, uart_server要组装之后回显.
+ * 5.有WriteValue失败, 超时, 或者低于-t指定的msg/s, 高于-t指定的p99时返回1, 可以作为回归测试.
+ *
+ * 由bench.sh启动, 见Makefile的bench目标.
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#define BLUEZ_BUS_NAME "org.bluez"
+#define BENCH_ADAPTER "/org/bluez/hci0"
+#define BENCH_DEVICE "/org/bluez/hci0/dev_00_11_22_33_44_55"
+
+/*
+ * 超过这个时间没有收到回显认为测试失败
+ */
+#define BENCH_TIMEOUT_S 10
+
+#define BENCH_MAX_SIZES 16
+
+/*
+ * -f时WriteValue的options中的"mtu"
+ */
+#define BENCH_MTU 247
+
+struct bench_t {
+	GDBusConnection *conn;
+	GMainLoop *loop;
+
+	/*
+	 * uart_server的unique name和特征的路径
+	 */
+	char *app_sender;
+	char *app_path;
+	char *rx_path;
+	char *tx_path;
+
+	int sizes[BENCH_MAX_SIZES];
+	int nsizes;
+	int size_index;
+	int count;
+	int window;
+	int frag;			/* 不为0时每条消息分成frag字节的片段 */
+	double min_rate;	/* -t: 每种长度最低的msg/s, 0表示不检查 */
+	double max_p99;		/* -t: 每种长度最高的p99(us), 0表示不检查 */
+	int failed;
+
+	/*
+	 * 当前长度的测试状态
+	 */
+	int size;
+	int sent;
+	int done;
+	int errors;
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t start_ns;
+	uint64_t *send_ns;
+	uint64_t *end_offset;		/* 第i条消息最后一个字节在回显数据中的偏移 */
+	uint64_t *latency_ns;
+	uint8_t *payload;
+
+	int progress;
+	int result;
+
+	/*
+	 * 模拟的adapter属性
+	 */
+	gboolean powered;
+	gboolean discoverable;
+};
+
+static struct bench_t bench = {
+	.sizes = {20, 64, 128, 244, 512},
+	.nsizes = 5,
+	.count = 5000,
+	.window = 8,
+	.result = 1,
+};
+
+
+static const gchar bluez_root_xml[] =
+"<node>"
+"  <interface name='org.freedesktop.DBus.ObjectManager'>"
+"    <method name='GetManagedObjects'>"
+"      <arg name='objects' type='a{oa{sa{sv}}}' direction='out'/>"
+"    </method>"
+"  </interface>"
+"</node>";
+
+static const gchar bluez_adapter_xml[] =
+"<node>"
+"  <interface name='org.bluez.Adapter1'>"
+"    <property name='Address' type='s' access='read'/>"
+"    <property name='Name' type='s' access='read'/>"
+"    <property name='Alias' type='s' access='read'/>"
+"    <property name='Powered' type='b' access='readwrite'/>"
+"    <property name='Discoverable' type='b' access='readwrite'/>"
+"    <property name='Discovering' type='b' access='read'/>"
+"    <property name='UUIDs' type='as' access='read'/>"
+"  </interface>"
+"  <interface name='org.bluez.GattManager1'>"
+"    <method name='RegisterApplication'>"
+"      <arg name='application' type='o' direction='in'/>"
+"      <arg name='options' type='a{sv}' direction='in'/>"
+"    </method>"
+"    <method name='UnregisterApplication'>"
+"      <arg name='application' type='o' direction='in'/>"
+"    </method>"
+"  </interface>"
+"  <interface name='org.bluez.LEAdvertisingManager1'>"
+"    <method name='RegisterAdvertisement'>"
+"      <arg name='advertisement' type='o' direction='in'/>"
+"      <arg name='options' type='a{sv}' direction='in'/>"
+"    </method>"
+"    <method name='UnregisterAdvertisement'>"
+"      <arg name='service' type='o' direction='in'/>"
+"    </method>"
+"    <property name='ActiveInstances' type='y' access='read'/>"
+"    <property name='SupportedInstances' type='y' access='read'/>"
+"  </interface>"
+"</node>";
+
+
+static uint64_t bench_now(void)
+{
+	struct timespec tm;
+
+	clock_gettime(CLOCK_MONOTONIC, &tm);
+
+	return (uint64_t)tm.tv_sec * 1000000000 + tm.tv_nsec;
+}
+
+
+static void bench_start_size(void);
+
+
+static void bench_finish(int result)
+{
+	bench.result = result;
+	g_main_loop_quit(bench.loop);
+}
+
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static double bench_percentile(uint64_t *sorted, int n, double p)
+{
+	int i = (int)(p * (n - 1) + 0.5);
+
+	return sorted[i] / 1000.0;
+}
+
+
+/*
+ * 输出一种长度的结果, 和-t的门限比较
+ */
+static void bench_report(void)
+{
+	double sec = (bench_now() - bench.start_ns) / 1e9;
+	double rate = bench.count / sec, p99;
+
+	qsort(bench.latency_ns, bench.count, sizeof(uint64_t), bench_cmp_u64);
+	p99 = bench_percentile(bench.latency_ns, bench.count, 0.99);
+
+	printf("%6d %8d %12.0f %14.0f %10.1f %10.1f %10.1f %6d\n",
+			bench.size, bench.count,
+			rate, bench.tx_bytes / sec,
+			bench_percentile(bench.latency_ns, bench.count, 0.50),
+			p99,
+			bench_percentile(bench.latency_ns, bench.count, 0.999),
+			bench.errors);
+	fflush(stdout);
+
+	if(bench.errors) {
+		fprintf(stderr, "bench: size %d, %d writes failed\n", bench.size, bench.errors);
+		bench.failed = 1;
+	}
+	if(bench.min_rate > 0 && rate < bench.min_rate) {
+		fprintf(stderr, "bench: size %d, %.0f msg/s below %.0f\n", bench.size, rate, bench.min_rate);
+		bench.failed = 1;
+	}
+	if(bench.max_p99 > 0 && p99 > bench.max_p99) {
+		fprintf(stderr, "bench: size %d, p99 %.1f us above %.1f\n", bench.size, p99, bench.max_p99);
+		bench.failed = 1;
+	}
+}
+
+
+/*
+ * 一次WriteValue, 失败时要知道是哪条消息的多少字节
+ */
+struct bench_write_t {
+	int size_index;
+	int msg;
+	int len;
+};
+
+
+static void bench_advance(void);
+
+
+/*
+ * 写入失败的数据不会回显, 这条消息和之后的消息少等len个字节, 否则要等到超时
+ */
+static void bench_write_failed(struct bench_write_t *w)
+{
+	int i;
+
+	bench.errors++;
+
+	for(i = w->msg; i < bench.sent; i++) {
+		bench.end_offset[i] -= w->len;
+	}
+	bench.tx_bytes -= w->len;
+
+	bench.progress = 1;
+	bench_advance();
+}
+
+
+static void bench_write_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	struct bench_write_t *w = user_data;
+	GError *error = NULL;
+	GVariant *v;
+
+	v = g_dbus_connection_call_finish((GDBusConnection *)source_object, res, &error);
+	if(error) {
+		fprintf(stderr, "WriteValue: %s\n", error->message);
+		g_error_free(error);
+		if(w->size_index == bench.size_index && bench.send_ns) {
+			bench_write_failed(w);
+		}
+	} else {
+		g_variant_unref(v);
+	}
+
+	g_free(w);
+}
+
+
+/*
+ * 写入payload的[offset, offset + len), reliable时和bluez执行Execute Write一样带上"type"和"offset"
+ */
+static void bench_write(int offset, int len, int reliable)
+{
+	struct bench_write_t *w = g_new(struct bench_write_t, 1);
+	GVariant *value, *options;
+	GVariantBuilder builder;
+
+	w->size_index = bench.size_index;
+	w->msg = bench.sent - 1;
+	w->len = len;
+
+	value = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, bench.payload + offset, len, 1);
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&builder, "{sv}", "device", g_variant_new_object_path(BENCH_DEVICE));
+	g_variant_builder_add(&builder, "{sv}", "link", g_variant_new_string("LE"));
+	if(reliable) {
+		g_variant_builder_add(&builder, "{sv}", "type", g_variant_new_string("reliable"));
+		g_variant_builder_add(&builder, "{sv}", "offset", g_variant_new_uint16(offset));
+		g_variant_builder_add(&builder, "{sv}", "mtu", g_variant_new_uint16(BENCH_MTU));
+	}
+	options = g_variant_builder_end(&builder);
+
+	g_dbus_connection_call(bench.conn,
+							bench.app_sender,
+							bench.rx_path,
+							"org.bluez.GattCharacteristic1",
+							"WriteValue",
+							g_variant_new("(@ay@a{sv})", value, options),
+							NULL,
+							G_DBUS_CALL_FLAGS_NONE,
+							-1,
+							NULL,
+							bench_write_done,
+							w);
+}
+
+
+/*
+ * 保持window个消息在途
+ * 每条消息前8个字节是序号, 其余是固定的数据
+ */
+static void bench_send(void)
+{
+	int offset;
+
+	while(bench.sent < bench.count && bench.sent - bench.done < bench.window) {
+		memcpy(bench.payload, &bench.sent, MIN(bench.size, (int)sizeof(bench.sent)));
+
+		bench.send_ns[bench.sent] = bench_now();
+		bench.tx_bytes += bench.size;
+		bench.end_offset[bench.sent] = bench.tx_bytes;
+		bench.sent++;
+
+		if(!bench.frag) {
+			bench_write(0, bench.size, 0);
+			continue;
+		}
+
+		for(offset = 0; offset < bench.size; offset += bench.frag) {
+			bench_write(offset, MIN(bench.frag, bench.size - offset), 1);
+		}
+	}
+}
+
+
+/*
+ * tx的PropertiesChanged, 即uart_server发出的notification
+ * params type: "(sa{sv}as)"
+ */
+static void bench_notify(GDBusConnection *conn,
+							const gchar *sender,
+							const gchar *object_path,
+							const gchar *interface_name,
+							const gchar *signal_name,
+							GVariant *params,
+							gpointer user_data)
+{
+	GVariant *changed, *value;
+	gsize len;
+
+	g_variant_get(params, "(&s@a{sv}@as)", NULL, &changed, NULL);
+	value = g_variant_lookup_value(changed, "Value", G_VARIANT_TYPE_BYTESTRING);
+	g_variant_unref(changed);
+	if(!value) {
+		return;
+	}
+
+	g_variant_get_fixed_array(value, &len, sizeof(uint8_t));
+	g_variant_unref(value);
+
+	if(!bench.send_ns) {
+		return;
+	}
+
+	bench.rx_bytes += len;
+	bench.progress = 1;
+
+	bench_advance();
+}
+
+
+/*
+ * 回显的字节数已经覆盖的消息算完成, 继续发送, 当前长度完成后开始下一种长度
+ */
+static void bench_advance(void)
+{
+	uint64_t now = bench_now();
+
+	while(bench.done < bench.sent && bench.end_offset[bench.done] <= bench.rx_bytes) {
+		bench.latency_ns[bench.done] = now - bench.send_ns[bench.done];
+		bench.done++;
+	}
+
+	if(bench.done < bench.count) {
+		bench_send();
+		return;
+	}
+
+	bench_report();
+
+	bench.size_index++;
+	if(bench.size_index < bench.nsizes) {
+		bench_start_size();
+	} else {
+		bench_finish(bench.failed);
+	}
+}
+
+
+static void bench_start_size(void)
+{
+	int i;
+
+	g_free(bench.send_ns);
+	g_free(bench.end_offset);
+	g_free(bench.latency_ns);
+	g_free(bench.payload);
+
+	bench.size = bench.sizes[bench.size_index];
+	bench.sent = 0;
+	bench.done = 0;
+	bench.errors = 0;
+	bench.tx_bytes = 0;
+	bench.rx_bytes = 0;
+	bench.send_ns = g_new0(uint64_t, bench.count);
+	bench.end_offset = g_new0(uint64_t, bench.count);
+	bench.latency_ns = g_new0(uint64_t, bench.count);
+	bench.payload = g_malloc(bench.size);
+	for(i = 0; i < bench.size; i++) {
+		bench.payload[i] = i;
+	}
+
+	bench.start_ns = bench_now();
+	bench_send();
+}
+
+
+static gboolean bench_watchdog(gpointer user_data)
+{
+	if(!bench.progress) {
+		fprintf(stderr, "bench: timeout, size %d sent %d done %d\n", bench.size, bench.sent, bench.done);
+		bench_finish(1);
+		return G_SOURCE_REMOVE;
+	}
+
+	bench.progress = 0;
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+static void bench_start_notify_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	GError *error = NULL;
+	GVariant *v;
+
+	v = g_dbus_connection_call_finish((GDBusConnection *)source_object, res, &error);
+	if(error) {
+		fprintf(stderr, "StartNotify: %s\n", error->message);
+		g_error_free(error);
+		bench_finish(1);
+		return;
+	}
+	g_variant_unref(v);
+
+	printf("  size    count        msg/s          B/s    p50(us)    p99(us)   p999(us) errors\n");
+
+	bench.progress = 1;
+	g_timeout_add_seconds(BENCH_TIMEOUT_S, bench_watchdog, NULL);
+
+	bench_start_size();
+}
+
+
+static int bench_has_flag(GVariant *props, const char *flag)
+{
+	const gchar **flags = NULL;
+	int i, ret = 0;
+
+	if(!g_variant_lookup(props, "Flags", "^a&s", &flags)) {
+		return 0;
+	}
+
+	for(i = 0; flags[i]; i++) {
+		if(!strcmp(flags[i], flag)) {
+			ret = 1;
+			break;
+		}
+	}
+
+	g_free(flags);
+
+	return ret;
+}
+
+
+/*
+ * 从应用的GetManagedObjects中找到rx(write)和tx(notify)特征
+ * reply type: "(a{oa{sa{sv}}})"
+ */
+static void bench_objects_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	GError *error = NULL;
+	GVariantIter *iter;
+	GVariant *v, *ifaces, *props;
+	const char *path;
+
+	v = g_dbus_connection_call_finish((GDBusConnection *)source_object, res, &error);
+	if(error) {
+		fprintf(stderr, "GetManagedObjects: %s\n", error->message);
+		g_error_free(error);
+		bench_finish(1);
+		return;
+	}
+
+	g_variant_get(v, "(a{oa{sa{sv}}})", &iter);
+	while(g_variant_iter_next(iter, "{&o@a{sa{sv}}}", &path, &ifaces)) {
+		props = g_variant_lookup_value(ifaces, "org.bluez.GattCharacteristic1", NULL);
+		if(props) {
+			if(!bench.tx_path && bench_has_flag(props, "notify")) {
+				bench.tx_path = g_strdup(path);
+			} else if(!bench.rx_path && (bench_has_flag(props, "write")
+											|| bench_has_flag(props, "write-without-response"))) {
+				bench.rx_path = g_strdup(path);
+			}
+			g_variant_unref(props);
+		}
+		g_variant_unref(ifaces);
+	}
+	g_variant_iter_free(iter);
+	g_variant_unref(v);
+
+	if(!bench.rx_path || !bench.tx_path) {
+		fprintf(stderr, "bench: uart characteristics not found\n");
+		bench_finish(1);
+		return;
+	}
+
+	g_dbus_connection_signal_subscribe(bench.conn,
+									bench.app_sender,
+									"org.freedesktop.DBus.Properties",
+									"PropertiesChanged",
+									bench.tx_path,
+									NULL,
+									G_DBUS_SIGNAL_FLAGS_NONE,
+									bench_notify,
+									NULL,
+									NULL);
+
+	g_dbus_connection_call(bench.conn,
+							bench.app_sender,
+							bench.tx_path,
+							"org.bluez.GattCharacteristic1",
+							"StartNotify",
+							NULL,
+							NULL,
+							G_DBUS_CALL_FLAGS_NONE,
+							-1,
+							NULL,
+							bench_start_notify_done,
+							NULL);
+}
+
+
+static void bench_register_application(GDBusMethodInvocation *invoc, GVariant *params)
+{
+	const char *path;
+
+	g_variant_get(params, "(&o@a{sv})", &path, NULL);
+
+	if(bench.app_sender) {
+		g_dbus_method_invocation_return_dbus_error(invoc, "org.bluez.Error.AlreadyExists", "Already Exists");
+		return;
+	}
+
+	bench.app_sender = g_strdup(g_dbus_method_invocation_get_sender(invoc));
+	bench.app_path = g_strdup(path);
+	g_dbus_method_invocation_return_value(invoc, NULL);
+
+	fprintf(stderr, "bench: application %s%s registered\n", bench.app_sender, bench.app_path);
+
+	g_dbus_connection_call(bench.conn,
+							bench.app_sender,
+							bench.app_path,
+							"org.freedesktop.DBus.ObjectManager",
+							"GetManagedObjects",
+							NULL,
+							G_VARIANT_TYPE("(a{oa{sa{sv}}})"),
+							G_DBUS_CALL_FLAGS_NONE,
+							-1,
+							NULL,
+							bench_objects_done,
+							NULL);
+}
+
+
+static GVariant *bench_adapter_props(void)
+{
+	GVariantBuilder builder;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&builder, "{sv}", "Address", g_variant_new_string("00:00:00:00:00:01"));
+	g_variant_builder_add(&builder, "{sv}", "Name", g_variant_new_string("bench"));
+	g_variant_builder_add(&builder, "{sv}", "Alias", g_variant_new_string("bench"));
+	g_variant_builder_add(&builder, "{sv}", "Powered", g_variant_new_boolean(bench.powered));
+	g_variant_builder_add(&builder, "{sv}", "Discoverable", g_variant_new_boolean(bench.discoverable));
+	g_variant_builder_add(&builder, "{sv}", "Discovering", g_variant_new_boolean(FALSE));
+	g_variant_builder_add(&builder, "{sv}", "UUIDs", g_variant_new_strv(NULL, 0));
+
+	return g_variant_builder_end(&builder);
+}
+
+
+/*
+ * reply type: "(a{oa{sa{sv}}})", 只有一个adapter
+ */
+static GVariant *bench_managed_objects(void)
+{
+	GVariantBuilder objects, ifaces;
+
+	g_variant_builder_init(&ifaces, G_VARIANT_TYPE("a{sa{sv}}"));
+	g_variant_builder_add(&ifaces, "{s@a{sv}}", "org.bluez.Adapter1", bench_adapter_props());
+	g_variant_builder_add(&ifaces, "{s@a{sv}}", "org.bluez.GattManager1",
+							g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0));
+	g_variant_builder_add(&ifaces, "{s@a{sv}}", "org.bluez.LEAdvertisingManager1",
+							g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0));
+
+	g_variant_builder_init(&objects, G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+	g_variant_builder_add(&objects, "{o@a{sa{sv}}}", BENCH_ADAPTER, g_variant_builder_end(&ifaces));
+
+	return g_variant_new("(@a{oa{sa{sv}}})", g_variant_builder_end(&objects));
+}
+
+
+static void bench_method_call(GDBusConnection *conn,
+							const gchar *sender,
+							const gchar *object_path,
+							const gchar *interface_name,
+							const gchar *method_name,
+							GVariant *params,
+							GDBusMethodInvocation *invoc,
+							gpointer user_data)
+{
+	if(!strcmp(method_name, "GetManagedObjects")) {
+		g_dbus_method_invocation_return_value(invoc, bench_managed_objects());
+	} else if(!strcmp(method_name, "RegisterApplication")) {
+		bench_register_application(invoc, params);
+	} else if(!strcmp(method_name, "RegisterAdvertisement")
+			|| !strcmp(method_name, "UnregisterAdvertisement")
+			|| !strcmp(method_name, "UnregisterApplication")) {
+		g_dbus_method_invocation_return_value(invoc, NULL);
+	} else {
+		g_dbus_method_invocation_return_dbus_error(invoc, "org.bluez.Error.NotSupported", "Not Supported");
+	}
+}
+
+
+static GVariant *bench_get_property(GDBusConnection *conn,
+							const gchar *sender,
+							const gchar *object_path,
+							const gchar *interface_name,
+							const gchar *property_name,
+							GError **error,
+							gpointer user_data)
+{
+	GVariant *props, *v;
+
+	if(!strcmp(interface_name, "org.bluez.LEAdvertisingManager1")) {
+		return g_variant_new_byte(!strcmp(property_name, "ActiveInstances") ? 0 : 5);
+	}
+
+	props = bench_adapter_props();
+	v = g_variant_lookup_value(props, property_name, NULL);
+	g_variant_unref(g_variant_ref_sink(props));
+
+	if(!v) {
+		g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY, "Unknown property %s", property_name);
+	}
+
+	return v;
+}
+
+
+static gboolean bench_set_property(GDBusConnection *conn,
+							const gchar *sender,
+							const gchar *object_path,
+							const gchar *interface_name,
+							const gchar *property_name,
+							GVariant *value,
+							GError **error,
+							gpointer user_data)
+{
+	if(!strcmp(property_name, "Powered")) {
+		bench.powered = g_variant_get_boolean(value);
+	} else if(!strcmp(property_name, "Discoverable")) {
+		bench.discoverable = g_variant_get_boolean(value);
+	}
+
+	return TRUE;
+}
+
+
+static int bench_register_objects(GDBusConnection *conn)
+{
+	static const GDBusInterfaceVTable vtable = {
+		.method_call = bench_method_call,
+		.get_property = bench_get_property,
+		.set_property = bench_set_property,
+	};
+	GDBusNodeInfo *root, *adapter;
+	GError *error = NULL;
+	int i;
+
+	root = g_dbus_node_info_new_for_xml(bluez_root_xml, &error);
+	if(error) {
+		goto err;
+	}
+
+	adapter = g_dbus_node_info_new_for_xml(bluez_adapter_xml, &error);
+	if(error) {
+		goto err;
+	}
+
+	g_dbus_connection_register_object(conn, "/", root->interfaces[0], &vtable, NULL, NULL, &error);
+	if(error) {
+		goto err;
+	}
+
+	for(i = 0; adapter->interfaces[i]; i++) {
+		g_dbus_connection_register_object(conn, BENCH_ADAPTER, adapter->interfaces[i], &vtable, NULL, NULL, &error);
+		if(error) {
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	fprintf(stderr, "bench: register object: %s\n", error->message);
+	g_error_free(error);
+	return -1;
+}
+
+
+static void bench_name_acquired(GDBusConnection *conn, const gchar *name, gpointer user_data)
+{
+	fprintf(stderr, "bench: %s acquired\n", name);
+}
+
+
+static void bench_name_lost(GDBusConnection *conn, const gchar *name, gpointer user_data)
+{
+	fprintf(stderr, "bench: can not own %s\n", name);
+	bench_finish(1);
+}
+
+
+static void bench_usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n count] [-w window] [-s size[,size...]] [-f frag] [-t msg/s,p99(us)]\n", name);
+	exit(2);
+}
+
+
+static void bench_parse_sizes(const char *arg)
+{
+	gchar **sizes = g_strsplit(arg, ",", BENCH_MAX_SIZES);
+	int i, n = 0;
+
+	for(i = 0; sizes[i]; i++) {
+		int size = atoi(sizes[i]);
+		if(size > 0 && size <= 512) {
+			bench.sizes[n++] = size;
+		}
+	}
+	g_strfreev(sizes);
+
+	bench.nsizes = n;
+}
+
+
+/*
+ * -t min_rate,max_p99: 每种长度都要达到的msg/s和不能超过的p99(us), 其中一个可以为0或者省略
+ */
+static void bench_parse_thresholds(const char *arg)
+{
+	const char *p99 = strchr(arg, ',');
+
+	bench.min_rate = atof(arg);
+	bench.max_p99 = p99 ? atof(p99 + 1) : 0;
+}
+
+
+/*
+ * 连接DBUS_SYSTEM_BUS_ADDRESS指定的总线, 即bench.sh启动的私有dbus-daemon
+ */
+int main(int argc, char *argv[])
+{
+	GError *error = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:w:s:f:t:")) != -1) {
+		switch(opt) {
+		case 'n':
+			bench.count = atoi(optarg);
+			break;
+		case 'w':
+			bench.window = atoi(optarg);
+			break;
+		case 's':
+			bench_parse_sizes(optarg);
+			break;
+		case 'f':
+			bench.frag = atoi(optarg);
+			break;
+		case 't':
+			bench_parse_thresholds(optarg);
+			break;
+		default:
+			bench_usage(argv[0]);
+		}
+	}
+
+	if(bench.count <= 0 || bench.window <= 0 || bench.nsizes <= 0 || bench.frag < 0) {
+		bench_usage(argv[0]);
+	}
+
+	bench.loop = g_main_loop_new(NULL, FALSE);
+
+	bench.conn = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+	if(error) {
+		fprintf(stderr, "bench: %s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	if(bench_register_objects(bench.conn) < 0) {
+		return 1;
+	}
+
+	g_bus_own_name_on_connection(bench.conn,
+								BLUEZ_BUS_NAME,
+								G_BUS_NAME_OWNER_FLAGS_NONE,
+								bench_name_acquired,
+								bench_name_lost,
+								NULL,
+								NULL);
+
+	g_main_loop_run(bench.loop);
+
+	return bench.result;
+}
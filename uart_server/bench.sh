@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# 在私有的dbus-daemon上运行性能测试
+# 1.启动dbus-daemon, 通过DBUS_SYSTEM_BUS_ADDRESS让uart_server和uart_bench都连接它
+# 2.uart_bench占用org.bluez后启动uart_server
+# 3.uart_bench输出结果后退出, 结束uart_server和dbus-daemon
+#
+# 参数直接传给uart_bench: [-n count] [-w window] [-s size[,size...]] [-f frag] [-t msg/s,p99(us)]
+# uart_bench的返回值就是这个脚本的返回值
+# DBUS_DAEMON, DBUS_SEND可以指定dbus-daemon, dbus-send的路径
+#
+
+cd "$(dirname "$0")"
+
+DBUS_DAEMON=${DBUS_DAEMON:-dbus-daemon}
+DBUS_SEND=${DBUS_SEND:-dbus-send}
+SERVER_LOG=${SERVER_LOG:-bench_server.log}
+
+set -- $($DBUS_DAEMON --session --fork --print-address=1 --print-pid=1) "$@"
+if [ -z "$1" ]; then
+	echo "bench: start $DBUS_DAEMON failed" >&2
+	exit 1
+fi
+
+export DBUS_SYSTEM_BUS_ADDRESS=$1
+DBUS_PID=$2
+shift 2
+
+SERVER_PID=
+cleanup() {
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null
+	kill $DBUS_PID 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+./uart_bench "$@" &
+BENCH_PID=$!
+
+i=0
+until $DBUS_SEND --system --print-reply --dest=org.freedesktop.DBus / \
+		org.freedesktop.DBus.GetNameOwner string:org.bluez >/dev/null 2>&1; do
+	i=$((i + 1))
+	if [ $i -ge 50 ] || ! kill -0 $BENCH_PID 2>/dev/null; then
+		echo "bench: org.bluez not owned" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+./uart_server 2>"$SERVER_LOG" &
+SERVER_PID=$!
+
+wait $BENCH_PID
@@ -0,0 +1,143 @@
+/*
+ * 发送数据的压缩
+ *
+ * 1.BLE的带宽很小, 发送的JSON和日志一般可以压缩到1/3以下.
+ * 2.每个notification单独sync flush, 接收方收到一个包就能解出这个包的全部数据, 延时不会增加,
+ *   压缩流跨包保留历史, 小包也能引用之前发送过的数据.
+ * 3.压缩后没有变小(已经压缩过的数据, 或者包太小)时原样发送并重置压缩流,
+ *   每个包最多增加COMPRESS_HEADER_SIZE个字节.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "log.h"
+
+/*
+ * 共享字典, 双方一致, 常用的字符串放在后面(距离近, 编码短)
+ */
+const uint8_t compress_dict[] =
+	"true false null undefined error warning info debug "
+	"\"status\":\"ok\" \"code\": \"message\":\"\" \"data\":{\"\" \"id\": \"type\":\"\" "
+	"\"time\": \"timestamp\": \"value\": \"name\":\"\" \"level\":\"\" "
+	"[ERROR] [WARN] [INFO] [DEBUG] ]\r\n}\r\n\":\"\",\"\":{\"\":[\"\"},{\"";
+
+const int compress_dict_len = sizeof(compress_dict) - 1;
+
+
+/*
+ * 重置压缩流, 和接收方一起回到只有字典的状态
+ */
+static int compress_reset(struct compress_t *c)
+{
+	if(deflateReset(&c->zs) != Z_OK ||
+			deflateSetDictionary(&c->zs, compress_dict, compress_dict_len) != Z_OK) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * 已经初始化时重置压缩流
+ */
+int compress_init(struct compress_t *c)
+{
+	int ret;
+
+	c->resync = 0;
+
+	if(c->ready) {
+		return compress_reset(c);
+	}
+
+	memset(&c->zs, 0, sizeof(c->zs));
+	ret = deflateInit2(&c->zs, COMPRESS_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	if(ret != Z_OK) {
+		u_tm_log("[%s:%d] deflateInit2 error: %d\n", __FUNCTION__, __LINE__, ret);
+		return -1;
+	}
+
+	if(deflateSetDictionary(&c->zs, compress_dict, compress_dict_len) != Z_OK) {
+		deflateEnd(&c->zs);
+		return -1;
+	}
+
+	c->ready = 1;
+
+	return 0;
+}
+
+
+void compress_end(struct compress_t *c)
+{
+	if(c->ready) {
+		deflateEnd(&c->zs);
+		c->ready = 0;
+	}
+}
+
+
+/*
+ * 上一个compress_packet的结果没有发送出去时调用
+ * deflate的历史里已经有这个包, 接收方却没有, 下一个包一起重置
+ */
+void compress_abort(struct compress_t *c)
+{
+	c->resync = 1;
+}
+
+
+/*
+ * 压缩一个包, out_size至少是len + COMPRESS_HEADER_SIZE
+ * 返回out中的长度, 不会超过len + COMPRESS_HEADER_SIZE
+ */
+int compress_packet(struct compress_t *c, const uint8_t *in, int len, uint8_t *out, int out_size)
+{
+	int n, ret;
+
+	if(len <= 0 || out_size < len + COMPRESS_HEADER_SIZE) {
+		return -1;
+	}
+
+	if(c->resync) {
+		c->resync = 0;
+		goto stored;
+	}
+
+	/*
+	 * 去掉sync flush的00 00 FF FF之后要比原始数据小
+	 */
+	c->zs.next_in = (Bytef *)in;
+	c->zs.avail_in = len;
+	c->zs.next_out = out + COMPRESS_HEADER_SIZE;
+	c->zs.avail_out = out_size - COMPRESS_HEADER_SIZE;
+	if(c->zs.avail_out > (uInt)len + 3) {
+		c->zs.avail_out = len + 3;
+	}
+
+	ret = deflate(&c->zs, Z_SYNC_FLUSH);
+	n = c->zs.next_out - (out + COMPRESS_HEADER_SIZE);
+
+	if(ret == Z_OK && !c->zs.avail_in && c->zs.avail_out && n >= 4 &&
+			!memcmp(out + COMPRESS_HEADER_SIZE + n - 4, "\x00\x00\xff\xff", 4)) {
+		out[0] = COMPRESS_DEFLATE;
+		return COMPRESS_HEADER_SIZE + n - 4;
+	}
+
+	/*
+	 * 输出放不下时压缩流只处理了一部分, 接收方无法跟上, 只能重置
+	 */
+stored:
+	if(compress_reset(c) < 0) {
+		u_tm_log("[%s:%d] reset compress stream error\n", __FUNCTION__, __LINE__);
+	}
+
+	out[0] = COMPRESS_STORED;
+	memcpy(out + COMPRESS_HEADER_SIZE, in, len);
+
+	return COMPRESS_HEADER_SIZE + len;
+}
@@ -0,0 +1,47 @@
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdint.h>
+#include <zlib.h>
+
+/*
+ * 发送数据的压缩
+ *
+ * 每个notification是一个压缩包: 1字节类型 + 数据
+ * COMPRESS_DEFLATE: raw deflate(windowBits -15), 以sync flush结束, 去掉了最后的00 00 FF FF,
+ *                   接收方补上后继续inflate, 压缩流跨包保留历史
+ * COMPRESS_STORED: 原始数据, 压缩后没有变小时发送, 双方都重置压缩流(重新设置共享字典)
+ * 压缩流开始和每次重置后都先设置compress_dict作为字典
+ */
+#define COMPRESS_HEADER_SIZE 1
+#define COMPRESS_STORED 0x00
+#define COMPRESS_DEFLATE 0x01
+
+#define COMPRESS_LEVEL 6
+
+/*
+ * resync: 压缩过的包没有发送出去, 接收方没有这部分历史, 下一个包重置压缩流并原样发送
+ */
+struct compress_t {
+	z_stream zs;
+	int ready;
+	int resync;
+};
+
+extern const uint8_t compress_dict[];
+extern const int compress_dict_len;
+
+int compress_init(struct compress_t *c);
+void compress_end(struct compress_t *c);
+void compress_abort(struct compress_t *c);
+int compress_packet(struct compress_t *c, const uint8_t *in, int len, uint8_t *out, int out_size);
+
+
+#endif
+#ifdef __cplusplus
+}
+#endif
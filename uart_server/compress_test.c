@@ -0,0 +1,237 @@
+/*
+ * 发送数据压缩的测试, 不需要蓝牙设备
+ *
+ * 接收方按compress.h描述的格式用zlib的inflate解压: 同样的字典, raw inflate,
+ * COMPRESS_DEFLATE的包补上00 00 FF FF, COMPRESS_STORED的包原样取出并重置解压流.
+ * 1.重复的JSON和日志要压缩, 跨包引用之前的数据, 解压后和原始数据一样.
+ * 2.随机数据(不可压缩)原样发送, 长度只增加COMPRESS_HEADER_SIZE, 之后的包还能解压.
+ * 3.compress_abort之后(接收方没有收到上一个包)下一个包原样发送, 重新同步.
+ *
+ * make test 运行, 全部通过时返回0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+#define COMPRESS_TEST_MAX 512
+
+struct compress_test_t {
+	struct compress_t c;
+	z_stream zs;			/* 接收方 */
+	int failures;
+
+	int packets;
+	int deflated;
+	int stored;
+	int in_bytes;
+	int out_bytes;
+};
+
+static struct compress_test_t t;
+
+
+static void compress_test_check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if(!ok) {
+		t.failures++;
+	}
+}
+
+
+static int compress_test_inflate_reset(void)
+{
+	if(inflateReset(&t.zs) != Z_OK ||
+			inflateSetDictionary(&t.zs, compress_dict, compress_dict_len) != Z_OK) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * 接收方解出一个包, 返回解出的长度, 出错返回-1
+ */
+static int compress_test_unpack(const uint8_t *pkt, int len, uint8_t *out, int out_size)
+{
+	uint8_t in[COMPRESS_TEST_MAX + 4];
+	int ret;
+
+	if(len < COMPRESS_HEADER_SIZE) {
+		return -1;
+	}
+
+	if(pkt[0] == COMPRESS_STORED) {
+		if(compress_test_inflate_reset() < 0 || len - COMPRESS_HEADER_SIZE > out_size) {
+			return -1;
+		}
+		memcpy(out, pkt + COMPRESS_HEADER_SIZE, len - COMPRESS_HEADER_SIZE);
+		return len - COMPRESS_HEADER_SIZE;
+	}
+
+	if(pkt[0] != COMPRESS_DEFLATE || len - COMPRESS_HEADER_SIZE > COMPRESS_TEST_MAX) {
+		return -1;
+	}
+
+	memcpy(in, pkt + COMPRESS_HEADER_SIZE, len - COMPRESS_HEADER_SIZE);
+	memcpy(in + len - COMPRESS_HEADER_SIZE, "\x00\x00\xff\xff", 4);
+
+	t.zs.next_in = in;
+	t.zs.avail_in = len - COMPRESS_HEADER_SIZE + 4;
+	t.zs.next_out = out;
+	t.zs.avail_out = out_size;
+
+	ret = inflate(&t.zs, Z_SYNC_FLUSH);
+	if((ret != Z_OK && ret != Z_BUF_ERROR) || t.zs.avail_in) {
+		return -1;
+	}
+
+	return out_size - t.zs.avail_out;
+}
+
+
+/*
+ * 压缩一个包, 接收方解出来要和原始数据一样
+ * deliver为0时模拟发送失败: 接收方收不到, 然后调用compress_abort
+ * 返回包的类型, 失败返回-1
+ */
+static int compress_test_packet(const uint8_t *data, int len, int deliver)
+{
+	uint8_t pkt[COMPRESS_TEST_MAX + COMPRESS_HEADER_SIZE], out[COMPRESS_TEST_MAX];
+	int n, m;
+
+	n = compress_packet(&t.c, data, len, pkt, sizeof(pkt));
+	if(n <= COMPRESS_HEADER_SIZE || n > len + COMPRESS_HEADER_SIZE) {
+		return -1;
+	}
+
+	if(!deliver) {
+		compress_abort(&t.c);
+		return pkt[0];
+	}
+
+	m = compress_test_unpack(pkt, n, out, sizeof(out));
+	if(m != len || memcmp(out, data, len)) {
+		return -1;
+	}
+
+	t.packets++;
+	t.in_bytes += len;
+	t.out_bytes += n;
+	if(pkt[0] == COMPRESS_DEFLATE) {
+		t.deflated++;
+	} else {
+		t.stored++;
+	}
+
+	return pkt[0];
+}
+
+
+/*
+ * 类似设备上报的JSON和日志, 每个包只有数字不同
+ */
+static int compress_test_text(char *buf, int size, int i)
+{
+	if(i % 2) {
+		return snprintf(buf, size, "[INFO] %d sensor update: {\"status\":\"ok\",\"id\":%d,\"value\":%d}\r\n",
+						1000 + i, i % 8, i * 37 % 1000);
+	}
+
+	return snprintf(buf, size, "{\"type\":\"report\",\"timestamp\":%d,\"data\":{\"temp\":%d,\"level\":\"info\"}}",
+					1600000000 + i, 20 + i % 10);
+}
+
+
+static void compress_test_roundtrip(void)
+{
+	char text[COMPRESS_TEST_MAX];
+	int i, n, ok = 1;
+
+	for(i = 0; i < 200; i++) {
+		n = compress_test_text(text, sizeof(text), i);
+		if(compress_test_packet((uint8_t *)text, n, 1) < 0) {
+			ok = 0;
+		}
+	}
+
+	compress_test_check(ok, "text round trip");
+	compress_test_check(t.deflated > t.stored && t.out_bytes * 2 < t.in_bytes, "text compressed");
+}
+
+
+/*
+ * 随机数据压缩后变大, 原样发送, 之后的文本继续压缩
+ */
+static void compress_test_incompressible(void)
+{
+	uint8_t data[COMPRESS_TEST_MAX];
+	char text[COMPRESS_TEST_MAX];
+	uint32_t x = 12345;
+	int i, n;
+
+	for(i = 0; i < (int)sizeof(data); i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 16;
+	}
+
+	compress_test_check(compress_test_packet(data, sizeof(data), 1) == COMPRESS_STORED,
+						"incompressible 512 bytes stored");
+	compress_test_check(compress_test_packet(data, 20, 1) == COMPRESS_STORED,
+						"incompressible 20 bytes stored");
+
+	n = compress_test_text(text, sizeof(text), 1);
+	compress_test_check(compress_test_packet((uint8_t *)text, n, 1) == COMPRESS_DEFLATE,
+						"text after stored packet");
+}
+
+
+/*
+ * 包没有送达, 压缩方的历史里有接收方没有的数据, 下一个包必须原样发送
+ */
+static void compress_test_abort(void)
+{
+	char text[COMPRESS_TEST_MAX];
+	int n;
+
+	n = compress_test_text(text, sizeof(text), 2);
+	compress_test_check(compress_test_packet((uint8_t *)text, n, 0) == COMPRESS_DEFLATE, "lost packet");
+
+	n = compress_test_text(text, sizeof(text), 4);
+	compress_test_check(compress_test_packet((uint8_t *)text, n, 1) == COMPRESS_STORED,
+						"stored after abort");
+
+	n = compress_test_text(text, sizeof(text), 6);
+	compress_test_check(compress_test_packet((uint8_t *)text, n, 1) == COMPRESS_DEFLATE,
+						"deflate after resync");
+}
+
+
+int main(int argc, char *argv[])
+{
+	if(compress_init(&t.c) < 0 || inflateInit2(&t.zs, -15) != Z_OK ||
+			inflateSetDictionary(&t.zs, compress_dict, compress_dict_len) != Z_OK) {
+		printf("init failed\n");
+		return 1;
+	}
+
+	compress_test_roundtrip();
+	compress_test_incompressible();
+	compress_test_abort();
+
+	printf("%d packets, %d deflated, %d stored, %d -> %d bytes\n",
+			t.packets, t.deflated, t.stored, t.in_bytes, t.out_bytes);
+
+	compress_end(&t.c);
+	inflateEnd(&t.zs);
+
+	printf("%s\n", t.failures ? "FAILED" : "PASSED");
+
+	return t.failures ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stdint.h>
+
+/*
+ * 帧格式: COBS(payload + CRC16) + 0x00
+ * CRC16为CRC-16/CCITT-FALSE(多项式0x1021, 初值0xFFFF), 小端
+ * COBS编码后数据中不存在0x00, 0x00作为帧结束符, 丢包或者出错后在下一个0x00处重新同步
+ */
+#define FRAME_MAX_PAYLOAD 4096
+#define FRAME_CRC_SIZE 2
+#define FRAME_DELIMITER 0x00
+
+/*
+ * 编码后的最大长度: 每254字节增加1字节开销, 加上首字节和结束符
+ */
+#define FRAME_ENCODED_MAX(len) ((len) + FRAME_CRC_SIZE + ((len) + FRAME_CRC_SIZE) / 254 + 2)
+
+/*
+ * msg只在回调期间有效
+ */
+typedef void (*frame_message_t)(uint8_t *msg, int len, void *user_data);
+
+struct frame_decoder_t {
+	uint8_t buf[FRAME_MAX_PAYLOAD + FRAME_CRC_SIZE];
+	int len;
+	/*
+	 * 当前COBS块的编码字节和块中还没有收到的字节数
+	 */
+	uint8_t code;
+	uint8_t remaining;
+	/*
+	 * 帧太长或者格式错误, 丢弃到下一个结束符
+	 */
+	int discard;
+
+	frame_message_t message_cb;
+	void *user_data;
+
+	uint32_t frames;
+	uint32_t crc_errors;
+	uint32_t format_errors;
+};
+
+uint16_t frame_crc16(uint16_t crc, const uint8_t *buf, int len);
+void frame_decoder_init(struct frame_decoder_t *dec, frame_message_t message_cb, void *user_data);
+void frame_decoder_feed(struct frame_decoder_t *dec, const uint8_t *buf, int len);
+int frame_encode(const uint8_t *msg, int len, uint8_t *out, int out_size);
+
+
+#endif
+#ifdef __cplusplus
+}
+#endif
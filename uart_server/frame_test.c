@@ -0,0 +1,192 @@
+/*
+ * 分帧层的测试, 不需要蓝牙设备
+ *
+ * 1.各种长度(包括COBS块边界254/255和含0x00的数据)编码后按不同的块大小喂给解码器, 原样解出.
+ * 2.一帧的CRC被破坏后丢弃这一帧, 后面的帧在结束符处重新同步.
+ * 3.从帧中间开始接收(前面的数据丢了), 丢弃到第一个结束符, 之后正常.
+ *
+ * make test 运行, 全部通过时返回0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+#define FRAME_TEST_MAX_ENCODED FRAME_ENCODED_MAX(FRAME_MAX_PAYLOAD)
+
+struct frame_test_t {
+	struct frame_decoder_t dec;
+	int failures;
+
+	/*
+	 * 最后一个解出的消息
+	 */
+	uint8_t msg[FRAME_MAX_PAYLOAD];
+	int len;
+	int messages;
+};
+
+static struct frame_test_t t;
+
+
+static void frame_test_check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if(!ok) {
+		t.failures++;
+	}
+}
+
+
+static void frame_test_message(uint8_t *msg, int len, void *user_data)
+{
+	memcpy(t.msg, msg, len);
+	t.len = len;
+	t.messages++;
+}
+
+
+/*
+ * 每chunk个字节调用一次frame_decoder_feed
+ */
+static void frame_test_feed(const uint8_t *buf, int len, int chunk)
+{
+	int n;
+
+	while(len > 0) {
+		n = len < chunk ? len : chunk;
+		frame_decoder_feed(&t.dec, buf, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+
+/*
+ * pattern 0: 没有0x00, 1: 每隔几个字节一个0x00, 2: 全部是0x00
+ */
+static void frame_test_fill(uint8_t *msg, int len, int pattern)
+{
+	int i;
+
+	for(i = 0; i < len; i++) {
+		switch(pattern) {
+		case 0:
+			msg[i] = (uint8_t)(i % 255 + 1);
+			break;
+		case 1:
+			msg[i] = (i % 7) ? (uint8_t)(i * 13) : 0x00;
+			break;
+		default:
+			msg[i] = 0x00;
+			break;
+		}
+	}
+}
+
+
+static void frame_test_roundtrip(void)
+{
+	static const int lens[] = {0, 1, 2, 252, 253, 254, 255, 256, 508, 509, 1000, FRAME_MAX_PAYLOAD};
+	static const int chunks[] = {1, 20, 244, FRAME_TEST_MAX_ENCODED};
+	static uint8_t msg[FRAME_MAX_PAYLOAD], enc[FRAME_TEST_MAX_ENCODED];
+	int i, pattern, c, n, ok = 1, encode_ok = 1;
+	char what[64];
+
+	for(pattern = 0; pattern < 3; pattern++) {
+		for(i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); i++) {
+			frame_test_fill(msg, lens[i], pattern);
+			n = frame_encode(msg, lens[i], enc, sizeof(enc));
+			if(n < 0 || n > FRAME_ENCODED_MAX(lens[i]) || memchr(enc, FRAME_DELIMITER, n - 1) ||
+					enc[n - 1] != FRAME_DELIMITER) {
+				encode_ok = 0;
+				continue;
+			}
+
+			for(c = 0; c < (int)(sizeof(chunks) / sizeof(chunks[0])); c++) {
+				t.messages = 0;
+				frame_test_feed(enc, n, chunks[c]);
+				if(t.messages != 1 || t.len != lens[i] || memcmp(t.msg, msg, lens[i])) {
+					ok = 0;
+					snprintf(what, sizeof(what), "round trip len %d pattern %d chunk %d",
+								lens[i], pattern, chunks[c]);
+					frame_test_check(0, what);
+				}
+			}
+		}
+	}
+
+	frame_test_check(encode_ok, "encode: no 0x00 inside, ends with delimiter, within FRAME_ENCODED_MAX");
+	frame_test_check(ok, "round trip");
+	frame_test_check(frame_encode(msg, FRAME_MAX_PAYLOAD + 1, enc, sizeof(enc)) < 0, "too long rejected");
+}
+
+
+/*
+ * A的CRC被破坏, B, C正常, 只解出B和C
+ */
+static void frame_test_crc_resync(void)
+{
+	static uint8_t enc[3 * FRAME_ENCODED_MAX(64)];
+	uint8_t msg[64];
+	uint32_t crc_errors = t.dec.crc_errors;
+	int n = 0, a_len;
+
+	frame_test_fill(msg, sizeof(msg), 1);
+	a_len = frame_encode(msg, sizeof(msg), enc, sizeof(enc));
+
+	/*
+	 * 改一个非零的数据字节(不是COBS编码字节), 不能改成0x00, 否则变成结束符
+	 */
+	enc[2] = enc[2] == 0xff ? 0x01 : enc[2] + 1;
+	n = a_len;
+
+	msg[0] = 'B';
+	n += frame_encode(msg, sizeof(msg), enc + n, sizeof(enc) - n);
+	msg[0] = 'C';
+	n += frame_encode(msg, sizeof(msg), enc + n, sizeof(enc) - n);
+
+	t.messages = 0;
+	frame_test_feed(enc, n, 20);
+
+	frame_test_check(t.dec.crc_errors == crc_errors + 1, "corrupted frame counted as crc error");
+	frame_test_check(t.messages == 2 && t.len == sizeof(msg) && t.msg[0] == 'C' &&
+						!memcmp(t.msg + 1, msg + 1, sizeof(msg) - 1), "resync after crc error");
+}
+
+
+/*
+ * 从一帧的中间开始接收
+ */
+static void frame_test_mid_frame(void)
+{
+	static uint8_t enc[2 * FRAME_ENCODED_MAX(300)];
+	uint8_t msg[300];
+	int n, first;
+
+	frame_test_fill(msg, sizeof(msg), 0);
+	first = frame_encode(msg, sizeof(msg), enc, sizeof(enc));
+	n = first + frame_encode(msg, 10, enc + first, sizeof(enc) - first);
+
+	t.messages = 0;
+	frame_test_feed(enc + first / 2, n - first / 2, 7);
+
+	frame_test_check(t.messages == 1 && t.len == 10 && !memcmp(t.msg, msg, 10), "resync from middle of frame");
+}
+
+
+int main(int argc, char *argv[])
+{
+	frame_decoder_init(&t.dec, frame_test_message, NULL);
+
+	frame_test_roundtrip();
+	frame_test_crc_resync();
+	frame_test_mid_frame();
+
+	printf("%s\n", t.failures ? "FAILED" : "PASSED");
+
+	return t.failures ? 1 : 0;
+}
@@ -16,16 +16,28 @@
  */
 
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <glib-unix.h>
 #include <stdlib.h>
 #include <glib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <stddef.h>
 
 #include "gatt.h"
+#include "compress.h"
+#include "stats.h"
+#include "adapter.h"
 #include "log.h"
 
 //#define __DEBUG__
 
+/*
+ * 每个adapter一个gatt application, 路径为UART_OBJECT_PATH/<adapter名字>, 例如/org/uart/server/hci0
+ */
 #define UART_OBJECT_PATH "/org/uart/server"
 
 static const gchar object_manager_xml[] =
@@ -64,6 +76,8 @@ static const gchar char_xml[] =
 "    <property name='Value' type='ay' access='read'/>"
 "    <property name='Notifying' type='b' access='read'/>"
 "    <property name='Flags' type='as' access='read'/>"
+"    <property name='WriteAcquired' type='b' access='read'/>"
+"    <property name='NotifyAcquired' type='b' access='read'/>"
 "    <method name='ReadValue'>"
 "      <arg name='options' type='a{sv}' direction='in'/>"
 "      <arg name='value' type='ay' direction='out'/>"
@@ -72,20 +86,153 @@ static const gchar char_xml[] =
 "      <arg name='value' type='ay' direction='in'/>"
 "      <arg name='options' type='a{sv}' direction='in'/>"
 "    </method>"
+"    <method name='AcquireWrite'>"
+"      <arg name='options' type='a{sv}' direction='in'/>"
+"      <arg name='fd' type='h' direction='out'/>"
+"      <arg name='mtu' type='q' direction='out'/>"
+"    </method>"
+"    <method name='AcquireNotify'>"
+"      <arg name='options' type='a{sv}' direction='in'/>"
+"      <arg name='fd' type='h' direction='out'/>"
+"      <arg name='mtu' type='q' direction='out'/>"
+"    </method>"
 "    <method name='StartNotify'>"
 "    </method>"
 "    <method name='StopNotify'/>"
+"    <method name='Confirm'/>"
 "  </interface>"
 "</node>";
 
 
 #define CHAR_FLAGS_SIZE 17
 
+/*
+ * 特性值的最大长度
+ */
+#define GATT_MAX_ATTR_LEN 512
+
+/*
+ * 最小的ATT_MTU
+ */
+#define GATT_DEFAULT_MTU 23
+
+#define RX_POOL_SIZE 8
+
+/*
+ * 长写/可靠写的片段在最后一个片段之后这么长时间没有新的片段时提交
+ */
+#define GATT_PREP_COMMIT_MS 50
+
+/*
+ * indication模式下交给bluez还没有确认的indication的最大个数
+ * 一个连接同时只能有一个indication在等待确认, bluez排队发送,
+ * 多交给bluez一个, 确认到达时bluez马上发送下一个, 不需要等应用的一个来回
+ */
+#define GATT_IND_WINDOW 2
+/*
+ * 发送队列按包放行, 一个包在发送时可能再分成几个indication: 打开压缩之前分好的片要留出压缩头,
+ * 更小MTU的设备连接之后按新的分片大小分. 最坏是每个最大的包都按最小的MTU分片, 都要记录
+ */
+#define GATT_IND_SLOTS (GATT_IND_WINDOW * \
+			(GATT_MAX_ATTR_LEN / (GATT_DEFAULT_MTU - 3 - COMPRESS_HEADER_SIZE) + 1))
+
+/*
+ * 这么长时间没有收齐确认的indication不再等待, 避免Confirm丢失后发送一直停止
+ */
+#define GATT_IND_TIMEOUT_MS 2000
+
+struct gatt_attr_t;
+
+/*
+ * 属性的get函数, 返回的GVariant可以是floating的
+ * 返回NULL表示对象没有这个属性, GetManagedObjects时跳过
+ */
+typedef GVariant *(*gatt_prop_get_t)(struct gatt_attr_t *attr);
+
+/*
+ * 方法的处理函数, 需要自己返回invoc
+ */
+typedef void (*gatt_method_call_t)(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc);
+
+struct gatt_prop_t {
+	const char *name;
+	gatt_prop_get_t get;
+};
+
+struct gatt_method_t {
+	const char *name;
+	gatt_method_call_t call;
+};
+
+enum gatt_attr_type_t {
+	GATT_ATTR_APP,		/* ObjectManager, 不属于managed objects */
+	GATT_ATTR_SERVICE,
+	GATT_ATTR_CHAR,
+	GATT_ATTR_DESC,
+};
+
+/*
+ * 一类对象(服务, 特性, 描述符)的接口, 属性和方法
+ * props的顺序就是GetManagedObjects中属性的顺序, 以{NULL}结尾
+ * prop_table/method_table: quark -> struct gatt_prop_t/gatt_method_t, 第一次创建server时建立
+ */
+struct gatt_class_t {
+	enum gatt_attr_type_t type;
+	const char *iface;
+	const gchar *xml;
+	const struct gatt_prop_t *props;
+	const struct gatt_method_t *methods;
+
+	GDBusNodeInfo *node_info;
+	GHashTable *prop_table;
+	GHashTable *method_table;
+};
+
+/*
+ * 属性表中的一项
+ * name: 相对于parent的路径, parent为-1时是application本身
+ * offset: 对象数据在struct server_t中的位置
+ */
+struct gatt_attr_desc_t {
+	const char *name;
+	int parent;
+	struct gatt_class_t *cls;
+	size_t offset;
+};
+
+/*
+ * 注册到D-Bus上的对象, 作为register_object的user_data, 不需要再按路径查找
+ */
+struct gatt_attr_t {
+	const struct gatt_attr_desc_t *desc;
+	struct gatt_class_t *cls;
+	struct gatt_attr_t *parent;
+	struct server_t *server;
+	void *data;
+	char *path;
+	guint reg_id;
+
+	/*
+	 * GetManagedObjects中这个对象的一项{oa{sa{sv}}}, 属性变化时清除
+	 */
+	GVariant *cache;
+};
+
+enum {
+	UART_ATTR_APP,
+	UART_ATTR_SERVICE,
+	UART_ATTR_RX,
+	UART_ATTR_TX,
+	UART_ATTR_CTRL,
+	UART_ATTR_COUNT,
+};
+
 struct char_t {
 	char *UUID;
-	char *Service;
-	uint8_t Value[512];
-	int len;
+	/*
+	 * 最后一次通知的Value(ay), 没有通知过为NULL
+	 */
+	GVariant *value;
 	/* @Flags:
 	 *	"broadcast"
 	 *	"read"
@@ -111,7 +258,33 @@ struct char_t {
 	 * characteristic are currently enabled.
 	 */
 	int Notifying;
-	
+
+	/*
+	 * True, if this characteristic has been acquired by any
+	 * client using AcquireWrite.
+	 */
+	int WriteAcquired;
+
+	/*
+	 * True, if this characteristic has been acquired by any
+	 * client using AcquireNotify.
+	 */
+	int NotifyAcquired;
+
+	/*
+	 * AcquireWrite/AcquireNotify返回给bluez的socket(SOCK_SEQPACKET),
+	 * 本地保留的一端,没有获取时为-1
+	 */
+	int fd;
+	guint fd_watch_id;
+	uint16_t mtu;
+	/*
+	 * 获取socket的设备(options中的"device")
+	 */
+	char *device;
+
+	struct server_t *server;
+	struct gatt_attr_t *attr;
 };
 
 
@@ -125,58 +298,186 @@ struct service_t {
 };
 
 
+/*
+ * 一个设备的长写/可靠写(Prepare Write + Execute Write)
+ * bluez执行Execute Write时按顺序对每个片段调用一次WriteValue, options中"type"为"reliable",
+ * "offset"为片段在属性值中的位置. 片段直接拷贝到接收缓存池的缓存中对应的位置,
+ * 整个值组装完成后作为一个包交给接收回调.
+ * 不知道哪个片段是最后一个, 下一个offset为0的片段, 普通写入, 断开或者超时时提交.
+ * 超时提交之后保留base, 同一个Execute Write后面接着的片段继续组装, 作为下一个包.
+ */
+struct gatt_prep_t {
+	struct server_t *srv;
+	char *device;
+	GBytes *buf;		/* 属性值[base, len)的数据 */
+	int base;			/* 已经提交的长度 */
+	int len;			/* 已经收到的长度 */
+	guint timer_id;
+};
+
+
+/*
+ * 正在交给接收回调的数据
+ */
+struct rx_pkt_t {
+	GVariant *value;	/* WriteValue: 数据在D-Bus消息中 */
+	GBytes *buf;		/* AcquireWrite: 数据在接收缓存中 */
+	gsize len;
+	const char *device;	/* 发送数据的设备, 不知道时为NULL */
+};
+
+
 struct server_t {
 	struct {
 		struct service_t service;
 		struct char_t rx_char;
 		struct char_t tx_char;
+		struct char_t ctrl_char;
 	} gatt;
 
 	GDBusConnection *conn;
-	GDBusNodeInfo *object_manager_node_info;
-	guint object_manager_reg_id;
-	GDBusNodeInfo *service_node_info;
-	guint service_reg_id;
-	GDBusNodeInfo *char_node_info;
-	guint tx_char_reg_id;
-	guint rx_char_reg_id;
-	uart_receive_t receive_cb_func;
+	/*
+	 * adapter的object path, 例如/org/bluez/hci0
+	 */
+	char *adapter;
+
+	struct gatt_attr_t attrs[UART_ATTR_COUNT];
+
+	/*
+	 * 缓存的GetManagedObjects返回值, 任何一个对象的缓存被清除时一起清除
+	 */
+	GVariant *managed_objects;
+
+	gatt_receive_t receive_cb_func;
+	gatt_notify_t notify_cb_func;
+	gatt_mtu_t mtu_cb_func;
+	void *user_data;
+	/*
+	 * 最后一次通过mtu_cb_func报告的设备和MTU, WriteValue每次都带"mtu", 没有变化时不报告
+	 */
+	char *mtu_device;
+	int mtu_last;
+	struct rx_pkt_t rx_pkt;
+	GBytes *rx_buf;
+	int rx_buf_held;
+	/*
+	 * device -> struct gatt_prep_t, 正在组装的长写
+	 */
+	GHashTable *prep;
+
+	struct gatt_tx_stats_t tx_stats;
+
+	/*
+	 * 信用流控, 客户端打开控制特性的通知时启用, 只在dbus线程中使用
+	 * tx_credits: 客户端给的发送信用, 每个通知用掉一个, 再分片多发的通知会让它小于0, 从下次的信用中扣除
+	 * rx_credits: 给客户端的接收信用还剩多少, rx_consumed: 上次补充之后收到的包数
+	 * stall_start: 发送信用用完并且还有数据要发送的时间, 没有停止时为0
+	 */
+	int fc_enabled;
+	int tx_credits;
+	int rx_credits;
+	int rx_consumed;
+	uint64_t stall_start;
+	gatt_credit_t credit_cb_func;
+	gatt_payload_t payload_cb_func;
+
+	/*
+	 * 客户端通过控制特性打开压缩后, 发送的每个包都经过压缩, 其他线程读取compressing
+	 * 通知会发给所有设备, 压缩流只有一个, 只在compress_device是唯一连接的设备时打开
+	 */
+	struct compress_t compress;
+	gint compressing;
+	char *compress_device;
+
+	/*
+	 * 连接到这个adapter的设备, 从WriteValue/Acquire*的"device"得知, Device1断开时删除
+	 */
+	GHashTable *peers;
+	guint peer_signal_id;
+
+	/*
+	 * indication模式: tx_char使用"indicate", 每个indication等待客户端的Confirm
+	 * ind: 还没有收齐确认的indication, 按发送顺序确认
+	 * ind_subscribers: 每个indication要收到的Confirm个数(打开indication的设备数),
+	 *   Confirm不带设备, 按ind_devices计算, bluez不告诉设备时按1个
+	 * ind_devices: StartNotify带了"device"的设备, StopNotify或者设备断开时删除
+	 */
+	int indicate;
+	int ind_inflight;
+	int ind_head;
+	int ind_subscribers;
+	GHashTable *ind_devices;
+	guint ind_timer_id;
+	struct {
+		uint64_t sent;
+		int confirms;
+	} ind[GATT_IND_SLOTS];
+
+	/*
+	 * RegisterApplication的结果, 释放server时取消还没有回复的调用
+	 */
+	GCancellable *cancellable;
+	gatt_registered_t registered_cb;
+	void *registered_data;
 };
 
 
+/*
+ * 所有server共用的PropertiesChanged信号中不变的部分, 第一次创建server时创建
+ */
+static GVariant *char_iface_name;
+static GVariant *value_name;
+static GVariant *empty_string_array;
+
+/*
+ * 每次通过信号通知时创建的GVariant个数:
+ * Value(ay), v, {sv}, a{sv}, (sa{sv}as)
+ */
+#define TX_VARIANTS_PER_NOTIFY 5
+
+#define TX_VARIANT(v) (srv->tx_stats.variant_allocs++, (v))
+
+
 
 /*
--> /org/uart/server
+-> /org/uart/server/hciX
   |   - org.freedesktop.DBus.ObjectManager
   |
-  -> /org/uart/server/service00
+  -> /org/uart/server/hciX/service00
   | |   - org.freedesktop.DBus.Properties
   | |   - org.bluez.GattService1
   | |
-  | -> /org/uart/server/service00/char0000
+  | -> /org/uart/server/hciX/service00/char0000
   | |     - org.freedesktop.DBus.Properties
   | |     - org.bluez.GattCharacteristic1
   | |
-  | -> /org/uart/server/service00/char0001
-  |   |   - org.freedesktop.DBus.Properties
-  |   |   - org.bluez.GattCharacteristic1
-  |   |
-  |   -> /org/uart/server/service00/char0001/desc000 (cccd被bluez自动创建)
-  |       - org.freedesktop.DBus.Properties
-  |       - org.bluez.GattDescriptor1
+  | -> /org/uart/server/hciX/service00/char0001
+  | |   |   - org.freedesktop.DBus.Properties
+  | |   |   - org.bluez.GattCharacteristic1
+  | |   |
+  | |   -> /org/uart/server/hciX/service00/char0001/desc000 (cccd被bluez自动创建)
+  | |       - org.freedesktop.DBus.Properties
+  | |       - org.bluez.GattDescriptor1
+  | |
+  | -> /org/uart/server/hciX/service00/char0002 (流控)
+  |     - org.freedesktop.DBus.Properties
+  |     - org.bluez.GattCharacteristic1
   |
-  -> /org/uart/server/serviceXX
+  -> /org/uart/server/hciX/serviceXX
     |   - org.freedesktop.DBus.Properties
     |   - org.bluez.GattService1
     |
-    -> /org/uart/server/serviceXX/char0000
+    -> /org/uart/server/hciX/serviceXX/char0000
         - org.freedesktop.DBus.Properties
         - org.bluez.GattCharacteristic1
 */
 
 
 
-static struct server_t server_ctx = {
+/*
+ * 创建server时从这里拷贝
+ */
+static const struct server_t server_template = {
 	.gatt = {
 		.service = {
 			.UUID = "6e400001-b5a3-f393-e0a9-e50e24dcca9e",
@@ -187,44 +488,259 @@ static struct server_t server_ctx = {
 		 */
 		.rx_char = {
 			.UUID = "6e400002-b5a3-f393-e0a9-e50e24dcca9e",
-			.Service = UART_OBJECT_PATH"/service00",
 			.Flags = {
 				[0] = "write-without-response",
-				//[1] = "read",
+				[1] = "write",
+				[2] = "reliable-write",
+				//[3] = "read",
 			},
+			.fd = -1,
 		},
 		/*
 		 * "/service00/char0001"
 		 */
 		.tx_char = {
 			.UUID = "6e400003-b5a3-f393-e0a9-e50e24dcca9e",
-			.Service = UART_OBJECT_PATH"/service00",
 			.Flags = {
 				[0] = "notify",
 			},
+			.fd = -1,
+		},
+		/*
+		 * "/service00/char0002"
+		 */
+		.ctrl_char = {
+			.UUID = "6e400004-b5a3-f393-e0a9-e50e24dcca9e",
+			.Flags = {
+				[0] = "write-without-response",
+				[1] = "notify",
+			},
+			.fd = -1,
 		},
 	},
 };
 
 
-void gatt_uart_register_receive_cb(uart_receive_t receive_cb)
+/*
+ * 对象的属性发生了变化, 下次GetManagedObjects时只重新构建这个对象
+ */
+static void gatt_attr_invalidate(struct gatt_attr_t *attr)
+{
+	struct server_t *srv = attr->server;
+
+	if(attr->cache) {
+		g_variant_unref(attr->cache);
+		attr->cache = NULL;
+	}
+
+	if(srv->managed_objects) {
+		g_variant_unref(srv->managed_objects);
+		srv->managed_objects = NULL;
+	}
+}
+
+
+static void gatt_payload_changed(struct server_t *srv)
 {
-	server_ctx.receive_cb_func = receive_cb;
+	if(srv->payload_cb_func) {
+		srv->payload_cb_func(srv->user_data);
+	}
 }
 
 
 /*
- * 最大发送512个字节
+ * 释放AcquireWrite/AcquireNotify获取的socket
+ * bluez在连接断开,客户端关闭通知或者重新获取时会关闭它那一端的socket
+ */
+static void gatt_char_release_fd(struct char_t *chr)
+{
+	struct server_t *srv = chr->server;
+
+	if(chr->fd_watch_id) {
+		g_source_remove(chr->fd_watch_id);
+		chr->fd_watch_id = 0;
+	}
+
+	if(chr->fd >= 0) {
+		close(chr->fd);
+		chr->fd = -1;
+	}
+
+	if(chr->NotifyAcquired) {
+		chr->NotifyAcquired = 0;
+		chr->Notifying = 0;
+		gatt_attr_invalidate(chr->attr);
+		if(srv->notify_cb_func) {
+			srv->notify_cb_func(chr->device, 0, srv->user_data);
+		}
+	}
+
+	if(chr->WriteAcquired) {
+		chr->WriteAcquired = 0;
+		gatt_attr_invalidate(chr->attr);
+	}
+
+	g_free(chr->device);
+	chr->device = NULL;
+
+	if(chr->mtu) {
+		chr->mtu = 0;
+		gatt_payload_changed(srv);
+	}
+}
+
+
+static void gatt_learn_mtu(struct server_t *srv, GVariant *options, const char *device);
+
+
+/*
+ * AcquireWrite/AcquireNotify(dict options) -> (fd, uint16 mtu)
+ * options: "device", "mtu", "link"
+ *
+ * 创建socketpair,一端通过fd list返回给bluez,另一端保留在chr->fd,
+ * 由func监听.
+ */
+static int gatt_char_acquire_fd(struct char_t *chr, GVariant *params, GDBusMethodInvocation *invoc,
+										GIOCondition condition, GUnixFDSourceFunc func)
+{
+	GVariant *options;
+	GUnixFDList *fd_list;
+	guint16 mtu = 0;
+	gchar *device = NULL;
+	int fds[2];
+
+	g_variant_get(params, "(@a{sv})", &options);
+	g_variant_lookup(options, "mtu", "q", &mtu);
+	g_variant_lookup(options, "device", "o", &device);
+	gatt_learn_mtu(chr->server, options, device);
+	g_variant_unref(options);
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+		u_tm_log("[%s:%d] socketpair error: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		g_dbus_method_invocation_return_dbus_error(invoc, "org.bluez.Error.Failed", strerror(errno));
+		g_free(device);
+		return -1;
+	}
+
+	/*
+	 * 重连后bluez会重新获取,之前的socket已经没用了
+	 */
+	gatt_char_release_fd(chr);
+
+	chr->fd = fds[0];
+	chr->mtu = mtu;
+	chr->device = device;
+	chr->fd_watch_id = g_unix_fd_add(chr->fd, condition, func, chr);
+	gatt_payload_changed(chr->server);
+
+	/*
+	 * fd_list接管fds[1],返回后由fd_list关闭
+	 */
+	fd_list = g_unix_fd_list_new_from_array(&fds[1], 1);
+	g_dbus_method_invocation_return_value_with_unix_fd_list(invoc, g_variant_new("(hq)", 0, mtu), fd_list);
+	g_object_unref(fd_list);
+
+	u_tm_log("[%s:%d] %s acquired fd = %d, mtu = %d, device = %s\n", __FUNCTION__, __LINE__,
+				chr->UUID, chr->fd, mtu, chr->device ? chr->device : "");
+
+	return 0;
+}
+
+
+void gatt_uart_get_tx_stats(struct server_t *srv, struct gatt_tx_stats_t *stats)
+{
+	*stats = srv->tx_stats;
+}
+
+
+/*
+ * 可以在任意线程调用, 返回客户端是否打开了通知
+ */
+int gatt_uart_is_notifying(struct server_t *srv)
+{
+	return g_atomic_int_get(&srv->gatt.tx_char.Notifying);
+}
+
+
+/*
+ * 一个notification能携带的最大数据长度(ATT_MTU - 3), 不超过属性的最大长度
+ * 不知道MTU(0)时按照最小的ATT_MTU(23)计算, 保证不会被截断
+ */
+int gatt_mtu_payload_size(int mtu)
+{
+	if(mtu < GATT_DEFAULT_MTU) {
+		mtu = GATT_DEFAULT_MTU;
+	}
+
+	return MIN(mtu - 3, GATT_MAX_ATTR_LEN);
+}
+
+
+/*
+ * 在uart server线程中调用, 其他线程使用payload_cb_func之后计算好的结果
+ * AcquireWrite/AcquireNotify得到的MTU, 设备的MTU由mtu_cb_func报告给会话层
+ */
+int gatt_uart_payload_size(struct server_t *srv)
+{
+	int mtu = srv->gatt.tx_char.mtu;
+
+	if(!mtu) {
+		mtu = srv->gatt.rx_char.mtu;
+	}
+
+	return gatt_mtu_payload_size(mtu);
+}
+
+
+/*
+ * 发送使用indication, 需要在gatt_uart_server_register之前调用
+ */
+void gatt_uart_set_indicate(struct server_t *srv, int on)
+{
+	srv->indicate = on;
+	srv->gatt.tx_char.Flags[0] = on ? "indicate" : "notify";
+	gatt_attr_invalidate(srv->gatt.tx_char.attr);
+}
+
+
+void gatt_uart_set_mtu_cb(struct server_t *srv, gatt_mtu_t cb)
+{
+	srv->mtu_cb_func = cb;
+}
+
+
+static void gatt_peer_seen(struct server_t *srv, const char *device);
+
+/*
+ * 在dbus线程中调用, 记录device, options中有"mtu"时报告给mtu_cb_func
  */
-void gatt_uart_send(uint8_t *buf, int len)
+static void gatt_learn_mtu(struct server_t *srv, GVariant *options, const char *device)
 {
-	if(!server_ctx.conn || !server_ctx.gatt.tx_char.Notifying || len > 512) {
-		return ;
+	guint16 mtu = 0;
+
+	gatt_peer_seen(srv, device);
+
+	if(!srv->mtu_cb_func || !g_variant_lookup(options, "mtu", "q", &mtu) || !mtu) {
+		return;
+	}
+
+	if(mtu == srv->mtu_last && !g_strcmp0(device, srv->mtu_device)) {
+		return;
 	}
 
-	memcpy(server_ctx.gatt.tx_char.Value, buf, len);
-	server_ctx.gatt.tx_char.len = len;
+	srv->mtu_last = mtu;
+	g_free(srv->mtu_device);
+	srv->mtu_device = g_strdup(device);
+
+	srv->mtu_cb_func(device, mtu, srv->user_data);
+}
+
 
+/*
+ * 通过Value属性的PropertiesChanged信号发送一个notification
+ */
+static int gatt_char_emit_value(struct server_t *srv, struct char_t *chr, const uint8_t *buf, int len)
+{
 	/*
 	 * 通知是通过PropertiesChanged信号实现的。
 	 * 当bluez收到Value属性PropertiesChanged的信号,
@@ -235,302 +751,1403 @@ void gatt_uart_send(uint8_t *buf, int len)
 	 * gets updated only after a successful read request and
 	 * when a notification or indication is received, upon
 	 * which a PropertiesChanged signal will be emitted.
+	 *
+	 * 信号参数(sa{sv}as)直接用g_variant_new_*构造,不使用GVariantBuilder:
+	 * interface_name和invalidated_properties是预先创建好的常量,
+	 * Value一次拷贝整块数据, 每次通知固定分配TX_VARIANTS_PER_NOTIFY个GVariant.
 	 */
+	GVariant *value = TX_VARIANT(g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, buf, len, 1));
+
+	/*
+	 * 保存最后一次通知的值, 读取Value属性时直接返回
+	 */
+	if(chr->value) {
+		g_variant_unref(chr->value);
+	}
+	chr->value = g_variant_ref_sink(value);
+	gatt_attr_invalidate(chr->attr);
+
+	GVariant *entry = TX_VARIANT(g_variant_new_dict_entry(value_name, TX_VARIANT(g_variant_new_variant(value))));
+
 	GVariant *parameters[3];
 	
 	/*
 	 * interface_name
 	 */
-	parameters[0] = g_variant_new_string("org.bluez.GattCharacteristic1");
+	parameters[0] = char_iface_name;
 
 	/*
 	 * changed_properties
 	 */
-	GVariantBuilder *builder = g_variant_builder_new(G_VARIANT_TYPE("ay"));
-	int i;
-	for(i = 0; i < server_ctx.gatt.tx_char.len; i++) {
-		g_variant_builder_add(builder, "y", server_ctx.gatt.tx_char.Value[i]);
-	}
-	
-	GVariant *value = g_variant_builder_end(builder);
-	g_variant_builder_unref(builder);
-
-	GVariantBuilder *prop_builder = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
-	g_variant_builder_add(prop_builder, "{sv}", "Value", value);
-	parameters[1] = g_variant_builder_end(prop_builder);
-	g_variant_builder_unref(prop_builder);
+	parameters[1] = TX_VARIANT(g_variant_new_array(NULL, &entry, 1));
 
 	/*
 	 * invalidated_properties
 	 */
-	GVariantBuilder *inv_prop_builder = g_variant_builder_new(G_VARIANT_TYPE("as"));
-	parameters[2] = g_variant_builder_end(inv_prop_builder);
-	g_variant_builder_unref(inv_prop_builder);
+	parameters[2] = empty_string_array;
+
+	srv->tx_stats.notify_signal++;
 
 	GError *error = NULL;
-	g_dbus_connection_emit_signal(server_ctx.conn,
+	g_dbus_connection_emit_signal(srv->conn,
                                "org.bluez",
-                               UART_OBJECT_PATH"/service00/char0001",
+                               chr->attr->path,
                                "org.freedesktop.DBus.Properties",
                                "PropertiesChanged" ,
-                               g_variant_new_tuple(parameters, 3), /* (sa{sv}as) */
+                               TX_VARIANT(g_variant_new_tuple(parameters, 3)), /* (sa{sv}as) */
                                &error);
 	if(error) {
 		u_tm_log("[%s:%d] error: %s\n", __FUNCTION__, __LINE__, error->message);
 		g_error_free (error);
-	}						   
+		stats_inc(STATS_EMIT_ERRORS);
+		return -1;
+	}
+
+	return 0;
 }
 
 
-static int gatt_create_node_info(void)
-{
-	GError *error = NULL;
+static void gatt_ind_sent(struct server_t *srv, uint64_t start);
 
-	server_ctx.object_manager_node_info = g_dbus_node_info_new_for_xml(object_manager_xml, &error);
 
-	if(error) {
-		u_tm_log("[%s:%d] error: %s\n", __FUNCTION__, __LINE__, error->message);
-		g_error_free (error);
+/*
+ * 最大发送512个字节
+ * 返回0表示已经交给bluez, -1表示数据被丢弃
+ */
+int gatt_uart_send(struct server_t *srv, uint8_t *buf, int len)
+{
+	uint8_t zbuf[GATT_MAX_ATTR_LEN];
+	uint64_t start;
+
+	if(!srv->conn) {
 		return -1;
 	}
 
-	server_ctx.service_node_info = g_dbus_node_info_new_for_xml(service_xml, &error);
+	if(!srv->gatt.tx_char.Notifying) {
+		stats_inc(STATS_TX_DROP_NOT_NOTIFYING);
+		return -1;
+	}
 
-	if(error) {
-		u_tm_log("[%s:%d] error: %s\n", __FUNCTION__, __LINE__, error->message);
-		g_error_free (error);
-		goto ERROR_1;
+	if(len > GATT_MAX_ATTR_LEN - gatt_uart_tx_overhead(srv)) {
+		stats_inc(STATS_TX_DROP_TOO_LONG);
+		return -1;
 	}
 
-	server_ctx.char_node_info = g_dbus_node_info_new_for_xml(char_xml, &error);
+	start = stats_now();
+
+	if(srv->compressing) {
+		stats_add(STATS_COMPRESS_IN_BYTES, len);
+		len = compress_packet(&srv->compress, buf, len, zbuf, sizeof(zbuf));
+		if(len < 0) {
+			return -1;
+		}
+		stats_add(STATS_COMPRESS_OUT_BYTES, len);
+		if(zbuf[0] == COMPRESS_STORED) {
+			stats_inc(STATS_COMPRESS_STORED);
+		}
+		buf = zbuf;
+	}
+
+	/*
+	 * AcquireNotify获取了socket, 直接写socket, bluez收到后发送notification
+	 */
+	if(srv->gatt.tx_char.fd >= 0) {
+		if(send(srv->gatt.tx_char.fd, buf, len, MSG_NOSIGNAL) < 0) {
+			u_tm_log("[%s:%d] send error: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+			stats_inc(STATS_SOCKET_ERRORS);
+			goto err;
+		}
+		srv->tx_stats.notify_socket++;
+	} else if(gatt_char_emit_value(srv, &srv->gatt.tx_char, buf, len) < 0) {
+		goto err;
+	}
+
+	/*
+	 * 已经交给bluez才用掉信用, 发送失败不会减少流控窗口
+	 * 发送前由gatt_uart_tx_credits保证有信用, 再分片多发的通知记为欠下的信用
+	 */
+	if(srv->fc_enabled) {
+		srv->tx_credits--;
+	}
+
+	if(srv->indicate) {
+		gatt_ind_sent(srv, start);
+	}
+
+	stats_inc(STATS_TX_PACKETS);
+	stats_add(STATS_TX_BYTES, len);
+	stats_hist_add(STATS_HIST_TX_LATENCY, stats_now() - start);
+
+	return 0;
+
+err:
+	/*
+	 * 客户端没有收到这个压缩包, 压缩流的历史不能保留
+	 */
+	if(buf == zbuf) {
+		compress_abort(&srv->compress);
+	}
+	return -1;
+}
+
+
+/*
+ * 通过控制特性给客户端n个接收信用
+ */
+static void gatt_fc_grant(struct server_t *srv, int n)
+{
+	uint8_t msg[GATT_FC_MSG_LEN] = {GATT_FC_OP_CREDIT, n & 0xff, (n >> 8) & 0xff};
+
+	if(gatt_char_emit_value(srv, &srv->gatt.ctrl_char, msg, sizeof(msg)) < 0) {
+		return;
+	}
+
+	srv->rx_credits += n;
+	stats_add(STATS_FC_CREDITS_GRANTED, n);
+}
+
+
+/*
+ * 收到一个包, 接收回调返回之后调用, 窗口用掉一半时补充
+ */
+static void gatt_fc_rx_consume(struct server_t *srv)
+{
+	if(srv->rx_credits > 0) {
+		srv->rx_credits--;
+	} else {
+		stats_inc(STATS_FC_RX_OVERRUN);
+	}
+
+	if(++srv->rx_consumed >= GATT_FC_WINDOW / 2) {
+		gatt_fc_grant(srv, srv->rx_consumed);
+		srv->rx_consumed = 0;
+	}
+}
+
+
+/*
+ * 在dbus线程中调用, 返回还可以发送的通知个数, 没有启用流控和indication模式时返回-1
+ */
+int gatt_uart_tx_credits(struct server_t *srv)
+{
+	int n = srv->fc_enabled ? MAX(srv->tx_credits, 0) : -1;
+	int window = MAX(GATT_IND_WINDOW - srv->ind_inflight, 0);
+
+	if(srv->indicate && (n < 0 || window < n)) {
+		n = window;
+	}
+
+	return n;
+}
+
+
+/*
+ * 发送信用用完并且还有数据要发送, 收到信用时记录停止的时间
+ * 只是在等indication的确认时不算
+ */
+void gatt_uart_tx_stall(struct server_t *srv)
+{
+	if(srv->fc_enabled && srv->tx_credits <= 0 && !srv->stall_start) {
+		srv->stall_start = stats_now();
+		stats_inc(STATS_FC_TX_STALLS);
+	}
+}
+
+
+void gatt_uart_set_credit_cb(struct server_t *srv, gatt_credit_t cb)
+{
+	srv->credit_cb_func = cb;
+}
+
+
+void gatt_uart_set_payload_cb(struct server_t *srv, gatt_payload_t cb)
+{
+	srv->payload_cb_func = cb;
+}
+
+
+/*
+ * 可以在任意线程调用, gatt_uart_server_new的user_data, 创建之后不变
+ */
+void *gatt_uart_user_data(struct server_t *srv)
+{
+	return srv->user_data;
+}
+
+
+/*
+ * 可以在任意线程调用, 每个包除了数据以外增加的字节数, 分片时需要留出来
+ */
+int gatt_uart_tx_overhead(struct server_t *srv)
+{
+	return g_atomic_int_get(&srv->compressing) ? COMPRESS_HEADER_SIZE : 0;
+}
+
+
+/*
+ * 打开或者关闭压缩, 打开时压缩流从字典重新开始, device是请求压缩的设备
+ * 通知会发给所有设备, 还有其他设备连接时拒绝打开
+ * 通过控制特性回复结果, 之后的通知按照新的设置发送
+ */
+static void gatt_compress_set(struct server_t *srv, int on, const char *device)
+{
+	uint8_t msg[GATT_CTRL_COMPRESS_LEN] = {GATT_CTRL_OP_COMPRESS, 0};
+	int others = g_hash_table_size(srv->peers);
+
+	if(device && g_hash_table_contains(srv->peers, device)) {
+		others--;
+	}
+
+	if(on && (device ? others > 0 : others > 1)) {
+		u_tm_log("%s compression refused, %d other devices connected\n", srv->adapter, others);
+		on = 0;
+	}
+
+	if(on && compress_init(&srv->compress) < 0) {
+		on = 0;
+	}
+
+	g_free(srv->compress_device);
+	srv->compress_device = on ? g_strdup(device) : NULL;
+
+	g_atomic_int_set(&srv->compressing, on);
+	u_tm_log("%s compression %s\n", srv->adapter, on ? "on" : "off");
+	gatt_payload_changed(srv);
+
+	if(srv->gatt.ctrl_char.Notifying) {
+		msg[1] = on;
+		gatt_char_emit_value(srv, &srv->gatt.ctrl_char, msg, sizeof(msg));
+	}
+}
+
+
+/*
+ * 第一次看到一个设备时加入peers, 压缩时有新的设备连接就关闭压缩, 新设备解不开压缩流
+ */
+static void gatt_peer_seen(struct server_t *srv, const char *device)
+{
+	if(!device || g_hash_table_contains(srv->peers, device)) {
+		return;
+	}
+
+	g_hash_table_add(srv->peers, g_strdup(device));
+
+	if(srv->compressing && g_strcmp0(device, srv->compress_device)) {
+		u_tm_log("%s %s connected while compressing\n", srv->adapter, device);
+		gatt_compress_set(srv, 0, NULL);
+	}
+}
+
+
+static void gatt_prep_flush(struct server_t *srv, const char *device);
+static void gatt_ind_update_subscribers(struct server_t *srv);
+
+/*
+ * org.bluez.Device1的PropertiesChanged, 这个adapter上的设备断开时提交它的长写, 从peers中删除
+ * params type: "(sa{sv}as)"
+ */
+static void gatt_device_changed(GDBusConnection *conn,
+							const gchar *sender,
+							const gchar *object_path,
+							const gchar *interface_name,
+							const gchar *signal_name,
+							GVariant *params,
+							gpointer user_data)
+{
+	struct server_t *srv = user_data;
+	GVariant *changed;
+	gboolean connected;
+	size_t n = strlen(srv->adapter);
+
+	if(strncmp(object_path, srv->adapter, n) || object_path[n] != '/') {
+		return;
+	}
+
+	g_variant_get(params, "(&s@a{sv}@as)", NULL, &changed, NULL);
+
+	if(g_variant_lookup(changed, "Connected", "b", &connected) && !connected) {
+		gatt_prep_flush(srv, object_path);
+		g_hash_table_remove(srv->peers, object_path);
+		if(g_hash_table_remove(srv->ind_devices, object_path)) {
+			gatt_ind_update_subscribers(srv);
+		}
+		if(srv->compressing && !g_strcmp0(object_path, srv->compress_device)) {
+			gatt_compress_set(srv, 0, NULL);
+		}
+	}
+
+	g_variant_unref(changed);
+}
+
+
+static void gatt_fc_tx_resume(struct server_t *srv)
+{
+	if(srv->stall_start) {
+		stats_hist_add(STATS_HIST_FC_STALL_TIME, (stats_now() - srv->stall_start) / 1000);
+		srv->stall_start = 0;
+	}
+
+	if(srv->credit_cb_func) {
+		srv->credit_cb_func(gatt_uart_tx_credits(srv), srv->user_data);
+	}
+}
+
+
+/*
+ * 最早的indication收齐了确认或者超时, 空出一个窗口
+ */
+static void gatt_ind_release(struct server_t *srv)
+{
+	srv->ind_head = (srv->ind_head + 1) % GATT_IND_SLOTS;
+	srv->ind_inflight--;
+
+	if(!srv->ind_inflight && srv->ind_timer_id) {
+		g_source_remove(srv->ind_timer_id);
+		srv->ind_timer_id = 0;
+	}
+
+	gatt_fc_tx_resume(srv);
+}
+
+
+/*
+ * 释放超时的indication, 打开indication的设备数只从StartNotify/StopNotify和断开得到,
+ * 超时不改变, 迟到的Confirm在gatt_tx_confirm中丢弃
+ */
+static gboolean gatt_ind_timeout(gpointer user_data)
+{
+	struct server_t *srv = user_data;
+	uint64_t now = stats_now();
+	int confirms;
+
+	while(srv->ind_inflight &&
+			now - srv->ind[srv->ind_head].sent >= (uint64_t)GATT_IND_TIMEOUT_MS * 1000000) {
+		confirms = srv->ind[srv->ind_head].confirms;
+		u_tm_log("%s indication timeout, %d/%d confirms\n", srv->adapter, confirms, srv->ind_subscribers);
+		stats_inc(STATS_IND_TIMEOUTS);
+		if(srv->ind_inflight == 1) {
+			srv->ind_timer_id = 0;
+		}
+		gatt_ind_release(srv);
+	}
+
+	return srv->ind_timer_id ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+
+/*
+ * indication已经交给bluez, 占用一个窗口
+ */
+static void gatt_ind_sent(struct server_t *srv, uint64_t start)
+{
+	int i;
+
+	if(srv->ind_inflight >= GATT_IND_SLOTS) {
+		return;
+	}
+
+	i = (srv->ind_head + srv->ind_inflight) % GATT_IND_SLOTS;
+	srv->ind[i].sent = start;
+	srv->ind[i].confirms = 0;
+	srv->ind_inflight++;
+
+	if(!srv->ind_timer_id) {
+		srv->ind_timer_id = g_timeout_add(GATT_IND_TIMEOUT_MS / 4, gatt_ind_timeout, srv);
+	}
+}
+
+
+/*
+ * ind_devices变化之后重新计算每个indication要收到的Confirm个数
+ */
+static void gatt_ind_update_subscribers(struct server_t *srv)
+{
+	int n = MAX(g_hash_table_size(srv->ind_devices), 1);
+
+	if(n != srv->ind_subscribers) {
+		srv->ind_subscribers = n;
+		u_tm_log("%s indication subscribers = %d\n", srv->adapter, n);
+	}
+}
+
+
+/*
+ * 通知打开或者关闭, 之前的indication不会再有Confirm
+ */
+static void gatt_ind_reset(struct server_t *srv)
+{
+	if(srv->ind_timer_id) {
+		g_source_remove(srv->ind_timer_id);
+		srv->ind_timer_id = 0;
+	}
+
+	gatt_ind_update_subscribers(srv);
+
+	if(srv->ind_inflight) {
+		srv->ind_inflight = 0;
+		gatt_fc_tx_resume(srv);
+	}
+}
+
+
+/*
+ * 解析xml, 建立属性和方法的quark表
+ */
+static int gatt_class_init(struct gatt_class_t *cls)
+{
+	GError *error = NULL;
+	int i;
+
+	if(cls->node_info) {
+		return 0;
+	}
+
+	cls->node_info = g_dbus_node_info_new_for_xml(cls->xml, &error);
 
 	if(error) {
 		u_tm_log("[%s:%d] error: %s\n", __FUNCTION__, __LINE__, error->message);
 		g_error_free (error);
-		goto ERROR_2;
+		return -1;
 	}
-	
-	u_tm_log("[%s:%d] %s\n", __FUNCTION__, __LINE__, "gatt_create node info ok");
+
+	cls->prop_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for(i = 0; cls->props && cls->props[i].name; i++) {
+		g_hash_table_insert(cls->prop_table,
+							GUINT_TO_POINTER(g_quark_from_static_string(cls->props[i].name)),
+							(gpointer)&cls->props[i]);
+	}
+
+	cls->method_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for(i = 0; cls->methods && cls->methods[i].name; i++) {
+		g_hash_table_insert(cls->method_table,
+							GUINT_TO_POINTER(g_quark_from_static_string(cls->methods[i].name)),
+							(gpointer)&cls->methods[i]);
+	}
+
 	return 0;
+}
+
+
+/*
+ * g_quark_try_string不会创建新的quark, 不认识的名字返回0, 查不到
+ */
+static const struct gatt_prop_t *gatt_class_prop(struct gatt_class_t *cls, const gchar *name)
+{
+	return g_hash_table_lookup(cls->prop_table, GUINT_TO_POINTER(g_quark_try_string(name)));
+}
+
+
+static const struct gatt_method_t *gatt_class_method(struct gatt_class_t *cls, const gchar *name)
+{
+	return g_hash_table_lookup(cls->method_table, GUINT_TO_POINTER(g_quark_try_string(name)));
+}
+
+
+/*
+ * type='{oa{sa{sv}}}'
+ * 对象在GetManagedObjects中的一项, 每个对象只有一个接口, 缓存到属性变化为止
+ */
+static GVariant *gatt_attr_managed_entry(struct gatt_attr_t *attr)
+{
+	GVariantBuilder *builder_if;
+	GVariant *v, *entry;
+	int i;
+
+	if(attr->cache) {
+		return attr->cache;
+	}
+
+	builder_if = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
+
+	for(i = 0; attr->cls->props[i].name; i++) {
+		v = attr->cls->props[i].get(attr);
+		if(v) {
+			g_variant_builder_add(builder_if, "{&sv}", attr->cls->props[i].name, v);
+		}
+	}
 
-ERROR_2:
-	g_dbus_node_info_unref(server_ctx.service_node_info);
+	v = g_variant_builder_end(builder_if);
+	g_variant_builder_unref(builder_if);
+
+	entry = g_variant_new_dict_entry(g_variant_new_string(attr->cls->iface), v);
+	v = g_variant_new_array(NULL, &entry, 1);
+
+	attr->cache = g_variant_ref_sink(g_variant_new_dict_entry(g_variant_new_object_path(attr->path), v));
+
+	return attr->cache;
+}
+
+
+/*
+ * type='(a{oa{sa{sv}}})'
+ * 属性表中除了application本身的每个对象一项
+ * 返回缓存的值, 不需要unref; 没有变化的对象直接使用各自缓存的一项
+ */
+static GVariant *gatt_get_managed_objects(struct server_t *srv)
+{
+	GVariant *entries[UART_ATTR_COUNT];
+	GVariant *v;
+	int i, n = 0;
+
+	if(srv->managed_objects) {
+		return srv->managed_objects;
+	}
+
+	for(i = 0; i < UART_ATTR_COUNT; i++) {
+		if(srv->attrs[i].cls->type == GATT_ATTR_APP) {
+			continue;
+		}
+		entries[n++] = gatt_attr_managed_entry(&srv->attrs[i]);
+	}
+
+	v = g_variant_new_array(G_VARIANT_TYPE("{oa{sa{sv}}}"), entries, n);
+
+	GVariant *tuples[] = {v};
+	
+	srv->managed_objects = g_variant_ref_sink(g_variant_new_tuple(tuples, 1));
+
+	return srv->managed_objects;
+}
+
+/*
+ * AcquireWrite接收缓存池
+ * 缓存以GBytes的形式交给应用保留, 应用释放最后一个引用时缓存回到池中,
+ * 释放可能发生在任意线程, 所以需要加锁.
+ */
+G_LOCK_DEFINE_STATIC(rx_pool);
+static uint8_t *rx_pool[RX_POOL_SIZE];
+static int rx_pool_count;
+
+static void rx_pool_put(gpointer data)
+{
+	G_LOCK(rx_pool);
+	if(rx_pool_count < RX_POOL_SIZE) {
+		rx_pool[rx_pool_count++] = data;
+		data = NULL;
+	}
+	G_UNLOCK(rx_pool);
+
+	g_free(data);
+}
+
+static GBytes *rx_pool_get(void)
+{
+	uint8_t *data = NULL;
+
+	G_LOCK(rx_pool);
+	if(rx_pool_count > 0) {
+		data = rx_pool[--rx_pool_count];
+	}
+	G_UNLOCK(rx_pool);
+
+	if(!data) {
+		data = g_malloc(GATT_MAX_ATTR_LEN);
+	}
+
+	return g_bytes_new_with_free_func(data, GATT_MAX_ATTR_LEN, rx_pool_put, data);
+}
+
+
+/*
+ * 只能在接收回调中调用, 返回当前数据的引用, 不拷贝数据.
+ * WriteValue: 引用D-Bus消息中的数据
+ * AcquireWrite: 引用接收缓存, 下次接收时换一个新的缓存
+ */
+GBytes *gatt_uart_rx_hold(struct server_t *srv)
+{
+	struct rx_pkt_t *pkt = &srv->rx_pkt;
+
+	if(pkt->value) {
+		return g_variant_get_data_as_bytes(pkt->value);
+	}
+
+	if(pkt->buf) {
+		if(pkt->buf == srv->rx_buf) {
+			srv->rx_buf_held = 1;
+		}
+		return g_bytes_new_from_bytes(pkt->buf, 0, pkt->len);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * 只能在接收回调中调用, 返回发送数据的设备的object path, 不知道时返回NULL
+ */
+const char *gatt_uart_rx_device(struct server_t *srv)
+{
+	return srv->rx_pkt.device;
+}
+
+
+/*
+ * 将数据提供给回调函数
+ */
+static void uart_rx_deliver(struct server_t *srv, uint8_t *buf, int len)
+{
+	uint64_t start;
+
+#ifdef __DEBUG__
+	u_tm_log("uart_rx_deliver len: %d\n", len);
+	u_tm_log_hex("uart_rx_deliver value: ", buf, len);
+#endif
+
+	if(!len) {
+		return;
+	}
+
+	stats_inc(STATS_RX_PACKETS);
+	stats_add(STATS_RX_BYTES, len);
+
+	if(srv->receive_cb_func) {
+		start = stats_now();
+		srv->receive_cb_func(buf, len, srv->user_data);
+		stats_hist_add(STATS_HIST_RX_LATENCY, stats_now() - start);
+	}
+
+	if(srv->fc_enabled) {
+		gatt_fc_rx_consume(srv);
+	}
+}
+
+static void uart_rx_callback(struct server_t *srv, GVariant *params)
+{
+#ifdef __DEBUG__
+	u_tm_log("params type: \"%s\"\n", g_variant_get_type_string(params));
+#endif
+
+	/*
+	 * params type: "(aya{sv})"
+	 */
+
+	GVariant *value, *flags;
+	g_variant_get(params, "(@ay@a{sv})", &value, &flags);
+	u_log(U_LOG_DEBUG, "value type: \"%s\"\n", g_variant_get_type_string(value));
+	u_log(U_LOG_DEBUG, "flags type: \"%s\"\n", g_variant_get_type_string(flags));
+	
+	/*
+	 * 提取数据, data直接指向D-Bus消息中的数据, 不拷贝
+	 */
+	gsize len;
+	const uint8_t *data = g_variant_get_fixed_array(value, &len, sizeof(uint8_t));
+	const gchar *device = NULL;
+
+	g_variant_lookup(flags, "device", "&o", &device);
+	gatt_learn_mtu(srv, flags, device);
+
+	srv->rx_pkt.value = value;
+	srv->rx_pkt.len = len;
+	srv->rx_pkt.device = device;
+	uart_rx_deliver(srv, (uint8_t *)data, len);
+	srv->rx_pkt.value = NULL;
+	srv->rx_pkt.device = NULL;
+
+	g_variant_unref(value);
+	g_variant_unref(flags);
+}
+
+
+/*
+ * AcquireWrite的socket可读,每个SEQPACKET包就是一次write without response的数据
+ */
+static gboolean uart_rx_fd_callback(gint fd, GIOCondition condition, gpointer user_data)
+{
+	struct char_t *rx_char = user_data;
+	struct server_t *srv = rx_char->server;
+	ssize_t n;
+
+	if(condition & G_IO_IN) {
+		while(1) {
+			/*
+			 * 上一个缓存被应用保留了,从缓存池重新取一个
+			 */
+			if(!srv->rx_buf || srv->rx_buf_held) {
+				if(srv->rx_buf) {
+					g_bytes_unref(srv->rx_buf);
+				}
+				srv->rx_buf = rx_pool_get();
+				srv->rx_buf_held = 0;
+			}
+
+			uint8_t *data = (uint8_t *)g_bytes_get_data(srv->rx_buf, NULL);
+
+			/*
+			 * MSG_TRUNC: 返回包的实际长度, 超过缓存的包丢弃
+			 */
+			n = recv(fd, data, GATT_MAX_ATTR_LEN, MSG_TRUNC);
+			if(n > GATT_MAX_ATTR_LEN) {
+				u_tm_log("[%s:%d] drop oversized packet len = %d\n", __FUNCTION__, __LINE__, (int)n);
+				continue;
+			}
+
+			if(n > 0) {
+				srv->rx_pkt.buf = srv->rx_buf;
+				srv->rx_pkt.len = n;
+				srv->rx_pkt.device = rx_char->device;
+				uart_rx_deliver(srv, data, n);
+				srv->rx_pkt.buf = NULL;
+				srv->rx_pkt.device = NULL;
+				continue;
+			}
+
+			if(n < 0 && errno == EINTR) {
+				continue;
+			}
+
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			}
+
+			/*
+			 * n == 0: bluez关闭了socket
+			 */
+			condition |= G_IO_HUP;
+			break;
+		}
+	}
+
+	if(condition & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		u_tm_log("[%s:%d] AcquireWrite fd %d released\n", __FUNCTION__, __LINE__, fd);
+		/*
+		 * 返回G_SOURCE_REMOVE后source会被删除,这里不能再调用g_source_remove
+		 */
+		rx_char->fd_watch_id = 0;
+		gatt_char_release_fd(rx_char);
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+/*
+ * AcquireNotify的socket只用于发送, bluez关闭socket表示客户端关闭了通知或者连接断开
+ */
+static gboolean uart_tx_fd_callback(gint fd, GIOCondition condition, gpointer user_data)
+{
+	struct char_t *tx_char = user_data;
+
+	if(condition & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		u_tm_log("[%s:%d] AcquireNotify fd %d released\n", __FUNCTION__, __LINE__, fd);
+		tx_char->fd_watch_id = 0;
+		gatt_char_release_fd(tx_char);
+		stats_inc(STATS_STOP_NOTIFY);
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+/*
+ * 服务和特性的属性
+ */
+static GVariant *gatt_service_uuid(struct gatt_attr_t *attr)
+{
+	struct service_t *service = attr->data;
+	return g_variant_new("s", service->UUID);
+}
+
+
+static GVariant *gatt_service_primary(struct gatt_attr_t *attr)
+{
+	struct service_t *service = attr->data;
+	return g_variant_new("b", service->Primary);
+}
+
+
+static GVariant *gatt_char_uuid(struct gatt_attr_t *attr)
+{
+	struct char_t *chr = attr->data;
+	return g_variant_new("s", chr->UUID);
+}
+
+
+static GVariant *gatt_char_service(struct gatt_attr_t *attr)
+{
+	return g_variant_new("o", attr->parent->path);
+}
+
+
+/*
+ * 接收的数据不缓存, 只在回调期间有效, 没有通知过的特性返回空数组
+ */
+static GVariant *gatt_char_value(struct gatt_attr_t *attr)
+{
+	struct char_t *chr = attr->data;
+
+	if(chr->value) {
+		return g_variant_ref(chr->value);
+	}
+
+	return g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, NULL, 0, 1);
+}
+
+
+static GVariant *gatt_char_notifying(struct gatt_attr_t *attr)
+{
+	struct char_t *chr = attr->data;
+	return g_variant_new("b", chr->Notifying);
+}
+
+
+static GVariant *gatt_char_flags(struct gatt_attr_t *attr)
+{
+	struct char_t *chr = attr->data;
+	GVariantBuilder *builder = g_variant_builder_new(G_VARIANT_TYPE("as"));
+	GVariant *v;
+	int i;
+
+	for(i = 0; i < CHAR_FLAGS_SIZE; i++) {
+		if(chr->Flags[i])
+			g_variant_builder_add(builder, "s", chr->Flags[i]);
+	}
+	v = g_variant_builder_end(builder);
+	g_variant_builder_unref(builder);
+
+	return v;
+}
+
+
+static GVariant *gatt_char_write_acquired(struct gatt_attr_t *attr)
+{
+	struct char_t *chr = attr->data;
+	return g_variant_new("b", chr->WriteAcquired);
+}
+
+
+/*
+ * indication需要bluez收到Confirm, 不能通过AcquireNotify的socket发送,
+ * 没有这个属性时bluez使用StartNotify
+ */
+static GVariant *gatt_char_notify_acquired(struct gatt_attr_t *attr)
+{
+	struct char_t *chr = attr->data;
+
+	if(chr->server->indicate) {
+		return NULL;
+	}
+
+	return g_variant_new("b", chr->NotifyAcquired);
+}
+
+
+/*
+ * 方法
+ */
+static void gatt_app_get_managed_objects(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
+{
+	/*
+	 * 返回值不是floating的, return_value会增加引用, 缓存继续有效
+	 */
+	g_dbus_method_invocation_return_value(invoc, gatt_get_managed_objects(attr->server));
+}
+
+
+/*
+ * 把组装好的数据交给接收回调, 接着的片段从base = len开始组装
+ */
+static void gatt_prep_commit(struct gatt_prep_t *prep)
+{
+	struct server_t *srv = prep->srv;
+
+	if(prep->timer_id) {
+		g_source_remove(prep->timer_id);
+		prep->timer_id = 0;
+	}
+
+	if(!prep->buf) {
+		return;
+	}
+
+	srv->rx_pkt.buf = prep->buf;
+	srv->rx_pkt.len = prep->len - prep->base;
+	srv->rx_pkt.device = prep->device[0] ? prep->device : NULL;
+	uart_rx_deliver(srv, (uint8_t *)g_bytes_get_data(prep->buf, NULL), prep->len - prep->base);
+	srv->rx_pkt.buf = NULL;
+	srv->rx_pkt.device = NULL;
+
+	/*
+	 * 应用保留的数据有自己的引用, 最后一个引用释放时缓存回到池中
+	 */
+	g_bytes_unref(prep->buf);
+	prep->buf = NULL;
+	prep->base = prep->len;
+}
+
+
+static gboolean gatt_prep_timeout(gpointer user_data)
+{
+	struct gatt_prep_t *prep = user_data;
+
+	prep->timer_id = 0;
+	gatt_prep_commit(prep);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void gatt_prep_free(gpointer data)
+{
+	struct gatt_prep_t *prep = data;
+
+	if(prep->timer_id) {
+		g_source_remove(prep->timer_id);
+	}
+	if(prep->buf) {
+		g_bytes_unref(prep->buf);
+	}
+	g_free(prep->device);
+	g_free(prep);
+}
+
+
+static struct gatt_prep_t *gatt_prep_get(struct server_t *srv, const char *device)
+{
+	struct gatt_prep_t *prep;
+
+	if(!device) {
+		device = "";
+	}
+
+	prep = g_hash_table_lookup(srv->prep, device);
+	if(!prep) {
+		prep = g_new0(struct gatt_prep_t, 1);
+		prep->srv = srv;
+		prep->device = g_strdup(device);
+		g_hash_table_insert(srv->prep, prep->device, prep);
+	}
 
-ERROR_1:
-	g_dbus_node_info_unref(server_ctx.object_manager_node_info);
-	return -1;
-	
+	return prep;
 }
 
 
-
-static GVariant *
-get_property_variant(const gchar *object_path, const gchar *interface_name, const gchar *property_name)
+/*
+ * 设备的普通写入之前先提交还没有提交的长写, 保持数据的顺序
+ * 设备断开时也提交, 不再等待超时. 之后不会再有这个长写的片段, 从srv->prep中删除
+ */
+static void gatt_prep_flush(struct server_t *srv, const char *device)
 {
-	GVariant *v = NULL;
+	struct gatt_prep_t *prep = g_hash_table_lookup(srv->prep, device ? device : "");
 
-	if(!strcmp(object_path, UART_OBJECT_PATH"/service00")) {
-		if(!strcmp(property_name, "UUID")) {
-			v = g_variant_new("s", server_ctx.gatt.service.UUID);
-		} else if(!strcmp(property_name, "Primary")) {
-			v = g_variant_new("b", server_ctx.gatt.service.Primary);
-		}
-	} else if(!strcmp(object_path, UART_OBJECT_PATH"/service00/char0000")) {
-		if(!strcmp(property_name, "UUID")) {
-			v = g_variant_new("s", server_ctx.gatt.rx_char.UUID);
-		} else if(!strcmp(property_name, "Flags")) {
-			GVariantBuilder *builder = g_variant_builder_new(G_VARIANT_TYPE("as"));
-			int i;
-			for(i = 0; i < CHAR_FLAGS_SIZE; i++) {
-				if(server_ctx.gatt.rx_char.Flags[i])
-					g_variant_builder_add(builder, "s", server_ctx.gatt.rx_char.Flags[i]);
-			}
-			v= g_variant_builder_end(builder);
-			g_variant_builder_unref(builder);
-		} else if(!strcmp(property_name, "Value")) {
-			GVariantBuilder *builder = g_variant_builder_new(G_VARIANT_TYPE("ay"));
-			int i;
-			for(i = 0; i < server_ctx.gatt.rx_char.len; i++) {
-				g_variant_builder_add(builder, "y", server_ctx.gatt.rx_char.Value[i]);
-			}
-			
-			v= g_variant_builder_end(builder);
-			g_variant_builder_unref(builder);
-		} else if(!strcmp(property_name, "Service")) {
-			v = g_variant_new("o", server_ctx.gatt.rx_char.Service);
-		}  else if(!strcmp(property_name, "Notifying")) {
-			v = g_variant_new("b", server_ctx.gatt.rx_char.Notifying);
-		}
-	} else if(!strcmp(object_path, UART_OBJECT_PATH"/service00/char0001")) {
-		if(!strcmp(property_name, "UUID")) {
-			v = g_variant_new("s", server_ctx.gatt.tx_char.UUID);
-		} else if(!strcmp(property_name, "Flags")) {
-			GVariantBuilder *builder = g_variant_builder_new(G_VARIANT_TYPE("as"));
-			int i;
-			for(i = 0; i < CHAR_FLAGS_SIZE; i++) {
-				if(server_ctx.gatt.tx_char.Flags[i])
-					g_variant_builder_add(builder, "s", server_ctx.gatt.tx_char.Flags[i]);
-			}
-			v= g_variant_builder_end(builder);
-			g_variant_builder_unref(builder);
-		} else if(!strcmp(property_name, "Value")) {
-			GVariantBuilder *builder = g_variant_builder_new(G_VARIANT_TYPE("ay"));
-			int i;
-			for(i = 0; i < server_ctx.gatt.tx_char.len; i++) {
-				g_variant_builder_add(builder, "y", server_ctx.gatt.tx_char.Value[i]);
-			}
-			
-			v= g_variant_builder_end(builder);
-			g_variant_builder_unref(builder);
-		} else if(!strcmp(property_name, "Service")) {
-			v = g_variant_new("o", server_ctx.gatt.tx_char.Service);
-		} else if(!strcmp(property_name, "Notifying")) {
-			v = g_variant_new("b", server_ctx.gatt.tx_char.Notifying);
-		}
+	if(prep) {
+		gatt_prep_commit(prep);
+		g_hash_table_remove(srv->prep, prep->device);
 	}
-
-	return v;
-
 }
 
+
 /*
- * type='a{oa{sa{sv}}}'
+ * 长写的一个片段, 返回NULL表示成功, 否则返回D-Bus错误名
+ * offset为0的片段开始一个新的值, 其他片段不能在已经收到的数据之后留下空洞,
+ * 也不能改写已经提交的数据
  */
-static GVariant *gatt_create_managed_objects(void)
+static const char *gatt_prep_write(struct server_t *srv, const char *device, int offset,
+									const uint8_t *data, int len)
 {
-	GVariant *v_property, *v;
-	GVariantBuilder *builder_if;
-	GVariantBuilder *builder_obj;
-	GVariantBuilder *builder_mobjs;
-	int i;
+	struct gatt_prep_t *prep = g_hash_table_lookup(srv->prep, device ? device : "");
+
+	if(!offset && prep) {
+		gatt_prep_commit(prep);
+		prep->base = 0;
+		prep->len = 0;
+	}
+
+	if(offset > (prep ? prep->len : 0) || (prep && offset < prep->base)) {
+		return "org.bluez.Error.InvalidOffset";
+	}
+
+	if(offset + len > GATT_MAX_ATTR_LEN) {
+		return "org.bluez.Error.InvalidValueLength";
+	}
+
+	if(!len) {
+		return NULL;
+	}
+
+	if(!prep) {
+		prep = gatt_prep_get(srv, device);
+	}
+
+	if(!prep->buf) {
+		prep->buf = rx_pool_get();
+	}
+
+	memcpy((uint8_t *)g_bytes_get_data(prep->buf, NULL) + offset - prep->base, data, len);
+	prep->len = MAX(prep->len, offset + len);
 
-	builder_mobjs = g_variant_builder_new(G_VARIANT_TYPE("a{oa{sa{sv}}}"));
+	if(prep->timer_id) {
+		g_source_remove(prep->timer_id);
+	}
+	prep->timer_id = g_timeout_add(GATT_PREP_COMMIT_MS, gatt_prep_timeout, prep);
 
 	/*
-	 * 构建/org/uart/server/service00的接口和属性
+	 * 属性值已经写满, 不会再有片段
 	 */
-	builder_if = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
-	
-	v_property = get_property_variant(UART_OBJECT_PATH"/service00", "org.bluez.GattService1", "UUID");
-	g_variant_builder_add(builder_if, "{&sv}", "UUID", v_property);
+	if(prep->len == GATT_MAX_ATTR_LEN) {
+		gatt_prep_commit(prep);
+	}
 
-	v_property = get_property_variant(UART_OBJECT_PATH"/service00", "org.bluez.GattService1", "Primary");
-	g_variant_builder_add(builder_if, "{&sv}", "Primary", v_property);
-	
-	v = g_variant_builder_end(builder_if);
-	g_variant_builder_unref(builder_if);
+	return NULL;
+}
 
-	builder_obj = g_variant_builder_new(G_VARIANT_TYPE("a{sa{sv}}"));
-	
-	g_variant_builder_add(builder_obj, "{&s@a{sv}}", "org.bluez.GattService1", v);
-	
-	v = g_variant_builder_end(builder_obj);
-	g_variant_builder_unref(builder_obj);
 
-	g_variant_builder_add(builder_mobjs, "{&o@a{sa{sv}}}", UART_OBJECT_PATH"/service00", v);
+/*
+ * WriteValue(array{byte} value, dict options)
+ * options: "offset", "type"("command", "request", "reliable"), "mtu", "device", "link", "prepare-authorize"
+ * "type"为"reliable"或者offset不为0时是长写/可靠写的片段, 其他直接交给接收回调
+ */
+static void gatt_rx_write_value(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
+{
+	struct server_t *srv = attr->server;
+	GVariant *value, *options;
+	const gchar *device = NULL, *type = NULL, *err = NULL;
+	const uint8_t *data;
+	guint16 offset = 0;
+	gboolean authorize = FALSE;
+	gsize len;
+
+	g_variant_get(params, "(@ay@a{sv})", &value, &options);
+	g_variant_lookup(options, "device", "&o", &device);
+	g_variant_lookup(options, "type", "&s", &type);
+	g_variant_lookup(options, "offset", "q", &offset);
+	g_variant_lookup(options, "prepare-authorize", "b", &authorize);
 
 	/*
-	 * 构建/org/uart/server/service00/char0000的接口和属性
+	 * 只是询问是否允许Prepare Write, 数据在Execute Write时才会写入
 	 */
-	builder_if = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
+	if(authorize) {
+		goto out;
+	}
+
+	if(offset || !g_strcmp0(type, "reliable")) {
+		gatt_learn_mtu(srv, options, device);
+		data = g_variant_get_fixed_array(value, &len, sizeof(uint8_t));
+		err = gatt_prep_write(srv, device, offset, data, len);
+		goto out;
+	}
+
+	gatt_prep_flush(srv, device);
+	uart_rx_callback(srv, params);
 
-	const char *char0000_list[] = {"UUID", "Service", "Value", "Notifying", "Flags"};
+out:
+	g_variant_unref(value);
+	g_variant_unref(options);
 
-	for(i = 0; i < sizeof(char0000_list)/sizeof(const char *); i++) {
-		v_property = get_property_variant(UART_OBJECT_PATH"/service00/char0000", "org.bluez.GattCharacteristic1", char0000_list[i]);
-		g_variant_builder_add(builder_if, "{&sv}", char0000_list[i], v_property);
+	if(err) {
+		g_dbus_method_invocation_return_dbus_error(invoc, err, "prepare write rejected");
+	} else {
+		g_dbus_method_invocation_return_value(invoc, NULL);
 	}
-	
-	v = g_variant_builder_end(builder_if);
-	g_variant_builder_unref(builder_if);
-	
-	builder_obj = g_variant_builder_new(G_VARIANT_TYPE("a{sa{sv}}"));
-	
-	g_variant_builder_add(builder_obj, "{&s@a{sv}}", "org.bluez.GattCharacteristic1", v);
-	
-	v = g_variant_builder_end(builder_obj);
-	g_variant_builder_unref(builder_obj);
-	
-	g_variant_builder_add(builder_mobjs, "{&o@a{sa{sv}}}", UART_OBJECT_PATH"/service00/char0000", v);
+}
 
-	/*
-	 * 构建/org/uart/server/service00/char0001的接口和属性
-	 */
-	builder_if = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
 
-	const char *char0001_list[] = {"UUID", "Service", "Value", "Notifying", "Flags"};
+static void gatt_rx_acquire_write(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
+{
+	struct char_t *chr = attr->data;
 
-	for(i = 0; i < sizeof(char0001_list)/sizeof(const char *); i++) {
-		v_property = get_property_variant(UART_OBJECT_PATH"/service00/char0001", "org.bluez.GattCharacteristic1", char0001_list[i]);
-		g_variant_builder_add(builder_if, "{&sv}", char0001_list[i], v_property);
+	if(!gatt_char_acquire_fd(chr, params, invoc, G_IO_IN | G_IO_HUP | G_IO_ERR, uart_rx_fd_callback)) {
+		chr->WriteAcquired = 1;
+		gatt_attr_invalidate(attr);
 	}
-	
-	v = g_variant_builder_end(builder_if);
-	g_variant_builder_unref(builder_if);
-	
-	builder_obj = g_variant_builder_new(G_VARIANT_TYPE("a{sa{sv}}"));
-	
-	g_variant_builder_add(builder_obj, "{&s@a{sv}}", "org.bluez.GattCharacteristic1", v);
-	
-	v = g_variant_builder_end(builder_obj);
-	g_variant_builder_unref(builder_obj);
-	
-	g_variant_builder_add(builder_mobjs, "{&o@a{sa{sv}}}", UART_OBJECT_PATH"/service00/char0001", v);
-	
+}
+
+
+static void gatt_tx_start_notify(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
+{
+	struct server_t *srv = attr->server;
+	struct char_t *chr = attr->data;
+	GVariant *options;
+	const gchar *device = NULL;
+
 	/*
-	 * 构建GetManagedObjects返回值类型
+	 * bluez 5.54的StartNotify没有参数, 以后的版本如果带了options也从中得到MTU
 	 */
-	v = g_variant_builder_end(builder_mobjs);
-	g_variant_builder_unref(builder_mobjs);
+	if(g_variant_is_of_type(params, G_VARIANT_TYPE("(a{sv})"))) {
+		g_variant_get(params, "(@a{sv})", &options);
+		g_variant_lookup(options, "device", "&o", &device);
+		gatt_learn_mtu(srv, options, device);
+		g_variant_unref(options);
+	}
 
-	GVariant *tuples[] = {v};
-	
-	return g_variant_new_tuple(tuples, 1);
+	if(device) {
+		g_hash_table_add(srv->ind_devices, g_strdup(device));
+	}
+
+	chr->Notifying = 1;
+	gatt_ind_reset(srv);
+	gatt_attr_invalidate(attr);
+	stats_inc(STATS_START_NOTIFY);
+	u_tm_log("Start tx_char.Notifying = %d\n", chr->Notifying);
+	if(srv->notify_cb_func) {
+		srv->notify_cb_func(NULL, 1, srv->user_data);
+	}
+	g_dbus_method_invocation_return_value(invoc, NULL);
 }
 
-static void uart_rx_callback(GVariant *params)
+
+static void gatt_tx_stop_notify(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
 {
-#ifdef __DEBUG__
-	u_tm_log("params type: \"%s\"\n", g_variant_get_type_string(params));
-#endif
+	struct server_t *srv = attr->server;
+	struct char_t *chr = attr->data;
+
+	chr->Notifying = 0;
+	gatt_attr_invalidate(attr);
+	stats_inc(STATS_STOP_NOTIFY);
+	u_tm_log("Stop tx_char.Notifying = %d\n", chr->Notifying);
 
 	/*
-	 * params type: "(aya{sv})"
+	 * 最后一个设备关闭之后bluez才调用StopNotify
 	 */
+	g_hash_table_remove_all(srv->ind_devices);
+	gatt_ind_reset(srv);
+	if(srv->notify_cb_func) {
+		srv->notify_cb_func(NULL, 0, srv->user_data);
+	}
+	g_dbus_method_invocation_return_value(invoc, NULL);
+}
 
-	GVariant *value, *flags;
-	g_variant_get(params, "(@ay@a{sv})", &value, &flags);
-	u_tm_log("value type: \"%s\"\n", g_variant_get_type_string(value));
-	u_tm_log("flags type: \"%s\"\n", g_variant_get_type_string(flags));
-	
-	GVariantIter *iter = g_variant_iter_new(value);
 
-	/*
-	 * 提取数据
-	 */
-	server_ctx.gatt.rx_char.len = 0;
-	uint8_t *pdata = server_ctx.gatt.rx_char.Value;
-	
-	while(g_variant_iter_next(iter, "y", (pdata + server_ctx.gatt.rx_char.len)))
-	{
-		server_ctx.gatt.rx_char.len++;
+/*
+ * 客户端确认了一个indication, 没有回复
+ * bluez对每个确认的设备调用一次, 而且不带设备, Confirm记到最早的还没有收齐的indication上,
+ * 收到ind_subscribers个之后这个indication才算送达, 空出窗口.
+ * 每个设备按顺序确认, 所以没有收齐的Confirm的总数总是对的.
+ * 没有等待确认的indication时收到的Confirm是超时之后才到的, 丢弃
+ */
+static void gatt_tx_confirm(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
+{
+	struct server_t *srv = attr->server;
+
+	g_dbus_method_invocation_return_value(invoc, NULL);
+
+	stats_inc(STATS_IND_CONFIRMED);
+
+	if(!srv->ind_inflight) {
+		return;
 	}
-	g_variant_iter_free(iter);
-	
-#ifdef __DEBUG__
-	u_tm_log("uart_rx_callback len: %d\n", server_ctx.gatt.rx_char.len);
-	u_tm_log_hex("uart_rx_callback value: ", server_ctx.gatt.rx_char.Value, server_ctx.gatt.rx_char.len);
-#endif
+
+	if(++srv->ind[srv->ind_head].confirms < srv->ind_subscribers) {
+		return;
+	}
+
+	stats_hist_add(STATS_HIST_CONFIRM_LATENCY, (stats_now() - srv->ind[srv->ind_head].sent) / 1000);
+	gatt_ind_release(srv);
+}
+
+
+static void gatt_tx_acquire_notify(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
+{
+	struct server_t *srv = attr->server;
+	struct char_t *chr = attr->data;
+
+	if(!gatt_char_acquire_fd(chr, params, invoc, G_IO_HUP | G_IO_ERR, uart_tx_fd_callback)) {
+		chr->NotifyAcquired = 1;
+		chr->Notifying = 1;
+		gatt_attr_invalidate(attr);
+		stats_inc(STATS_START_NOTIFY);
+		if(srv->notify_cb_func) {
+			srv->notify_cb_func(chr->device, 1, srv->user_data);
+		}
+	}
+}
+
+
+/*
+ * 控制特性的写入
+ * GATT_FC_OP_CREDIT: 客户端给的发送信用
+ * GATT_CTRL_OP_COMPRESS: 打开或者关闭压缩
+ */
+static void gatt_ctrl_write_value(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
+{
+	struct server_t *srv = attr->server;
+	GVariant *value, *options;
+	const uint8_t *data;
+	const gchar *device = NULL;
+	gsize len;
+	int n;
+
+	g_variant_get(params, "(@ay@a{sv})", &value, &options);
+	data = g_variant_get_fixed_array(value, &len, sizeof(uint8_t));
+	g_variant_lookup(options, "device", "&o", &device);
+	gatt_peer_seen(srv, device);
+
+	if(srv->fc_enabled && len >= GATT_FC_MSG_LEN && data[0] == GATT_FC_OP_CREDIT) {
+		n = data[1] | (data[2] << 8);
+		srv->tx_credits += n;
+		stats_add(STATS_FC_CREDITS_RECEIVED, n);
+		if(srv->tx_credits > 0) {
+			gatt_fc_tx_resume(srv);
+		}
+	} else if(len >= GATT_CTRL_COMPRESS_LEN && data[0] == GATT_CTRL_OP_COMPRESS) {
+		gatt_compress_set(srv, !!data[1], device);
+	}
+
+	g_variant_unref(value);
+	g_variant_unref(options);
+	g_dbus_method_invocation_return_value(invoc, NULL);
+}
+
+
+/*
+ * 客户端打开控制特性的通知时启用流控, 发送信用从0开始, 等待客户端给信用
+ */
+static void gatt_ctrl_start_notify(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
+{
+	struct server_t *srv = attr->server;
+	struct char_t *chr = attr->data;
+
+	chr->Notifying = 1;
+	gatt_attr_invalidate(attr);
+	g_dbus_method_invocation_return_value(invoc, NULL);
+
+	srv->fc_enabled = 1;
+	srv->tx_credits = 0;
+	srv->rx_credits = 0;
+	srv->rx_consumed = 0;
+	srv->stall_start = 0;
+	u_tm_log("%s flow control enabled\n", srv->adapter);
 
 	/*
-	 * 将数据提供给回调函数
+	 * 回复StartNotify之后再通知, bluez已经打开了通知
 	 */
-	if(server_ctx.gatt.rx_char.len && server_ctx.receive_cb_func) {
-		server_ctx.receive_cb_func(server_ctx.gatt.rx_char.Value, server_ctx.gatt.rx_char.len);
+	gatt_fc_grant(srv, GATT_FC_WINDOW);
+}
+
+
+/*
+ * 关闭流控和压缩, 停止的发送队列继续发送
+ */
+static void gatt_ctrl_stop_notify(struct gatt_attr_t *attr, GVariant *params, GDBusMethodInvocation *invoc)
+{
+	struct server_t *srv = attr->server;
+	struct char_t *chr = attr->data;
+
+	chr->Notifying = 0;
+	gatt_attr_invalidate(attr);
+	g_dbus_method_invocation_return_value(invoc, NULL);
+
+	if(srv->compressing) {
+		gatt_compress_set(srv, 0, NULL);
+	}
+
+	if(srv->fc_enabled) {
+		srv->fc_enabled = 0;
+		u_tm_log("%s flow control disabled\n", srv->adapter);
+		gatt_fc_tx_resume(srv);
 	}
 }
 
 
+/*
+ * 对象的类型
+ * bluez只有在特性存在WriteAcquired属性时才会调用AcquireWrite,
+ * 存在NotifyAcquired属性时才会调用AcquireNotify
+ */
+static struct gatt_class_t app_class = {
+	.type = GATT_ATTR_APP,
+	.iface = "org.freedesktop.DBus.ObjectManager",
+	.xml = object_manager_xml,
+	.methods = (const struct gatt_method_t []) {
+		{"GetManagedObjects", gatt_app_get_managed_objects},
+		{NULL},
+	},
+};
+
+static struct gatt_class_t service_class = {
+	.type = GATT_ATTR_SERVICE,
+	.iface = "org.bluez.GattService1",
+	.xml = service_xml,
+	.props = (const struct gatt_prop_t []) {
+		{"UUID", gatt_service_uuid},
+		{"Primary", gatt_service_primary},
+		{NULL},
+	},
+};
+
+static struct gatt_class_t rx_char_class = {
+	.type = GATT_ATTR_CHAR,
+	.iface = "org.bluez.GattCharacteristic1",
+	.xml = char_xml,
+	.props = (const struct gatt_prop_t []) {
+		{"UUID", gatt_char_uuid},
+		{"Service", gatt_char_service},
+		{"Value", gatt_char_value},
+		{"Notifying", gatt_char_notifying},
+		{"Flags", gatt_char_flags},
+		{"WriteAcquired", gatt_char_write_acquired},
+		{NULL},
+	},
+	.methods = (const struct gatt_method_t []) {
+		{"WriteValue", gatt_rx_write_value},
+		{"AcquireWrite", gatt_rx_acquire_write},
+		{NULL},
+	},
+};
+
+static struct gatt_class_t tx_char_class = {
+	.type = GATT_ATTR_CHAR,
+	.iface = "org.bluez.GattCharacteristic1",
+	.xml = char_xml,
+	.props = (const struct gatt_prop_t []) {
+		{"UUID", gatt_char_uuid},
+		{"Service", gatt_char_service},
+		{"Value", gatt_char_value},
+		{"Notifying", gatt_char_notifying},
+		{"Flags", gatt_char_flags},
+		{"NotifyAcquired", gatt_char_notify_acquired},
+		{NULL},
+	},
+	.methods = (const struct gatt_method_t []) {
+		{"StartNotify", gatt_tx_start_notify},
+		{"StopNotify", gatt_tx_stop_notify},
+		{"AcquireNotify", gatt_tx_acquire_notify},
+		{"Confirm", gatt_tx_confirm},
+		{NULL},
+	},
+};
+
+static struct gatt_class_t ctrl_char_class = {
+	.type = GATT_ATTR_CHAR,
+	.iface = "org.bluez.GattCharacteristic1",
+	.xml = char_xml,
+	.props = (const struct gatt_prop_t []) {
+		{"UUID", gatt_char_uuid},
+		{"Service", gatt_char_service},
+		{"Value", gatt_char_value},
+		{"Notifying", gatt_char_notifying},
+		{"Flags", gatt_char_flags},
+		{NULL},
+	},
+	.methods = (const struct gatt_method_t []) {
+		{"WriteValue", gatt_ctrl_write_value},
+		{"StartNotify", gatt_ctrl_start_notify},
+		{"StopNotify", gatt_ctrl_stop_notify},
+		{NULL},
+	},
+};
+
+static struct gatt_class_t *gatt_classes[] = {
+	&app_class, &service_class, &rx_char_class, &tx_char_class, &ctrl_char_class,
+};
+
+
+/*
+ * 属性表, 增加服务和特性只需要在这里增加一项
+ */
+static const struct gatt_attr_desc_t uart_attr_table[UART_ATTR_COUNT] = {
+	[UART_ATTR_APP] = {NULL, -1, &app_class, 0},
+	[UART_ATTR_SERVICE] = {"service00", UART_ATTR_APP, &service_class, offsetof(struct server_t, gatt.service)},
+	[UART_ATTR_RX] = {"char0000", UART_ATTR_SERVICE, &rx_char_class, offsetof(struct server_t, gatt.rx_char)},
+	[UART_ATTR_TX] = {"char0001", UART_ATTR_SERVICE, &tx_char_class, offsetof(struct server_t, gatt.tx_char)},
+	[UART_ATTR_CTRL] = {"char0002", UART_ATTR_SERVICE, &ctrl_char_class, offsetof(struct server_t, gatt.ctrl_char)},
+};
+
+
+/*
+ * 所有对象共用的method_call, udata为struct gatt_attr_t
+ */
 static void 
 on_method_call(GDBusConnection *con,
                        const gchar *sender,
@@ -541,29 +2158,22 @@ on_method_call(GDBusConnection *con,
                        GDBusMethodInvocation *invoc,
                        gpointer udata)
 {
+	struct gatt_attr_t *attr = udata;
+	const struct gatt_method_t *method;
+
 #ifdef __DEBUG__
 	u_tm_log("[%s:%d] object_path :%s\n", __FUNCTION__, __LINE__, obj_path);
 	u_tm_log("[%s:%d] iface_name :%s\n", __FUNCTION__, __LINE__, iface_name);
 	u_tm_log("[%s:%d] method_name :%s\n", __FUNCTION__, __LINE__, method_name);
 #endif
 
-	if(!strcmp(obj_path, UART_OBJECT_PATH)) {
-		if(!strcmp(method_name, "GetManagedObjects")) {
-			g_dbus_method_invocation_return_value(invoc, gatt_create_managed_objects());
-		}
-	} else if(!strcmp(obj_path, UART_OBJECT_PATH"/service00/char0000")) {/* Rx */
-		if(!strcmp(method_name, "WriteValue")) {
-			uart_rx_callback(params);
-		}
-	} else if(!strcmp(obj_path, UART_OBJECT_PATH"/service00/char0001")) {/* Tx */
-		if(!strcmp(method_name, "StartNotify")) {
-			server_ctx.gatt.tx_char.Notifying = 1;
-			u_tm_log("Start server_ctx.gatt.tx_char.Notifying = %d\n", server_ctx.gatt.tx_char.Notifying);
-		} else if(!strcmp(method_name, "StopNotify")) {
-			server_ctx.gatt.tx_char.Notifying = 0;
-			u_tm_log("Stop server_ctx.gatt.tx_char.Notifying = %d\n", server_ctx.gatt.tx_char.Notifying);
-		}
-	} 
+	method = gatt_class_method(attr->cls, method_name);
+	if(!method) {
+		g_dbus_method_invocation_return_dbus_error(invoc, "org.bluez.Error.NotSupported", method_name);
+		return;
+	}
+
+	method->call(attr, params, invoc);
 }
 
 /*
@@ -580,6 +2190,10 @@ get_property(GDBusConnection *connection,
 					GError **error,
 					gpointer user_data)
 {
+	struct gatt_attr_t *attr = user_data;
+	const struct gatt_prop_t *prop;
+	GVariant *v;
+
 #ifdef __DEBUG__
 	u_tm_log("[%s:%d] sender :%s\n", __FUNCTION__, __LINE__, sender);
 	u_tm_log("[%s:%d] object_path :%s\n", __FUNCTION__, __LINE__, object_path);
@@ -587,92 +2201,51 @@ get_property(GDBusConnection *connection,
 	u_tm_log("[%s:%d] property_name :%s\n", __FUNCTION__, __LINE__, property_name);
 #endif
 
-	GVariant *v = get_property_variant(object_path, 
-										interface_name, 
-										property_name);
+	prop = gatt_class_prop(attr->cls, property_name);
+	v = prop ? prop->get(attr) : NULL;
+	if(!v) {
+		g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY, "No such property '%s'", property_name);
+		return NULL;
+	}
 
 	return v;
 }
 
 
-
-
-static int gatt_object_register(GDBusConnection *conn)
+/*
+ * 按照属性表注册所有对象, 每个对象的user_data是自己的struct gatt_attr_t
+ */
+static int gatt_object_register(struct server_t *srv)
 {
+	GDBusConnection *conn = srv->conn;
 	GError *error = NULL;
 	GDBusInterfaceVTable interface_vtable;
+	struct gatt_attr_t *attr;
+	int i;
 
 	/*
 	 * 这些回调函数的执行是依赖于g_main_loop的
 	 */
-	interface_vtable.method_call = on_method_call;
-	interface_vtable.get_property = NULL; /*ObjectManager 不存在属性*/
-	interface_vtable.set_property = NULL;
-
-  
-	server_ctx.object_manager_reg_id = 
-		g_dbus_connection_register_object(conn,
-                                   		UART_OBJECT_PATH,
-                                   		server_ctx.object_manager_node_info->interfaces[0],/*org.freedesktop.DBus.ObjectManager*/
-                                   		&interface_vtable,
-                                   		NULL,
-                                   		NULL,
-                                   		&error);
-	if(error) {
-		u_tm_log("<org.freedesktop.DBus.ObjectManager> interface info register Error\n");
-		u_tm_log("%s\n", error->message);
-		g_error_free (error);
-		return -1;
-	}
-
-
 	interface_vtable.method_call = on_method_call;
 	interface_vtable.get_property = get_property;
 	interface_vtable.set_property = NULL;
-	
-	server_ctx.service_reg_id = 
-		g_dbus_connection_register_object(conn,
-                                   		UART_OBJECT_PATH"/service00",
-                                   		server_ctx.service_node_info->interfaces[0],/*org.bluez.GattService1*/
-                                   		&interface_vtable,
-                                   		NULL,
-                                   		NULL,
-                                   		&error);
-	if(error) {
-		u_tm_log("<org.bluez.GattService1> interface info register Error\n");
-		u_tm_log("%s\n", error->message);
-		g_error_free (error);
-		return -1;
-	}
-
-	server_ctx.rx_char_reg_id = 
-		g_dbus_connection_register_object(conn,
-                                   		UART_OBJECT_PATH"/service00/char0000",
-                                   		server_ctx.char_node_info->interfaces[0],/*org.bluez.GattCharacteristic1*/
-                                   		&interface_vtable,
-                                   		NULL,
-                                   		NULL,
-                                   		&error);
-	if(error) {
-		u_tm_log("<RX org.bluez.GattCharacteristic1> interface info register Error\n");
-		u_tm_log("%s\n", error->message);
-		g_error_free (error);
-		return -1;
-	}
 
-	server_ctx.tx_char_reg_id = 
-		g_dbus_connection_register_object(conn,
-                                   		UART_OBJECT_PATH"/service00/char0001",
-                                   		server_ctx.char_node_info->interfaces[0],/*org.bluez.GattCharacteristic1*/
-                                   		&interface_vtable,
-                                   		NULL,
-                                   		NULL,
-                                   		&error);
-	if(error) {
-		u_tm_log("<TX org.bluez.GattCharacteristic1> interface info register Error\n");
-		u_tm_log("%s\n", error->message);
-		g_error_free (error);
-		return -1;
+	for(i = 0; i < UART_ATTR_COUNT; i++) {
+		attr = &srv->attrs[i];
+		attr->reg_id = 
+			g_dbus_connection_register_object(conn,
+	                                   		attr->path,
+	                                   		attr->cls->node_info->interfaces[0],
+	                                   		&interface_vtable,
+	                                   		attr,
+	                                   		NULL,
+	                                   		&error);
+		if(error) {
+			u_tm_log("<%s> %s interface info register Error\n", attr->cls->iface, attr->path);
+			u_tm_log("%s\n", error->message);
+			g_error_free (error);
+			return -1;
+		}
 	}
 	
 	u_tm_log("[%s:%d] %s\n", __FUNCTION__, __LINE__, "gatt object register ok");
@@ -680,35 +2253,30 @@ static int gatt_object_register(GDBusConnection *conn)
 	return 0;
 }
 
-static void async_ready_callback(GObject *source_object,
-                        GAsyncResult *res,
-                        gpointer user_data)
+/*
+ * 重试已经用完时error不为NULL, server释放(取消)后不会调用
+ */
+static void uart_register_application_ready(GVariant *reply, const GError *error, void *user_data)
 {
-	
-	GDBusConnection *conn = (GDBusConnection *)user_data;
-	GError *error = NULL;
-	
-	g_dbus_connection_call_finish (conn,
-                               res,
-                               &error);
+	struct server_t *srv = user_data;
 
-   if(error) {
-	   u_tm_log("Error: RegisterApplication %s\n", error->message);
-	   g_error_free (error);
-   		return;
-   }
+	if(!error) {
+		u_tm_log("%s RegisterApplication ok\n", srv->adapter);
+	}
 
-   u_tm_log("async_ready_callback: uart_register_application ok \n");
+	if(srv->registered_cb) {
+		srv->registered_cb(srv, !error, srv->registered_data);
+	}
 }
 
 
 
-static void uart_register_application_async(GDBusConnection *conn)
+static void uart_register_application_async(struct server_t *srv)
 {
 	GVariant *parameters;
 	
 
-	GVariant *vobject_path = g_variant_new("o", UART_OBJECT_PATH);
+	GVariant *vobject_path = g_variant_new("o", srv->attrs[UART_ATTR_APP].path);
 
 	GVariantBuilder *dict_builder = g_variant_builder_new(G_VARIANT_TYPE("a{sv}"));
 	GVariant *dict_v = g_variant_builder_end(dict_builder);
@@ -717,31 +2285,165 @@ static void uart_register_application_async(GDBusConnection *conn)
 	GVariant *children[] = {vobject_path, dict_v};
 	parameters = g_variant_new_tuple(children, 2);
 
-	g_dbus_connection_call (conn,
-							"org.bluez",
-							"/org/bluez/hci1",
-							"org.bluez.GattManager1",
-							"RegisterApplication",
-							parameters,
-							NULL,
-							G_DBUS_CALL_FLAGS_NONE,
-							-1,
-							NULL,
-							async_ready_callback,
-							conn);	
+	bluez_call_async(srv->conn, srv->adapter, "org.bluez.GattManager1", "RegisterApplication",
+					parameters, srv->cancellable, uart_register_application_ready, srv);
 }
 
 
-int gatt_uart_server_start(GDBusConnection *conn)
+static void gatt_create_const_variant(void)
 {
-	gatt_create_node_info();
-	gatt_object_register(conn);
-	uart_register_application_async(conn);
-	server_ctx.conn = conn;
-	return 0;
+	if(char_iface_name) {
+		return;
+	}
+
+	char_iface_name = g_variant_ref_sink(g_variant_new_string("org.bluez.GattCharacteristic1"));
+	value_name = g_variant_ref_sink(g_variant_new_string("Value"));
+	empty_string_array = g_variant_ref_sink(g_variant_new_array(G_VARIANT_TYPE_STRING, NULL, 0));
+}
+
+
+/*
+ * 在adapter上创建一个gatt server, adapter为object path, 例如/org/bluez/hci0
+ * 只注册本地对象, 之后调用gatt_uart_server_register向bluez注册application
+ * 回调都在dbus线程中调用, user_data原样传给回调
+ */
+struct server_t *gatt_uart_server_new(GDBusConnection *conn,
+									const char *adapter,
+									gatt_receive_t receive_cb,
+									gatt_notify_t notify_cb,
+									void *user_data)
+{
+	struct server_t *srv;
+	struct gatt_attr_t *attr;
+	const char *name;
+	int i;
+
+	gatt_create_const_variant();
+	for(i = 0; i < G_N_ELEMENTS(gatt_classes); i++) {
+		if(gatt_class_init(gatt_classes[i]) < 0) {
+			return NULL;
+		}
+	}
+
+	name = strrchr(adapter, '/');
+	name = name ? name + 1 : adapter;
+
+	srv = g_new(struct server_t, 1);
+	*srv = server_template;
+	srv->gatt.rx_char.server = srv;
+	srv->gatt.tx_char.server = srv;
+	srv->gatt.ctrl_char.server = srv;
+	srv->gatt.rx_char.attr = &srv->attrs[UART_ATTR_RX];
+	srv->gatt.tx_char.attr = &srv->attrs[UART_ATTR_TX];
+	srv->gatt.ctrl_char.attr = &srv->attrs[UART_ATTR_CTRL];
+
+	srv->conn = conn;
+	srv->adapter = g_strdup(adapter);
+
+	/*
+	 * 属性表中parent总是在前面, 按顺序生成路径
+	 */
+	for(i = 0; i < UART_ATTR_COUNT; i++) {
+		attr = &srv->attrs[i];
+		attr->desc = &uart_attr_table[i];
+		attr->cls = attr->desc->cls;
+		attr->server = srv;
+		attr->data = (uint8_t *)srv + attr->desc->offset;
+
+		if(attr->desc->parent < 0) {
+			attr->path = g_strdup_printf(UART_OBJECT_PATH"/%s", name);
+		} else {
+			attr->parent = &srv->attrs[attr->desc->parent];
+			attr->path = g_strdup_printf("%s/%s", attr->parent->path, attr->desc->name);
+		}
+	}
+
+	srv->receive_cb_func = receive_cb;
+	srv->notify_cb_func = notify_cb;
+	srv->user_data = user_data;
+
+	srv->cancellable = g_cancellable_new();
+	srv->ind_subscribers = 1;
+	srv->ind_devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	srv->prep = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, gatt_prep_free);
+	srv->peers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	srv->peer_signal_id =
+		g_dbus_connection_signal_subscribe(conn,
+										"org.bluez",
+										"org.freedesktop.DBus.Properties",
+										"PropertiesChanged",
+										NULL,
+										"org.bluez.Device1",
+										G_DBUS_SIGNAL_FLAGS_NONE,
+										gatt_device_changed,
+										srv,
+										NULL);
+
+	gatt_object_register(srv);
+
+	return srv;
+}
+
+
+/*
+ * 向bluez注册application, 结果交给cb, adapter需要已经打开
+ */
+void gatt_uart_server_register(struct server_t *srv, gatt_registered_t cb, void *user_data)
+{
+	srv->registered_cb = cb;
+	srv->registered_data = user_data;
+
+	uart_register_application_async(srv);
 }
 
 
+/*
+ * adapter被移除时调用, bluez那边的application已经随adapter一起消失, 这里只注销本地对象
+ */
+void gatt_uart_server_free(struct server_t *srv)
+{
+	int i;
+
+	if(!srv) {
+		return;
+	}
 
+	srv->notify_cb_func = NULL;
+	srv->credit_cb_func = NULL;
+	srv->payload_cb_func = NULL;
+	if(srv->ind_timer_id) {
+		g_source_remove(srv->ind_timer_id);
+	}
+	g_dbus_connection_signal_unsubscribe(srv->conn, srv->peer_signal_id);
+	g_cancellable_cancel(srv->cancellable);
+	g_object_unref(srv->cancellable);
+	gatt_char_release_fd(&srv->gatt.rx_char);
+	gatt_char_release_fd(&srv->gatt.tx_char);
+	g_hash_table_destroy(srv->prep);
+	g_hash_table_destroy(srv->peers);
+	g_hash_table_destroy(srv->ind_devices);
+
+	for(i = UART_ATTR_COUNT - 1; i >= 0; i--) {
+		if(srv->attrs[i].reg_id) {
+			g_dbus_connection_unregister_object(srv->conn, srv->attrs[i].reg_id);
+		}
+		gatt_attr_invalidate(&srv->attrs[i]);
+		g_free(srv->attrs[i].path);
+	}
 
+	if(srv->gatt.tx_char.value) {
+		g_variant_unref(srv->gatt.tx_char.value);
+	}
+	if(srv->gatt.ctrl_char.value) {
+		g_variant_unref(srv->gatt.ctrl_char.value);
+	}
+	compress_end(&srv->compress);
+	if(srv->rx_buf) {
+		g_bytes_unref(srv->rx_buf);
+	}
 
+	g_free(srv->compress_device);
+	g_free(srv->mtu_device);
+	g_free(srv->adapter);
+	g_free(srv);
+}
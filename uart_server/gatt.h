@@ -8,11 +8,100 @@
 #include <stdint.h>
 #include <gio/gio.h>
 
+/*
+ * buf只在回调期间有效, 需要保留数据时在回调中调用uart_server_rx_hold()
+ */
 typedef void (*uart_receive_t)(uint8_t *buf, int len);
 
-int gatt_uart_server_start(GDBusConnection *conn);
-void gatt_uart_register_receive_cb(uart_receive_t receive_cb);
-void gatt_uart_send(uint8_t *buf, int len);
+/*
+ * gatt server的接收回调, user_data为gatt_uart_server_new的user_data
+ */
+typedef void (*gatt_receive_t)(uint8_t *buf, int len, void *user_data);
+
+/*
+ * 通知状态变化, device为NULL表示StartNotify/StopNotify(bluez没有告诉是哪个设备)
+ */
+typedef void (*gatt_notify_t)(const char *device, int notifying, void *user_data);
+
+/*
+ * 每个adapter一个gatt server
+ */
+struct server_t;
+
+/*
+ * 从bluez调用的"mtu"选项得到设备的ATT_MTU, device为NULL表示不知道是哪个设备
+ * 同一个设备的MTU没有变化时不重复调用
+ */
+typedef void (*gatt_mtu_t)(const char *device, int mtu, void *user_data);
+
+/*
+ * 控制特性(6e400004)收发的消息
+ *
+ * {GATT_FC_OP_CREDIT, n & 0xff, n >> 8}: 流控, 给对方n个包的信用
+ * 客户端打开控制特性的通知时启用流控, 服务端先给客户端GATT_FC_WINDOW个接收信用,
+ * 客户端写入信用之后服务端才发送, 每个通知用掉一个信用, 客户端每次写入用掉一个服务端给的信用
+ *
+ * {GATT_CTRL_OP_COMPRESS, on}: 客户端请求打开(1)或者关闭(0)发送数据的压缩(格式见compress.h),
+ * 服务端通过控制特性回复同样格式的消息, on为实际的结果, 回复之后的通知按照新的设置发送.
+ * 关闭控制特性的通知时关闭压缩
+ */
+#define GATT_FC_OP_CREDIT	0x01
+#define GATT_FC_MSG_LEN		3
+
+#define GATT_CTRL_OP_COMPRESS	0x02
+#define GATT_CTRL_COMPRESS_LEN	2
+
+/*
+ * 给客户端的接收窗口(包数), 收到一半后补充
+ */
+#define GATT_FC_WINDOW		32
+
+/*
+ * 收到发送信用, 关闭了流控或者indication被确认, credits为gatt_uart_tx_credits的返回值
+ */
+typedef void (*gatt_credit_t)(int credits, void *user_data);
+
+/*
+ * 发送的分片大小可能变化: AcquireNotify/AcquireWrite得到或者释放了MTU, 打开或者关闭了压缩
+ */
+typedef void (*gatt_payload_t)(void *user_data);
+
+/*
+ * ok: RegisterApplication成功
+ */
+typedef void (*gatt_registered_t)(struct server_t *srv, int ok, void *user_data);
+
+/*
+ * 发送统计, variant_allocs / notify_signal 应该恒等于每次通知分配的GVariant个数
+ */
+struct gatt_tx_stats_t {
+	uint64_t notify_signal;		/* 通过PropertiesChanged信号发送的通知 */
+	uint64_t notify_socket;		/* 通过AcquireNotify socket发送的通知 */
+	uint64_t variant_allocs;	/* 发送路径上创建的GVariant个数 */
+};
+
+struct server_t *gatt_uart_server_new(GDBusConnection *conn,
+									const char *adapter,
+									gatt_receive_t receive_cb,
+									gatt_notify_t notify_cb,
+									void *user_data);
+void gatt_uart_server_register(struct server_t *srv, gatt_registered_t cb, void *user_data);
+void gatt_uart_server_free(struct server_t *srv);
+GBytes *gatt_uart_rx_hold(struct server_t *srv);
+const char *gatt_uart_rx_device(struct server_t *srv);
+int gatt_uart_send(struct server_t *srv, uint8_t *buf, int len);
+int gatt_uart_is_notifying(struct server_t *srv);
+int gatt_uart_payload_size(struct server_t *srv);
+int gatt_mtu_payload_size(int mtu);
+void gatt_uart_set_mtu_cb(struct server_t *srv, gatt_mtu_t cb);
+void gatt_uart_get_tx_stats(struct server_t *srv, struct gatt_tx_stats_t *stats);
+int gatt_uart_tx_credits(struct server_t *srv);
+void gatt_uart_tx_stall(struct server_t *srv);
+void gatt_uart_set_credit_cb(struct server_t *srv, gatt_credit_t cb);
+int gatt_uart_tx_overhead(struct server_t *srv);
+void gatt_uart_set_payload_cb(struct server_t *srv, gatt_payload_t cb);
+void *gatt_uart_user_data(struct server_t *srv);
+void gatt_uart_set_indicate(struct server_t *srv, int on);
 
 
 #endif
@@ -1,56 +1,703 @@
+/*
+ * HCI命令引擎
+ *
+ * 1.每个adapter一直打开一个HCI raw socket, 不再每次命令都打开关闭.
+ * 2.命令先放入等待队列, 控制器允许的个数(Num_HCI_Command_Packets)内直接发送,
+ *   发送后放入在途队列, 按opcode匹配Command Complete/Command Status,
+ *   回调中可以检查status, 超过HCI_CMD_TIMEOUT_MS没有回复时以HCI_STATUS_TIMEOUT回调.
+ * 3.提供影响吞吐的LE命令: 广播参数, Data Length Extension, 2M PHY, 连接参数更新.
+ *
+ * raw socket会收到其他程序(例如bluetoothd)发送的命令的回复,
+ * 只有在途队列中有相同opcode的命令时才会被当成自己的回复.
+ */
+
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <bluetooth/bluetooth.h>
-#include <bluetooth/hci.h>
-#include <bluetooth/hci_lib.h>
+
+#include "hci.h"
 #include "log.h"
 
+/*
+ * 和内核的struct sockaddr_hci, struct hci_filter一样
+ */
+struct hci_sockaddr_t {
+	sa_family_t hci_family;
+	unsigned short hci_dev;
+	unsigned short hci_channel;
+};
+
+struct hci_filter_t {
+	uint32_t type_mask;
+	uint32_t event_mask[2];
+	uint16_t opcode;
+};
+
+#define HCI_CHANNEL_RAW		0
+#define HCI_SOCK_FILTER		2
+
+#define HCI_CMD_HDR_SIZE	4
+#define HCI_EVENT_HDR_SIZE	3
+#define HCI_MAX_PARAM_SIZE	255
+
+struct hci_cmd_t {
+	struct hci_cmd_t *next;
+	uint16_t opcode;
+	int len;
+	gint64 sent_at;
+	hci_cmd_cb_t cb;
+	void *user_data;
+	uint8_t pkt[HCI_CMD_HDR_SIZE + HCI_MAX_PARAM_SIZE];
+};
+
+/*
+ * 单向链表实现的FIFO
+ */
+struct hci_cmd_list_t {
+	struct hci_cmd_t *head;
+	struct hci_cmd_t *tail;
+	int count;
+};
+
+struct hci_engine_t {
+	int fd;
+	guint watch_id;
+	guint timer_id;
+	int attached;
+	/*
+	 * 控制器还能接收的命令个数
+	 */
+	int credits;
+	struct hci_cmd_list_t pending;
+	struct hci_cmd_list_t inflight;
+	hci_event_cb_t event_cb;
+	void *event_data;
+	uint8_t buf[1 + HCI_EVENT_HDR_SIZE + HCI_MAX_PARAM_SIZE];
+};
+
+
+static inline void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+
+static void hci_list_push(struct hci_cmd_list_t *list, struct hci_cmd_t *cmd)
+{
+	cmd->next = NULL;
+	if(list->tail) {
+		list->tail->next = cmd;
+	} else {
+		list->head = cmd;
+	}
+	list->tail = cmd;
+	list->count++;
+}
+
+
+static struct hci_cmd_t *hci_list_pop(struct hci_cmd_list_t *list)
+{
+	struct hci_cmd_t *cmd = list->head;
+
+	if(cmd) {
+		list->head = cmd->next;
+		if(!list->head) {
+			list->tail = NULL;
+		}
+		list->count--;
+	}
+
+	return cmd;
+}
+
+
+/*
+ * 取出第一个opcode相同的命令
+ */
+static struct hci_cmd_t *hci_list_remove(struct hci_cmd_list_t *list, uint16_t opcode)
+{
+	struct hci_cmd_t *cmd, *prev = NULL;
+
+	for(cmd = list->head; cmd; prev = cmd, cmd = cmd->next) {
+		if(cmd->opcode != opcode) {
+			continue;
+		}
+
+		if(prev) {
+			prev->next = cmd->next;
+		} else {
+			list->head = cmd->next;
+		}
+		if(list->tail == cmd) {
+			list->tail = prev;
+		}
+		list->count--;
+
+		return cmd;
+	}
+
+	return NULL;
+}
+
+
+static void hci_cmd_complete(struct hci_cmd_t *cmd, uint8_t status, const uint8_t *rparam, int rlen)
+{
+	if(status) {
+		u_tm_log("Error: hci opcode 0x%04x status 0x%02x\n", cmd->opcode, status);
+	}
+
+	if(cmd->cb) {
+		cmd->cb(status, rparam, rlen, cmd->user_data);
+	}
+
+	g_free(cmd);
+}
+
+
+static gboolean hci_engine_timeout(gpointer user_data);
+
+
+/*
+ * 在控制器允许的个数内发送等待的命令
+ */
+static void hci_engine_flush(struct hci_engine_t *eng)
+{
+	struct hci_cmd_t *cmd;
+
+	while(eng->credits > 0 && eng->pending.head) {
+		cmd = hci_list_pop(&eng->pending);
+
+		if(write(eng->fd, cmd->pkt, cmd->len) != cmd->len) {
+			u_tm_log("Error: [%s:%d] hci write: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+			hci_cmd_complete(cmd, HCI_STATUS_TIMEOUT, NULL, 0);
+			continue;
+		}
+
+		cmd->sent_at = g_get_monotonic_time();
+		hci_list_push(&eng->inflight, cmd);
+		eng->credits--;
+	}
+
+	if(eng->attached && eng->inflight.head && !eng->timer_id) {
+		eng->timer_id = g_timeout_add(HCI_CMD_TIMEOUT_MS / 4, hci_engine_timeout, eng);
+	}
+}
+
+
+/*
+ * 超时的命令认为控制器已经丢弃, 恢复一个发送的机会
+ */
+static gboolean hci_engine_timeout(gpointer user_data)
+{
+	struct hci_engine_t *eng = user_data;
+	gint64 now = g_get_monotonic_time();
+	struct hci_cmd_t *cmd;
+
+	while(eng->inflight.head && now - eng->inflight.head->sent_at >= HCI_CMD_TIMEOUT_MS * 1000) {
+		cmd = hci_list_pop(&eng->inflight);
+		if(eng->credits < 1) {
+			eng->credits = 1;
+		}
+		hci_cmd_complete(cmd, HCI_STATUS_TIMEOUT, NULL, 0);
+	}
+
+	hci_engine_flush(eng);
+
+	if(eng->inflight.head) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	eng->timer_id = 0;
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * 放入等待队列, 可以发送时立即发送
+ * 返回0表示已经放入队列, 之后一定会调用cb
+ */
+int hci_send_cmd(struct hci_engine_t *eng, uint16_t opcode, const void *param, int plen,
+					hci_cmd_cb_t cb, void *user_data)
+{
+	struct hci_cmd_t *cmd;
+
+	if(!eng || plen < 0 || plen > HCI_MAX_PARAM_SIZE) {
+		return -1;
+	}
+
+	cmd = g_new(struct hci_cmd_t, 1);
+	cmd->opcode = opcode;
+	cmd->cb = cb;
+	cmd->user_data = user_data;
+	cmd->pkt[0] = HCI_COMMAND_PKT;
+	put_le16(cmd->pkt + 1, opcode);
+	cmd->pkt[3] = plen;
+	if(plen) {
+		memcpy(cmd->pkt + HCI_CMD_HDR_SIZE, param, plen);
+	}
+	cmd->len = HCI_CMD_HDR_SIZE + plen;
+
+	hci_list_push(&eng->pending, cmd);
+	hci_engine_flush(eng);
+
+	return 0;
+}
+
+
+/*
+ * 处理一个事件包(包括包类型)
+ */
+static void hci_engine_event(struct hci_engine_t *eng, const uint8_t *pkt, int len)
+{
+	const uint8_t *p = pkt + 1 + HCI_EVENT_HDR_SIZE - 1;
+	struct hci_cmd_t *cmd;
+	uint8_t evt, plen;
+
+	if(len < 1 + HCI_EVENT_HDR_SIZE - 1 || pkt[0] != HCI_EVENT_PKT) {
+		return;
+	}
+
+	evt = pkt[1];
+	plen = pkt[2];
+	if(plen > len - 3) {
+		return;
+	}
+
+	switch(evt) {
+	case HCI_EV_CMD_COMPLETE:
+		if(plen < 3) {
+			return;
+		}
+		eng->credits = p[0];
+		cmd = hci_list_remove(&eng->inflight, get_le16(p + 1));
+		if(cmd) {
+			hci_cmd_complete(cmd, plen > 3 ? p[3] : 0, p + 3, plen - 3);
+		}
+		break;
+	case HCI_EV_CMD_STATUS:
+		if(plen < 4) {
+			return;
+		}
+		eng->credits = p[1];
+		cmd = hci_list_remove(&eng->inflight, get_le16(p + 2));
+		if(cmd) {
+			hci_cmd_complete(cmd, p[0], NULL, 0);
+		}
+		break;
+	case HCI_EV_LE_META:
+		if(plen >= 1 && eng->event_cb) {
+			eng->event_cb(p[0], p + 1, plen - 1, eng->event_data);
+		}
+		break;
+	case HCI_EV_DISCONN_COMPLETE:
+		if(eng->event_cb) {
+			eng->event_cb(HCI_EV_DISCONN_PSEUDO, p, plen, eng->event_data);
+		}
+		break;
+	}
+
+	hci_engine_flush(eng);
+}
+
+
+/*
+ * 读出socket中所有的事件, 返回处理的个数, -1表示socket出错
+ * 没有attach到main loop时(例如测试)由调用者调用
+ */
+int hci_engine_process(struct hci_engine_t *eng)
+{
+	ssize_t n;
+	int count = 0;
+
+	while(1) {
+		n = recv(eng->fd, eng->buf, sizeof(eng->buf), MSG_DONTWAIT);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				return count;
+			}
+			return -1;
+		}
+		if(n == 0) {
+			return -1;
+		}
+
+		hci_engine_event(eng, eng->buf, n);
+		count++;
+	}
+}
+
+
+static gboolean hci_fd_callback(gint fd, GIOCondition condition, gpointer user_data)
+{
+	struct hci_engine_t *eng = user_data;
+
+	if(hci_engine_process(eng) < 0 || (condition & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))) {
+		u_tm_log("Error: hci fd %d closed\n", fd);
+		eng->watch_id = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+/*
+ * 在当前线程的main loop中处理事件和超时
+ */
+int hci_engine_attach(struct hci_engine_t *eng)
+{
+	eng->watch_id = g_unix_fd_add(eng->fd, G_IO_IN | G_IO_HUP | G_IO_ERR, hci_fd_callback, eng);
+	eng->attached = 1;
+	hci_engine_flush(eng);
+
+	return 0;
+}
+
+
+void hci_engine_set_event_cb(struct hci_engine_t *eng, hci_event_cb_t cb, void *user_data)
+{
+	eng->event_cb = cb;
+	eng->event_data = user_data;
+}
+
+
+/*
+ * 等待和在途的命令个数
+ */
+int hci_engine_pending(struct hci_engine_t *eng)
+{
+	return eng->pending.count + eng->inflight.count;
+}
+
 
-int le_set_advertising_parameters(uint16_t	min_interval, uint16_t	max_interval, uint8_t chan_map)
+/*
+ * fd由engine管理, hci_engine_free时关闭
+ */
+struct hci_engine_t *hci_engine_new(int fd)
 {
-	struct hci_request rq;
-	le_set_advertising_parameters_cp adv_params_cp;
-	le_set_advertise_enable_cp advertise_cp;
-	uint8_t status;
-	int dd, ret = 0;
+	struct hci_engine_t *eng = g_new0(struct hci_engine_t, 1);
 
+	eng->fd = fd;
 	/*
-	 * 打开hci0
+	 * 第一个Command Complete之前只发送一个命令
 	 */
-	dd = hci_open_dev(0);
-	
-	u_tm_log("[%s:%d] hci0 dd = %d !\n", __FUNCTION__, __LINE__, dd);
-	
-	if(dd < 0) {
-		u_tm_log("Error: [%s:%d] hci0 open failed !\n", __FUNCTION__, __LINE__);
+	eng->credits = 1;
+
+	return eng;
+}
+
+
+/*
+ * 打开hci<dev_id>的raw socket, 只接收命令的回复, LE Meta和Disconnection Complete事件
+ * 需要CAP_NET_RAW
+ */
+struct hci_engine_t *hci_engine_open(int dev_id)
+{
+	struct hci_sockaddr_t addr;
+	struct hci_filter_t filter;
+	int fd;
+
+	fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+	if(fd < 0) {
+		u_tm_log("Error: [%s:%d] hci socket: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		return NULL;
+	}
+
+	memset(&filter, 0, sizeof(filter));
+	filter.type_mask = 1 << HCI_EVENT_PKT;
+	filter.event_mask[HCI_EV_DISCONN_COMPLETE >> 5] |= 1 << (HCI_EV_DISCONN_COMPLETE & 31);
+	filter.event_mask[HCI_EV_CMD_COMPLETE >> 5] |= 1 << (HCI_EV_CMD_COMPLETE & 31);
+	filter.event_mask[HCI_EV_CMD_STATUS >> 5] |= 1 << (HCI_EV_CMD_STATUS & 31);
+	filter.event_mask[HCI_EV_LE_META >> 5] |= 1 << (HCI_EV_LE_META & 31);
+	if(setsockopt(fd, SOL_HCI, HCI_SOCK_FILTER, &filter, sizeof(filter)) < 0) {
+		u_tm_log("Error: [%s:%d] hci filter: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		goto err;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = dev_id;
+	addr.hci_channel = HCI_CHANNEL_RAW;
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		u_tm_log("Error: [%s:%d] hci%d bind: %s\n", __FUNCTION__, __LINE__, dev_id, strerror(errno));
+		goto err;
+	}
+
+	u_tm_log("hci%d engine fd = %d\n", dev_id, fd);
+
+	return hci_engine_new(fd);
+
+err:
+	close(fd);
+	return NULL;
+}
+
+
+/*
+ * 没有回复的命令以HCI_STATUS_TIMEOUT回调
+ */
+void hci_engine_free(struct hci_engine_t *eng)
+{
+	struct hci_cmd_t *cmd;
+
+	if(!eng) {
+		return;
+	}
+
+	if(eng->watch_id) {
+		g_source_remove(eng->watch_id);
+	}
+	if(eng->timer_id) {
+		g_source_remove(eng->timer_id);
+	}
+
+	while((cmd = hci_list_pop(&eng->inflight))) {
+		hci_cmd_complete(cmd, HCI_STATUS_TIMEOUT, NULL, 0);
+	}
+	while((cmd = hci_list_pop(&eng->pending))) {
+		hci_cmd_complete(cmd, HCI_STATUS_TIMEOUT, NULL, 0);
+	}
+
+	close(eng->fd);
+	g_free(eng);
+}
+
+
+/*
+ * "hci0"或者"/org/bluez/hci0" -> 0, 不是adapter名字时返回-1
+ */
+int hci_dev_id(const char *adapter)
+{
+	const char *name;
+	char *end;
+	long id;
+
+	if(!adapter) {
+		return -1;
+	}
+
+	name = strrchr(adapter, '/');
+	name = name ? name + 1 : adapter;
+
+	if(strncmp(name, "hci", 3)) {
 		return -1;
 	}
 
+	id = strtol(name + 3, &end, 10);
+	if(end == name + 3 || *end || id < 0 || id > 0xffff) {
+		return -1;
+	}
+
+	return id;
+}
+
+
+/*
+ * 返回参数: status, BD_ADDR(6个字节, 小端)
+ */
+int hci_read_bd_addr(struct hci_engine_t *eng, hci_cmd_cb_t cb, void *user_data)
+{
+	return hci_send_cmd(eng, HCI_OP_READ_BD_ADDR, NULL, 0, cb, user_data);
+}
+
+
+/*
+ * 间隔单位0.625ms, 可连接的非定向广播, 公共地址
+ */
+int hci_le_set_adv_params(struct hci_engine_t *eng, uint16_t min_interval, uint16_t max_interval,
+					uint8_t chan_map, hci_cmd_cb_t cb, void *user_data)
+{
+	uint8_t cp[15];
+
 	if(min_interval > max_interval) {
-		ret = -1;
-		goto done;
+		return -1;
 	}
-	
-	memset(&adv_params_cp, 0, sizeof(adv_params_cp));
-	adv_params_cp.min_interval = htobs(min_interval);
-	adv_params_cp.max_interval = htobs(max_interval);
-	adv_params_cp.chan_map = chan_map;
 
-	memset(&rq, 0, sizeof(rq));
-	rq.ogf = OGF_LE_CTL;
-	rq.ocf = OCF_LE_SET_ADVERTISING_PARAMETERS;
-	rq.cparam = &adv_params_cp;
-	rq.clen = LE_SET_ADVERTISING_PARAMETERS_CP_SIZE;
-	rq.rparam = &status;
-	rq.rlen = 1;
+	memset(cp, 0, sizeof(cp));
+	put_le16(cp, min_interval);
+	put_le16(cp + 2, max_interval);
+	cp[4] = 0x00;		/* ADV_IND */
+	cp[5] = 0x00;		/* own address: public */
+	cp[13] = chan_map;
+	cp[14] = 0x00;		/* 不过滤 */
 
-	ret = hci_send_req(dd, &rq, 1000);
-	u_tm_log("[%s:%d] ADVERTISING_PARAMETERS status = %d !\n", __FUNCTION__, __LINE__, status);
-	if(ret < 0) {
-		u_tm_log("[%s:%d] ADVERTISING_PARAMETERS status = %d !\n", __FUNCTION__, __LINE__, status);
-		goto done;
+	return hci_send_cmd(eng, HCI_OP_LE_SET_ADV_PARAMS, cp, sizeof(cp), cb, user_data);
+}
+
+
+static int hci_le_set_data(struct hci_engine_t *eng, uint16_t opcode, const uint8_t *data, int len,
+					hci_cmd_cb_t cb, void *user_data)
+{
+	uint8_t cp[32];
+
+	if(len < 0 || len > 31) {
+		return -1;
 	}
 
-done:
-	hci_close_dev(dd);
-	return ret;
+	memset(cp, 0, sizeof(cp));
+	cp[0] = len;
+	memcpy(cp + 1, data, len);
+
+	return hci_send_cmd(eng, opcode, cp, sizeof(cp), cb, user_data);
+}
+
+
+/*
+ * data是AD structure, 最长31个字节
+ */
+int hci_le_set_adv_data(struct hci_engine_t *eng, const uint8_t *data, int len, hci_cmd_cb_t cb, void *user_data)
+{
+	return hci_le_set_data(eng, HCI_OP_LE_SET_ADV_DATA, data, len, cb, user_data);
 }
 
+
+int hci_le_set_scan_rsp_data(struct hci_engine_t *eng, const uint8_t *data, int len, hci_cmd_cb_t cb, void *user_data)
+{
+	return hci_le_set_data(eng, HCI_OP_LE_SET_SCAN_RSP_DATA, data, len, cb, user_data);
+}
+
+
+int hci_le_set_adv_enable(struct hci_engine_t *eng, int enable, hci_cmd_cb_t cb, void *user_data)
+{
+	uint8_t cp = !!enable;
+
+	return hci_send_cmd(eng, HCI_OP_LE_SET_ADV_ENABLE, &cp, 1, cb, user_data);
+}
+
+
+/*
+ * 之后建立的连接使用的数据长度
+ */
+int hci_le_write_default_data_len(struct hci_engine_t *eng, uint16_t tx_octets, uint16_t tx_time,
+					hci_cmd_cb_t cb, void *user_data)
+{
+	uint8_t cp[4];
+
+	put_le16(cp, tx_octets);
+	put_le16(cp + 2, tx_time);
+
+	return hci_send_cmd(eng, HCI_OP_LE_WRITE_DEF_DATA_LEN, cp, sizeof(cp), cb, user_data);
+}
+
+
+/*
+ * 结果由LE Data Length Change事件通知
+ */
+int hci_le_set_data_len(struct hci_engine_t *eng, uint16_t handle, uint16_t tx_octets, uint16_t tx_time,
+					hci_cmd_cb_t cb, void *user_data)
+{
+	uint8_t cp[6];
+
+	put_le16(cp, handle);
+	put_le16(cp + 2, tx_octets);
+	put_le16(cp + 4, tx_time);
+
+	return hci_send_cmd(eng, HCI_OP_LE_SET_DATA_LEN, cp, sizeof(cp), cb, user_data);
+}
+
+
+/*
+ * 之后建立的连接优先使用的PHY, tx_phys/rx_phys是HCI_LE_PHY_*的组合
+ */
+int hci_le_set_default_phy(struct hci_engine_t *eng, uint8_t tx_phys, uint8_t rx_phys,
+					hci_cmd_cb_t cb, void *user_data)
+{
+	uint8_t cp[3];
+
+	cp[0] = 0x00;		/* all_phys: 有偏好 */
+	cp[1] = tx_phys;
+	cp[2] = rx_phys;
+
+	return hci_send_cmd(eng, HCI_OP_LE_SET_DEFAULT_PHY, cp, sizeof(cp), cb, user_data);
+}
+
+
+/*
+ * 回复Command Status, 结果由LE PHY Update Complete事件通知
+ */
+int hci_le_set_phy(struct hci_engine_t *eng, uint16_t handle, uint8_t tx_phys, uint8_t rx_phys,
+					hci_cmd_cb_t cb, void *user_data)
+{
+	uint8_t cp[7];
+
+	put_le16(cp, handle);
+	cp[2] = 0x00;
+	cp[3] = tx_phys;
+	cp[4] = rx_phys;
+	put_le16(cp + 5, 0x0000);	/* phy_options */
+
+	return hci_send_cmd(eng, HCI_OP_LE_SET_PHY, cp, sizeof(cp), cb, user_data);
+}
+
+
+/*
+ * 间隔单位1.25ms, timeout单位10ms
+ * 回复Command Status, 结果由LE Connection Update Complete事件通知
+ */
+int hci_le_conn_update(struct hci_engine_t *eng, uint16_t handle, uint16_t min_interval, uint16_t max_interval,
+					uint16_t latency, uint16_t timeout, hci_cmd_cb_t cb, void *user_data)
+{
+	uint8_t cp[14];
+
+	if(min_interval > max_interval) {
+		return -1;
+	}
+
+	put_le16(cp, handle);
+	put_le16(cp + 2, min_interval);
+	put_le16(cp + 4, max_interval);
+	put_le16(cp + 6, latency);
+	put_le16(cp + 8, timeout);
+	put_le16(cp + 10, 0x0000);	/* min_ce_length */
+	put_le16(cp + 12, 0x0000);	/* max_ce_length */
+
+	return hci_send_cmd(eng, HCI_OP_LE_CONN_UPDATE, cp, sizeof(cp), cb, user_data);
+}
+
+
+/*
+ * 之后的连接默认使用最大的数据长度和2M PHY
+ * 两个命令一起放入队列, 控制器允许时流水线发送
+ */
+int hci_le_tune_defaults(struct hci_engine_t *eng)
+{
+	if(hci_le_write_default_data_len(eng, HCI_LE_MAX_TX_OCTETS, HCI_LE_MAX_TX_TIME, NULL, NULL) < 0) {
+		return -1;
+	}
+
+	return hci_le_set_default_phy(eng, HCI_LE_PHY_1M | HCI_LE_PHY_2M, HCI_LE_PHY_1M | HCI_LE_PHY_2M, NULL, NULL);
+}
+
+
+/*
+ * 已经建立的连接: 打开DLE, 切换到2M PHY, 连接间隔7.5ms~15ms
+ * 对端不支持时控制器会回复错误或者保持原来的参数, 不影响连接
+ */
+int hci_le_tune_link(struct hci_engine_t *eng, uint16_t handle)
+{
+	if(hci_le_set_data_len(eng, handle, HCI_LE_MAX_TX_OCTETS, HCI_LE_MAX_TX_TIME, NULL, NULL) < 0) {
+		return -1;
+	}
+
+	if(hci_le_set_phy(eng, handle, HCI_LE_PHY_2M, HCI_LE_PHY_2M, NULL, NULL) < 0) {
+		return -1;
+	}
+
+	return hci_le_conn_update(eng, handle, 6, 12, 0, 400, NULL, NULL);
+}
@@ -0,0 +1,124 @@
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#ifndef __HCI_H__
+#define __HCI_H__
+
+#include <stdint.h>
+
+/*
+ * HCI命令引擎
+ *
+ * 一直打开一个HCI socket, 命令按照控制器给的Num_HCI_Command_Packets流水线发送,
+ * Command Complete/Command Status到达或者超时后调用命令的回调.
+ * socket可以是真实的HCI raw socket(hci_engine_open), 也可以是任何按包收发的fd
+ * (hci_engine_new), 例如测试时用socketpair模拟控制器.
+ */
+
+#define HCI_COMMAND_PKT		0x01
+#define HCI_EVENT_PKT		0x04
+
+#define HCI_EV_DISCONN_COMPLETE		0x05
+#define HCI_EV_CMD_COMPLETE			0x0E
+#define HCI_EV_CMD_STATUS			0x0F
+#define HCI_EV_LE_META				0x3E
+
+/*
+ * LE Meta的子事件
+ */
+#define HCI_EV_LE_CONN_COMPLETE			0x01
+#define HCI_EV_LE_CONN_UPDATE_COMPLETE	0x03
+#define HCI_EV_LE_DATA_LEN_CHANGE		0x07
+#define HCI_EV_LE_PHY_UPDATE_COMPLETE	0x0C
+#define HCI_EV_LE_ENH_CONN_COMPLETE		0x0A
+
+/*
+ * 不是LE Meta的子事件: Disconnection Complete用这个值交给hci_event_cb_t, 0没有被LE Meta使用
+ */
+#define HCI_EV_DISCONN_PSEUDO			0x00
+
+#define HCI_OGF_INFO_PARAM	0x04
+#define HCI_OGF_LE_CTL		0x08
+#define HCI_OPCODE(ogf, ocf) ((uint16_t)(((ogf) << 10) | (ocf)))
+
+#define HCI_OP_READ_BD_ADDR					HCI_OPCODE(HCI_OGF_INFO_PARAM, 0x0009)
+#define HCI_OP_LE_SET_ADV_PARAMS			HCI_OPCODE(HCI_OGF_LE_CTL, 0x0006)
+#define HCI_OP_LE_SET_ADV_DATA				HCI_OPCODE(HCI_OGF_LE_CTL, 0x0008)
+#define HCI_OP_LE_SET_SCAN_RSP_DATA			HCI_OPCODE(HCI_OGF_LE_CTL, 0x0009)
+#define HCI_OP_LE_SET_ADV_ENABLE			HCI_OPCODE(HCI_OGF_LE_CTL, 0x000A)
+#define HCI_OP_LE_CONN_UPDATE				HCI_OPCODE(HCI_OGF_LE_CTL, 0x0013)
+#define HCI_OP_LE_SET_DATA_LEN				HCI_OPCODE(HCI_OGF_LE_CTL, 0x0022)
+#define HCI_OP_LE_WRITE_DEF_DATA_LEN		HCI_OPCODE(HCI_OGF_LE_CTL, 0x0024)
+#define HCI_OP_LE_SET_DEFAULT_PHY			HCI_OPCODE(HCI_OGF_LE_CTL, 0x0031)
+#define HCI_OP_LE_SET_PHY					HCI_OPCODE(HCI_OGF_LE_CTL, 0x0032)
+
+#define HCI_LE_PHY_1M		0x01
+#define HCI_LE_PHY_2M		0x02
+#define HCI_LE_PHY_CODED	0x04
+
+/*
+ * LE Data Length Extension的最大值
+ */
+#define HCI_LE_MAX_TX_OCTETS	251
+#define HCI_LE_MAX_TX_TIME		2120
+
+/*
+ * 引擎自己产生的状态: 命令超时或者引擎被释放
+ */
+#define HCI_STATUS_TIMEOUT	0xFF
+
+#define HCI_CMD_TIMEOUT_MS	2000
+
+struct hci_engine_t;
+
+/*
+ * status是Command Complete返回参数的第一个字节或者Command Status的status
+ * rparam/rlen是Command Complete的返回参数(包括status), Command Status时为NULL/0
+ */
+typedef void (*hci_cmd_cb_t)(uint8_t status, const uint8_t *rparam, int rlen, void *user_data);
+
+/*
+ * LE Meta事件和Disconnection Complete(subevent为HCI_EV_DISCONN_PSEUDO)
+ * data/len是子事件的参数, 不包括subevent
+ */
+typedef void (*hci_event_cb_t)(uint8_t subevent, const uint8_t *data, int len, void *user_data);
+
+struct hci_engine_t *hci_engine_open(int dev_id);
+struct hci_engine_t *hci_engine_new(int fd);
+void hci_engine_free(struct hci_engine_t *eng);
+int hci_engine_attach(struct hci_engine_t *eng);
+int hci_engine_process(struct hci_engine_t *eng);
+void hci_engine_set_event_cb(struct hci_engine_t *eng, hci_event_cb_t cb, void *user_data);
+int hci_engine_pending(struct hci_engine_t *eng);
+int hci_send_cmd(struct hci_engine_t *eng, uint16_t opcode, const void *param, int plen,
+					hci_cmd_cb_t cb, void *user_data);
+
+int hci_dev_id(const char *adapter);
+int hci_read_bd_addr(struct hci_engine_t *eng, hci_cmd_cb_t cb, void *user_data);
+
+int hci_le_set_adv_params(struct hci_engine_t *eng, uint16_t min_interval, uint16_t max_interval,
+					uint8_t chan_map, hci_cmd_cb_t cb, void *user_data);
+int hci_le_set_adv_data(struct hci_engine_t *eng, const uint8_t *data, int len, hci_cmd_cb_t cb, void *user_data);
+int hci_le_set_scan_rsp_data(struct hci_engine_t *eng, const uint8_t *data, int len, hci_cmd_cb_t cb, void *user_data);
+int hci_le_set_adv_enable(struct hci_engine_t *eng, int enable, hci_cmd_cb_t cb, void *user_data);
+int hci_le_write_default_data_len(struct hci_engine_t *eng, uint16_t tx_octets, uint16_t tx_time,
+					hci_cmd_cb_t cb, void *user_data);
+int hci_le_set_data_len(struct hci_engine_t *eng, uint16_t handle, uint16_t tx_octets, uint16_t tx_time,
+					hci_cmd_cb_t cb, void *user_data);
+int hci_le_set_default_phy(struct hci_engine_t *eng, uint8_t tx_phys, uint8_t rx_phys,
+					hci_cmd_cb_t cb, void *user_data);
+int hci_le_set_phy(struct hci_engine_t *eng, uint16_t handle, uint8_t tx_phys, uint8_t rx_phys,
+					hci_cmd_cb_t cb, void *user_data);
+int hci_le_conn_update(struct hci_engine_t *eng, uint16_t handle, uint16_t min_interval, uint16_t max_interval,
+					uint16_t latency, uint16_t timeout, hci_cmd_cb_t cb, void *user_data);
+
+int hci_le_tune_defaults(struct hci_engine_t *eng);
+int hci_le_tune_link(struct hci_engine_t *eng, uint16_t handle);
+
+
+#endif
+#ifdef __cplusplus
+}
+#endif
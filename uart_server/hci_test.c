@@ -0,0 +1,267 @@
+/*
+ * HCI命令引擎的测试, 不需要蓝牙设备
+ *
+ * socketpair的一端交给hci_engine_new, 另一端是假的控制器: 读出命令,
+ * 按测试的需要回复Command Complete, Command Status或者不回复(超时),
+ * 也可以主动发送LE Meta和Disconnection Complete事件.
+ *
+ * make test 运行, 全部通过时返回0. 超时的测试需要等HCI_CMD_TIMEOUT_MS.
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "hci.h"
+
+#define HCI_TEST_WAIT_MS 200
+
+#define HCI_TEST_MAX_PKT 260
+#define HCI_TEST_MAX_RPARAM 32
+
+/*
+ * 一个命令的回调结果
+ */
+struct hci_test_result_t {
+	int called;
+	uint8_t status;
+	int rlen;
+	uint8_t rparam[HCI_TEST_MAX_RPARAM];
+};
+
+struct hci_test_t {
+	struct hci_engine_t *eng;
+	int fd;			/* 假的控制器 */
+	int failures;
+
+	int events;
+	uint8_t subevent;
+	int event_len;
+};
+
+static struct hci_test_t t;
+
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+
+static void hci_test_check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if(!ok) {
+		t.failures++;
+	}
+}
+
+
+static void hci_test_cmd_cb(uint8_t status, const uint8_t *rparam, int rlen, void *user_data)
+{
+	struct hci_test_result_t *r = user_data;
+
+	r->called++;
+	r->status = status;
+	r->rlen = rlen;
+	if(rparam && rlen > 0) {
+		memcpy(r->rparam, rparam, MIN(rlen, (int)sizeof(r->rparam)));
+	}
+}
+
+
+static void hci_test_event_cb(uint8_t subevent, const uint8_t *data, int len, void *user_data)
+{
+	t.events++;
+	t.subevent = subevent;
+	t.event_len = len;
+}
+
+
+/*
+ * 运行main loop直到*flag不为0或者超时, 返回*flag
+ */
+static int hci_test_run(int *flag, int timeout_ms)
+{
+	gint64 deadline = g_get_monotonic_time() + (gint64)timeout_ms * 1000;
+
+	while(!*flag && g_get_monotonic_time() < deadline) {
+		if(!g_main_context_iteration(NULL, FALSE)) {
+			g_usleep(1000);
+		}
+	}
+
+	return *flag;
+}
+
+
+/*
+ * 控制器读一个命令, 返回opcode, HCI_TEST_WAIT_MS内没有命令时返回0
+ */
+static uint16_t hci_test_ctrl_recv(void)
+{
+	uint8_t pkt[HCI_TEST_MAX_PKT];
+	struct pollfd pfd = {.fd = t.fd, .events = POLLIN};
+	ssize_t n;
+
+	g_main_context_iteration(NULL, FALSE);
+
+	if(poll(&pfd, 1, HCI_TEST_WAIT_MS) <= 0) {
+		return 0;
+	}
+
+	n = recv(t.fd, pkt, sizeof(pkt), MSG_DONTWAIT);
+	if(n < 4 || pkt[0] != HCI_COMMAND_PKT) {
+		return 0;
+	}
+
+	return get_le16(pkt + 1);
+}
+
+
+static void hci_test_ctrl_event(const uint8_t *pkt, int len)
+{
+	if(send(t.fd, pkt, len, 0) != len) {
+		perror("send");
+	}
+}
+
+
+static void hci_test_cmd_complete(uint8_t ncmd, uint16_t opcode, const uint8_t *rparam, int rlen)
+{
+	uint8_t pkt[3 + 3 + HCI_TEST_MAX_RPARAM] = {HCI_EVENT_PKT, HCI_EV_CMD_COMPLETE, 3 + rlen, ncmd,
+											opcode & 0xff, opcode >> 8};
+
+	memcpy(pkt + 6, rparam, rlen);
+	hci_test_ctrl_event(pkt, 6 + rlen);
+}
+
+
+static void hci_test_cmd_status(uint8_t ncmd, uint16_t opcode, uint8_t status)
+{
+	uint8_t pkt[] = {HCI_EVENT_PKT, HCI_EV_CMD_STATUS, 4, status, ncmd, opcode & 0xff, opcode >> 8};
+
+	hci_test_ctrl_event(pkt, sizeof(pkt));
+}
+
+
+/*
+ * 第一个Command Complete之前只发送一个命令, 回复之后按ncmd发送等待的命令
+ */
+static void hci_test_complete(void)
+{
+	static const uint8_t bdaddr[7] = {0x00, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11};
+	struct hci_test_result_t a = {0}, b = {0};
+
+	hci_send_cmd(t.eng, HCI_OP_READ_BD_ADDR, NULL, 0, hci_test_cmd_cb, &a);
+	hci_le_write_default_data_len(t.eng, HCI_LE_MAX_TX_OCTETS, HCI_LE_MAX_TX_TIME, hci_test_cmd_cb, &b);
+
+	hci_test_check(hci_test_ctrl_recv() == HCI_OP_READ_BD_ADDR, "first command sent");
+	hci_test_check(hci_test_ctrl_recv() == 0, "second command waits for credit");
+
+	hci_test_cmd_complete(1, HCI_OP_READ_BD_ADDR, bdaddr, sizeof(bdaddr));
+	hci_test_run(&a.called, HCI_TEST_WAIT_MS);
+	hci_test_check(a.called == 1 && a.status == 0 && a.rlen == sizeof(bdaddr) &&
+					!memcmp(a.rparam, bdaddr, sizeof(bdaddr)), "command complete");
+
+	hci_test_check(hci_test_ctrl_recv() == HCI_OP_LE_WRITE_DEF_DATA_LEN, "second command sent after credit");
+	hci_test_cmd_complete(1, HCI_OP_LE_WRITE_DEF_DATA_LEN, (const uint8_t *)"\x00", 1);
+	hci_test_run(&b.called, HCI_TEST_WAIT_MS);
+	hci_test_check(b.called == 1 && b.status == 0, "second command complete");
+	hci_test_check(hci_engine_pending(t.eng) == 0, "nothing pending");
+}
+
+
+/*
+ * Command Status只有status, 没有返回参数
+ */
+static void hci_test_status(void)
+{
+	struct hci_test_result_t r = {0};
+
+	hci_le_set_phy(t.eng, 0x0040, HCI_LE_PHY_2M, HCI_LE_PHY_2M, hci_test_cmd_cb, &r);
+	hci_test_check(hci_test_ctrl_recv() == HCI_OP_LE_SET_PHY, "set phy sent");
+
+	hci_test_cmd_status(1, HCI_OP_LE_SET_PHY, 0x0C);
+	hci_test_run(&r.called, HCI_TEST_WAIT_MS);
+	hci_test_check(r.called == 1 && r.status == 0x0C && r.rlen == 0, "command status");
+}
+
+
+/*
+ * 控制器不回复时以HCI_STATUS_TIMEOUT回调, 恢复发送的机会, 后面的命令继续发送
+ */
+static void hci_test_timeout(void)
+{
+	struct hci_test_result_t a = {0}, b = {0};
+
+	/*
+	 * 控制器只允许一个命令, 第二个命令只能等第一个超时
+	 */
+	hci_le_set_adv_enable(t.eng, 1, hci_test_cmd_cb, &a);
+	hci_le_set_adv_enable(t.eng, 0, hci_test_cmd_cb, &b);
+	hci_test_check(hci_test_ctrl_recv() == HCI_OP_LE_SET_ADV_ENABLE, "set adv enable sent");
+	hci_test_check(hci_test_ctrl_recv() == 0, "no reply, second command waits");
+
+	hci_test_run(&a.called, HCI_CMD_TIMEOUT_MS + HCI_CMD_TIMEOUT_MS / 2);
+	hci_test_check(a.called == 1 && a.status == HCI_STATUS_TIMEOUT, "command timeout");
+
+	hci_test_check(hci_test_ctrl_recv() == HCI_OP_LE_SET_ADV_ENABLE, "next command sent after timeout");
+	hci_test_cmd_complete(1, HCI_OP_LE_SET_ADV_ENABLE, (const uint8_t *)"\x00", 1);
+	hci_test_run(&b.called, HCI_TEST_WAIT_MS);
+	hci_test_check(b.called == 1 && b.status == 0, "command after timeout complete");
+}
+
+
+static void hci_test_events(void)
+{
+	static const uint8_t dle[] = {HCI_EVENT_PKT, HCI_EV_LE_META, 11, HCI_EV_LE_DATA_LEN_CHANGE,
+									0x40, 0x00, 0xfb, 0x00, 0x48, 0x08, 0xfb, 0x00, 0x48, 0x08};
+	static const uint8_t disconn[] = {HCI_EVENT_PKT, HCI_EV_DISCONN_COMPLETE, 4, 0x00, 0x40, 0x00, 0x13};
+
+	t.events = 0;
+	hci_test_ctrl_event(dle, sizeof(dle));
+	hci_test_run(&t.events, HCI_TEST_WAIT_MS);
+	hci_test_check(t.events == 1 && t.subevent == HCI_EV_LE_DATA_LEN_CHANGE && t.event_len == 10,
+					"le data length change event");
+
+	t.events = 0;
+	hci_test_ctrl_event(disconn, sizeof(disconn));
+	hci_test_run(&t.events, HCI_TEST_WAIT_MS);
+	hci_test_check(t.events == 1 && t.subevent == HCI_EV_DISCONN_PSEUDO && t.event_len == 4,
+					"disconnection complete event");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	t.fd = sv[1];
+	t.eng = hci_engine_new(sv[0]);
+	hci_engine_set_event_cb(t.eng, hci_test_event_cb, NULL);
+	hci_engine_attach(t.eng);
+
+	hci_test_complete();
+	hci_test_status();
+	hci_test_timeout();
+	hci_test_events();
+
+	hci_engine_free(t.eng);
+	close(t.fd);
+
+	printf("%s\n", t.failures ? "FAILED" : "PASSED");
+
+	return t.failures ? 1 : 0;
+}
@@ -0,0 +1,347 @@
+/*
+ * 十六进制编码
+ *
+ * 1.标量版本查表, 每个字节一次拷贝3个字符.
+ * 2.x86上运行时检测CPU, SSSE3每次编码16个字节, AVX2每次编码32个字节:
+ *   高低4位分别用pshufb查表得到字符, 再用pshufb把字符和空格排成"XX XX ..."
+ * 3.日志, 抓包等需要十六进制输出的地方都使用这里的函数.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEXDUMP_X86
+#endif
+
+#include "hexdump.h"
+
+/*
+ * 每个字节对应的"XX "
+ */
+static char hex_table[256][3];
+
+static const char hex_digits[16] __attribute__((aligned(16))) = "0123456789ABCDEF";
+
+typedef void (*hex_encode_t)(char *dst, const uint8_t *src, int len);
+static hex_encode_t hex_encode_func;
+static pthread_once_t hex_once = PTHREAD_ONCE_INIT;
+
+static __thread char hex_ring[HEXDUMP_RING_SIZE];
+static __thread size_t hex_ring_pos;
+
+
+/*
+ * dst写入3 * len个字符, 不写结束符
+ */
+static void hex_encode_scalar(char *dst, const uint8_t *src, int len)
+{
+	int i;
+
+	for(i = 0; i < len; i++) {
+		memcpy(dst, hex_table[src[i]], 3);
+		dst += 3;
+	}
+}
+
+
+#ifdef HEXDUMP_X86
+
+/*
+ * 16个字节编码成48个字符, 第j个16字符的输出:
+ * 位置k = 16 * j + p, 来自第k / 3个字节, k % 3为0是高4位, 1是低4位, 2是空格
+ */
+static const uint8_t hex_shuf_hi[3][16] __attribute__((aligned(16))) = {
+	{0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02, 0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80, 0x80, 0x05},
+	{0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80, 0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80, 0x0a, 0x80},
+	{0x80, 0x0b, 0x80, 0x80, 0x0c, 0x80, 0x80, 0x0d, 0x80, 0x80, 0x0e, 0x80, 0x80, 0x0f, 0x80, 0x80},
+};
+
+static const uint8_t hex_shuf_lo[3][16] __attribute__((aligned(16))) = {
+	{0x80, 0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02, 0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80, 0x80},
+	{0x05, 0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80, 0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80, 0x0a},
+	{0x80, 0x80, 0x0b, 0x80, 0x80, 0x0c, 0x80, 0x80, 0x0d, 0x80, 0x80, 0x0e, 0x80, 0x80, 0x0f, 0x80},
+};
+
+static const uint8_t hex_space[3][16] __attribute__((aligned(16))) = {
+	{0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00},
+	{0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00},
+	{0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20, 0x00, 0x00, 0x20},
+};
+
+
+__attribute__((target("ssse3")))
+static void hex_encode_ssse3(char *dst, const uint8_t *src, int len)
+{
+	const __m128i digits = _mm_load_si128((const __m128i *)hex_digits);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	__m128i v, hi, lo;
+	int j;
+
+	while(len >= 16) {
+		v = _mm_loadu_si128((const __m128i *)src);
+		hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+		lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, nibble));
+
+		for(j = 0; j < 3; j++) {
+			__m128i out = _mm_or_si128(
+							_mm_or_si128(_mm_shuffle_epi8(hi, _mm_load_si128((const __m128i *)hex_shuf_hi[j])),
+										 _mm_shuffle_epi8(lo, _mm_load_si128((const __m128i *)hex_shuf_lo[j]))),
+							_mm_load_si128((const __m128i *)hex_space[j]));
+			_mm_storeu_si128((__m128i *)(dst + 16 * j), out);
+		}
+
+		src += 16;
+		dst += 48;
+		len -= 16;
+	}
+
+	hex_encode_scalar(dst, src, len);
+}
+
+
+/*
+ * vpshufb只在128位的lane内查表, 两个lane各自按SSSE3的方式编码16个字节,
+ * 低lane的结果写到前48个字符, 高lane写到后48个字符
+ */
+__attribute__((target("avx2")))
+static void hex_encode_avx2(char *dst, const uint8_t *src, int len)
+{
+	const __m256i digits = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)hex_digits));
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i v, hi, lo, out;
+	int j;
+
+	while(len >= 32) {
+		v = _mm256_loadu_si256((const __m256i *)src);
+		hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, nibble));
+
+		for(j = 0; j < 3; j++) {
+			__m256i shuf_hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)hex_shuf_hi[j]));
+			__m256i shuf_lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)hex_shuf_lo[j]));
+			__m256i space = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)hex_space[j]));
+
+			out = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(hi, shuf_hi),
+												  _mm256_shuffle_epi8(lo, shuf_lo)),
+								  space);
+			_mm_storeu_si128((__m128i *)(dst + 16 * j), _mm256_castsi256_si128(out));
+			_mm_storeu_si128((__m128i *)(dst + 48 + 16 * j), _mm256_extracti128_si256(out, 1));
+		}
+
+		src += 32;
+		dst += 96;
+		len -= 32;
+	}
+
+	hex_encode_ssse3(dst, src, len);
+}
+
+#endif
+
+
+static void hex_init(void)
+{
+	int i;
+
+	for(i = 0; i < 256; i++) {
+		hex_table[i][0] = hex_digits[i >> 4];
+		hex_table[i][1] = hex_digits[i & 0x0f];
+		hex_table[i][2] = ' ';
+	}
+
+	hex_encode_func = hex_encode_scalar;
+
+#ifdef HEXDUMP_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		hex_encode_func = hex_encode_avx2;
+	} else if(__builtin_cpu_supports("ssse3")) {
+		hex_encode_func = hex_encode_ssse3;
+	}
+#endif
+}
+
+
+/*
+ * 一行的长度(不含换行)
+ */
+static size_t hexdump_line_size(int width, const struct hexdump_opt_t *opt)
+{
+	size_t n = 3 * (size_t)width;
+
+	if(opt->offset) {
+		n += 10;
+	}
+
+	if(opt->ascii) {
+		n += width + 2;
+	}
+
+	return n;
+}
+
+
+/*
+ * 编码len个字节需要的缓存大小, 包括结束符
+ */
+size_t hexdump_size(int len, const struct hexdump_opt_t *opt)
+{
+	static const struct hexdump_opt_t def;
+	int width, lines;
+
+	if(!opt) {
+		opt = &def;
+	}
+
+	if(opt->limit && len > opt->limit) {
+		len = opt->limit;
+	}
+
+	width = opt->width ? opt->width : len;
+	lines = width ? (len + width - 1) / width : 0;
+
+	return lines * (hexdump_line_size(width, opt) + (opt->width ? 1 : 0)) + 3 + 1;
+}
+
+
+/*
+ * 把buf编码到out, 返回写入的长度, 不包括结束符
+ * 超过opt->limit或者out放不下时截断, 末尾输出"..."
+ */
+int hexdump_encode(char *out, size_t size, const void *buf, int len, const struct hexdump_opt_t *opt)
+{
+	static const struct hexdump_opt_t def;
+	const uint8_t *src = buf;
+	char *p = out;
+	int width, n, i, off, trunc = 0;
+
+	pthread_once(&hex_once, hex_init);
+
+	/*
+	 * 至少要放得下"..."和结束符
+	 */
+	if(size < 4) {
+		if(size) {
+			out[0] = 0;
+		}
+		return 0;
+	}
+
+	if(!opt) {
+		opt = &def;
+	}
+
+	if(len < 0) {
+		len = 0;
+	}
+
+	if(opt->limit && len > opt->limit) {
+		len = opt->limit;
+		trunc = 1;
+	}
+
+	/*
+	 * 放不下时减少编码的字节数, 每个字节至少占3个字符
+	 */
+	if(hexdump_size(len, opt) > size) {
+		trunc = 1;
+		n = size / 3 < len ? size / 3 : len;
+		while(n > 0 && hexdump_size(n, opt) > size) {
+			n--;
+		}
+		len = n;
+	}
+
+	width = opt->width ? opt->width : len;
+
+	for(off = 0; off < len; off += width) {
+		n = len - off < width ? len - off : width;
+
+		if(opt->offset) {
+			static const char digits[] = "0123456789ABCDEF";
+			for(i = 0; i < 8; i++) {
+				p[i] = digits[(off >> (28 - 4 * i)) & 0x0f];
+			}
+			p[8] = ' ';
+			p[9] = ' ';
+			p += 10;
+		}
+
+		hex_encode_func(p, src + off, n);
+		p += 3 * n;
+
+		if(opt->ascii) {
+			/*
+			 * 最后一行不满时补空格, ASCII列对齐
+			 */
+			if(opt->width && n < width) {
+				memset(p, ' ', 3 * (width - n));
+				p += 3 * (width - n);
+			}
+
+			*p++ = '|';
+			for(i = 0; i < n; i++) {
+				*p++ = (src[off + i] >= 0x20 && src[off + i] < 0x7f) ? src[off + i] : '.';
+			}
+			*p++ = '|';
+		}
+
+		if(opt->width) {
+			*p++ = '\n';
+		}
+	}
+
+	if(trunc) {
+		memcpy(p, "...", 3);
+		p += 3;
+	}
+
+	*p = 0;
+
+	return p - out;
+}
+
+
+/*
+ * 从线程私有的环形缓存分配, 结果一直有效到缓存绕回来被覆盖
+ */
+char *hexdump_ring_alloc(size_t size)
+{
+	char *p;
+
+	if(size > HEXDUMP_RING_SIZE) {
+		return NULL;
+	}
+
+	if(hex_ring_pos + size > HEXDUMP_RING_SIZE) {
+		hex_ring_pos = 0;
+	}
+
+	p = hex_ring + hex_ring_pos;
+	hex_ring_pos += size;
+
+	return p;
+}
+
+
+/*
+ * 编码到环形缓存, 结果太长时截断
+ */
+const char *hexdump(const void *buf, int len, const struct hexdump_opt_t *opt)
+{
+	size_t size = hexdump_size(len, opt);
+	char *out;
+
+	if(size > HEXDUMP_RING_SIZE) {
+		size = HEXDUMP_RING_SIZE;
+	}
+
+	out = hexdump_ring_alloc(size);
+	hexdump_encode(out, size, buf, len, opt);
+
+	return out;
+}
@@ -0,0 +1,36 @@
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#ifndef __HEXDUMP_H__
+#define __HEXDUMP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * 每个字节输出"XX ", 和原来的u_tm_log_hex格式一样
+ */
+struct hexdump_opt_t {
+	int width;		/* 每行的字节数, 0表示不换行 */
+	int offset;		/* 每行前输出偏移"00000010  " */
+	int ascii;		/* 每行后输出" |....|" */
+	int limit;		/* 最多编码的字节数, 超过的部分截断并输出"...", 0表示不限制 */
+};
+
+/*
+ * 线程私有的环形缓存大小, hexdump()的结果最长为HEXDUMP_RING_SIZE - 1
+ */
+#define HEXDUMP_RING_SIZE 16384
+
+size_t hexdump_size(int len, const struct hexdump_opt_t *opt);
+int hexdump_encode(char *out, size_t size, const void *buf, int len, const struct hexdump_opt_t *opt);
+char *hexdump_ring_alloc(size_t size);
+const char *hexdump(const void *buf, int len, const struct hexdump_opt_t *opt);
+
+
+#endif
+#ifdef __cplusplus
+}
+#endif
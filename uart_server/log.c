@@ -1,51 +1,629 @@
+/*
+ * 异步日志
+ *
+ * 1.每个线程第一次写日志时分配一个环形缓存(单生产者单消费者), 写日志只拷贝参数, 不格式化, 不加锁.
+ * 2.后台线程取出所有环形缓存中的记录, 格式化后攒成一批调用一次write.
+ *   所有环形缓存都空时后台线程睡在eventfd上, 睡眠期间第一条日志唤醒它.
+ * 3.环形缓存满时丢弃记录并计数, 不会阻塞调用者.
+ */
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdarg.h>
 #include <sys/time.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "hexdump.h"
 
 #define MAX_BUF_SIZE 1024
 
-void u_tm_log(char *arg, ...)
+/*
+ * 每个线程的记录个数, 必须是2的幂
+ */
+#define U_LOG_RING_SIZE 256
+
+/*
+ * 一条记录中%s参数的拷贝空间, 超过的部分截断
+ */
+#define U_LOG_STR_SIZE 384
+
+/*
+ * 后台线程一次write的最大长度
+ */
+#define U_LOG_BATCH_SIZE 16384
+
+/*
+ * 后台线程等待eventfd的最长时间, 唤醒丢失或者没有eventfd时也能输出
+ */
+#define U_LOG_IDLE_MS 100
+
+/*
+ * u_log_flush检查后台线程是否输出完的间隔
+ */
+#define U_LOG_FLUSH_NS (1000 * 1000)
+
+/*
+ * 十六进制日志最多保存的字节数, 编码后不超过MAX_BUF_SIZE
+ */
+#define U_LOG_HEX_MAX ((MAX_BUF_SIZE - 64) / 3)
+
+struct u_log_rec_t {
+	uint64_t ts;			/* CLOCK_MONOTONIC, 纳秒 */
+	const char *fmt;		/* 格式id: 格式字符串常量的地址 */
+	uint8_t level;
+	uint8_t nargs;
+	uint8_t hex;			/* 十六进制日志: str中是info和原始数据 */
+	uint16_t str_len;
+	/*
+	 * U_LOG_ARG_STR的参数i保存字符串在str中的偏移
+	 * 十六进制日志: args[0]是原始数据在str中的偏移, args[1]是保存的长度, args[2]是原始长度
+	 */
+	struct u_log_arg_t args[U_LOG_MAX_ARGS];
+	char str[U_LOG_STR_SIZE];
+};
+
+struct u_log_ring_t {
+	_Alignas(64) atomic_uint head;		/* 写日志的线程 */
+	_Alignas(64) atomic_uint tail;		/* 后台线程 */
+	atomic_ulong dropped;
+	struct u_log_ring_t *next;
+	struct u_log_rec_t recs[U_LOG_RING_SIZE];
+};
+
+atomic_int u_log_level = U_LOG_INFO;
+
+/*
+ * 所有线程的环形缓存, 只增加不删除, 线程退出后保留
+ */
+static _Atomic(struct u_log_ring_t *) u_log_rings;
+static __thread struct u_log_ring_t *u_log_local_ring;
+
+static pthread_once_t u_log_once = PTHREAD_ONCE_INIT;
+static pthread_t u_log_pthread;
+static atomic_int u_log_stop;
+static int u_log_running;
+
+/*
+ * u_log_sleeping: 后台线程准备睡眠, 写日志的线程看到后清零并写u_log_efd唤醒
+ */
+static int u_log_efd = -1;
+static atomic_int u_log_sleeping;
+
+
+static int u_log_format(char *buf, int size, struct u_log_rec_t *rec);
+
+
+static int u_log_drain(struct u_log_ring_t *r, char *out, int *len)
+{
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+	unsigned long dropped;
+	int n = 0;
+
+	while(tail != head) {
+		/*
+		 * 一条记录格式化后不会超过MAX_BUF_SIZE
+		 */
+		if(*len > U_LOG_BATCH_SIZE - MAX_BUF_SIZE) {
+			break;
+		}
+
+		*len += u_log_format(out + *len, MAX_BUF_SIZE, &r->recs[tail & (U_LOG_RING_SIZE - 1)]);
+		tail++;
+		n++;
+	}
+
+	atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+	dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+	if(dropped && *len <= U_LOG_BATCH_SIZE - 64) {
+		*len += sprintf(out + *len, "[log] %lu records dropped\n", dropped);
+	}
+
+	return n;
+}
+
+
+static void u_log_output(const char *out, int len)
+{
+	ssize_t n;
+
+	while(len > 0) {
+		n = write(STDERR_FILENO, out, len);
+		if(n <= 0) {
+			return;
+		}
+		out += n;
+		len -= n;
+	}
+}
+
+
+static void u_log_wakeup(void)
+{
+	uint64_t v = 1;
+
+	if(u_log_efd >= 0 && write(u_log_efd, &v, sizeof(v)) < 0) {
+		/*
+		 * 计数器不会溢出, 失败时后台线程超时后输出
+		 */
+	}
+}
+
+
+/*
+ * 所有环形缓存都空时等待写日志的线程唤醒
+ * 先设置u_log_sleeping再检查一次, 和u_log_commit的顺序相反, 不会丢失唤醒
+ */
+static void u_log_wait(void)
+{
+	struct timespec idle = {0, U_LOG_IDLE_MS * 1000 * 1000};
+	struct pollfd pfd = {.fd = u_log_efd, .events = POLLIN};
+	struct u_log_ring_t *r;
+	uint64_t v;
+
+	if(u_log_efd < 0) {
+		nanosleep(&idle, NULL);
+		return;
+	}
+
+	atomic_store(&u_log_sleeping, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	for(r = atomic_load(&u_log_rings); r; r = r->next) {
+		if(atomic_load_explicit(&r->head, memory_order_relaxed) !=
+				atomic_load_explicit(&r->tail, memory_order_relaxed)) {
+			atomic_store(&u_log_sleeping, 0);
+			return;
+		}
+	}
+
+	if(!atomic_load(&u_log_stop)) {
+		poll(&pfd, 1, U_LOG_IDLE_MS);
+	}
+
+	atomic_store(&u_log_sleeping, 0);
+	if(read(u_log_efd, &v, sizeof(v)) < 0) {
+		/*
+		 * 超时醒来时没有计数, EAGAIN
+		 */
+	}
+}
+
+
+static void *u_log_process(void *arg)
+{
+	static char out[U_LOG_BATCH_SIZE];
+	struct u_log_ring_t *r;
+	int len, busy;
+
+	while(1) {
+		busy = 0;
+		len = 0;
+
+		for(r = atomic_load(&u_log_rings); r; r = r->next) {
+			busy += u_log_drain(r, out, &len);
+			if(len > U_LOG_BATCH_SIZE - MAX_BUF_SIZE) {
+				u_log_output(out, len);
+				len = 0;
+			}
+		}
+
+		u_log_output(out, len);
+
+		if(!busy) {
+			if(atomic_load(&u_log_stop)) {
+				break;
+			}
+			u_log_wait();
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * 进程退出时输出剩下的日志
+ */
+static void u_log_exit(void)
+{
+	atomic_store(&u_log_stop, 1);
+	u_log_wakeup();
+	pthread_join(u_log_pthread, NULL);
+}
+
+
+static void u_log_start(void)
+{
+	u_log_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(pthread_create(&u_log_pthread, NULL, u_log_process, NULL) == 0) {
+		u_log_running = 1;
+		atexit(u_log_exit);
+	}
+}
+
+
+static struct u_log_ring_t *u_log_ring(void)
+{
+	struct u_log_ring_t *r = u_log_local_ring;
+
+	if(r) {
+		return r;
+	}
+
+	pthread_once(&u_log_once, u_log_start);
+
+	r = aligned_alloc(64, sizeof(struct u_log_ring_t));
+	if(!r) {
+		return NULL;
+	}
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->dropped, 0);
+
+	r->next = atomic_load(&u_log_rings);
+	while(!atomic_compare_exchange_weak(&u_log_rings, &r->next, r))
+		;
+
+	u_log_local_ring = r;
+
+	return r;
+}
+
+
+/*
+ * 取本线程环形缓存中下一个空闲的记录, 满时返回NULL
+ */
+static struct u_log_rec_t *u_log_reserve(struct u_log_ring_t **ring)
 {
-	char buf[MAX_BUF_SIZE];
-	uint32_t len , n;
+	struct u_log_ring_t *r = u_log_ring();
+	struct u_log_rec_t *rec;
 	struct timespec tm;
+	unsigned int head;
+
+	if(!r) {
+		return NULL;
+	}
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&r->tail, memory_order_acquire) >= U_LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	rec = &r->recs[head & (U_LOG_RING_SIZE - 1)];
 
 	clock_gettime(CLOCK_MONOTONIC, &tm);
+	rec->ts = (uint64_t)tm.tv_sec * 1000000000 + tm.tv_nsec;
+	rec->str_len = 0;
 
-	n = sprintf(buf, "[%ld.%06ld] ", tm.tv_sec, tm.tv_nsec/1000);
-	
-	va_list vl;  
-	va_start(vl, arg);  
-	len = vsprintf(buf+n, arg, vl);   
-	va_end(vl);  
-	len = len+n;
+	*ring = r;
+
+	return rec;
+}
+
+
+/*
+ * 后台线程只在所有环形缓存都空时睡眠, 所以看到u_log_sleeping时这个环形缓存是从空变为非空,
+ * 只有第一个看到的线程写eventfd, 后台线程醒着时只多一次原子读
+ */
+static void u_log_commit(struct u_log_ring_t *r)
+{
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if(atomic_load_explicit(&u_log_sleeping, memory_order_relaxed) &&
+			atomic_exchange(&u_log_sleeping, 0)) {
+		u_log_wakeup();
+	}
+}
+
+
+/*
+ * 由u_log宏调用, 在调用者的线程中只拷贝参数
+ */
+void u_log_write(int level, const char *fmt, const struct u_log_arg_t *args, int nargs)
+{
+	struct u_log_ring_t *r;
+	struct u_log_rec_t *rec = u_log_reserve(&r);
+	const char *s;
+	int i, n;
+
+	if(!rec) {
+		return;
+	}
+
+	rec->fmt = fmt;
+	rec->level = level;
+	rec->hex = 0;
+	rec->nargs = nargs < U_LOG_MAX_ARGS ? nargs : U_LOG_MAX_ARGS;
+
+	for(i = 0; i < rec->nargs; i++) {
+		rec->args[i] = args[i];
+		if(args[i].type != U_LOG_ARG_STR) {
+			continue;
+		}
+
+		/*
+		 * 字符串在后台线程格式化时可能已经不存在了, 拷贝到记录中
+		 */
+		if(rec->str_len >= U_LOG_STR_SIZE) {
+			/*
+			 * 空间用完了, 指向最后一个字符串的结束符
+			 */
+			rec->args[i].i = U_LOG_STR_SIZE - 1;
+			continue;
+		}
+
+		s = args[i].s ? args[i].s : "(null)";
+		n = strnlen(s, U_LOG_STR_SIZE - rec->str_len - 1);
+		memcpy(rec->str + rec->str_len, s, n);
+		rec->str[rec->str_len + n] = 0;
+		rec->args[i].i = rec->str_len;
+		rec->str_len += n + 1;
+	}
+
+	u_log_commit(r);
+}
+
+
+/*
+ * 由u_log_hex宏调用, 只拷贝info和原始数据, 十六进制编码在后台线程中完成
+ */
+void u_log_write_hex(int level, const char *info, const void *buf, int count)
+{
+	struct u_log_ring_t *r;
+	struct u_log_rec_t *rec = u_log_reserve(&r);
+	int n;
+
+	if(!rec) {
+		return;
+	}
+
+	rec->fmt = NULL;
+	rec->level = level;
+	rec->hex = 1;
+	rec->nargs = 0;
+
+	info = info ? info : "";
+	n = strnlen(info, U_LOG_STR_SIZE / 2 - 1);
+	memcpy(rec->str, info, n);
+	rec->str[n] = 0;
+	rec->str_len = n + 1;
+
+	if(count < 0 || !buf) {
+		count = 0;
+	}
+
+	n = count;
+	if(n > U_LOG_STR_SIZE - rec->str_len) {
+		n = U_LOG_STR_SIZE - rec->str_len;
+	}
+	if(n > U_LOG_HEX_MAX) {
+		n = U_LOG_HEX_MAX;
+	}
+	memcpy(rec->str + rec->str_len, buf, n);
+
+	rec->args[0].i = rec->str_len;
+	rec->args[1].i = n;
+	rec->args[2].i = count;
+	rec->str_len += n;
+
+	u_log_commit(r);
+}
+
+
+/*
+ * 按照格式字符串中的转换说明取参数, 长度修饰统一换成ll
+ * 参数类型和转换说明不匹配时输出<?>
+ */
+static int u_log_format_arg(char *buf, int size, const char *spec, int spec_len, int lmod,
+								char conv, struct u_log_arg_t *arg, struct u_log_rec_t *rec)
+{
+	char f[32];
+
+	if(!arg || spec_len > (int)sizeof(f) - 4 || memchr(spec, '*', spec_len)) {
+		return snprintf(buf, size, "<?>");
+	}
+
+	memcpy(f, spec, spec_len);
+
+	switch(conv) {
+	case 'd':
+	case 'i':
+		if(arg->type != U_LOG_ARG_INT) {
+			break;
+		}
+		strcpy(f + spec_len, "ll");
+		f[spec_len + 2] = conv;
+		f[spec_len + 3] = 0;
+		/*
+		 * 没有长度修饰时参数是int, 高位是符号扩展的
+		 */
+		return snprintf(buf, size, f, lmod ? (long long)arg->i : (long long)(int)arg->i);
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'o':
+		if(arg->type != U_LOG_ARG_INT) {
+			break;
+		}
+		strcpy(f + spec_len, "ll");
+		f[spec_len + 2] = conv;
+		f[spec_len + 3] = 0;
+		return snprintf(buf, size, f, lmod ? (unsigned long long)arg->i : (unsigned long long)(unsigned int)arg->i);
+	case 'c':
+		if(arg->type != U_LOG_ARG_INT) {
+			break;
+		}
+		f[spec_len] = conv;
+		f[spec_len + 1] = 0;
+		return snprintf(buf, size, f, (int)arg->i);
+	case 's':
+		if(arg->type != U_LOG_ARG_STR) {
+			break;
+		}
+		f[spec_len] = conv;
+		f[spec_len + 1] = 0;
+		return snprintf(buf, size, f, rec->str + arg->i);
+	case 'p':
+		if(arg->type != U_LOG_ARG_PTR) {
+			break;
+		}
+		f[spec_len] = conv;
+		f[spec_len + 1] = 0;
+		return snprintf(buf, size, f, arg->p);
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		if(arg->type != U_LOG_ARG_DOUBLE) {
+			break;
+		}
+		f[spec_len] = conv;
+		f[spec_len + 1] = 0;
+		return snprintf(buf, size, f, arg->d);
+	}
+
+	return snprintf(buf, size, "<?>");
+}
+
+
+/*
+ * "info" + "XX XX ... " + "\n", 数据没有保存完整时在末尾输出"..."
+ */
+static int u_log_format_hex(char *buf, int size, struct u_log_rec_t *rec)
+{
+	int len;
+
+	len = snprintf(buf, size, "%s", rec->str);
+	if(len >= size - 1) {
+		buf[size - 1] = 0;
+		return size - 1;
+	}
+
+	/*
+	 * 放不下时hexdump_encode自己截断并输出"..."
+	 */
+	len += hexdump_encode(buf + len, size - len - 4, rec->str + rec->args[0].i, (int)rec->args[1].i, NULL);
+	if(rec->args[2].i > rec->args[1].i && (len < 3 || memcmp(buf + len - 3, "...", 3))) {
+		memcpy(buf + len, "...", 3);
+		len += 3;
+	}
+	buf[len++] = '\n';
 	buf[len] = 0;
-	fprintf(stderr, "%s", buf);
+
+	return len;
 }
 
-void u_tm_log_hex(char *info, unsigned char *buf, int count)
+
+/*
+ * 在后台线程中格式化一条记录, 返回写入的长度, 不超过size - 1
+ */
+static int u_log_format(char *buf, int size, struct u_log_rec_t *rec)
 {
-	int i, n, index;
-	char str[MAX_BUF_SIZE];
-	
-	index = sprintf(str, "%s", info);
-	for(i = 0; i < count; i++) {
-		n = sprintf(str + index, "%02X ", buf[i]);
-		index += n;
-		if(index >= (MAX_BUF_SIZE - n - 5)) {
-			str[index] = '.';
-			str[index + 1] = '.';
-			str[index + 2] = '.';
-			str[index + 3] = 0;
+	const char *p = rec->fmt, *q;
+	int n, len, lmod, i = 0;
+
+	len = snprintf(buf, size, "[%ld.%06ld] ", (long)(rec->ts / 1000000000), (long)(rec->ts % 1000000000 / 1000));
+
+	if(rec->hex) {
+		return len + u_log_format_hex(buf + len, size - len, rec);
+	}
+
+	while(*p && len < size - 1) {
+		if(*p != '%') {
+			buf[len++] = *p++;
+			continue;
+		}
+
+		if(p[1] == '%') {
+			buf[len++] = '%';
+			p += 2;
+			continue;
+		}
+
+		/*
+		 * %[flags][width][.precision][length]conversion
+		 */
+		q = p + 1;
+		q += strspn(q, "-+ #0");
+		q += strspn(q, "0123456789*");
+		if(*q == '.') {
+			q++;
+			q += strspn(q, "0123456789*");
+		}
+		n = q - p;
+		lmod = strspn(q, "hlLqjzt");
+		/*
+		 * h, hh按int处理
+		 */
+		if(lmod && *q == 'h') {
+			lmod = 0;
+			q += strspn(q, "h");
+		} else {
+			q += lmod;
+		}
+
+		if(!*q) {
 			break;
 		}
+
+		n = u_log_format_arg(buf + len, size - len, p, n, lmod, *q,
+								i < rec->nargs ? &rec->args[i] : NULL, rec);
+		i++;
+		len += n < size - len ? n : size - len - 1;
+		p = q + 1;
 	}
-	
-	u_tm_log("%s\n", str);
+
+	buf[len] = 0;
+
+	return len;
 }
 
 
+/*
+ * 运行时过滤, 大于level的日志在调用处直接跳过
+ */
+void u_log_set_level(int level)
+{
+	atomic_store_explicit(&u_log_level, level, memory_order_relaxed);
+}
+
+
+/*
+ * 等待后台线程输出所有已经写入的日志
+ */
+void u_log_flush(void)
+{
+	struct timespec idle = {0, U_LOG_FLUSH_NS};
+	struct u_log_ring_t *r;
+
+	if(!u_log_running) {
+		return;
+	}
+
+	for(r = atomic_load(&u_log_rings); r; r = r->next) {
+		while(atomic_load(&r->tail) != atomic_load(&r->head)) {
+			nanosleep(&idle, NULL);
+		}
+	}
+}
+
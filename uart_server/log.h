@@ -1,6 +1,131 @@
 
 #ifndef __LOG_H__
-void u_tm_log(char *arg, ...);
-void u_tm_log_hex(char *info, unsigned char *buf, int count);
+#define __LOG_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * 异步日志
+ *
+ * 调用者只把时间, 级别, 格式字符串的地址和参数写入本线程的环形缓存(无锁),
+ * 后台线程按照格式字符串格式化后批量写到stderr.
+ * 格式字符串必须是字符串常量, 只保存地址; %s的参数在调用时拷贝.
+ * 最多U_LOG_MAX_ARGS个参数, 只支持整数, double, 字符串(char *)和指针(%p).
+ */
+
+#define U_LOG_ERR	0
+#define U_LOG_WARN	1
+#define U_LOG_INFO	2
+#define U_LOG_DEBUG	3
+
+/*
+ * 编译时过滤, 大于U_LOG_LEVEL_MAX的级别不会生成代码
+ */
+#ifndef U_LOG_LEVEL_MAX
+#define U_LOG_LEVEL_MAX U_LOG_DEBUG
+#endif
+
+#define U_LOG_MAX_ARGS 8
+
+enum u_log_arg_type_t {
+	U_LOG_ARG_INT,
+	U_LOG_ARG_DOUBLE,
+	U_LOG_ARG_STR,
+	U_LOG_ARG_PTR,
+};
+
+struct u_log_arg_t {
+	uint8_t type;
+	union {
+		uint64_t i;
+		double d;
+		const char *s;
+		const void *p;
+	};
+};
+
+static inline struct u_log_arg_t u_log_arg_int(uint64_t v) { return (struct u_log_arg_t){.type = U_LOG_ARG_INT, .i = v}; }
+static inline struct u_log_arg_t u_log_arg_double(double v) { return (struct u_log_arg_t){.type = U_LOG_ARG_DOUBLE, .d = v}; }
+static inline struct u_log_arg_t u_log_arg_str(const char *v) { return (struct u_log_arg_t){.type = U_LOG_ARG_STR, .s = v}; }
+static inline struct u_log_arg_t u_log_arg_ptr(const void *v) { return (struct u_log_arg_t){.type = U_LOG_ARG_PTR, .p = v}; }
+
+/*
+ * 整数类型逐个列出, 其他(任意类型的指针)都按%p记录
+ * enum和它兼容的整数类型一样处理
+ */
+#define U_LOG_ARG(x) _Generic((x),				\
+	char *: u_log_arg_str,						\
+	const char *: u_log_arg_str,				\
+	float: u_log_arg_double,					\
+	double: u_log_arg_double,					\
+	long double: u_log_arg_double,				\
+	_Bool: u_log_arg_int,						\
+	char: u_log_arg_int,						\
+	signed char: u_log_arg_int,					\
+	unsigned char: u_log_arg_int,				\
+	short: u_log_arg_int,						\
+	unsigned short: u_log_arg_int,				\
+	int: u_log_arg_int,							\
+	unsigned int: u_log_arg_int,				\
+	long: u_log_arg_int,						\
+	unsigned long: u_log_arg_int,				\
+	long long: u_log_arg_int,					\
+	unsigned long long: u_log_arg_int,			\
+	default: u_log_arg_ptr)(x)
+
+/*
+ * 每个参数转换成struct u_log_arg_t, 后面都带逗号
+ */
+#define U_LOG_MAP0()
+#define U_LOG_MAP1(a) U_LOG_ARG(a),
+#define U_LOG_MAP2(a, ...) U_LOG_ARG(a), U_LOG_MAP1(__VA_ARGS__)
+#define U_LOG_MAP3(a, ...) U_LOG_ARG(a), U_LOG_MAP2(__VA_ARGS__)
+#define U_LOG_MAP4(a, ...) U_LOG_ARG(a), U_LOG_MAP3(__VA_ARGS__)
+#define U_LOG_MAP5(a, ...) U_LOG_ARG(a), U_LOG_MAP4(__VA_ARGS__)
+#define U_LOG_MAP6(a, ...) U_LOG_ARG(a), U_LOG_MAP5(__VA_ARGS__)
+#define U_LOG_MAP7(a, ...) U_LOG_ARG(a), U_LOG_MAP6(__VA_ARGS__)
+#define U_LOG_MAP8(a, ...) U_LOG_ARG(a), U_LOG_MAP7(__VA_ARGS__)
+#define U_LOG_SELECT(_0, _1, _2, _3, _4, _5, _6, _7, _8, name, ...) name
+#define U_LOG_MAP(...) U_LOG_SELECT(_0, ##__VA_ARGS__, U_LOG_MAP8, U_LOG_MAP7, U_LOG_MAP6, U_LOG_MAP5, \
+									U_LOG_MAP4, U_LOG_MAP3, U_LOG_MAP2, U_LOG_MAP1, U_LOG_MAP0)(__VA_ARGS__)
+#define U_LOG_NARGS(...) U_LOG_SELECT(_0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+
+/*
+ * 任意线程读取, u_log_set_level修改
+ */
+extern atomic_int u_log_level;
+
+#define U_LOG_ENABLED(level) \
+	((level) <= U_LOG_LEVEL_MAX && (level) <= atomic_load_explicit(&u_log_level, memory_order_relaxed))
+
+void u_log_write(int level, const char *fmt, const struct u_log_arg_t *args, int nargs);
+void u_log_write_hex(int level, const char *info, const void *buf, int count);
+
+/*
+ * 级别被过滤时不会计算参数
+ */
+#define u_log(level, fmt, ...) do {													\
+	if(U_LOG_ENABLED(level)) {														\
+		u_log_write((level), (fmt), (const struct u_log_arg_t []){U_LOG_MAP(__VA_ARGS__) {0}},	\
+					U_LOG_NARGS(__VA_ARGS__));										\
+	}																				\
+} while(0)
+
+/*
+ * info后面输出buf的十六进制"XX XX ...", 编码在后台线程中完成
+ */
+#define u_log_hex(level, info, buf, count) do {							\
+	if(U_LOG_ENABLED(level)) {											\
+		u_log_write_hex((level), (info), (buf), (count));				\
+	}																	\
+} while(0)
+
+#define u_tm_log(fmt, ...) u_log(U_LOG_INFO, fmt, ##__VA_ARGS__)
+#define u_tm_log_hex(info, buf, count) u_log_hex(U_LOG_INFO, info, buf, count)
+
+void u_log_set_level(int level);
+void u_log_flush(void);
+
 #endif
 
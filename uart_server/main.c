@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "log.h"
 #include "uart_server.h"
 #include <stdint.h>
@@ -15,9 +17,21 @@ static void uart_receive_func(uint8_t *buf, int len)
 
 
 
-int main(void)
+/*
+ * uart_server att [hciN|address]: 不经过bluetoothd, 直接在L2CAP ATT通道上提供服务
+ * uart_server indicate: 发送使用indication
+ */
+int main(int argc, char *argv[])
 {
-	uart_server_init(uart_receive_func);
+	if(argc > 1 && !strcmp(argv[1], "indicate")) {
+		uart_server_set_indicate(1);
+	}
+
+	if(argc > 1 && !strcmp(argv[1], "att")) {
+		uart_server_init_att(argc > 2 ? argv[2] : NULL, uart_receive_func);
+	} else {
+		uart_server_init(uart_receive_func);
+	}
 
 	while(1) {
 		sleep(1);
@@ -0,0 +1,405 @@
+/*
+ * 多个central同时连接时的会话管理
+ *
+ * 1.会话表以设备的object path为key, 在uart server线程中创建和删除,
+ *   其他线程发送时通过session_lookup查找并持有引用.
+ * 2.每个会话有自己的发送队列, 所有队列共用一个eventfd,
+ *   调度时每个会话轮流发送一个包, 一个会话发送大量数据不会饿死其他会话.
+ * 3.设备断开(org.bluez.Device1的Connected变为false)时删除会话.
+ *
+ * bluez的D-Bus GATT接口中notification不能指定设备, 会发送给所有打开通知的设备,
+ * 所以这里的公平是指各个会话的发送机会, 不是链路.
+ */
+
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "session.h"
+#include "log.h"
+
+struct session_ctx_t {
+	/*
+	 * device -> struct session_t, 修改和其他线程查找时加锁
+	 */
+	GHashTable *table;
+	/*
+	 * 调度顺序, 只在uart server线程中使用
+	 */
+	GPtrArray *list;
+	guint sched_next;
+
+	/*
+	 * StartNotify打开通知的adapter个数, bluez对一个adapter上所有设备的订阅计数, 最后一个设备关闭时才StopNotify
+	 */
+	int any_notifying;
+
+	int efd;
+	guint efd_watch_id;
+	guint signal_id;
+
+	frame_message_t message_cb;
+	txq_drain_t drain;
+	txq_writable_t writable;
+	txq_gate_t gate;
+};
+
+G_LOCK_DEFINE_STATIC(session_table);
+static struct session_ctx_t session_ctx = {
+	.efd = -1,
+};
+
+
+static struct session_t *session_ref(struct session_t *s)
+{
+	g_atomic_int_inc(&s->ref);
+	return s;
+}
+
+
+/*
+ * 可以在任意线程调用
+ */
+void session_unref(struct session_t *s)
+{
+	if(!s || !g_atomic_int_dec_and_test(&s->ref)) {
+		return;
+	}
+
+	txq_free(s->txq);
+	g_free(s->device);
+	g_free(s);
+}
+
+
+/*
+ * 在uart server线程中调用, 会话不存在时创建
+ * 返回的会话由会话表持有, 调用者不需要unref
+ */
+struct session_t *session_get(void *owner, const char *device)
+{
+	struct session_t *s;
+
+	if(!device) {
+		device = SESSION_DEFAULT_DEVICE;
+	}
+
+	s = g_hash_table_lookup(session_ctx.table, device);
+	if(s) {
+		s->owner = owner;
+		return s;
+	}
+
+	s = g_new0(struct session_t, 1);
+	s->device = g_strdup(device);
+	s->owner = owner;
+	s->ref = 1;
+	frame_decoder_init(&s->decoder, session_ctx.message_cb, s);
+	s->txq = txq_new_full(session_ctx.drain, s, session_ctx.efd);
+	txq_set_writable_cb(s->txq, session_ctx.writable);
+	txq_set_gate(s->txq, session_ctx.gate);
+
+	G_LOCK(session_table);
+	g_hash_table_insert(session_ctx.table, s->device, s);
+	G_UNLOCK(session_table);
+
+	g_ptr_array_add(session_ctx.list, s);
+
+	u_tm_log("[%s:%d] session %s created\n", __FUNCTION__, __LINE__, s->device);
+
+	return s;
+}
+
+
+/*
+ * 可以在任意线程调用, 返回的会话用完后需要session_unref
+ */
+struct session_t *session_lookup(const char *device)
+{
+	struct session_t *s;
+
+	if(!session_ctx.table) {
+		return NULL;
+	}
+
+	if(!device) {
+		device = SESSION_DEFAULT_DEVICE;
+	}
+
+	G_LOCK(session_table);
+	s = g_hash_table_lookup(session_ctx.table, device);
+	if(s) {
+		session_ref(s);
+	}
+	G_UNLOCK(session_table);
+
+	return s;
+}
+
+
+static void session_remove(const char *device)
+{
+	struct session_t *s;
+
+	G_LOCK(session_table);
+	s = g_hash_table_lookup(session_ctx.table, device);
+	if(s) {
+		g_hash_table_remove(session_ctx.table, device);
+	}
+	G_UNLOCK(session_table);
+
+	if(!s) {
+		return;
+	}
+
+	g_ptr_array_remove(session_ctx.list, s);
+	u_tm_log("[%s:%d] session %s removed\n", __FUNCTION__, __LINE__, device);
+	session_unref(s);
+}
+
+
+/*
+ * 在uart server线程中调用, adapter被移除时删除它上面的所有会话
+ */
+void session_remove_owner(void *owner)
+{
+	struct session_t *s;
+	guint i = 0;
+
+	if(!session_ctx.list) {
+		return;
+	}
+
+	while(i < session_ctx.list->len) {
+		s = g_ptr_array_index(session_ctx.list, i);
+		if(s->owner != owner) {
+			i++;
+			continue;
+		}
+
+		G_LOCK(session_table);
+		g_hash_table_remove(session_ctx.table, s->device);
+		G_UNLOCK(session_table);
+
+		g_ptr_array_remove_index(session_ctx.list, i);
+		u_tm_log("[%s:%d] session %s removed\n", __FUNCTION__, __LINE__, s->device);
+		session_unref(s);
+	}
+
+	session_ctx.sched_next = 0;
+}
+
+
+/*
+ * 在uart server线程中调用, device为NULL表示StartNotify/StopNotify
+ */
+void session_set_notifying(void *owner, const char *device, int notifying)
+{
+	if(!device) {
+		if(notifying) {
+			g_atomic_int_inc(&session_ctx.any_notifying);
+		} else if(g_atomic_int_get(&session_ctx.any_notifying) > 0) {
+			g_atomic_int_add(&session_ctx.any_notifying, -1);
+		}
+		return;
+	}
+
+	g_atomic_int_set(&session_get(owner, device)->notifying, notifying);
+}
+
+
+/*
+ * 可以在任意线程调用
+ */
+int session_is_notifying(struct session_t *s)
+{
+	return g_atomic_int_get(&session_ctx.any_notifying) || g_atomic_int_get(&s->notifying);
+}
+
+
+/*
+ * 在uart server线程中调用
+ */
+void session_set_mtu(void *owner, const char *device, int mtu)
+{
+	struct session_t *s = session_get(owner, device);
+
+	if(g_atomic_int_get(&s->mtu) != mtu) {
+		u_tm_log("[%s:%d] session %s mtu = %d\n", __FUNCTION__, __LINE__, s->device, mtu);
+		g_atomic_int_set(&s->mtu, mtu);
+	}
+}
+
+
+/*
+ * 可以在任意线程调用, 返回owner上知道MTU的会话中最小的MTU, 都不知道时返回0
+ * 通知会发给所有打开通知的设备, 所以广播发送按最小的MTU分片
+ */
+int session_min_mtu(void *owner)
+{
+	GHashTableIter iter;
+	struct session_t *s;
+	int mtu = 0, n;
+
+	if(!session_ctx.table) {
+		return 0;
+	}
+
+	G_LOCK(session_table);
+	g_hash_table_iter_init(&iter, session_ctx.table);
+	while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&s)) {
+		if(s->owner != owner) {
+			continue;
+		}
+		n = g_atomic_int_get(&s->mtu);
+		if(n && (!mtu || n < mtu)) {
+			mtu = n;
+		}
+	}
+	G_UNLOCK(session_table);
+
+	return mtu;
+}
+
+
+/*
+ * 在uart server线程中调用, owner的会话可以继续发送(例如收到了流控信用)
+ */
+void session_kick(void *owner)
+{
+	struct session_t *s;
+	guint i;
+
+	if(!session_ctx.list) {
+		return;
+	}
+
+	for(i = 0; i < session_ctx.list->len; i++) {
+		s = g_ptr_array_index(session_ctx.list, i);
+		if(s->owner == owner && txq_pending(s->txq)) {
+			txq_kick(s->txq);
+		}
+	}
+}
+
+
+/*
+ * 所有会话的发送队列共用的eventfd可读
+ * 每个会话轮流取一个包, 最多发送TXQ_BATCH个包后让出main loop
+ */
+static gboolean session_sched_callback(gint fd, GIOCondition condition, gpointer user_data)
+{
+	struct session_t *s;
+	uint64_t cnt;
+	guint i, len;
+	int budget = TXQ_BATCH, sent;
+
+	if(read(fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+		u_tm_log("[%s:%d] eventfd read error: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+	}
+
+	len = session_ctx.list->len;
+	if(!len) {
+		return G_SOURCE_CONTINUE;
+	}
+
+	for(i = 0; i < len; i++) {
+		txq_rearm(((struct session_t *)g_ptr_array_index(session_ctx.list, i))->txq);
+	}
+
+	do {
+		sent = 0;
+		for(i = 0; i < len && budget; i++) {
+			s = g_ptr_array_index(session_ctx.list, (session_ctx.sched_next + i) % len);
+			if(txq_drain(s->txq, 1)) {
+				s->tx_packets++;
+				sent++;
+				budget--;
+			}
+		}
+		session_ctx.sched_next = (session_ctx.sched_next + 1) % len;
+	} while(sent && budget);
+
+	if(!budget) {
+		/*
+		 * 还可能有数据, 让出main loop, 下次继续
+		 */
+		uint64_t one = 1;
+		if(write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			u_tm_log("[%s:%d] eventfd write error: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		}
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+/*
+ * org.bluez.Device1的PropertiesChanged
+ * params type: "(sa{sv}as)"
+ */
+static void session_device_changed(GDBusConnection *conn,
+							const gchar *sender,
+							const gchar *object_path,
+							const gchar *interface_name,
+							const gchar *signal_name,
+							GVariant *params,
+							gpointer user_data)
+{
+	GVariant *changed;
+	gboolean connected;
+
+	g_variant_get(params, "(&s@a{sv}@as)", NULL, &changed, NULL);
+
+	if(g_variant_lookup(changed, "Connected", "b", &connected) && !connected) {
+		session_remove(object_path);
+	}
+
+	g_variant_unref(changed);
+}
+
+
+/*
+ * 在uart server线程中调用
+ * message_cb: 会话收到完整的消息, user_data为会话
+ * drain: 发送会话队列中的数据, user_data为会话
+ * gate: 会话队列的流控, user_data为会话
+ */
+int session_start(GDBusConnection *conn, frame_message_t message_cb, txq_drain_t drain, txq_writable_t writable,
+					txq_gate_t gate)
+{
+	session_ctx.message_cb = message_cb;
+	session_ctx.drain = drain;
+	session_ctx.writable = writable;
+	session_ctx.gate = gate;
+
+	session_ctx.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(session_ctx.efd < 0) {
+		u_tm_log("[%s:%d] eventfd error: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		return -1;
+	}
+
+	session_ctx.list = g_ptr_array_new();
+	session_ctx.table = g_hash_table_new(g_str_hash, g_str_equal);
+	session_ctx.efd_watch_id = g_unix_fd_add(session_ctx.efd, G_IO_IN, session_sched_callback, NULL);
+
+	session_ctx.signal_id =
+		g_dbus_connection_signal_subscribe(conn,
+										"org.bluez",
+										"org.freedesktop.DBus.Properties",
+										"PropertiesChanged",
+										NULL,
+										"org.bluez.Device1",
+										G_DBUS_SIGNAL_FLAGS_NONE,
+										session_device_changed,
+										NULL,
+										NULL);
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include <stdint.h>
+#include <gio/gio.h>
+
+#include "frame.h"
+#include "txq.h"
+
+/*
+ * 每个连接的central(设备)一个会话, 以设备的object path为key
+ * 不知道设备时(例如旧版本bluez的WriteValue没有device)使用SESSION_DEFAULT_DEVICE
+ */
+#define SESSION_DEFAULT_DEVICE ""
+
+struct session_t {
+	char *device;
+	gint ref;
+
+	/*
+	 * 收到这个设备数据的gatt server, 多个adapter时发送要经过同一个adapter
+	 */
+	void *owner;
+
+	/*
+	 * 只有AcquireNotify会告诉是哪个设备打开了通知
+	 */
+	int notifying;
+
+	/*
+	 * 设备的ATT_MTU, 从WriteValue/AcquireWrite/AcquireNotify的"mtu"选项得到, 0表示不知道
+	 */
+	gint mtu;
+
+	/*
+	 * 每个会话独立的分帧和发送队列, 不同设备的数据不会混在一起
+	 */
+	struct frame_decoder_t decoder;
+	struct txq_t *txq;
+
+	uint64_t rx_bytes;
+	uint64_t tx_packets;
+};
+
+int session_start(GDBusConnection *conn, frame_message_t message_cb, txq_drain_t drain, txq_writable_t writable,
+					txq_gate_t gate);
+struct session_t *session_get(void *owner, const char *device);
+struct session_t *session_lookup(const char *device);
+void session_unref(struct session_t *s);
+void session_set_notifying(void *owner, const char *device, int notifying);
+void session_remove_owner(void *owner);
+int session_is_notifying(struct session_t *s);
+void session_set_mtu(void *owner, const char *device, int mtu);
+int session_min_mtu(void *owner);
+void session_kick(void *owner);
+
+
+#endif
+#ifdef __cplusplus
+}
+#endif
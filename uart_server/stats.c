@@ -0,0 +1,173 @@
+/*
+ * 运行统计
+ *
+ * 1.计数器和直方图是全局的原子变量, 更新时只做一次relaxed的fetch_add.
+ * 2.在STATS_OBJECT_PATH注册只读的org.uart.Stats接口, 每个属性是一个计数器或者直方图,
+ *   用org.freedesktop.DBus.Properties.GetAll可以一次取得所有统计.
+ *   例如: busctl get-property <bus_name> /org/uart/server org.uart.Stats TxPackets
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "log.h"
+
+#define STATS_OBJECT_PATH "/org/uart/server"
+
+atomic_uint_fast64_t stats_counters[STATS_COUNTER_COUNT];
+atomic_uint_fast64_t stats_hists[STATS_HIST_COUNT][STATS_HIST_BUCKETS];
+
+static const gchar stats_xml[] =
+"<node>"
+"  <interface name='org.uart.Stats'>"
+"    <property name='RxBytes' type='t' access='read'/>"
+"    <property name='RxPackets' type='t' access='read'/>"
+"    <property name='TxBytes' type='t' access='read'/>"
+"    <property name='TxPackets' type='t' access='read'/>"
+"    <property name='TxDroppedTooLong' type='t' access='read'/>"
+"    <property name='TxDroppedNotNotifying' type='t' access='read'/>"
+"    <property name='TxQueueFull' type='t' access='read'/>"
+"    <property name='StartNotify' type='t' access='read'/>"
+"    <property name='StopNotify' type='t' access='read'/>"
+"    <property name='EmitErrors' type='t' access='read'/>"
+"    <property name='SocketErrors' type='t' access='read'/>"
+"    <property name='TxSocketFull' type='t' access='read'/>"
+"    <property name='BluezRetries' type='t' access='read'/>"
+"    <property name='FcCreditsGranted' type='t' access='read'/>"
+"    <property name='FcCreditsReceived' type='t' access='read'/>"
+"    <property name='FcTxStalls' type='t' access='read'/>"
+"    <property name='FcRxOverrun' type='t' access='read'/>"
+"    <property name='CompressInBytes' type='t' access='read'/>"
+"    <property name='CompressOutBytes' type='t' access='read'/>"
+"    <property name='CompressStored' type='t' access='read'/>"
+"    <property name='IndConfirmed' type='t' access='read'/>"
+"    <property name='IndTimeouts' type='t' access='read'/>"
+"    <property name='QueueDepth' type='at' access='read'/>"
+"    <property name='RxLatency' type='at' access='read'/>"
+"    <property name='TxLatency' type='at' access='read'/>"
+"    <property name='TimeToAdvertise' type='at' access='read'/>"
+"    <property name='TimeToRegistered' type='at' access='read'/>"
+"    <property name='FcStallTime' type='at' access='read'/>"
+"    <property name='ConfirmLatency' type='at' access='read'/>"
+"  </interface>"
+"</node>";
+
+/*
+ * 属性名和计数器的对应关系, 顺序和xml一致
+ */
+static const char *const stats_counter_names[STATS_COUNTER_COUNT] = {
+	[STATS_RX_BYTES] = "RxBytes",
+	[STATS_RX_PACKETS] = "RxPackets",
+	[STATS_TX_BYTES] = "TxBytes",
+	[STATS_TX_PACKETS] = "TxPackets",
+	[STATS_TX_DROP_TOO_LONG] = "TxDroppedTooLong",
+	[STATS_TX_DROP_NOT_NOTIFYING] = "TxDroppedNotNotifying",
+	[STATS_TX_QUEUE_FULL] = "TxQueueFull",
+	[STATS_START_NOTIFY] = "StartNotify",
+	[STATS_STOP_NOTIFY] = "StopNotify",
+	[STATS_EMIT_ERRORS] = "EmitErrors",
+	[STATS_SOCKET_ERRORS] = "SocketErrors",
+	[STATS_TX_SOCKET_FULL] = "TxSocketFull",
+	[STATS_BLUEZ_RETRIES] = "BluezRetries",
+	[STATS_FC_CREDITS_GRANTED] = "FcCreditsGranted",
+	[STATS_FC_CREDITS_RECEIVED] = "FcCreditsReceived",
+	[STATS_FC_TX_STALLS] = "FcTxStalls",
+	[STATS_FC_RX_OVERRUN] = "FcRxOverrun",
+	[STATS_COMPRESS_IN_BYTES] = "CompressInBytes",
+	[STATS_COMPRESS_OUT_BYTES] = "CompressOutBytes",
+	[STATS_COMPRESS_STORED] = "CompressStored",
+	[STATS_IND_CONFIRMED] = "IndConfirmed",
+	[STATS_IND_TIMEOUTS] = "IndTimeouts",
+};
+
+static const char *const stats_hist_names[STATS_HIST_COUNT] = {
+	[STATS_HIST_QUEUE_DEPTH] = "QueueDepth",
+	[STATS_HIST_RX_LATENCY] = "RxLatency",
+	[STATS_HIST_TX_LATENCY] = "TxLatency",
+	[STATS_HIST_TIME_TO_ADVERTISE] = "TimeToAdvertise",
+	[STATS_HIST_TIME_TO_REGISTERED] = "TimeToRegistered",
+	[STATS_HIST_FC_STALL_TIME] = "FcStallTime",
+	[STATS_HIST_CONFIRM_LATENCY] = "ConfirmLatency",
+};
+
+static GDBusNodeInfo *stats_node_info;
+
+
+static GVariant *stats_hist_variant(enum stats_hist_t h)
+{
+	guint64 buckets[STATS_HIST_BUCKETS];
+	int i;
+
+	for(i = 0; i < STATS_HIST_BUCKETS; i++) {
+		buckets[i] = atomic_load_explicit(&stats_hists[h][i], memory_order_relaxed);
+	}
+
+	return g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64, buckets, STATS_HIST_BUCKETS, sizeof(guint64));
+}
+
+
+static GVariant *stats_get_property(GDBusConnection *conn,
+							const gchar *sender,
+							const gchar *object_path,
+							const gchar *interface_name,
+							const gchar *property_name,
+							GError **error,
+							gpointer user_data)
+{
+	int i;
+
+	for(i = 0; i < STATS_COUNTER_COUNT; i++) {
+		if(!strcmp(property_name, stats_counter_names[i])) {
+			return g_variant_new_uint64(atomic_load_explicit(&stats_counters[i], memory_order_relaxed));
+		}
+	}
+
+	for(i = 0; i < STATS_HIST_COUNT; i++) {
+		if(!strcmp(property_name, stats_hist_names[i])) {
+			return stats_hist_variant(i);
+		}
+	}
+
+	g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY, "Unknown property %s", property_name);
+
+	return NULL;
+}
+
+
+/*
+ * 在uart server线程中调用一次
+ */
+int stats_register(GDBusConnection *conn)
+{
+	static const GDBusInterfaceVTable vtable = {
+		.get_property = stats_get_property,
+	};
+	GError *error = NULL;
+
+	if(!stats_node_info) {
+		stats_node_info = g_dbus_node_info_new_for_xml(stats_xml, &error);
+		if(error) {
+			u_tm_log("Error: stats xml %s\n", error->message);
+			g_error_free(error);
+			return -1;
+		}
+	}
+
+	g_dbus_connection_register_object(conn,
+									STATS_OBJECT_PATH,
+									stats_node_info->interfaces[0],
+									&vtable,
+									NULL,
+									NULL,
+									&error);
+	if(error) {
+		u_tm_log("Error: register %s %s\n", STATS_OBJECT_PATH, error->message);
+		g_error_free(error);
+		return -1;
+	}
+
+	return 0;
+}
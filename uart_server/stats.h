@@ -0,0 +1,99 @@
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <gio/gio.h>
+
+/*
+ * 运行统计, 通过org.uart.Stats接口导出
+ * 计数器都是relaxed原子操作, 可以在任意线程调用
+ */
+enum stats_counter_t {
+	STATS_RX_BYTES,
+	STATS_RX_PACKETS,
+	STATS_TX_BYTES,
+	STATS_TX_PACKETS,
+	STATS_TX_DROP_TOO_LONG,			/* 数据超过512个字节 */
+	STATS_TX_DROP_NOT_NOTIFYING,	/* 没有客户端打开通知 */
+	STATS_TX_QUEUE_FULL,			/* 发送队列满 */
+	STATS_START_NOTIFY,				/* StartNotify和AcquireNotify */
+	STATS_STOP_NOTIFY,				/* StopNotify和AcquireNotify的socket关闭 */
+	STATS_EMIT_ERRORS,				/* PropertiesChanged信号发送失败 */
+	STATS_SOCKET_ERRORS,			/* AcquireNotify的socket发送失败 */
+	STATS_TX_SOCKET_FULL,			/* ATT连接的socket发送缓冲满, PDU放入等待队列 */
+	STATS_BLUEZ_RETRIES,			/* 调用bluez失败后的重试 */
+	STATS_FC_CREDITS_GRANTED,		/* 流控: 给客户端的接收信用 */
+	STATS_FC_CREDITS_RECEIVED,		/* 流控: 客户端给的发送信用 */
+	STATS_FC_TX_STALLS,				/* 流控: 发送信用用完, 队列中还有数据 */
+	STATS_FC_RX_OVERRUN,			/* 流控: 客户端超过信用写入的包 */
+	STATS_COMPRESS_IN_BYTES,		/* 压缩前的字节数, 除以压缩后的字节数为压缩比 */
+	STATS_COMPRESS_OUT_BYTES,		/* 压缩后的字节数, 包括包头 */
+	STATS_COMPRESS_STORED,			/* 没有压缩, 原样发送的包 */
+	STATS_IND_CONFIRMED,			/* 客户端确认的indication */
+	STATS_IND_TIMEOUTS,				/* 没有收齐确认的indication */
+	STATS_COUNTER_COUNT,
+};
+
+/*
+ * 直方图按2的幂分桶: 桶0是0, 桶i(i > 0)是[2^(i-1), 2^i), 最后一个桶包括更大的值
+ */
+enum stats_hist_t {
+	STATS_HIST_QUEUE_DEPTH,			/* 每次取发送队列时队列中的包数 */
+	STATS_HIST_RX_LATENCY,			/* 接收回调的处理时间, 纳秒 */
+	STATS_HIST_TX_LATENCY,			/* 一次通知交给bluez的时间, 纳秒 */
+	STATS_HIST_TIME_TO_ADVERTISE,	/* 发现adapter到广播注册成功的时间, 微秒 */
+	STATS_HIST_TIME_TO_REGISTERED,	/* 发现adapter到gatt application注册成功的时间, 微秒 */
+	STATS_HIST_FC_STALL_TIME,		/* 流控: 发送信用用完到收到新信用的时间, 微秒 */
+	STATS_HIST_CONFIRM_LATENCY,		/* indication交给bluez到收齐Confirm的时间, 微秒 */
+	STATS_HIST_COUNT,
+};
+
+#define STATS_HIST_BUCKETS 32
+
+extern atomic_uint_fast64_t stats_counters[STATS_COUNTER_COUNT];
+extern atomic_uint_fast64_t stats_hists[STATS_HIST_COUNT][STATS_HIST_BUCKETS];
+
+static inline void stats_add(enum stats_counter_t c, uint64_t n)
+{
+	atomic_fetch_add_explicit(&stats_counters[c], n, memory_order_relaxed);
+}
+
+static inline void stats_inc(enum stats_counter_t c)
+{
+	stats_add(c, 1);
+}
+
+static inline void stats_hist_add(enum stats_hist_t h, uint64_t v)
+{
+	int i = v ? 64 - __builtin_clzll(v) : 0;
+
+	if(i >= STATS_HIST_BUCKETS) {
+		i = STATS_HIST_BUCKETS - 1;
+	}
+
+	atomic_fetch_add_explicit(&stats_hists[h][i], 1, memory_order_relaxed);
+}
+
+static inline uint64_t stats_now(void)
+{
+	struct timespec tm;
+
+	clock_gettime(CLOCK_MONOTONIC, &tm);
+
+	return (uint64_t)tm.tv_sec * 1000000000 + tm.tv_nsec;
+}
+
+int stats_register(GDBusConnection *conn);
+
+
+#endif
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,364 @@
+/*
+ * 发送队列
+ *
+ * 应用线程(可以是多个)调用txq_push, 数据拷贝进环形队列的槽中,
+ * main loop线程通过eventfd被唤醒后批量取出数据发送.
+ *
+ * 环形队列是有界的无锁多生产者单消费者队列, 每个槽带一个序号:
+ *	seq == pos		槽空闲, 生产者可以占用
+ *	seq == pos + 1	槽中有数据, 消费者可以取出
+ * 生产者通过CAS抢占head, 消费者单线程移动tail.
+ */
+
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "txq.h"
+#include "log.h"
+#include "stats.h"
+
+#define TXQ_SLOT_MASK (TXQ_SLOT_COUNT - 1)
+
+struct txq_slot_t {
+	atomic_size_t seq;
+	int len;
+	uint8_t data[TXQ_SLOT_SIZE];
+};
+
+struct txq_t {
+	struct txq_slot_t slot[TXQ_SLOT_COUNT];
+
+	/*
+	 * 生产者和消费者的位置放在不同的cache line
+	 */
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) size_t tail;
+
+	/*
+	 * 已经通知过消费者但是消费者还没有处理, 避免每个包都写一次eventfd
+	 */
+	atomic_int wakeup;
+	int efd;
+	int own_efd;
+	guint watch_id;
+
+	/*
+	 * 有生产者因为队列满而失败, 等待队列空出来
+	 */
+	atomic_int want_writable;
+
+	txq_drain_t drain;
+	txq_writable_t writable;
+	txq_gate_t gate;
+	void *user_data;
+};
+
+
+/*
+ * efd < 0: 创建自己的eventfd, 通过txq_attach在main loop中处理
+ * efd >= 0: 多个队列共用一个eventfd, 由调用者监听eventfd并调用txq_rearm/txq_drain
+ */
+struct txq_t *txq_new_full(txq_drain_t drain, void *user_data, int efd)
+{
+	struct txq_t *q;
+	size_t i;
+
+	/*
+	 * head和tail要求64字节对齐
+	 */
+	q = aligned_alloc(64, sizeof(struct txq_t));
+	if(!q) {
+		return NULL;
+	}
+	memset(q, 0, sizeof(struct txq_t));
+
+	if(efd < 0) {
+		q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(q->efd < 0) {
+			u_tm_log("[%s:%d] eventfd error: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+			free(q);
+			return NULL;
+		}
+		q->own_efd = 1;
+	} else {
+		q->efd = efd;
+	}
+
+	for(i = 0; i < TXQ_SLOT_COUNT; i++) {
+		atomic_init(&q->slot[i].seq, i);
+	}
+
+	atomic_init(&q->head, 0);
+	atomic_init(&q->wakeup, 0);
+	atomic_init(&q->want_writable, 0);
+	q->tail = 0;
+	q->drain = drain;
+	q->user_data = user_data;
+
+	return q;
+}
+
+
+struct txq_t *txq_new(txq_drain_t drain, void *user_data)
+{
+	return txq_new_full(drain, user_data, -1);
+}
+
+
+/*
+ * 在main loop线程中调用, 队列中没有取出的数据会被丢弃
+ */
+void txq_free(struct txq_t *q)
+{
+	if(!q) {
+		return;
+	}
+
+	if(q->watch_id) {
+		g_source_remove(q->watch_id);
+	}
+
+	if(q->own_efd) {
+		close(q->efd);
+	}
+
+	free(q);
+}
+
+
+void txq_set_writable_cb(struct txq_t *q, txq_writable_t writable)
+{
+	q->writable = writable;
+}
+
+
+/*
+ * 流控: 由gate决定每次最多取出多少个包
+ */
+void txq_set_gate(struct txq_t *q, txq_gate_t gate)
+{
+	q->gate = gate;
+}
+
+
+static void txq_wakeup(struct txq_t *q)
+{
+	uint64_t one = 1;
+
+	if(!atomic_exchange(&q->wakeup, 1)) {
+		if(write(q->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			u_tm_log("[%s:%d] eventfd write error: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+		}
+	}
+}
+
+
+/*
+ * 可以在任意线程调用
+ * 将数据按frag_size分片, 一次占用所有需要的槽, 要么全部入队要么都不入队.
+ * 返回TXQ_OK, 队列空间不够返回TXQ_ERR_FULL, 参数错误或者分片数超过队列长度返回TXQ_ERR_INVAL
+ */
+int txq_push_frag(struct txq_t *q, const uint8_t *buf, int len, int frag_size)
+{
+	struct txq_slot_t *slot;
+	size_t pos, seq, n, i;
+	intptr_t dif;
+	int off, frag_len;
+
+	if(!q || len <= 0 || frag_size <= 0 || frag_size > TXQ_SLOT_SIZE) {
+		return TXQ_ERR_INVAL;
+	}
+
+	n = (len + frag_size - 1) / frag_size;
+	if(n > TXQ_SLOT_COUNT) {
+		return TXQ_ERR_INVAL;
+	}
+
+	pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+	while(1) {
+		/*
+		 * 消费者按顺序释放槽, 最后一个槽空闲说明前面的槽都空闲
+		 */
+		slot = &q->slot[(pos + n - 1) & TXQ_SLOT_MASK];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)(pos + n - 1);
+
+		if(dif == 0) {
+			if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + n,
+													memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if(dif < 0) {
+			/*
+			 * 队列满, 唤醒消费者, 由消费者在队列空出来后调用writable
+			 */
+			atomic_store(&q->want_writable, 1);
+			txq_wakeup(q);
+			return TXQ_ERR_FULL;
+		} else {
+			pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+		}
+	}
+
+	for(i = 0, off = 0; i < n; i++, off += frag_len) {
+		frag_len = MIN(frag_size, len - off);
+		slot = &q->slot[(pos + i) & TXQ_SLOT_MASK];
+		memcpy(slot->data, buf + off, frag_len);
+		slot->len = frag_len;
+		atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+	}
+
+	txq_wakeup(q);
+
+	return TXQ_OK;
+}
+
+
+/*
+ * 可以在任意线程调用
+ */
+int txq_push(struct txq_t *q, const uint8_t *buf, int len)
+{
+	return txq_push_frag(q, buf, len, len);
+}
+
+
+/*
+ * 只在main loop线程调用
+ * 返回取出的包的个数
+ */
+static int txq_drain_batch(struct txq_t *q, int max)
+{
+	struct txq_slot_t *slot;
+	size_t seq;
+	int n = 0, pending, allow;
+
+	pending = txq_pending(q);
+	stats_hist_add(STATS_HIST_QUEUE_DEPTH, pending);
+
+	if(q->gate && pending) {
+		allow = q->gate(pending, q->user_data);
+		if(allow >= 0 && allow < max) {
+			max = allow;
+		}
+	}
+
+	while(n < max) {
+		slot = &q->slot[q->tail & TXQ_SLOT_MASK];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+		if(seq != q->tail + 1) {
+			break;
+		}
+
+		q->drain(slot->data, slot->len, q->user_data);
+
+		atomic_store_explicit(&slot->seq, q->tail + TXQ_SLOT_COUNT, memory_order_release);
+		q->tail++;
+		n++;
+	}
+
+	return n;
+}
+
+
+/*
+ * 只在main loop线程调用
+ * 清除唤醒标志, 必须在txq_drain之前调用, 之后push的生产者会重新写eventfd
+ */
+void txq_rearm(struct txq_t *q)
+{
+	atomic_store(&q->wakeup, 0);
+}
+
+
+/*
+ * 只在main loop线程调用
+ * 队列中等待发送的包的个数
+ */
+int txq_pending(struct txq_t *q)
+{
+	return atomic_load_explicit(&q->head, memory_order_relaxed) - q->tail;
+}
+
+
+/*
+ * 只在main loop线程调用
+ * 最多取出max个包交给drain, 返回取出的个数
+ */
+int txq_drain(struct txq_t *q, int max)
+{
+	int n = txq_drain_batch(q, max);
+
+	/*
+	 * 队列空出一半以上才通知, 避免生产者频繁的满/可写切换
+	 */
+	if(atomic_load(&q->want_writable) && txq_pending(q) <= TXQ_SLOT_COUNT / 2) {
+		atomic_store(&q->want_writable, 0);
+		if(q->writable) {
+			q->writable(q->user_data);
+		}
+	}
+
+	return n;
+}
+
+
+/*
+ * 共用eventfd时, 由调用者重新唤醒
+ */
+void txq_kick(struct txq_t *q)
+{
+	txq_wakeup(q);
+}
+
+
+static gboolean txq_fd_callback(gint fd, GIOCondition condition, gpointer user_data)
+{
+	struct txq_t *q = user_data;
+	uint64_t cnt;
+
+	if(read(fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+		u_tm_log("[%s:%d] eventfd read error: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+	}
+
+	txq_rearm(q);
+
+	if(txq_drain(q, TXQ_BATCH) == TXQ_BATCH) {
+		/*
+		 * 还可能有数据, 让出main loop, 下次继续
+		 */
+		txq_wakeup(q);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+
+/*
+ * 在运行main loop的线程中调用
+ */
+int txq_attach(struct txq_t *q)
+{
+	if(!q) {
+		return -1;
+	}
+
+	q->watch_id = g_unix_fd_add(q->efd, G_IO_IN, txq_fd_callback, q);
+
+	/*
+	 * attach之前push的数据
+	 */
+	txq_wakeup(q);
+
+	return 0;
+}
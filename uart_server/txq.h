@@ -0,0 +1,69 @@
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#ifndef __TXQ_H__
+#define __TXQ_H__
+
+#include <stdint.h>
+#include <gio/gio.h>
+
+/*
+ * 槽的个数必须是2的幂
+ */
+#define TXQ_SLOT_COUNT 256
+#define TXQ_SLOT_SIZE 512
+
+/*
+ * 每次唤醒最多处理的数据包个数, 剩下的下次再处理, 避免阻塞main loop
+ */
+#define TXQ_BATCH 32
+
+/*
+ * txq_push/txq_push_frag的返回值
+ */
+#define TXQ_OK 0
+#define TXQ_ERR_FULL -1
+#define TXQ_ERR_INVAL -2
+
+struct txq_t;
+
+/*
+ * 在main loop线程中调用, 每个数据包调用一次
+ */
+typedef void (*txq_drain_t)(uint8_t *buf, int len, void *user_data);
+
+/*
+ * 在main loop线程中调用, push返回TXQ_ERR_FULL之后队列空出一半时调用一次
+ */
+typedef void (*txq_writable_t)(void *user_data);
+
+/*
+ * 在main loop线程中调用, 每次取包之前调用, pending是队列中的包数
+ * 返回现在最多可以取出的包数, 小于0表示不限制
+ * 返回0之后队列停止发送, 可以继续发送时由调用者txq_kick
+ */
+typedef int (*txq_gate_t)(int pending, void *user_data);
+
+struct txq_t *txq_new(txq_drain_t drain, void *user_data);
+struct txq_t *txq_new_full(txq_drain_t drain, void *user_data, int efd);
+void txq_free(struct txq_t *q);
+void txq_set_writable_cb(struct txq_t *q, txq_writable_t writable);
+void txq_set_gate(struct txq_t *q, txq_gate_t gate);
+int txq_attach(struct txq_t *q);
+int txq_push(struct txq_t *q, const uint8_t *buf, int len);
+int txq_push_frag(struct txq_t *q, const uint8_t *buf, int len, int frag_size);
+
+/*
+ * 多个队列共用eventfd时使用
+ */
+void txq_rearm(struct txq_t *q);
+int txq_drain(struct txq_t *q, int max);
+int txq_pending(struct txq_t *q);
+void txq_kick(struct txq_t *q);
+
+
+#endif
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,223 @@
+/*
+ * 发送队列的测试, 不需要蓝牙设备
+ *
+ * 1.TXQ_TEST_THREADS个生产者线程同时txq_push_frag, 队列满时重试,
+ *   测试线程作为唯一的消费者直接txq_drain, 不经过main loop.
+ * 2.每条消息开头是生产者和序号, 数据由生产者, 序号和位置决定, 消费者检查
+ *   每个生产者的消息按顺序到达, 一条消息的片段连续不被其他消息插入, 每个字节都正确,
+ *   最后比较双方的校验和.
+ *
+ * make test 运行, 全部通过时返回0.
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "txq.h"
+
+#define TXQ_TEST_THREADS 4
+#define TXQ_TEST_MSGS 20000
+#define TXQ_TEST_FRAG 200
+#define TXQ_TEST_MAX_LEN (TXQ_TEST_FRAG * 4)
+
+/*
+ * 消息头: 生产者(1字节), 序号(4字节), 长度(2字节)
+ */
+#define TXQ_TEST_HDR 7
+
+struct txq_test_t {
+	struct txq_t *q;
+	int failures;
+
+	atomic_int producers_done;
+	atomic_int full_retries;
+	uint64_t tx_sum[TXQ_TEST_THREADS];
+
+	/*
+	 * 消费者: 正在接收的消息和每个生产者下一个应该收到的序号
+	 */
+	int cur_producer;
+	uint32_t cur_seq;
+	int cur_len;
+	int cur_got;
+	uint32_t next_seq[TXQ_TEST_THREADS];
+	uint64_t rx_sum[TXQ_TEST_THREADS];
+	int messages;
+	int bad_frags;
+	int bad_bytes;
+	int writable;
+};
+
+static struct txq_test_t t;
+
+
+static void txq_test_check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if(!ok) {
+		t.failures++;
+	}
+}
+
+
+static inline uint8_t txq_test_byte(int producer, uint32_t seq, int off)
+{
+	return (uint8_t)(seq * 31 + off * 7 + producer);
+}
+
+
+static int txq_test_len(int producer, uint32_t seq)
+{
+	return TXQ_TEST_HDR + (seq * 131 + producer * 17) % (TXQ_TEST_MAX_LEN - TXQ_TEST_HDR + 1);
+}
+
+
+static void *txq_test_producer(void *arg)
+{
+	int p = (int)(intptr_t)arg, len, i;
+	uint8_t buf[TXQ_TEST_MAX_LEN];
+	uint64_t sum = 0;
+	uint32_t seq;
+
+	for(seq = 0; seq < TXQ_TEST_MSGS; seq++) {
+		len = txq_test_len(p, seq);
+		buf[0] = p;
+		memcpy(buf + 1, &seq, 4);
+		buf[5] = len & 0xff;
+		buf[6] = len >> 8;
+		for(i = TXQ_TEST_HDR; i < len; i++) {
+			buf[i] = txq_test_byte(p, seq, i);
+		}
+
+		while(txq_push_frag(t.q, buf, len, TXQ_TEST_FRAG) == TXQ_ERR_FULL) {
+			atomic_fetch_add(&t.full_retries, 1);
+			sched_yield();
+		}
+
+		for(i = 0; i < len; i++) {
+			sum += buf[i];
+		}
+	}
+
+	t.tx_sum[p] = sum;
+	atomic_fetch_add(&t.producers_done, 1);
+
+	return NULL;
+}
+
+
+/*
+ * 消费者, 一次一个片段
+ */
+static void txq_test_drain(uint8_t *buf, int len, void *user_data)
+{
+	int i, off;
+
+	if(!t.cur_got) {
+		if(len < TXQ_TEST_HDR || buf[0] >= TXQ_TEST_THREADS) {
+			t.bad_frags++;
+			return;
+		}
+		t.cur_producer = buf[0];
+		memcpy(&t.cur_seq, buf + 1, 4);
+		t.cur_len = buf[5] | (buf[6] << 8);
+		if(t.cur_seq != t.next_seq[t.cur_producer]) {
+			t.bad_frags++;
+		}
+		t.next_seq[t.cur_producer] = t.cur_seq + 1;
+	}
+
+	/*
+	 * 除了最后一个片段都是TXQ_TEST_FRAG字节
+	 */
+	if(t.cur_got + len > t.cur_len || (t.cur_got + len < t.cur_len && len != TXQ_TEST_FRAG)) {
+		t.bad_frags++;
+		t.cur_got = 0;
+		return;
+	}
+
+	for(i = 0; i < len; i++) {
+		off = t.cur_got + i;
+		if(off >= TXQ_TEST_HDR && buf[i] != txq_test_byte(t.cur_producer, t.cur_seq, off)) {
+			t.bad_bytes++;
+		}
+		t.rx_sum[t.cur_producer] += buf[i];
+	}
+
+	t.cur_got += len;
+	if(t.cur_got == t.cur_len) {
+		t.cur_got = 0;
+		t.messages++;
+	}
+}
+
+
+static void txq_test_writable(void *user_data)
+{
+	t.writable++;
+}
+
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[TXQ_TEST_THREADS];
+	int fd, i, sums_ok = 1;
+
+	/*
+	 * 共用eventfd的方式创建, 唤醒写到/dev/null, 测试线程自己取包
+	 */
+	fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if(fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	t.q = txq_new_full(txq_test_drain, NULL, fd);
+	txq_set_writable_cb(t.q, txq_test_writable);
+
+	for(i = 0; i < TXQ_TEST_THREADS; i++) {
+		pthread_create(&threads[i], NULL, txq_test_producer, (void *)(intptr_t)i);
+	}
+
+	while(atomic_load(&t.producers_done) < TXQ_TEST_THREADS || txq_pending(t.q)) {
+		txq_rearm(t.q);
+		if(!txq_drain(t.q, TXQ_BATCH)) {
+			sched_yield();
+		}
+	}
+
+	for(i = 0; i < TXQ_TEST_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	txq_drain(t.q, TXQ_SLOT_COUNT);
+
+	for(i = 0; i < TXQ_TEST_THREADS; i++) {
+		if(t.tx_sum[i] != t.rx_sum[i] || t.next_seq[i] != TXQ_TEST_MSGS) {
+			sums_ok = 0;
+		}
+	}
+
+	printf("%d messages, %d full retries\n", t.messages, atomic_load(&t.full_retries));
+	txq_test_check(t.messages == TXQ_TEST_THREADS * TXQ_TEST_MSGS, "all messages received");
+	txq_test_check(!t.bad_frags, "messages in order, fragments not interleaved");
+	txq_test_check(!t.bad_bytes, "payload bytes");
+	txq_test_check(sums_ok, "checksum per producer");
+	txq_test_check(!atomic_load(&t.full_retries) || t.writable > 0, "writable after full");
+	txq_test_check(txq_pending(t.q) == 0, "queue empty");
+
+	txq_free(t.q);
+	close(fd);
+
+	printf("%s\n", t.failures ? "FAILED" : "PASSED");
+
+	return t.failures ? 1 : 0;
+}
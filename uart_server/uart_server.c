@@ -2,14 +2,776 @@
 #include "uart_server.h"
 #include "log.h"
 #include "adapter.h"
+#include "txq.h"
+#include "frame.h"
+#include "session.h"
+#include "stats.h"
+#include "att_l2cap.h"
+#include "hci.h"
 #include <gio/gio.h>
 #include <stdlib.h>
 #include <glib.h>
+#include <string.h>
 
 
 #define BLUEZ_BUS_NAME "org.bluez"
 
 static pthread_t pthread_hand;
+static GDBusConnection *bus_conn;
+
+/*
+ * 每个adapter一个uart server, 有自己的广播, gatt application和接收回调
+ */
+struct uart_instance_t {
+	char *adapter;		/* adapter的object path, 例如/org/bluez/hci0 */
+	const char *name;	/* adapter的名字, 例如hci0 */
+	struct server_t *gatt;
+	struct advertising_t *adv;
+	/*
+	 * 调整链路参数的HCI通道, 没有权限时为NULL
+	 */
+	struct hci_engine_t *hci;
+	uart_receive_t receive_cb;
+	/*
+	 * StartNotify打开的通知, adapter移除时需要告诉会话层
+	 */
+	int start_notifying;
+	/*
+	 * 分片大小, 在uart server线程中由uart_server_update_payload_size计算, 其他线程只读取
+	 */
+	gint payload_size;
+	/*
+	 * 启动过程: 同时打开Powered和Discoverable, Powered成功后同时注册广播和gatt application
+	 * 所有调用都是异步的, adapter移除时通过cancellable取消
+	 */
+	GCancellable *cancellable;
+	uint64_t start_time;
+	int advertising;
+	int registered;
+};
+
+/*
+ * adapter object path -> struct uart_instance_t
+ * 只在uart server线程中修改, 修改和其他线程访问时加锁
+ */
+static GHashTable *instances;
+
+/*
+ * adapter名字 -> uart_receive_t, uart_server_init_adapter设置的adapter
+ * serve_all: 调用过uart_server_init, 使用所有adapter
+ */
+static GHashTable *adapter_cbs;
+static int serve_all;
+G_LOCK_DEFINE_STATIC(uart_instances);
+
+/*
+ * 所有打开通知的adapter中最小的分片大小, 没有时为0, 和payload_size一样只在uart server线程中修改
+ */
+static gint tx_payload_size;
+
+/*
+ * 正在调用接收回调的adapter, 给uart_server_rx_hold使用
+ */
+static struct uart_instance_t *rx_instance;
+
+/*
+ * 应用线程发送的数据先放入队列, 在uart_server_process线程中发送
+ */
+static struct txq_t *tx_queue;
+static uart_writable_t writable_cb;
+
+static uart_receive_t receive_cb;
+
+/*
+ * 设置了message_cb后, 接收的数据经过分帧层解码, 以完整的消息交给message_cb
+ * 每个设备(会话)有独立的分帧层
+ */
+static uart_message_t message_cb;
+
+static uart_session_receive_t session_receive_cb;
+static uart_session_message_t session_message_cb;
+
+/*
+ * 发送使用indication, 每个包都由客户端确认
+ */
+static int indicate_mode;
+
+/*
+ * ATT模式: 不经过D-Bus和bluetoothd, 直接在L2CAP ATT通道上提供服务
+ * att_srv在uart server线程中创建, 其他线程只读取分片大小
+ */
+static int att_mode;
+static char *att_address;
+static struct att_server_t *att_srv;
+static struct hci_engine_t *att_hci;
+
+
+static void uart_server_rx_message(uint8_t *msg, int len, void *user_data)
+{
+	struct session_t *s = user_data;
+
+	if(message_cb) {
+		message_cb(msg, len);
+	}
+
+	if(session_message_cb) {
+		session_message_cb(s->device, msg, len);
+	}
+}
+
+
+/*
+ * gatt收到的数据先交给adapter的原始数据回调, 再交给发送数据的设备的会话
+ */
+static void uart_server_rx(uint8_t *buf, int len, void *user_data)
+{
+	struct uart_instance_t *inst = user_data;
+	struct session_t *s;
+
+	rx_instance = inst;
+
+	if(inst->receive_cb) {
+		inst->receive_cb(buf, len);
+	}
+
+	s = session_get(inst->gatt, gatt_uart_rx_device(inst->gatt));
+	s->rx_bytes += len;
+
+	if(session_receive_cb) {
+		session_receive_cb(s->device, buf, len);
+	}
+
+	if(message_cb || session_message_cb) {
+		frame_decoder_feed(&s->decoder, buf, len);
+	}
+
+	rx_instance = NULL;
+}
+
+
+/*
+ * ATT模式收到的数据只交给原始数据回调
+ */
+static void uart_server_att_rx(struct att_conn_t *conn, uint8_t *buf, int len, void *user_data)
+{
+	if(receive_cb) {
+		receive_cb(buf, len);
+	}
+}
+
+
+static int uart_instance_payload_size(struct uart_instance_t *inst);
+
+/*
+ * 在uart server线程中调用, MTU, 通知或者压缩变化时重新计算分片大小
+ * 发送的线程只读取payload_size和tx_payload_size, 不需要加锁
+ */
+static void uart_server_update_payload_size(void)
+{
+	struct uart_instance_t *inst;
+	GHashTableIter iter;
+	int size = 0, n;
+
+	g_hash_table_iter_init(&iter, instances);
+	while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&inst)) {
+		n = uart_instance_payload_size(inst);
+		g_atomic_int_set(&inst->payload_size, n);
+
+		if(gatt_uart_is_notifying(inst->gatt) && (!size || n < size)) {
+			size = n;
+		}
+	}
+
+	g_atomic_int_set(&tx_payload_size, size);
+}
+
+
+static void uart_server_payload_changed(void *user_data)
+{
+	uart_server_update_payload_size();
+}
+
+
+static void uart_server_mtu_changed(const char *device, int mtu, void *user_data)
+{
+	struct uart_instance_t *inst = user_data;
+
+	session_set_mtu(inst->gatt, device, mtu);
+	uart_server_update_payload_size();
+}
+
+
+static void uart_server_notify(const char *device, int notifying, void *user_data)
+{
+	struct uart_instance_t *inst = user_data;
+
+	if(!device) {
+		inst->start_notifying = notifying;
+	}
+
+	/*
+	 * 连接断开时bluez会关闭通知, 重新快速广播让设备尽快重连
+	 */
+	if(!notifying) {
+		advertising_fast(inst->adv);
+	}
+
+	session_set_notifying(inst->gatt, device, notifying);
+	uart_server_update_payload_size();
+}
+
+/*
+ * 按size分片发送, size已经去掉了gatt_uart_tx_overhead
+ * 队列中的包在打开压缩之前分片时没有留出压缩头, 这里再分一次
+ */
+static void uart_server_gatt_send(struct server_t *gatt, int size, uint8_t *buf, int len)
+{
+	while(size > 0 && len > size) {
+		gatt_uart_send(gatt, buf, size);
+		buf += size;
+		len -= size;
+	}
+
+	gatt_uart_send(gatt, buf, len);
+}
+
+
+/*
+ * user_data为NULL时是公共发送队列, 发送给所有adapter
+ * 否则是会话的发送队列, 从收到这个设备数据的adapter发送
+ */
+static void uart_server_tx_drain(uint8_t *buf, int len, void *user_data)
+{
+	struct session_t *s = user_data;
+	struct uart_instance_t *inst;
+	GHashTableIter iter;
+
+	int sent = 0, size;
+
+	if(att_mode) {
+		att_server_send(att_srv, buf, len);
+		return;
+	}
+
+	if(s) {
+		size = g_atomic_int_get(&s->mtu);
+		size = size ? gatt_mtu_payload_size(size) : gatt_uart_payload_size(s->owner);
+		uart_server_gatt_send(s->owner, size - gatt_uart_tx_overhead(s->owner), buf, len);
+		return;
+	}
+
+	g_hash_table_iter_init(&iter, instances);
+	while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&inst)) {
+		if(gatt_uart_is_notifying(inst->gatt)) {
+			uart_server_gatt_send(inst->gatt, g_atomic_int_get(&inst->payload_size), buf, len);
+			sent = 1;
+		}
+	}
+
+	if(!sent) {
+		stats_inc(STATS_TX_DROP_NOT_NOTIFYING);
+	}
+}
+
+
+/*
+ * 发送队列的流控, user_data和uart_server_tx_drain一样
+ * 会话队列按owner的信用发送, 公共队列发给所有打开通知的adapter, 按最少的信用发送
+ */
+static int uart_server_tx_gate(int pending, void *user_data)
+{
+	struct session_t *s = user_data;
+	struct uart_instance_t *inst;
+	GHashTableIter iter;
+	int allow = -1, n;
+
+	if(att_mode) {
+		return att_srv && att_server_tx_blocked(att_srv) ? 0 : -1;
+	}
+
+	if(s) {
+		allow = gatt_uart_tx_credits(s->owner);
+		if(!allow) {
+			gatt_uart_tx_stall(s->owner);
+		}
+		return allow;
+	}
+
+	g_hash_table_iter_init(&iter, instances);
+	while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&inst)) {
+		if(!gatt_uart_is_notifying(inst->gatt)) {
+			continue;
+		}
+		n = gatt_uart_tx_credits(inst->gatt);
+		if(!n) {
+			gatt_uart_tx_stall(inst->gatt);
+		}
+		if(n >= 0 && (allow < 0 || n < allow)) {
+			allow = n;
+		}
+	}
+
+	return allow;
+}
+
+
+/*
+ * 收到流控信用或者关闭了流控, 停止的发送队列继续发送
+ */
+static void uart_server_tx_credit(int credits, void *user_data)
+{
+	struct uart_instance_t *inst = user_data;
+
+	if(txq_pending(tx_queue)) {
+		txq_kick(tx_queue);
+	}
+	session_kick(inst->gatt);
+}
+
+
+static void uart_server_tx_writable(void *user_data)
+{
+	if(writable_cb) {
+		writable_cb();
+	}
+}
+
+
+static const char *uart_server_adapter_name(const char *adapter)
+{
+	const char *name = strrchr(adapter, '/');
+
+	return name ? name + 1 : adapter;
+}
+
+
+/*
+ * 返回adapter是否需要uart server, 需要时cb为adapter的接收回调
+ */
+static int uart_server_adapter_cb(const char *adapter, uart_receive_t *cb)
+{
+	gpointer func;
+	int ret = 0;
+
+	G_LOCK(uart_instances);
+	if(g_hash_table_lookup_extended(adapter_cbs, uart_server_adapter_name(adapter), NULL, &func)) {
+		*cb = (uart_receive_t)func;
+		ret = 1;
+	} else if(serve_all) {
+		*cb = receive_cb;
+		ret = 1;
+	}
+	G_UNLOCK(uart_instances);
+
+	return ret;
+}
+
+
+static void uart_server_hci_disconnected(struct hci_engine_t *eng)
+{
+	GHashTableIter iter;
+	struct uart_instance_t *inst;
+
+	if(att_mode) {
+		advertising_hci_enable(eng);
+		return;
+	}
+
+	g_hash_table_iter_init(&iter, instances);
+	while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&inst)) {
+		if(inst->hci == eng) {
+			advertising_fast(inst->adv);
+		}
+	}
+}
+
+
+#define UART_HCI_LE16(p) ((p)[0] | ((p)[1] << 8))
+
+/*
+ * 新的LE连接打开DLE和2M PHY, 连接断开后重新快速广播
+ * 连接完成, PHY更新和断开的参数以status开始, 数据长度变化没有status
+ */
+static void uart_server_hci_event(uint8_t subevent, const uint8_t *data, int len, void *user_data)
+{
+	struct hci_engine_t *eng = user_data;
+
+	switch(subevent) {
+	case HCI_EV_LE_CONN_COMPLETE:
+	case HCI_EV_LE_ENH_CONN_COMPLETE:
+		if(len >= 3 && !data[0]) {
+			u_tm_log("hci le connected handle 0x%04x\n", UART_HCI_LE16(data + 1) & 0x0fff);
+			hci_le_tune_link(eng, UART_HCI_LE16(data + 1) & 0x0fff);
+		}
+		break;
+	case HCI_EV_LE_DATA_LEN_CHANGE:
+		/*
+		 * handle, max tx octets, max tx time, max rx octets, max rx time
+		 */
+		if(len >= 10) {
+			u_tm_log("hci handle 0x%04x tx octets %d time %d rx octets %d time %d\n",
+						UART_HCI_LE16(data) & 0x0fff, UART_HCI_LE16(data + 2), UART_HCI_LE16(data + 4),
+						UART_HCI_LE16(data + 6), UART_HCI_LE16(data + 8));
+		}
+		break;
+	case HCI_EV_LE_PHY_UPDATE_COMPLETE:
+		if(len >= 5 && !data[0]) {
+			u_tm_log("hci handle 0x%04x tx phy %d rx phy %d\n",
+						UART_HCI_LE16(data + 1) & 0x0fff, data[3], data[4]);
+		}
+		break;
+	case HCI_EV_DISCONN_PSEUDO:
+		if(len >= 3 && !data[0]) {
+			uart_server_hci_disconnected(eng);
+		}
+		break;
+	}
+}
+
+
+/*
+ * 打开adapter的HCI通道, 设置之后连接的默认数据长度和PHY
+ * 失败时(例如没有CAP_NET_RAW)返回NULL, 使用控制器的默认参数
+ */
+static struct hci_engine_t *uart_server_hci_open(int dev_id)
+{
+	struct hci_engine_t *eng;
+
+	if(dev_id < 0) {
+		return NULL;
+	}
+
+	eng = hci_engine_open(dev_id);
+	if(!eng) {
+		return NULL;
+	}
+
+	hci_engine_set_event_cb(eng, uart_server_hci_event, eng);
+	hci_engine_attach(eng);
+	hci_le_tune_defaults(eng);
+
+	return eng;
+}
+
+
+/*
+ * 第一次注册成功时记录从发现adapter开始的时间
+ */
+static void uart_instance_advertising(struct advertising_t *adv, int ok, void *user_data)
+{
+	struct uart_instance_t *inst = user_data;
+	uint64_t us;
+
+	if(!ok || inst->advertising) {
+		return;
+	}
+
+	inst->advertising = 1;
+	us = (stats_now() - inst->start_time) / 1000;
+	stats_hist_add(STATS_HIST_TIME_TO_ADVERTISE, us);
+	u_tm_log("%s time to advertise %d us\n", inst->name, (int)us);
+}
+
+
+static void uart_instance_registered(struct server_t *srv, int ok, void *user_data)
+{
+	struct uart_instance_t *inst = user_data;
+	uint64_t us;
+
+	if(!ok || inst->registered) {
+		return;
+	}
+
+	inst->registered = 1;
+	us = (stats_now() - inst->start_time) / 1000;
+	stats_hist_add(STATS_HIST_TIME_TO_REGISTERED, us);
+	u_tm_log("%s time to registered %d us\n", inst->name, (int)us);
+}
+
+
+/*
+ * Powered设置完成(重试用完时也继续, adapter可能已经是打开的), 开始广播和注册gatt application
+ */
+static void uart_instance_powered(GVariant *reply, const GError *error, void *user_data)
+{
+	struct uart_instance_t *inst = user_data;
+
+	u_tm_log("%s powered %s\n", inst->name, error ? "failed" : "ok");
+
+	inst->adv = advertising_start(bus_conn, inst->adapter, uart_instance_advertising, inst);
+	gatt_uart_server_register(inst->gatt, uart_instance_registered, inst);
+}
+
+
+static void uart_instance_discoverable(GVariant *reply, const GError *error, void *user_data)
+{
+	struct uart_instance_t *inst = user_data;
+
+	u_tm_log("%s discoverable %s\n", inst->name, error ? "failed" : "ok");
+}
+
+
+/*
+ * adapter重新打开后快速广播, 让之前连接的设备尽快重连
+ */
+static void uart_server_adapter_changed(const char *adapter, const char *name, int value, void *user_data)
+{
+	struct uart_instance_t *inst = g_hash_table_lookup(instances, adapter);
+
+	u_tm_log("%s %s = %d\n", adapter, name, value);
+
+	if(inst && value && !strcmp(name, "Powered")) {
+		advertising_fast(inst->adv);
+	}
+}
+
+
+/*
+ * 在uart server线程中调用, 在adapter上启动uart server
+ */
+static void uart_instance_add(const char *adapter)
+{
+	struct uart_instance_t *inst;
+	uart_receive_t cb = NULL;
+
+	if(!uart_server_adapter_cb(adapter, &cb)) {
+		return;
+	}
+
+	inst = g_hash_table_lookup(instances, adapter);
+	if(inst) {
+		inst->receive_cb = cb;
+		return;
+	}
+
+	u_tm_log("[%s:%d] adapter %s added\n", __FUNCTION__, __LINE__, adapter);
+
+	inst = g_new0(struct uart_instance_t, 1);
+	inst->adapter = g_strdup(adapter);
+	inst->name = uart_server_adapter_name(inst->adapter);
+	inst->receive_cb = cb;
+	inst->start_time = stats_now();
+
+	/*
+	 * 本地的gatt对象, 向bluez注册在adapter打开之后
+	 */
+	inst->gatt = gatt_uart_server_new(bus_conn, adapter, uart_server_rx, uart_server_notify, inst);
+	if(!inst->gatt) {
+		g_free(inst->adapter);
+		g_free(inst);
+		return;
+	}
+	gatt_uart_set_mtu_cb(inst->gatt, uart_server_mtu_changed);
+	gatt_uart_set_credit_cb(inst->gatt, uart_server_tx_credit);
+	gatt_uart_set_payload_cb(inst->gatt, uart_server_payload_changed);
+	gatt_uart_set_indicate(inst->gatt, indicate_mode);
+
+	adapter_cache_start(bus_conn, adapter);
+
+	inst->cancellable = g_cancellable_new();
+	adapter_power_on_async(bus_conn, adapter, inst->cancellable, uart_instance_powered, inst);
+	adapter_discoverable_enable_async(bus_conn, adapter, inst->cancellable, uart_instance_discoverable, inst);
+
+	inst->hci = uart_server_hci_open(hci_dev_id(adapter));
+
+	G_LOCK(uart_instances);
+	g_hash_table_insert(instances, inst->adapter, inst);
+	G_UNLOCK(uart_instances);
+
+	uart_server_update_payload_size();
+}
+
+
+/*
+ * 在uart server线程中调用, adapter被拔掉时释放它的uart server
+ */
+static void uart_instance_remove(const char *adapter)
+{
+	struct uart_instance_t *inst;
+
+	G_LOCK(uart_instances);
+	inst = g_hash_table_lookup(instances, adapter);
+	if(inst) {
+		g_hash_table_remove(instances, adapter);
+	}
+	G_UNLOCK(uart_instances);
+
+	if(!inst) {
+		return;
+	}
+
+	u_tm_log("[%s:%d] adapter %s removed\n", __FUNCTION__, __LINE__, adapter);
+
+	g_cancellable_cancel(inst->cancellable);
+	g_object_unref(inst->cancellable);
+	adapter_cache_stop(adapter);
+
+	if(inst->start_notifying) {
+		session_set_notifying(inst->gatt, NULL, 0);
+	}
+	session_remove_owner(inst->gatt);
+
+	gatt_uart_server_free(inst->gatt);
+	advertising_stop(inst->adv);
+	hci_engine_free(inst->hci);
+	g_free(inst->adapter);
+	g_free(inst);
+
+	uart_server_update_payload_size();
+}
+
+
+/*
+ * 通过bluez的ObjectManager查找所有adapter
+ * reply type: "(a{oa{sa{sv}}})"
+ */
+static void uart_server_scan_ready(GVariant *reply, const GError *error, void *user_data)
+{
+	GVariantIter *iter;
+	GVariant *ifaces, *props;
+	const char *path;
+
+	if(error || !g_variant_is_of_type(reply, G_VARIANT_TYPE("(a{oa{sa{sv}}})"))) {
+		return;
+	}
+
+	g_variant_get(reply, "(a{oa{sa{sv}}})", &iter);
+	while(g_variant_iter_next(iter, "{&o@a{sa{sv}}}", &path, &ifaces)) {
+		props = g_variant_lookup_value(ifaces, "org.bluez.Adapter1", NULL);
+		if(props) {
+			uart_instance_add(path);
+			g_variant_unref(props);
+		}
+		g_variant_unref(ifaces);
+	}
+
+	g_variant_iter_free(iter);
+}
+
+
+static void uart_server_scan_adapters(void)
+{
+	bluez_call_async(bus_conn, "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects",
+					NULL, NULL, uart_server_scan_ready, NULL);
+}
+
+
+/*
+ * bluez的InterfacesAdded/InterfacesRemoved, 处理adapter的插拔
+ * InterfacesAdded params type: "(oa{sa{sv}})"
+ * InterfacesRemoved params type: "(oas)"
+ */
+static void uart_server_interfaces_changed(GDBusConnection *conn,
+							const gchar *sender,
+							const gchar *object_path,
+							const gchar *interface_name,
+							const gchar *signal_name,
+							GVariant *params,
+							gpointer user_data)
+{
+	const char *path;
+	GVariant *ifaces, *props;
+	const gchar **names;
+	int i;
+
+	if(!strcmp(signal_name, "InterfacesAdded")) {
+		g_variant_get(params, "(&o@a{sa{sv}})", &path, &ifaces);
+		props = g_variant_lookup_value(ifaces, "org.bluez.Adapter1", NULL);
+		if(props) {
+			uart_instance_add(path);
+			g_variant_unref(props);
+		}
+		g_variant_unref(ifaces);
+	} else if(!strcmp(signal_name, "InterfacesRemoved")) {
+		g_variant_get(params, "(&o^a&s)", &path, &names);
+		for(i = 0; names[i]; i++) {
+			if(!strcmp(names[i], "org.bluez.Adapter1")) {
+				uart_instance_remove(path);
+				break;
+			}
+		}
+		g_free(names);
+	}
+}
+
+
+/*
+ * 在uart server线程中调用, 启动后新设置的adapter
+ */
+static gboolean uart_server_rescan(gpointer user_data)
+{
+	uart_server_scan_adapters();
+	return G_SOURCE_REMOVE;
+}
+
+
+/*
+ * ATT连接的socket满了之后又可以写, 发送队列继续发送
+ */
+static void uart_server_att_writable(void *user_data)
+{
+	if(txq_pending(tx_queue)) {
+		txq_kick(tx_queue);
+	}
+}
+
+
+static void uart_server_att_listen(const char *address)
+{
+	struct att_server_t *srv = att_server_new(uart_server_att_rx, NULL, NULL);
+
+	att_server_set_writable_cb(srv, uart_server_att_writable);
+
+	if(att_server_listen(srv, address) < 0) {
+		att_server_free(srv);
+		return;
+	}
+
+	g_atomic_pointer_set(&att_srv, srv);
+	txq_attach(tx_queue);
+}
+
+
+/*
+ * 在adapter自己的地址上监听, 读取失败时监听所有adapter
+ */
+static void uart_server_att_bd_addr(uint8_t status, const uint8_t *rparam, int rlen, void *user_data)
+{
+	char address[18];
+
+	if(status || rlen < 7) {
+		uart_server_att_listen(NULL);
+		return;
+	}
+
+	g_snprintf(address, sizeof(address), "%02X:%02X:%02X:%02X:%02X:%02X",
+				rparam[6], rparam[5], rparam[4], rparam[3], rparam[2], rparam[1]);
+	uart_server_att_listen(address);
+}
+
+
+/*
+ * att_address是地址时直接监听, 广播需要另外打开
+ * 是adapter名字(默认hci0)时由HCI通道广播, 读取adapter地址后再监听
+ */
+static void uart_server_att_start(void)
+{
+	int dev_id = att_address ? hci_dev_id(att_address) : 0;
+
+	if(dev_id < 0) {
+		uart_server_att_listen(att_address);
+		return;
+	}
+
+	att_hci = uart_server_hci_open(dev_id);
+	if(!att_hci) {
+		uart_server_att_listen(NULL);
+		return;
+	}
+
+	advertising_start_hci(att_hci);
+	hci_read_bd_addr(att_hci, uart_server_att_bd_addr, NULL);
+}
 
 
 static void *uart_server_process(void *arg)
@@ -18,6 +780,12 @@ static void *uart_server_process(void *arg)
 	
 	GError *error = NULL;
 	loop = g_main_loop_new (NULL, FALSE);
+
+	if(att_mode) {
+		uart_server_att_start();
+		g_main_loop_run(loop);
+		return 0;
+	}
 	
 	GDBusConnection *conn = g_bus_get_sync(
 											G_BUS_TYPE_SYSTEM, 
@@ -32,21 +800,28 @@ static void *uart_server_process(void *arg)
 	const char *bus_name = g_dbus_connection_get_unique_name(conn);
 	u_tm_log("bus_name = %s\n", bus_name);
 
-	adapter_power_on(conn);
-	adapter_discoverable_enable(conn);
+	bus_conn = conn;
 
-	u_tm_log("adapter_power_state = %d\n", adapter_power_state(conn));
-	u_tm_log("adapter_discoverable_state = %d\n", adapter_discoverable_state(conn));
-	
-	/*
-	 * 开始广播
-	 */
-	advertising_start(conn);
+	stats_register(conn);
 
-	/*
-	 * 注册gatt server
-	 */
-	gatt_uart_server_start(conn);
+	adapter_cache_set_cb(uart_server_adapter_changed, NULL);
+
+	session_start(conn, uart_server_rx_message, uart_server_tx_drain, uart_server_tx_writable, uart_server_tx_gate);
+
+	g_dbus_connection_signal_subscribe(conn,
+									BLUEZ_BUS_NAME,
+									"org.freedesktop.DBus.ObjectManager",
+									NULL,
+									"/",
+									NULL,
+									G_DBUS_SIGNAL_FLAGS_NONE,
+									uart_server_interfaces_changed,
+									NULL,
+									NULL);
+
+	uart_server_scan_adapters();
+
+	txq_attach(tx_queue);
 
 	g_main_loop_run(loop);
 
@@ -55,29 +830,345 @@ static void *uart_server_process(void *arg)
 }
 
 
-void uart_server_init(uart_receive_t cb)
+/*
+ * 第一次调用时启动ble uart线程, 之后在线程中重新查找adapter
+ */
+static void uart_server_start(void)
 {
 	static int is_init = 0;
 
-	if(!is_init) {
-		is_init = 1;
-		/*
-		 * 注册串口接收回调函数
-	 	 */
-		gatt_uart_register_receive_cb(cb);
+	if(is_init) {
+		g_idle_add(uart_server_rescan, NULL);
+		return;
+	}
 
-		/*
-		 * 启动ble uart 线程
-		 */
-		pthread_create(&pthread_hand, NULL, uart_server_process, NULL);
+	is_init = 1;
+
+	tx_queue = txq_new(uart_server_tx_drain, NULL);
+	txq_set_writable_cb(tx_queue, uart_server_tx_writable);
+	txq_set_gate(tx_queue, uart_server_tx_gate);
+
+	/*
+	 * 启动ble uart 线程
+	 */
+	pthread_create(&pthread_hand, NULL, uart_server_process, NULL);
+}
+
+
+static void uart_server_config_init(void)
+{
+	if(!adapter_cbs) {
+		instances = g_hash_table_new(g_str_hash, g_str_equal);
+		adapter_cbs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+}
+
+
+/*
+ * 在所有adapter上启动uart server, 包括之后插入的adapter
+ * 用uart_server_init_adapter单独设置过的adapter使用自己的回调
+ */
+void uart_server_init(uart_receive_t cb)
+{
+	G_LOCK(uart_instances);
+	uart_server_config_init();
+	/*
+	 * 注册串口接收回调函数
+ 	 */
+	receive_cb = cb;
+	serve_all = 1;
+	G_UNLOCK(uart_instances);
+
+	uart_server_start();
+}
+
+
+/*
+ * ATT模式, 必须在uart_server_init/uart_server_init_adapter之前调用, 两种模式不能同时使用
+ * address是adapter的名字(hci0)或者地址, NULL表示hci0
+ * 1.需要bluetoothd没有运行或者没有占用ATT通道.
+ *   使用adapter名字时通过HCI通道广播(需要CAP_NET_RAW), 使用地址时广播需要另外打开.
+ * 2.只支持原始数据回调和uart_server_send/uart_server_send_stream,
+ *   会话和分帧层依赖bluez的设备对象, 这个模式下不可用.
+ */
+void uart_server_init_att(const char *address, uart_receive_t cb)
+{
+	G_LOCK(uart_instances);
+	if(tx_queue) {
+		G_UNLOCK(uart_instances);
+		u_tm_log("Error: uart server already started\n");
+		return;
+	}
+	receive_cb = cb;
+	att_mode = 1;
+	att_address = g_strdup(address);
+	G_UNLOCK(uart_instances);
+
+	uart_server_start();
+}
+
+
+/*
+ * 在一个adapter上启动uart server, adapter可以是名字(hci0)或者object path(/org/bluez/hci0)
+ * 可以多次调用, 每个adapter有自己的接收回调, adapter之后才插入也可以
+ * 没有调用uart_server_init时只使用这样设置过的adapter
+ */
+void uart_server_init_adapter(const char *adapter, uart_receive_t cb)
+{
+	G_LOCK(uart_instances);
+	uart_server_config_init();
+	g_hash_table_replace(adapter_cbs, g_strdup(uart_server_adapter_name(adapter)), (gpointer)cb);
+	G_UNLOCK(uart_instances);
+
+	uart_server_start();
+}
+
+
+/*
+ * 按照当前的MTU将数据分片, 全部放入发送队列或者全部不放入
+ */
+static enum uart_send_status_t uart_server_push(struct txq_t *q, const uint8_t *buf, int len, int frag)
+{
+	switch(txq_push_frag(q, buf, len, frag)) {
+	case TXQ_OK:
+		return UART_SEND_QUEUED;
+	case TXQ_ERR_FULL:
+		stats_inc(STATS_TX_QUEUE_FULL);
+		return UART_SEND_WOULD_BLOCK;
+	default:
+		return UART_SEND_DROPPED;
 	}
 }
 
 
+/*
+ * 在uart server线程中调用
+ * adapter的分片大小: 知道设备的MTU时按这个adapter上最小的设备MTU - 3,
+ * 否则按AcquireNotify/AcquireWrite得到的MTU或者最小的MTU
+ * 打开压缩时留出压缩包头
+ */
+static int uart_instance_payload_size(struct uart_instance_t *inst)
+{
+	int mtu = session_min_mtu(inst->gatt);
+	int size = mtu ? gatt_mtu_payload_size(mtu) : gatt_uart_payload_size(inst->gatt);
+
+	return size - gatt_uart_tx_overhead(inst->gatt);
+}
+
+
+/*
+ * 可以在任意线程调用
+ * owner为NULL时返回所有打开通知的adapter中最小的分片大小, 否则返回owner的分片大小
+ * 没有可以发送的adapter时返回0
+ */
+static int uart_server_payload_size(struct server_t *owner)
+{
+	struct uart_instance_t *inst;
+
+	if(att_mode) {
+		struct att_server_t *srv = g_atomic_pointer_get(&att_srv);
+		return srv ? att_server_payload_size(srv) : 0;
+	}
+
+	if(!owner) {
+		return g_atomic_int_get(&tx_payload_size);
+	}
+
+	inst = gatt_uart_user_data(owner);
+
+	return g_atomic_int_get(&inst->payload_size);
+}
+
+
+enum uart_send_status_t uart_server_send_stream(const uint8_t *buf, int len)
+{
+	int frag = uart_server_payload_size(NULL);
+
+	if(!frag) {
+		return UART_SEND_DROPPED;
+	}
+
+	return uart_server_push(tx_queue, buf, len, frag);
+}
+
+
+/*
+ * 可以在任意线程调用
+ * 和uart_server_send_stream一样按当前的MTU分片, 放不下时丢弃
+ */
 void uart_server_send(uint8_t *buf, int len)
 {
-	gatt_uart_send(buf, len);
+	int frag = uart_server_payload_size(NULL);
+
+	if(len <= 0) {
+		return;
+	}
+
+	if(!frag) {
+		stats_inc(STATS_TX_DROP_NOT_NOTIFYING);
+		return;
+	}
+
+	switch(txq_push_frag(tx_queue, buf, len, frag)) {
+	case TXQ_OK:
+		break;
+	case TXQ_ERR_FULL:
+		stats_inc(STATS_TX_QUEUE_FULL);
+		u_tm_log("[%s:%d] tx queue full, drop %d bytes\n", __FUNCTION__, __LINE__, len);
+		break;
+	default:
+		stats_inc(STATS_TX_DROP_TOO_LONG);
+		u_tm_log("[%s:%d] %d bytes too long for tx queue, drop\n", __FUNCTION__, __LINE__, len);
+		break;
+	}
 }
 
 
+/*
+ * 可以在任意线程调用
+ * 放入设备的会话的发送队列, 各个会话轮流发送
+ */
+enum uart_send_status_t uart_server_send_to(const char *device, const uint8_t *buf, int len)
+{
+	enum uart_send_status_t ret = UART_SEND_DROPPED;
+	struct session_t *s;
+
+	s = session_lookup(device);
+	if(!s) {
+		return UART_SEND_DROPPED;
+	}
+
+	if(session_is_notifying(s)) {
+		int mtu = g_atomic_int_get(&s->mtu);
+		int frag = mtu ? gatt_mtu_payload_size(mtu) - gatt_uart_tx_overhead(s->owner)
+						: uart_server_payload_size(s->owner);
+		if(frag) {
+			ret = uart_server_push(s->txq, buf, len, frag);
+		}
+	}
+
+	session_unref(s);
+
+	return ret;
+}
+
 
+void uart_server_set_writable_cb(uart_writable_t cb)
+{
+	writable_cb = cb;
+}
+
+
+/*
+ * 发送使用indication, 需要在uart_server_init之前调用
+ * 每个包都由客户端确认, 吞吐比notification低, ATT模式不支持
+ */
+void uart_server_set_indicate(int on)
+{
+	indicate_mode = on;
+}
+
+
+/*
+ * 打开分帧层, 需要在uart_server_init之前调用
+ */
+void uart_server_set_message_cb(uart_message_t cb)
+{
+	message_cb = cb;
+}
+
+
+/*
+ * 可以在任意线程调用
+ * 将消息编码成一帧后按照uart_server_send_stream发送
+ */
+enum uart_send_status_t uart_server_send_message(const uint8_t *msg, int len)
+{
+	uint8_t frame[FRAME_ENCODED_MAX(FRAME_MAX_PAYLOAD)];
+	int n;
+
+	n = frame_encode(msg, len, frame, sizeof(frame));
+	if(n < 0) {
+		return UART_SEND_DROPPED;
+	}
+
+	return uart_server_send_stream(frame, n);
+}
+
+
+enum uart_send_status_t uart_server_send_message_to(const char *device, const uint8_t *msg, int len)
+{
+	uint8_t frame[FRAME_ENCODED_MAX(FRAME_MAX_PAYLOAD)];
+	int n;
+
+	n = frame_encode(msg, len, frame, sizeof(frame));
+	if(n < 0) {
+		return UART_SEND_DROPPED;
+	}
+
+	return uart_server_send_to(device, frame, n);
+}
+
+
+/*
+ * 按设备接收数据, 需要在uart_server_init之前调用
+ */
+void uart_server_set_session_cb(uart_session_receive_t receive, uart_session_message_t message)
+{
+	session_receive_cb = receive;
+	session_message_cb = message;
+}
+
+
+/*
+ * 在接收回调中调用, 不拷贝地保留本次接收的数据, 用完后g_bytes_unref
+ */
+GBytes *uart_server_rx_hold(void)
+{
+	if(!rx_instance) {
+		return NULL;
+	}
+
+	return gatt_uart_rx_hold(rx_instance->gatt);
+}
+
+
+/*
+ * adapter是否打开, adapter可以是名字(hci0)或者object path
+ * 读取属性缓存, 可以在任意线程频繁调用, 没有在这个adapter上启动uart server时返回-1
+ */
+int uart_server_adapter_powered(const char *adapter)
+{
+	return adapter_power_state(NULL, adapter);
+}
+
+
+/*
+ * 可以在任意线程调用, 返回发送时使用的ATT_MTU(分片大小 + 3)
+ * device为NULL时是uart_server_send_stream使用的MTU, 否则是发给这个设备使用的MTU
+ * 没有可以发送的连接时返回0
+ */
+int uart_server_mtu(const char *device)
+{
+	struct session_t *s;
+	int mtu, frag;
+
+	if(!device) {
+		frag = uart_server_payload_size(NULL);
+		return frag ? frag + 3 : 0;
+	}
+
+	s = session_lookup(device);
+	if(!s) {
+		return 0;
+	}
+
+	mtu = g_atomic_int_get(&s->mtu);
+	if(!mtu) {
+		frag = uart_server_payload_size(s->owner);
+		mtu = frag ? frag + 3 : 0;
+	}
+	session_unref(s);
+
+	return mtu;
+}
@@ -9,8 +9,47 @@ extern "C" {
 #include "gatt.h"
 #include "advertising.h"
 
+/*
+ * uart_server_send_stream的返回值
+ */
+enum uart_send_status_t {
+	UART_SEND_QUEUED = 0,		/* 全部数据已经放入发送队列 */
+	UART_SEND_WOULD_BLOCK,		/* 发送队列空间不够, 数据没有入队, 等待writable回调后重试 */
+	UART_SEND_DROPPED,			/* 没有客户端打开通知或者数据太长, 数据被丢弃 */
+};
+
+/*
+ * 在uart server线程中调用, 发送队列可以继续写入
+ */
+typedef void (*uart_writable_t)(void);
+
+/*
+ * 在uart server线程中调用, msg是一条完整的消息, 只在回调期间有效
+ */
+typedef void (*uart_message_t)(uint8_t *msg, int len);
+
+/*
+ * 在uart server线程中调用, device是发送数据的设备的object path,
+ * bluez没有提供设备时为""
+ */
+typedef void (*uart_session_receive_t)(const char *device, uint8_t *buf, int len);
+typedef void (*uart_session_message_t)(const char *device, uint8_t *msg, int len);
+
 void uart_server_init(uart_receive_t cb);
+void uart_server_init_adapter(const char *adapter, uart_receive_t cb);
+void uart_server_init_att(const char *address, uart_receive_t cb);
 void uart_server_send(uint8_t *buf, int len);
+enum uart_send_status_t uart_server_send_stream(const uint8_t *buf, int len);
+void uart_server_set_writable_cb(uart_writable_t cb);
+void uart_server_set_message_cb(uart_message_t cb);
+void uart_server_set_indicate(int on);
+enum uart_send_status_t uart_server_send_message(const uint8_t *msg, int len);
+void uart_server_set_session_cb(uart_session_receive_t receive, uart_session_message_t message);
+enum uart_send_status_t uart_server_send_to(const char *device, const uint8_t *buf, int len);
+enum uart_send_status_t uart_server_send_message_to(const char *device, const uint8_t *msg, int len);
+GBytes *uart_server_rx_hold(void);
+int uart_server_adapter_powered(const char *adapter);
+int uart_server_mtu(const char *device);
 
 
 #endif